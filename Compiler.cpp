@@ -2,12 +2,41 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <set>
 #include <stdexcept>
 #include <sstream>
 #include <fstream>
 #include <iomanip>
 #include <regex>
 #include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <chrono>
+#include <charconv>
+#include <random>
+#include <array>
+#include <cmath>
+#include <memory_resource>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <climits>
+#include <cerrno>
+#include <memory>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 using namespace std;
 
@@ -62,7 +91,10 @@ enum TokenType
     T_STARNDARD_INPUT_STREAM, // >>, cin
     T_LOGICAL_AND,
     T_LOGICAL_OR,
-    T_VOID
+    T_VOID,
+    T_LBRACKET,
+    T_RBRACKET,
+    T_COMMA
 };
 
 struct Token
@@ -72,6 +104,408 @@ struct Token
     int lineNumber;
 };
 
+/*
+    CompileError:
+
+    Thrown by the lexer, the parser and the code generator when the program cannot be
+    compiled. compile() turns it into a Diagnostic; `line` is 0 when there is no position.
+*/
+struct CompileError : runtime_error
+{
+    int line;
+
+    CompileError(const string &message, int line = 0) : runtime_error(message), line(line) {}
+};
+
+/*
+    OutputBuffer class:
+
+    Collects a text listing (icg.obj, assembly.asm, --dump output) in large fixed-size chunks and writes
+    the whole thing with writev once it is complete. Lines are appended piece by piece, so
+    nothing is formatted into temporary strings and the stream is never flushed per line.
+    Chunks are never reallocated; a piece that does not fit is split across two of them.
+*/
+class OutputBuffer
+{
+public:
+    explicit OutputBuffer(size_t chunkSize = 1 << 20) : chunkSize(chunkSize) {}
+
+    void append(const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            if (chunks.empty() || used == chunkSize)
+            {
+                chunks.emplace_back(new char[chunkSize]);
+                used = 0;
+            }
+            size_t piece = min(size, chunkSize - used);
+            memcpy(chunks.back().get() + used, data, piece);
+            used += piece;
+            data += piece;
+            size -= piece;
+        }
+    }
+
+    void append(const string &text) { append(text.data(), text.size()); }
+    void append(const char *text) { append(text, strlen(text)); }
+    void append(char c) { append(&c, 1); }
+
+    size_t size() const { return chunks.empty() ? 0 : (chunks.size() - 1) * chunkSize + used; }
+
+    string str() const
+    {
+        string text;
+        text.reserve(size());
+        for (size_t i = 0; i < chunks.size(); i++)
+            text.append(chunks[i].get(), i + 1 < chunks.size() ? chunkSize : used);
+        return text;
+    }
+
+    // A JSON string literal, with quotes, backslashes and control characters escaped
+    void appendJsonString(const string &text)
+    {
+        static const char hex[] = "0123456789abcdef";
+        append('"');
+        size_t plain = 0;
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            unsigned char c = text[i];
+            if (c >= 0x20 && c != '"' && c != '\\')
+                continue;
+            append(text.data() + plain, i - plain);
+            plain = i + 1;
+            if (c == '"' || c == '\\')
+            {
+                char escaped[2] = {'\\', (char)c};
+                append(escaped, 2);
+            }
+            else
+            {
+                char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                append(escaped, 6);
+            }
+        }
+        append(text.data() + plain, text.size() - plain);
+        append('"');
+    }
+
+    void appendNumber(long long value)
+    {
+        char digits[24];
+        auto end = to_chars(digits, digits + sizeof(digits), value).ptr;
+        append(digits, end - digits);
+    }
+
+    // Write everything to `filename` (truncating it); false if the file cannot be written
+    bool writeToFile(const string &filename) const
+    {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        bool written = writeTo(fd);
+        return close(fd) == 0 && written;
+    }
+
+    // Write everything to an open file descriptor (such as 1 for stdout)
+    bool writeTo(int fd) const
+    {
+        vector<iovec> pieces(chunks.size());
+        for (size_t i = 0; i < chunks.size(); i++)
+            pieces[i] = {chunks[i].get(), i + 1 < chunks.size() ? chunkSize : used};
+
+        // writev takes at most IOV_MAX pieces and may stop short, so resume where it left off
+        size_t next = 0;
+        while (next < pieces.size())
+        {
+            int count = (int)min(pieces.size() - next, (size_t)IOV_MAX);
+            ssize_t written = writev(fd, &pieces[next], count);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            while (next < pieces.size() && (size_t)written >= pieces[next].iov_len)
+                written -= pieces[next++].iov_len;
+            if (next < pieces.size())
+            {
+                pieces[next].iov_base = (char *)pieces[next].iov_base + written;
+                pieces[next].iov_len -= written;
+            }
+        }
+        return true;
+    }
+
+private:
+    size_t chunkSize;
+    size_t used = 0;
+    vector<unique_ptr<char[]>> chunks;
+};
+
+/*
+    CompilationArena class:
+
+    The memory for one compilation. Pass memory() to compile() (CompileOptions::memory) and
+    the pmr containers the phases keep their per-compile data in (the symbol table, control
+    flow graph blocks and loops, the code generator's variable set) take their memory from
+    it instead of from malloc. Small blocks come from size-class pools carved out of large
+    chunks and are recycled within the compile; blocks too big for a pool go straight to
+    operator new, so a pass that keeps rebuilding big vectors does not make the arena grow.
+    reset() (or destroying the arena) hands everything back at once.
+
+    Everything allocated from the arena must be gone before reset() and before the arena
+    itself is destroyed, so create it before the compiler objects that use it. An arena is
+    not thread-safe: give every thread that compiles its own. Within one compile, the tasks
+    of its TaskPool reach the arena through a SharedMemory.
+*/
+class CompilationArena
+{
+public:
+    CompilationArena() : pools(pmr::new_delete_resource()) {}
+
+    CompilationArena(const CompilationArena &) = delete;
+    CompilationArena &operator=(const CompilationArena &) = delete;
+
+    pmr::memory_resource *memory()
+    {
+        return &pools;
+    }
+
+    void reset()
+    {
+        pools.release();
+    }
+
+private:
+    pmr::unsynchronized_pool_resource pools;
+};
+
+/*
+    SharedMemory class:
+
+    Lets the tasks of one compile share a memory resource that is not thread-safe (such as a
+    CompilationArena). Every request is passed on to that resource; between beginShared() and
+    endShared(), which the TaskPool calls around a run that has tasks on several threads, they
+    are passed on under a lock. Outside of a run a request costs one extra atomic load. Every
+    compile makes its own, so compiles on different threads never share a lock or a flag.
+*/
+class SharedMemory : public pmr::memory_resource
+{
+public:
+    explicit SharedMemory(pmr::memory_resource *upstream) : upstream(upstream) {}
+
+    void beginShared()
+    {
+        sharedSections++;
+    }
+
+    void endShared()
+    {
+        sharedSections--;
+    }
+
+private:
+    pmr::memory_resource *upstream;
+    mutex lock;
+    atomic<int> sharedSections{0};
+
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (!sharedSections.load(memory_order_relaxed))
+            return upstream->allocate(bytes, alignment);
+        lock_guard<mutex> guard(lock);
+        return upstream->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *block, size_t bytes, size_t alignment) override
+    {
+        if (!sharedSections.load(memory_order_relaxed))
+        {
+            upstream->deallocate(block, bytes, alignment);
+            return;
+        }
+        lock_guard<mutex> guard(lock);
+        upstream->deallocate(block, bytes, alignment);
+    }
+
+    bool do_is_equal(const pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+/*
+    TaskPool class:
+
+    A fixed set of worker threads for the fork-join parallelism inside one compile. run() calls
+    task(0) .. task(n - 1) and returns once all of them are done; the calling thread works
+    along. Tasks are dealt out largest first (by the cost the caller gives for each one),
+    round-robin over one deque per thread. A thread takes work from the front of its own deque
+    and, once that is empty, steals from the back of another one, so a thread that drew small
+    tasks helps with the rest. Starting with the largest tasks keeps the whole run close to the
+    time of the largest task once there are enough threads.
+
+    If tasks throw, run() rethrows the exception of the lowest task index, so the error a compile
+    reports does not depend on scheduling.
+*/
+class TaskPool
+{
+public:
+    // `memory`, if given, is locked while tasks run on several threads
+    explicit TaskPool(int threads, SharedMemory *memory = nullptr) : queues(max(threads, 1)), memory(memory)
+    {
+        for (auto &queue : queues)
+            queue = make_unique<Queue>();
+        for (size_t self = 1; self < queues.size(); self++)
+            workers.emplace_back([this, self]()
+                                 { workerLoop(self); });
+    }
+
+    ~TaskPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    TaskPool(const TaskPool &) = delete;
+    TaskPool &operator=(const TaskPool &) = delete;
+
+    int size() const
+    {
+        return (int)queues.size();
+    }
+
+    void run(const vector<size_t> &costs, const function<void(size_t)> &task)
+    {
+        vector<size_t> order(costs.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        stable_sort(order.begin(), order.end(), [&costs](size_t a, size_t b)
+                    { return costs[a] > costs[b]; });
+
+        errors.assign(costs.size(), nullptr);
+        current = &task;
+        remaining = costs.size();
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            Queue &queue = *queues[i % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back(order[i]);
+        }
+
+        if (memory)
+            memory->beginShared();
+        {
+            lock_guard<mutex> guard(lock);
+            generation++;
+        }
+        wake.notify_all();
+        work(0);
+        {
+            unique_lock<mutex> guard(lock);
+            done.wait(guard, [this]()
+                      { return remaining == 0; });
+        }
+        if (memory)
+            memory->endShared();
+
+        for (auto &error : errors)
+        {
+            if (error)
+                rethrow_exception(error);
+        }
+    }
+
+private:
+    struct Queue
+    {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+
+    vector<unique_ptr<Queue>> queues; // one per thread, the caller's first
+    SharedMemory *memory;
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    uint64_t generation = 0;
+    bool stopping = false;
+    size_t remaining = 0; // tasks of the current run not finished yet (guarded by lock)
+    const function<void(size_t)> *current = nullptr;
+    vector<exception_ptr> errors;
+
+    void workerLoop(size_t self)
+    {
+        uint64_t seen = 0;
+        while (true)
+        {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&]()
+                          { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+            work(self);
+        }
+    }
+
+    void work(size_t self)
+    {
+        size_t task;
+        while (take(self, task))
+        {
+            try
+            {
+                (*current)(task);
+            }
+            catch (...)
+            {
+                errors[task] = current_exception();
+            }
+            bool last;
+            {
+                lock_guard<mutex> guard(lock);
+                last = --remaining == 0;
+            }
+            if (last)
+                done.notify_all();
+        }
+    }
+
+    // The front of our own deque, or else the back of someone else's
+    bool take(size_t self, size_t &task)
+    {
+        for (size_t i = 0; i < queues.size(); i++)
+        {
+            Queue &queue = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty())
+                continue;
+            if (i == 0)
+            {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            else
+            {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
 class Lexer
 {
 private:
@@ -292,9 +726,18 @@ public:
             case '}':
                 tokens.push_back(Token{T_RBRACE, "}", lineNumber});
                 break;
+            case '[':
+                tokens.push_back(Token{T_LBRACKET, "[", lineNumber});
+                break;
+            case ']':
+                tokens.push_back(Token{T_RBRACKET, "]", lineNumber});
+                break;
             case ';':
                 tokens.push_back(Token{T_SEMICOLON, ";", lineNumber});
                 break;
+            case ',':
+                tokens.push_back(Token{T_COMMA, ",", lineNumber});
+                break;
             case '>':
                 tokens.push_back(Token{T_GT, ">", lineNumber});
                 break;
@@ -302,8 +745,7 @@ public:
                 tokens.push_back(Token{T_LT, "<", lineNumber});
                 break;
             default:
-                cout << "Unexpected character: " << current << " at line " << lineNumber << endl;
-                exit(1);
+                throw CompileError("Unexpected character: " + string(1, current) + " at line " + to_string(lineNumber), lineNumber);
             }
             pos++;
         }
@@ -377,8 +819,7 @@ public:
             }
         }
 
-        cout << "Unterminated string at line " << lineNumber << endl;
-        exit(1); // Error: Unterminated string
+        throw CompileError("Unterminated string at line " + to_string(lineNumber), lineNumber);
     }
 
     void skipComments()
@@ -405,7 +846,7 @@ public:
         }
     }
 
-    string tokenTypeToString(TokenType type)
+    static string tokenTypeToString(TokenType type)
     {
         switch (type)
         {
@@ -507,11 +948,32 @@ public:
             return "LOGICAL_OR";
         case T_VOID:
             return "VOID";
+        case T_LBRACKET:
+            return "LEFT_BRACKET";
+        case T_RBRACKET:
+            return "RIGHT_BRACKET";
+        case T_COMMA:
+            return "COMMA";
         default:
             return "UNKNOWN";
         }
     }
 
+    // One JSON object per line: {"type":"T_ID","value":"x","line":3}
+    static void dumpTokens(const vector<Token> &tokens, OutputBuffer &out)
+    {
+        for (const auto &token : tokens)
+        {
+            out.append("{\"type\":", 8);
+            out.appendJsonString(tokenTypeToString(token.type));
+            out.append(",\"value\":", 9);
+            out.appendJsonString(token.value);
+            out.append(",\"line\":", 8);
+            out.appendNumber(token.lineNumber);
+            out.append("}\n", 2);
+        }
+    }
+
     void printTokenizer(const vector<Token> &tokens)
     {
         // Clear the screen
@@ -621,31 +1083,104 @@ public:
     - When a variable is declared, it is added to the symbol table, and its type is stored.
     - When a variable is referenced, the symbol table is consulted to ensure that it has been declared and to retrieve its type.
     - The symbol table helps detect semantic errors such as undeclared variables or redeclared variables.
+
+    Memory:
+    - The maps take their nodes from the memory resource given to the constructor (the default
+      resource if none is), so a compile can keep its table in its CompilationArena.
+
+    Layering:
+    - A table can be layered over another one with SymbolTable(&parent, memory). Lookups fall through to the
+      parent, while declarations stay in the layer and size(), forEachSymbol() and the dumps only
+      show them. Function passes that run in parallel declare their temps in such a layer, and the
+      PassManager copies the layers back into the shared table in function order.
 */
 class SymbolTable
 {
 public:
+    explicit SymbolTable(pmr::memory_resource *memory = pmr::get_default_resource())
+        : symbolTable(memory), arraySizes(memory) {}
+
+    SymbolTable(const SymbolTable *parent, pmr::memory_resource *memory)
+        : symbolTable(memory), arraySizes(memory), parent(parent) {}
+
     void declareVariable(const string &name, const string &type)
     {
-        if (symbolTable.find(name) != symbolTable.end())
+        if (isDeclared(name))
         {
             throw runtime_error("Semantic error: Variable '" + name + "' is already declared.");
         }
         symbolTable[name] = type;
     }
 
-    string getVariableType(const string &name)
+    string getVariableType(const string &name) const
+    {
+        auto it = symbolTable.find(name);
+        if (it != symbolTable.end())
+            return it->second;
+        if (parent)
+            return parent->getVariableType(name);
+        throw runtime_error("Semantic error: Variable '" + name + "' is not declared.");
+    }
+
+    size_t size() const
+    {
+        return symbolTable.size();
+    }
+
+    // Calls visit(name, type, arraySize) for every symbol in name order; arraySize is 0 for scalars
+    void forEachSymbol(const function<void(const string &, const string &, int)> &visit) const
     {
-        if (symbolTable.find(name) == symbolTable.end())
+        for (const auto &entry : symbolTable)
         {
-            throw runtime_error("Semantic error: Variable '" + name + "' is not declared.");
+            auto array = arraySizes.find(entry.first);
+            visit(entry.first, entry.second, array == arraySizes.end() ? 0 : array->second);
         }
-        return symbolTable[name];
     }
 
     bool isDeclared(const string &name) const
     {
-        return symbolTable.find(name) != symbolTable.end();
+        return symbolTable.find(name) != symbolTable.end() || (parent && parent->isDeclared(name));
+    }
+
+    // A fixed-size array `type name[size]`; its type is the type of one element
+    void declareArray(const string &name, const string &type, int size)
+    {
+        declareVariable(name, type);
+        arraySizes[name] = size;
+    }
+
+    bool isArray(const string &name) const
+    {
+        return arraySizes.find(name) != arraySizes.end() || (parent && parent->isArray(name));
+    }
+
+    int getArraySize(const string &name) const
+    {
+        auto it = arraySizes.find(name);
+        if (it != arraySizes.end())
+            return it->second;
+        if (parent)
+            return parent->getArraySize(name);
+        throw runtime_error("Semantic error: '" + name + "' is not an array.");
+    }
+
+    // One JSON object per line: {"name":"a","type":"int","size":10} ("size" only for arrays)
+    void dumpSymbols(OutputBuffer &out) const
+    {
+        for (const auto &entry : symbolTable)
+        {
+            out.append("{\"name\":", 8);
+            out.appendJsonString(entry.first);
+            out.append(",\"type\":", 8);
+            out.appendJsonString(entry.second);
+            auto array = arraySizes.find(entry.first);
+            if (array != arraySizes.end())
+            {
+                out.append(",\"size\":", 8);
+                out.appendNumber(array->second);
+            }
+            out.append("}\n", 2);
+        }
     }
 
     void printSymbolTable() const
@@ -678,8 +1213,11 @@ public:
             // Print each symbol
             for (const auto &entry : symbolTable)
             {
+                string type = entry.second;
+                if (isArray(entry.first))
+                    type += "[" + to_string(getArraySize(entry.first)) + "]";
                 cout << "| " << left << setw(nameWidth) << entry.first
-                     << " | " << left << setw(typeWidth) << entry.second
+                     << " | " << left << setw(typeWidth) << type
                      << " |" << endl;
             }
         }
@@ -689,7 +1227,9 @@ public:
     }
 
 private:
-    map<string, string> symbolTable;
+    pmr::map<string, string> symbolTable;
+    pmr::map<string, int> arraySizes;
+    const SymbolTable *parent = nullptr;
 };
 
 class IntermediateCodeGnerator
@@ -697,10 +1237,21 @@ class IntermediateCodeGnerator
 public:
     vector<string> instructions;
     int tempCount = 0;
+    int tempStride = 1; // more than 1 when the PassManager interleaves the names of parallel tasks
+    pmr::memory_resource *memory = pmr::get_default_resource(); // for the passes' control flow graphs
 
     string newTemp()
     {
-        return "t" + to_string(tempCount++);
+        string temp = "t" + to_string(tempCount);
+        tempCount += tempStride;
+        return temp;
+    }
+
+    string newLabel()
+    {
+        string label = "L" + to_string(tempCount);
+        tempCount += tempStride;
+        return label;
     }
 
     void addInstruction(const string &instr)
@@ -717,27 +1268,6 @@ public:
             cout << instr << endl;
         }
     }
-
-    void saveInstructionsToFile(const string &filename)
-    {
-        // Open a .obj file in text mode
-        ofstream outFile(filename);
-        if (!outFile.is_open())
-        {
-            cerr << "Error: Unable to open file for writing!" << endl;
-            return;
-        }
-
-        // Write each instruction to the file
-        for (const auto &instr : instructions)
-        {
-            outFile << instr << endl;
-        }
-
-        // Close the file
-        outFile.close();
-        cout << "Generated Intermediate Code is saved to file: " << filename << endl;
-    }
 };
 
 class Parser
@@ -754,21 +1284,55 @@ public:
         {
             parseStatement();
         }
+        for (const auto &function : functions)
+        {
+            if (!function.second.defined)
+            {
+                throw CompileError("Semantic error: function '" + function.first + "' declared at line " + to_string(function.second.line) + " is never defined", function.second.line);
+            }
+        }
+
+        // The functions follow the main program, which must not run into them
+        if (!functionCode.empty())
+        {
+            if (!endsWithReturn())
+                icg.addInstruction("return");
+            icg.instructions.insert(icg.instructions.end(), functionCode.begin(), functionCode.end());
+        }
     }
 
 private:
-    vector<Token> tokens;
+    const vector<Token> &tokens;
     size_t pos;
     SymbolTable &symTable;
     IntermediateCodeGnerator &icg;
 
+    struct FunctionSignature
+    {
+        string returnType; // "void" for a function without a value
+        vector<string> paramTypes;
+        bool defined = false;
+        int line = 0;
+    };
+    map<string, FunctionSignature> functions;
+    string currentFunction;      // the function whose body is being parsed, empty in the main program
+    vector<string> functionCode; // TAC of all function bodies, emitted after the main program
+
     void parseStatement()
     {
         if (tokens[pos].type == T_INT || tokens[pos].type == T_FLOAT ||
             tokens[pos].type == T_DOUBLE || tokens[pos].type == T_STRING ||
             tokens[pos].type == T_CHAR || tokens[pos].type == T_BOOL)
         {
-            parseDeclarationOrDeclarationAssignment();
+            if (tokens[pos + 1].type == T_ID && tokens[pos + 2].type == T_LPAREN)
+                parseFunctionDefinition();
+            else
+                parseDeclarationOrDeclarationAssignment();
+        }
+        else if (tokens[pos].type == T_ID && tokens[pos + 1].type == T_LPAREN)
+        {
+            parseCall(false);
+            expect(T_SEMICOLON);
         }
         else if (tokens[pos].type == T_ID)
         {
@@ -776,7 +1340,7 @@ private:
         }
         else if (tokens[pos].type == T_VOID)
         {
-            parseVoidFunction();
+            parseFunctionDefinition();
         }
         else if (tokens[pos].type == T_IF)
         {
@@ -824,32 +1388,234 @@ private:
         }
         else
         {
-            cout << "Syntax error: unexpected token '" << tokens[pos].value << "' at line " << tokens[pos].lineNumber << endl;
-            exit(1);
+            throw CompileError("Syntax error: unexpected token '" + tokens[pos].value + "' at line " + to_string(tokens[pos].lineNumber), tokens[pos].lineNumber);
         }
     }
 
-    void parseVoidFunction()
+    /*
+        parseFunctionDefinition handles `type name(type a, type b) { ... }` and `void name() { ... }`.
+        A declaration without a body (`int f(int n);`) lets two functions call each other.
+        Parameters and locals are named `name__x`, so they cannot clash with globals or with the
+        variables of another function; like globals they live in static storage, and the back ends
+        save them around a call only when the function can recurse. The body is collected on its
+        own and emitted after the main program. A body that can run off its end returns 0 (or "").
+        Example:
+        int add(int a, int b) { return a + b; }   -->   function int add add__a add__b
+                                                        t0 = add__a + add__b
+                                                        return t0
+    */
+    void parseFunctionDefinition()
     {
-        cout << "LEts see\n";
-        expect(T_VOID);
-        expect(T_ID);
+        int line = tokens[pos].lineNumber;
+        string returnType = tokens[pos].type == T_VOID ? "void" : typeName(tokens[pos].type);
+        pos++;
+        string name = expectAndReturnValue(T_ID);
+        if (!currentFunction.empty())
+        {
+            throw CompileError("Semantic error: function '" + name + "' is defined inside function '" + currentFunction + "' at line " + to_string(line), line);
+        }
+        if (symTable.isDeclared(name))
+        {
+            throw CompileError("Semantic error: '" + name + "' is already declared as a variable at line " + to_string(line), line);
+        }
+
         expect(T_LPAREN);
+        vector<string> paramTypes, paramNames;
+        int integerParams = 0, floatParams = 0;
+        while (tokens[pos].type != T_RPAREN)
+        {
+            if (!paramNames.empty())
+                expect(T_COMMA);
+            paramTypes.push_back(typeName(tokens[pos].type));
+            pos++;
+            paramNames.push_back(expectAndReturnValue(T_ID));
+            if (paramTypes.back() == "float" || paramTypes.back() == "double")
+                floatParams++;
+            else
+                integerParams++;
+        }
         expect(T_RPAREN);
+        // Arguments are passed in registers only (rdi, rsi, rdx, rcx, r8, r9 and xmm0-xmm7)
+        if (integerParams > 6 || floatParams > 8)
+        {
+            throw CompileError("Semantic error: function '" + name + "' has more than 6 integer or 8 floating point parameters at line " + to_string(line), line);
+        }
+
+        FunctionSignature &signature = functions[name];
+        if (!signature.returnType.empty() && (signature.returnType != returnType || signature.paramTypes != paramTypes))
+        {
+            throw CompileError("Semantic error: function '" + name + "' does not match its declaration at line " + to_string(signature.line), line);
+        }
+        if (signature.returnType.empty())
+            signature.line = line;
+        signature.returnType = returnType;
+        signature.paramTypes = paramTypes;
+
+        if (tokens[pos].type == T_SEMICOLON)
+        {
+            pos++;
+            return;
+        }
+        if (signature.defined)
+        {
+            throw CompileError("Semantic error: function '" + name + "' is already defined at line " + to_string(line), line);
+        }
+        signature.defined = true;
+
+        currentFunction = name;
+        size_t start = icg.instructions.size();
+        string header = "function " + returnType + " " + name;
+        for (size_t i = 0; i < paramNames.size(); i++)
+        {
+            symTable.declareVariable(localName(paramNames[i]), paramTypes[i]);
+            header += " " + localName(paramNames[i]);
+        }
+        icg.addInstruction(header);
         parseBlock();
+        if (!endsWithReturn())
+            icg.addInstruction(returnType == "void" ? "return" : returnType == "string" ? "return \"\"" : "return 0");
+
+        functionCode.insert(functionCode.end(), icg.instructions.begin() + start, icg.instructions.end());
+        icg.instructions.resize(start);
+        currentFunction.clear();
     }
-    void parseInputStatement()
-    {
+
+    /*
+        parseCall handles `name(a, b + 1)`. The arguments are evaluated left to right into operands
+        and passed with one `call` instruction; as a value the result goes into a new temp.
+        Example:
+        x = add(a, 2) * 3;   -->   t0 = call add a 2
+                                   t1 = t0 * 3
+                                   x = t1
+    */
+    string parseCall(bool needsValue)
+    {
+        int line = tokens[pos].lineNumber;
+        string name = expectAndReturnValue(T_ID);
+        auto function = functions.find(name);
+        if (function == functions.end())
+        {
+            throw CompileError("Semantic error: function '" + name + "' is not declared at line " + to_string(line), line);
+        }
+        if (needsValue && function->second.returnType == "void")
+        {
+            throw CompileError("Semantic error: void function '" + name + "' does not return a value at line " + to_string(line), line);
+        }
+
+        expect(T_LPAREN);
+        string call = "call " + name;
+        size_t count = 0;
+        while (tokens[pos].type != T_RPAREN)
+        {
+            if (count++ > 0)
+                expect(T_COMMA);
+            if (tokens[pos].type == T_STRING)
+            {
+                // A string literal may contain spaces, so it is passed through a temp
+                string temp = icg.newTemp();
+                icg.addInstruction(temp + " = " + quoteString(expectAndReturnValue(T_STRING)));
+                call += " " + temp;
+            }
+            else
+            {
+                call += " " + parseExpression();
+            }
+        }
+        expect(T_RPAREN);
+        if (count != function->second.paramTypes.size())
+        {
+            throw CompileError("Semantic error: function '" + name + "' takes " + to_string(function->second.paramTypes.size()) +
+                                   " arguments but " + to_string(count) + " were given at line " + to_string(line),
+                               line);
+        }
+
+        if (!needsValue)
+        {
+            icg.addInstruction(call);
+            return "";
+        }
+        string temp = icg.newTemp();
+        icg.addInstruction(temp + " = " + call);
+        return temp;
+    }
+
+    // Inside a function its parameters and locals hide globals of the same name
+    string resolve(const string &name) const
+    {
+        if (!currentFunction.empty() && symTable.isDeclared(localName(name)))
+            return localName(name);
+        return name;
+    }
+
+    string localName(const string &name) const
+    {
+        return currentFunction + "__" + name;
+    }
+
+    bool endsWithReturn() const
+    {
+        if (icg.instructions.empty())
+            return false;
+        const string &last = icg.instructions.back();
+        return last == "return" || last.compare(0, 7, "return ") == 0;
+    }
+
+    string typeName(TokenType type)
+    {
+        switch (type)
+        {
+        case T_INT:
+            return "int";
+        case T_FLOAT:
+            return "float";
+        case T_DOUBLE:
+            return "double";
+        case T_STRING:
+            return "string";
+        case T_CHAR:
+            return "char";
+        case T_BOOL:
+            return "bool";
+        default:
+            throw CompileError("Unexpected type in declaration", tokens[pos].lineNumber);
+        }
+    }
+    /*
+        `cin >> a >> b;` reads each variable in turn (`read a`, `read b`) and
+        `cout << "x = " << x + 1 << endl;` prints each item (`print "x = "`, `print t0`, `print "\n"`).
+    */
+    void parseInputStatement()
+    {
         expect(T_STARNDARD_INPUT_STREAM);
-        expect(T_EXTRACTION_OPERATOR);
-        expect(T_ID);
+        do
+        {
+            expect(T_EXTRACTION_OPERATOR);
+            string varName = resolve(expectAndReturnValue(T_ID));
+            symTable.getVariableType(varName);
+            icg.addInstruction("read " + varName);
+        } while (tokens[pos].type == T_EXTRACTION_OPERATOR);
         expect(T_SEMICOLON);
     }
     void parsePrintStatement()
     {
         expect(T_STANDARD_OUTPUT_STREAM);
-        expect(T_STREAM_INSERTION_OPERATOR);
-        expect(T_STRING);
+        do
+        {
+            expect(T_STREAM_INSERTION_OPERATOR);
+            if (tokens[pos].type == T_STRING)
+            {
+                icg.addInstruction("print " + quoteString(expectAndReturnValue(T_STRING)));
+            }
+            else if (tokens[pos].type == T_ID && tokens[pos].value == "endl" && !symTable.isDeclared("endl"))
+            {
+                pos++;
+                icg.addInstruction("print " + quoteString("\n"));
+            }
+            else
+            {
+                icg.addInstruction("print " + parseExpression());
+            }
+        } while (tokens[pos].type == T_STREAM_INSERTION_OPERATOR);
         expect(T_SEMICOLON);
     }
     void parseDoWhileStatement()
@@ -872,20 +1638,10 @@ private:
         string conditionLabel = icg.newTemp() + "_do_while_condition";
         icg.addInstruction(conditionLabel + ":");
 
-        // Parse the condition expression
-        string conditionExpr = parseExpression();
+        // Jump back to the start of the loop while the condition holds, fall out otherwise
+        parseCondition(startLabel, "");
         expect(T_RPAREN);
         expect(T_SEMICOLON);
-
-        // Generate condition check instruction
-        string conditionTemp = icg.newTemp();
-        icg.addInstruction(conditionTemp + " = " + conditionExpr);
-
-        // Generate conditional jump back to start of loop
-        string endLabel = icg.newTemp() + "_do_while_end";
-        icg.addInstruction("if !" + conditionTemp + " goto " + endLabel);
-        icg.addInstruction("goto " + startLabel);
-        icg.addInstruction(endLabel + ":");
     }
 
     void parseBreakStatement()
@@ -893,6 +1649,19 @@ private:
         expect(T_BREAK);
         expect(T_SEMICOLON);
     }
+    /*
+        parseSwitchStatement parses every case body first and only then emits the dispatch code in
+        front of them (the body code is cut out of the instruction list and appended again).
+        Knowing all case values up front lets the dispatch pick its shape from how dense they are:
+           - runs of at least 4 values that fill at least 40% of their range become one bounds-checked
+             `jumptable` instruction (a table of labels in .rodata);
+           - the remaining values and tables are searched with a balanced tree of `<` compares,
+             ending in short `==` chains, so dispatch costs O(log n) compares instead of O(n).
+        If some case value is not an integer literal the old linear chain of `==` tests is used.
+        Example:
+        switch (x) { case 1: ... case 2: ... case 3: ... case 4: ... }
+            -->  jumptable x 1 L5,L6,L7,L8 default L4
+    */
     void parseSwitchStatement()
     {
         // Parse 'switch' keyword
@@ -911,6 +1680,12 @@ private:
 
         // Generate labels for switch statement
         string endSwitchLabel = icg.newTemp() + "_switch_end";
+        string defaultLabel = endSwitchLabel;
+        vector<pair<string, string>> cases; // case value, label of its body
+        vector<string> caseValueCode;       // code computing non-literal case values
+
+        // Case bodies are collected here and emitted after the dispatch code
+        size_t bodyStart = icg.instructions.size();
 
         // Parse cases
         while (tokens[pos].type != T_RBRACE && tokens[pos].type != T_EOF)
@@ -921,21 +1696,19 @@ private:
                 expect(T_CASE);
 
                 // Parse case expression (can be a literal or constant expression)
+                size_t caseExprStart = icg.instructions.size();
                 string caseExpr = parseExpression();
+                vector<string> caseExprCode(icg.instructions.begin() + caseExprStart, icg.instructions.end());
+                icg.instructions.resize(caseExprStart);
 
                 // Expect colon after case
                 expect(T_COLON);
 
                 // Generate a unique label for this case
                 string caseLabel = icg.newTemp() + "_case";
-
-                // Add comparison instruction
-                string compareTemp = icg.newTemp();
-                icg.addInstruction(compareTemp + " = " + switchExpr + " == " + caseExpr);
-
-                // Add conditional jump
-                string nextCaseLabel = icg.newTemp() + "_next_case";
-                icg.addInstruction("if !" + compareTemp + " goto " + nextCaseLabel);
+                cases.push_back({caseExpr, caseLabel});
+                caseValueCode.insert(caseValueCode.end(), caseExprCode.begin(), caseExprCode.end());
+                icg.addInstruction(caseLabel + ":");
 
                 // Parse statements in this case block
                 while (tokens[pos].type != T_CASE &&
@@ -947,29 +1720,28 @@ private:
 
                 // Add unconditional jump to end of switch
                 icg.addInstruction("goto " + endSwitchLabel);
-
-                // Label for next case
-                icg.addInstruction(nextCaseLabel + ":");
             }
             else if (tokens[pos].type == T_DEFAULT)
             {
                 // Ensure only one default case
                 if (hasDefaultCase)
                 {
-                    cout << "Syntax error: Multiple default cases in switch statement" << endl;
-                    exit(1);
+                    throw CompileError("Syntax error: Multiple default cases in switch statement", tokens[pos].lineNumber);
                 }
 
                 expect(T_DEFAULT);
                 expect(T_COLON);
 
                 hasDefaultCase = true;
+                defaultLabel = icg.newTemp() + "_default";
+                icg.addInstruction(defaultLabel + ":");
 
                 // Parse statements in default case block
                 while (tokens[pos].type != T_RBRACE)
                 {
                     parseStatement();
                 }
+                icg.addInstruction("goto " + endSwitchLabel);
             }
             else
             {
@@ -977,6 +1749,15 @@ private:
             }
         }
 
+        vector<string> bodyCode(icg.instructions.begin() + bodyStart, icg.instructions.end());
+        icg.instructions.resize(bodyStart);
+
+        emitSwitchDispatch(switchExpr, cases, caseValueCode, defaultLabel);
+        for (const auto &instr : bodyCode)
+        {
+            icg.addInstruction(instr);
+        }
+
         // Add end switch label
         icg.addInstruction(endSwitchLabel + ":");
 
@@ -984,11 +1765,138 @@ private:
         expect(T_RBRACE);
     }
 
+    struct SwitchCluster
+    {
+        long long low;
+        long long high;
+        vector<pair<long long, string>> cases; // sorted by value
+    };
+
+    void emitSwitchDispatch(const string &switchExpr, const vector<pair<string, string>> &cases,
+                            const vector<string> &caseValueCode, const string &defaultLabel)
+    {
+        vector<pair<long long, string>> values;
+        bool allLiterals = true;
+        for (const auto &c : cases)
+        {
+            // Any int literal; a case computed into a temp forces the chain of tests
+            long long value = 0;
+            const char *end = c.first.data() + c.first.size();
+            auto parsed = from_chars(c.first.data(), end, value);
+            if (c.first.empty() || !isdigit((unsigned char)c.first[0]) || parsed.ec != errc() || parsed.ptr != end ||
+                value > INT_MAX)
+            {
+                allLiterals = false;
+                break;
+            }
+            values.push_back({value, c.second});
+        }
+
+        if (!allLiterals)
+        {
+            // Linear chain of tests, in source order
+            for (const auto &instr : caseValueCode)
+            {
+                icg.addInstruction(instr);
+            }
+            for (const auto &c : cases)
+            {
+                string compareTemp = icg.newTemp();
+                icg.addInstruction(compareTemp + " = " + switchExpr + " == " + c.first);
+                icg.addInstruction("if " + compareTemp + " goto " + c.second);
+            }
+            icg.addInstruction("goto " + defaultLabel);
+            return;
+        }
+
+        // Sort by value; a repeated value keeps the first case that used it
+        stable_sort(values.begin(), values.end(), [](const pair<long long, string> &a, const pair<long long, string> &b)
+                    { return a.first < b.first; });
+        values.erase(unique(values.begin(), values.end(), [](const pair<long long, string> &a, const pair<long long, string> &b)
+                            { return a.first == b.first; }),
+                     values.end());
+
+        // Greedily group runs of values that are dense enough for a jump table
+        const size_t minTableCases = 4;
+        const double minTableDensity = 0.4;
+        vector<SwitchCluster> clusters;
+        size_t i = 0;
+        while (i < values.size())
+        {
+            size_t best = i;
+            for (size_t j = i + 1; j < values.size(); j++)
+            {
+                double density = double(j - i + 1) / double(values[j].first - values[i].first + 1);
+                if (density >= minTableDensity)
+                    best = j;
+            }
+            if (best - i + 1 < minTableCases)
+                best = i;
+
+            SwitchCluster cluster;
+            cluster.low = values[i].first;
+            cluster.high = values[best].first;
+            cluster.cases.assign(values.begin() + i, values.begin() + best + 1);
+            clusters.push_back(cluster);
+            i = best + 1;
+        }
+
+        emitSwitchTree(switchExpr, clusters, 0, clusters.size(), defaultLabel);
+    }
+
+    void emitSwitchTree(const string &switchExpr, const vector<SwitchCluster> &clusters, size_t first, size_t last, const string &defaultLabel)
+    {
+        // A few single values: test them one after another
+        bool smallChain = last - first <= 3;
+        for (size_t c = first; c < last && smallChain; c++)
+        {
+            smallChain = clusters[c].cases.size() == 1;
+        }
+
+        if (last - first == 1 && clusters[first].cases.size() > 1)
+        {
+            const SwitchCluster &cluster = clusters[first];
+            string table;
+            size_t next = 0;
+            for (long long value = cluster.low; value <= cluster.high; value++)
+            {
+                if (next < cluster.cases.size() && cluster.cases[next].first == value)
+                    table += cluster.cases[next++].second;
+                else
+                    table += defaultLabel;
+                if (value != cluster.high)
+                    table += ",";
+            }
+            icg.addInstruction("jumptable " + switchExpr + " " + to_string(cluster.low) + " " + table + " default " + defaultLabel);
+        }
+        else if (smallChain)
+        {
+            for (size_t c = first; c < last; c++)
+            {
+                string compareTemp = icg.newTemp();
+                icg.addInstruction(compareTemp + " = " + switchExpr + " == " + to_string(clusters[c].low));
+                icg.addInstruction("if " + compareTemp + " goto " + clusters[c].cases[0].second);
+            }
+            icg.addInstruction("goto " + defaultLabel);
+        }
+        else
+        {
+            size_t middle = first + (last - first) / 2;
+            string lowerLabel = icg.newLabel();
+            string compareTemp = icg.newTemp();
+            icg.addInstruction(compareTemp + " = " + switchExpr + " < " + to_string(clusters[middle].low));
+            icg.addInstruction("if " + compareTemp + " goto " + lowerLabel);
+            emitSwitchTree(switchExpr, clusters, middle, last, defaultLabel);
+            icg.addInstruction(lowerLabel + ":");
+            emitSwitchTree(switchExpr, clusters, first, middle, defaultLabel);
+        }
+    }
+
     string parseIncrementDecrement()
     {
         if (tokens[pos].type == T_ID)
         {
-            string var = tokens[pos].value;
+            string var = resolve(tokens[pos].value);
             expect(T_ID);
             if (tokens[pos].type == T_PLUS && tokens[pos + 1].type == T_PLUS)
             {
@@ -1014,14 +1922,12 @@ private:
             }
             else
             {
-                cout << "Syntax error: invalid increment/decrement in 'for' loop at line " << tokens[pos].lineNumber << endl;
-                exit(1);
+                throw CompileError("Syntax error: invalid increment/decrement in 'for' loop at line " + to_string(tokens[pos].lineNumber), tokens[pos].lineNumber);
             }
         }
         else
         {
-            cout << "Syntax error: expected increment/decrement expression in 'for' loop at lineNumber " << tokens[pos].lineNumber << endl;
-            exit(1);
+            throw CompileError("Syntax error: expected increment/decrement expression in 'for' loop at lineNumber " + to_string(tokens[pos].lineNumber), tokens[pos].lineNumber);
         }
     }
 
@@ -1033,16 +1939,15 @@ private:
         }
         else
         {
-            cout << "Syntax error: expected initialization statement in 'for' loop at line " << tokens[pos].lineNumber << endl;
-            exit(1);
+            throw CompileError("Syntax error: expected initialization statement in 'for' loop at line " + to_string(tokens[pos].lineNumber), tokens[pos].lineNumber);
         }
     }
 
     void parseForStatement()
     {
-        string initLabel = "L" + to_string(icg.tempCount++);
-        string startLabel = "L" + to_string(icg.tempCount++);
-        string endLabel = "L" + to_string(icg.tempCount++);
+        string initLabel = icg.newLabel();
+        string startLabel = icg.newLabel();
+        string endLabel = icg.newLabel();
 
         // for (i = 0; i < 5; i = i + 1){}
         expect(T_FOR);
@@ -1052,40 +1957,42 @@ private:
         parseDeclarationOrDeclarationAssignment();
         icg.addInstruction(initLabel + ":");
 
-        string condition = parseExpression();
-        icg.addInstruction("if " + condition + " goto " + endLabel);
+        parseCondition("", endLabel);
 
         expect(T_SEMICOLON);
-        string incrementCode = parseIncrementDecrement();
+
+        // The increment is written before the body but runs after it, so its code
+        // (including any temps of its expression) is cut out here and emitted after the body.
+        size_t incrementStart = icg.instructions.size();
+        parseIncrementDecrement();
+        vector<string> incrementCode(icg.instructions.begin() + incrementStart, icg.instructions.end());
+        icg.instructions.resize(incrementStart);
 
         expect(T_RPAREN);
 
         icg.addInstruction(startLabel + ":");
         parseBlock(); // Parse the body of the loop
-        icg.addInstruction(incrementCode);
+        for (const auto &instr : incrementCode)
+        {
+            icg.addInstruction(instr);
+        }
         icg.addInstruction("goto " + initLabel);
         icg.addInstruction(endLabel + ":");
     }
 
     void parseWhileStatement()
     {
-        string startLabel = "L" + to_string(icg.tempCount++);
-        string endLabel = "L" + to_string(icg.tempCount++);
+        string startLabel = icg.newLabel();
+        string endLabel = icg.newLabel();
 
         icg.addInstruction("goto " + startLabel);
         icg.addInstruction(startLabel + ":");
 
         expect(T_WHILE);
         expect(T_LPAREN);
-        string condition = parseExpression();
+        parseCondition("", endLabel);
         expect(T_RPAREN);
 
-        string temp = icg.newTemp();
-        icg.addInstruction(temp + " = " + condition);
-
-        icg.addInstruction("if " + temp + " goto " + endLabel);
-        icg.addInstruction("goto " + startLabel);
-
         parseBlock();
 
         icg.addInstruction("goto " + startLabel);
@@ -1096,28 +2003,24 @@ private:
     {
         expect(T_AGAR);
         expect(T_LPAREN);
-        string cond = parseExpression();
+        string falseLabel = icg.newLabel();
+        parseCondition("", falseLabel);
         expect(T_RPAREN);
 
-        string temp = icg.newTemp();
-        icg.addInstruction(temp + " = " + cond);
-        icg.addInstruction("agar " + temp + " goto L1");
-        icg.addInstruction("goto L2");
-        icg.addInstruction("L1:");
-
         parseStatement();
 
         if (tokens[pos].type == T_MAGAR)
         { // If an `magar` part exists, handle it.
-            icg.addInstruction("goto L3");
-            icg.addInstruction("L2:");
+            string endLabel = icg.newLabel();
+            icg.addInstruction("goto " + endLabel);
+            icg.addInstruction(falseLabel + ":");
             expect(T_MAGAR);
             parseStatement();
-            icg.addInstruction("L3:");
+            icg.addInstruction(endLabel + ":");
         }
         else
         {
-            icg.addInstruction("L2:");
+            icg.addInstruction(falseLabel + ":");
         }
     }
 
@@ -1128,42 +2031,39 @@ private:
      It also registers the declared variable in the symbol table with type "int".
      Example:
      int x;   // This will be parsed and the symbol table will store x with type "int".
+     int a[10];   // A fixed-size array of 10 ints, all 0; arrays have no initializer.
     */
 
     void parseDeclarationOrDeclarationAssignment()
     {
         // Determine the type of the variable
-        string varType;
-        switch (tokens[pos].type)
-        {
-        case T_INT:
-            varType = "int";
-            break;
-        case T_FLOAT:
-            varType = "float";
-            break;
-        case T_DOUBLE:
-            varType = "double";
-            break;
-        case T_STRING:
-            varType = "string";
-            break;
-        case T_CHAR:
-            varType = "char";
-            break;
-        case T_BOOL:
-            varType = "bool";
-            break;
-        default:
-            cout << "Unexpected type in declaration" << endl;
-            exit(1);
-        }
+        string varType = typeName(tokens[pos].type);
 
         // Consume the type token
         expect(tokens[pos].type);
 
-        // Get the variable name
+        // Get the variable name; inside a function it is a local of that function
         string varName = expectAndReturnValue(T_ID);
+        if (functions.count(varName))
+        {
+            throw CompileError("Semantic error: '" + varName + "' is already declared as a function at line " + to_string(tokens[pos].lineNumber), tokens[pos].lineNumber);
+        }
+        if (!currentFunction.empty())
+            varName = localName(varName);
+
+        if (tokens[pos].type == T_LBRACKET)
+        {
+            expect(T_LBRACKET);
+            string size = expectAndReturnValue(T_NUM);
+            expect(T_RBRACKET);
+            if (size.size() > 9 || stoi(size) == 0)
+            {
+                throw CompileError("Semantic error: invalid size for array '" + varName + "' at line " + to_string(tokens[pos].lineNumber), tokens[pos].lineNumber);
+            }
+            symTable.declareArray(varName, varType, stoi(size));
+            expect(T_SEMICOLON);
+            return;
+        }
 
         // Declare the variable in the symbol table
         symTable.declareVariable(varName, varType);
@@ -1178,7 +2078,7 @@ private:
             if (tokens[pos].type == T_STRING)
             {
                 string strValue = expectAndReturnValue(T_STRING);
-                icg.addInstruction(varName + " = " + strValue);
+                icg.addInstruction(varName + " = " + quoteString(strValue));
             }
             else if (tokens[pos].type == T_TRUE || tokens[pos].type == T_FALSE)
             {
@@ -1192,6 +2092,11 @@ private:
                 icg.addInstruction(varName + " = " + expr);
             }
         }
+        else if (!currentFunction.empty())
+        {
+            // A local starts out empty on every call, not with the value of the previous call
+            icg.addInstruction(varName + " = " + (varType == "string" ? "\"\"" : "0"));
+        }
 
         // Expect semicolon to end the statement
         expect(T_SEMICOLON);
@@ -1205,13 +2110,18 @@ private:
     for the assignment.
     Example:
     x = 10;   -->  This will be parsed, checking if x is declared, then generating intermediate code like `x = 10`.
+    a[i + 1] = x;   -->  `t0 = i + 1` and `a[t0] = x`.
    */
 
     // The parseAssignment function
     void parseAssignment()
     {
-        string varName = expectAndReturnValue(T_ID);
+        string varName = resolve(expectAndReturnValue(T_ID));
         symTable.getVariableType(varName);
+        if (tokens[pos].type == T_LBRACKET)
+            varName = parseArrayIndex(varName);
+        else
+            checkNotArray(varName);
         expect(T_ASSIGN);
 
         if (tokens[pos].type == T_TRUE || tokens[pos].type == T_FALSE)
@@ -1223,7 +2133,7 @@ private:
         else if (tokens[pos].type == T_STRING)
         {
             string strValue = expectAndReturnValue(T_STRING);
-            icg.addInstruction(varName + " = " + strValue);
+            icg.addInstruction(varName + " = " + quoteString(strValue));
         }
 
         else
@@ -1239,7 +2149,8 @@ private:
         It expects the keyword `if`, followed by an expression in parentheses that serves as the condition.
         If the condition evaluates to true, it executes the statement inside the block. If an `else` part is present,
         it executes the corresponding statement after the `else` keyword.
-        Intermediate code for the `if` statement is generated, including labels for conditional jumps.
+        The condition is lowered by parseCondition straight into a jump to the `else` part (or past the
+        statement) when it is false; the true case simply falls through into the statement.
         Example:
         if(5 > 3) { x = 20; }  --> This will generate intermediate code for the condition check and jump instructions.
    */
@@ -1248,29 +2159,24 @@ private:
     {
         expect(T_IF);
         expect(T_LPAREN);
-        string cond = parseExpression();
+        string falseLabel = icg.newLabel();
+        parseCondition("", falseLabel);
         expect(T_RPAREN);
 
-        string temp = icg.newTemp();
-        icg.addInstruction(temp + " = " + cond);
-
-        icg.addInstruction("if " + temp + " goto L1");
-        icg.addInstruction("goto L2");
-        icg.addInstruction("L1:");
-
         parseStatement();
 
         if (tokens[pos].type == T_ELSE)
         { // If an `else` part exists, handle it.
-            icg.addInstruction("goto L3");
-            icg.addInstruction("L2:");
+            string endLabel = icg.newLabel();
+            icg.addInstruction("goto " + endLabel);
+            icg.addInstruction(falseLabel + ":");
             expect(T_ELSE);
             parseStatement();
-            icg.addInstruction("L3:");
+            icg.addInstruction(endLabel + ":");
         }
         else
         {
-            icg.addInstruction("L2:");
+            icg.addInstruction(falseLabel + ":");
         }
     }
 
@@ -1278,15 +2184,33 @@ private:
         parseReturnStatement handles the parsing of `return` statements.
         It expects the keyword `return`, followed by an expression to return, and a semicolon to terminate the statement.
         It generates intermediate code to represent the return of the expression.
+        A void function (and the main program) may also use a bare `return;`.
         Example:
         return x + 5;   -->  This will generate intermediate code like `return x + 5`.
     */
 
     void parseReturnStatement()
     {
+        int line = tokens[pos].lineNumber;
         expect(T_RETURN);
-        string expr = parseExpression();
-        icg.addInstruction("return " + expr);
+        string returnType = currentFunction.empty() ? "" : functions[currentFunction].returnType;
+        if (tokens[pos].type == T_SEMICOLON)
+        {
+            if (!returnType.empty() && returnType != "void")
+            {
+                throw CompileError("Semantic error: function '" + currentFunction + "' must return a value at line " + to_string(line), line);
+            }
+            icg.addInstruction("return");
+        }
+        else
+        {
+            if (returnType == "void")
+            {
+                throw CompileError("Semantic error: void function '" + currentFunction + "' cannot return a value at line " + to_string(line), line);
+            }
+            string expr = tokens[pos].type == T_STRING ? quoteString(expectAndReturnValue(T_STRING)) : parseExpression();
+            icg.addInstruction("return " + expr);
+        }
         expect(T_SEMICOLON);
     }
 
@@ -1307,30 +2231,186 @@ private:
         expect(T_RBRACE);
     }
 
+    /*
+       parseCondition lowers the condition of `if`, `agar`, `while`, `for` and `do-while` straight into
+       jumps instead of computing a boolean value first. `trueLabel` is where control goes when the
+       condition holds and `falseLabel` where it goes otherwise; an empty label means "fall through to
+       the code right after the condition".
+       `||` binds weaker than `&&`. Every operand but the last of an `||` chain jumps to the true target
+       as soon as it holds, and every operand but the last of an `&&` chain jumps to the false target as
+       soon as it fails, so the right operand is only evaluated when it can change the result.
+       Example:
+       if (a < b && c > d) { ... }   -->   t0 = a < b
+                                           if !t0 goto L1
+                                           t2 = c > d
+                                           if !t2 goto L1
+                                           ...
+                                           L1:
+   */
+
+    void parseCondition(const string &trueLabel, const string &falseLabel)
+    {
+        // condition := andCondition ('||' andCondition)*
+        string orTrue = trueLabel;
+        while (operandFollowedBy(T_LOGICAL_OR))
+        {
+            if (orTrue.empty())
+                orTrue = icg.newLabel();
+            parseAndCondition(orTrue, "");
+            expect(T_LOGICAL_OR);
+        }
+        parseAndCondition(trueLabel, falseLabel);
+        if (trueLabel.empty() && !orTrue.empty())
+            icg.addInstruction(orTrue + ":");
+    }
+
+    void parseAndCondition(const string &trueLabel, const string &falseLabel)
+    {
+        // andCondition := conditionOperand ('&&' conditionOperand)*
+        string andFalse = falseLabel;
+        while (operandFollowedBy(T_LOGICAL_AND))
+        {
+            if (andFalse.empty())
+                andFalse = icg.newLabel();
+            parseConditionOperand("", andFalse);
+            expect(T_LOGICAL_AND);
+        }
+        parseConditionOperand(trueLabel, falseLabel);
+        if (falseLabel.empty() && !andFalse.empty())
+            icg.addInstruction(andFalse + ":");
+    }
+
+    void parseConditionOperand(const string &trueLabel, const string &falseLabel)
+    {
+        // A parenthesised condition such as `(a || b) && c` is lowered as a nested condition
+        if (tokens[pos].type == T_LPAREN && isParenthesisedCondition())
+        {
+            expect(T_LPAREN);
+            parseCondition(trueLabel, falseLabel);
+            expect(T_RPAREN);
+            return;
+        }
+
+        // Literal true/false: the jump (if any) is known at compile time
+        if ((tokens[pos].type == T_TRUE || tokens[pos].type == T_FALSE) && endsConditionOperand(pos + 1))
+        {
+            string target = tokens[pos++].type == T_TRUE ? trueLabel : falseLabel;
+            if (!target.empty())
+                icg.addInstruction("goto " + target);
+            return;
+        }
+
+        string value = parseRelational();
+        if (!trueLabel.empty())
+        {
+            icg.addInstruction("if " + value + " goto " + trueLabel);
+            if (!falseLabel.empty())
+                icg.addInstruction("goto " + falseLabel);
+        }
+        else
+        {
+            icg.addInstruction("if !" + value + " goto " + falseLabel);
+        }
+    }
+
+    // Does the operand starting at `pos` end with the given logical operator (at the same nesting level)?
+    // Parentheses and array brackets both nest; an unmatched closing one ends the operand.
+    bool operandFollowedBy(TokenType op)
+    {
+        int depth = 0;
+        for (size_t i = pos; i < tokens.size(); i++)
+        {
+            TokenType type = tokens[i].type;
+            if (type == T_LPAREN || type == T_LBRACKET)
+                depth++;
+            else if (type == T_RPAREN || type == T_RBRACKET)
+            {
+                if (depth == 0)
+                    return false;
+                depth--;
+            }
+            else if (depth == 0)
+            {
+                if (type == T_LOGICAL_OR)
+                    return op == T_LOGICAL_OR;
+                if (type == T_LOGICAL_AND && op == T_LOGICAL_AND)
+                    return true;
+                if (type == T_SEMICOLON || type == T_COLON || type == T_LBRACE || type == T_RBRACE || type == T_EOF ||
+                    type == T_COMMA)
+                    return false;
+            }
+        }
+        return false;
+    }
+
+    bool endsConditionOperand(size_t i)
+    {
+        TokenType type = tokens[i].type;
+        return type == T_LOGICAL_AND || type == T_LOGICAL_OR || type == T_RPAREN || type == T_RBRACKET || type == T_SEMICOLON ||
+               type == T_COMMA;
+    }
+
+    // `(` at pos starts a group that contains && or || and is used as a whole condition operand
+    bool isParenthesisedCondition()
+    {
+        int depth = 0, brackets = 0;
+        bool hasLogicalOperator = false;
+        for (size_t i = pos; i < tokens.size(); i++)
+        {
+            TokenType type = tokens[i].type;
+            if (type == T_LPAREN)
+                depth++;
+            else if (type == T_RPAREN)
+            {
+                if (--depth == 0)
+                    return hasLogicalOperator && endsConditionOperand(i + 1);
+            }
+            else if (type == T_LBRACKET)
+                brackets++;
+            else if (type == T_RBRACKET)
+                brackets--;
+            else if (depth == 1 && brackets == 0 && (type == T_LOGICAL_AND || type == T_LOGICAL_OR))
+                hasLogicalOperator = true;
+            else if (type == T_SEMICOLON || type == T_LBRACE || type == T_EOF)
+                return false;
+        }
+        return false;
+    }
+
     /*
        parseExpression handles the parsing of expressions involving addition, subtraction, or comparison operations.
-       It first parses a term, then processes addition (`+`) or subtraction (`-`) operators if present, generating
-       intermediate code for the operations.
+       When the value of an `&&` / `||` expression is needed (e.g. `flag = a > 0 && b > 0;`), the operands are still
+       evaluated with short-circuit jumps and only the final result is stored into a temp.
        Example:
        5 + 3 - 2;  -->  This will generate intermediate code like `t0 = 5 + 3` and `t1 = t0 - 2`.
    */
 
     string parseExpression()
     {
-        string term = parseTerm();
-        while (tokens[pos].type == T_PLUS || tokens[pos].type == T_MINUS)
+        if (operandFollowedBy(T_LOGICAL_OR) || operandFollowedBy(T_LOGICAL_AND))
         {
-            TokenType op = tokens[pos++].type;
-            string nextTerm = parseTerm();
             string temp = icg.newTemp();
-            icg.addInstruction(temp + " = " + term + (op == T_PLUS ? " + " : " - ") + nextTerm);
-            term = temp;
+            string falseLabel = icg.newLabel();
+            string endLabel = icg.newLabel();
+            parseCondition("", falseLabel);
+            icg.addInstruction(temp + " = true");
+            icg.addInstruction("goto " + endLabel);
+            icg.addInstruction(falseLabel + ":");
+            icg.addInstruction(temp + " = false");
+            icg.addInstruction(endLabel + ":");
+            return temp;
         }
-        while (tokens[pos].type == T_GT || tokens[pos].type == T_LT || tokens[pos].type == T_EQ || tokens[pos].type == T_NE || tokens[pos].type == T_LE || tokens[pos].type == T_GE || tokens[pos].type == T_LOGICAL_AND || tokens[pos].type == T_LOGICAL_OR)
+        return parseRelational();
+    }
+
+    // relational := arithmetic (relop arithmetic)*
+    string parseRelational()
+    {
+        string term = parseArithmetic();
+        while (tokens[pos].type == T_GT || tokens[pos].type == T_LT || tokens[pos].type == T_EQ || tokens[pos].type == T_NE || tokens[pos].type == T_LE || tokens[pos].type == T_GE)
         {
-            // pos++;
             TokenType op = tokens[pos++].type;
-            string nextExpr = parseExpression();
+            string nextExpr = parseArithmetic();
             string temp = icg.newTemp();
             if (op == T_GT)
             {
@@ -1356,20 +2436,27 @@ private:
             {
                 icg.addInstruction(temp + " = " + term + " >= " + nextExpr);
             }
-            else if (op == T_LOGICAL_AND)
-            {
-                icg.addInstruction(temp + " = " + term + " && " + nextExpr);
-            }
-            else if (op == T_LOGICAL_OR)
-            {
-                icg.addInstruction(temp + " = " + term + " || " + nextExpr);
-            }
 
             term = temp;
         }
         return term;
     }
 
+    // arithmetic := term (('+' | '-') term)*
+    string parseArithmetic()
+    {
+        string term = parseTerm();
+        while (tokens[pos].type == T_PLUS || tokens[pos].type == T_MINUS)
+        {
+            TokenType op = tokens[pos++].type;
+            string nextTerm = parseTerm();
+            string temp = icg.newTemp();
+            icg.addInstruction(temp + " = " + term + (op == T_PLUS ? " + " : " - ") + nextTerm);
+            term = temp;
+        }
+        return term;
+    }
+
     /*
        parseTerm handles the parsing of terms involving multiplication or division operations.
        It first parses a factor, then processes multiplication (`*`) or division (`/`) operators if present,
@@ -1399,6 +2486,7 @@ private:
        5;          -->  This will return the number "5".
        x;          -->  This will return the identifier "x".
        (5 + 3);    --> This will return the sub-expression "5 + 3".
+       f(x);       --> A call, see parseCall; this will return the temp holding its result.
    */
 
     string parseFactor()
@@ -1412,9 +2500,23 @@ private:
         {
             return tokens[pos++].value;
         }
-        else if (tokens[pos].type == T_ID)
+        else if (tokens[pos].type == T_ID && tokens[pos + 1].type == T_LPAREN)
         {
-            return tokens[pos++].value;
+            return parseCall(true);
+        }
+        else if (tokens[pos].type == T_ID)
+        {
+            string name = resolve(tokens[pos++].value);
+            if (tokens[pos].type != T_LBRACKET)
+            {
+                checkNotArray(name);
+                return name;
+            }
+            // Array element: loaded into a temp (`t0 = a[i]`)
+            string element = parseArrayIndex(name);
+            string temp = icg.newTemp();
+            icg.addInstruction(temp + " = " + element);
+            return temp;
         }
         else if (tokens[pos].type == T_TRUE || tokens[pos].type == T_FALSE)
         {
@@ -1429,8 +2531,36 @@ private:
         }
         else
         {
-            cout << "Syntax error: unexpected token '" << tokens[pos].value << "' at line " << tokens[pos].lineNumber << endl;
-            exit(1);
+            throw CompileError("Syntax error: unexpected token '" + tokens[pos].value + "' at line " + to_string(tokens[pos].lineNumber), tokens[pos].lineNumber);
+        }
+    }
+
+    // `[index]` after the name of an array; returns the element as it is written in the TAC: `a[t3]`
+    string parseArrayIndex(const string &arrayName)
+    {
+        int line = tokens[pos].lineNumber;
+        if (!symTable.isArray(arrayName))
+        {
+            throw CompileError("Semantic error: '" + arrayName + "' is not an array at line " + to_string(line), line);
+        }
+        expect(T_LBRACKET);
+        string index = parseExpression();
+        expect(T_RBRACKET);
+
+        bool literal = !index.empty() && index.find_first_not_of("0123456789") == string::npos;
+        if (literal && (index.size() > 9 || stoi(index) >= symTable.getArraySize(arrayName)))
+        {
+            throw CompileError("Semantic error: index " + index + " is out of bounds for '" + arrayName + "' at line " + to_string(line), line);
+        }
+        return arrayName + "[" + index + "]";
+    }
+
+    // Arrays can only be used one element at a time
+    void checkNotArray(const string &name)
+    {
+        if (symTable.isArray(name))
+        {
+            throw CompileError("Semantic error: array '" + name + "' needs an index at line " + to_string(tokens[pos].lineNumber), tokens[pos].lineNumber);
         }
     }
 
@@ -1445,8 +2575,7 @@ private:
     {
         if (tokens[pos].type != type)
         {
-            cout << "Syntax error: expected '" << type << "' at line " << tokens[pos].lineNumber << endl;
-            exit(1);
+            throw CompileError("Syntax error: expected '" + to_string(type) + "' at line " + to_string(tokens[pos].lineNumber), tokens[pos].lineNumber);
         }
         pos++;
     }
@@ -1469,6 +2598,24 @@ private:
         return value;
     }
 
+    // String literals keep their quotes in the TAC so they cannot be mistaken for names or operators
+    static string quoteString(const string &value)
+    {
+        string quoted = "\"";
+        for (char c : value)
+        {
+            if (c == '\n')
+            {
+                quoted += "\\n";
+                continue;
+            }
+            if (c == '"' || c == '\\')
+                quoted += '\\';
+            quoted += c;
+        }
+        return quoted + "\"";
+    }
+
     /*
        Why both functions are needed:
        - The `expect` function is useful when you are only concerned with ensuring the correct token type without needing its value.
@@ -1478,293 +2625,9563 @@ private:
    */
 };
 
-class AssemblyCodeGenerator
+/*
+    TacInstruction:
+
+    The parser emits three address code as plain strings (`t0 = x + 1`, `if !t3 goto L7`, `L7:`).
+    The optimization passes need to look inside each line, so TacInstruction splits one line into
+    its kind, destination and operands, and toString() gives back exactly the same text.
+
+    Recognised forms:
+       x = y              -> TAC_COPY      (result = x, arg1 = y)
+       x = a op b         -> TAC_BINARY    (result = x, arg1 = a, op, arg2 = b)
+       L1:                -> TAC_LABEL     (result = L1)
+       goto L1            -> TAC_GOTO      (result = L1)
+       if t goto L1       -> TAC_IF        (arg1 = t, result = L1, keyword = "if" or "agar")
+       if !t goto L1      -> TAC_IF_FALSE
+       return x           -> TAC_RETURN    (arg1 = x, empty for a bare `return`)
+       print x            -> TAC_PRINT     (arg1 = x, a variable or a literal)
+       read x             -> TAC_READ      (result = x)
+       x = a[i]           -> TAC_LOAD      (result = x, arg1 = a, arg2 = i)
+       a[i] = x           -> TAC_STORE     (result = a, arg1 = x, arg2 = i)
+    String literals stay quoted (`s = "a + b"`) and are always a single operand.
+       jumptable x 1 L4,L5,L6 default L9
+                          -> TAC_JUMP_TABLE (arg1 = x, arg2 = lowest case value, targets = L4 L5 L6,
+                                             result = default label used when x is out of range)
+       function int f f__a f__b
+                          -> TAC_FUNCTION  (keyword = return type, result = f, targets = parameters)
+       t = call f a 1     -> TAC_CALL      (result = t, arg1 = f, targets = arguments; a call
+                                             statement `call f a 1` has no result)
+    A function runs from its `function` line up to the next one; the main program comes first.
+    Anything else is kept as TAC_OTHER together with its original text.
+    The LoopVectorizer prefixes copies, arithmetic, loads and stores with `vector N` (lanes = N):
+    the instruction works on N elements at once. A temp it defines holds N values, other
+    variables are single values, and `a[i]` stands for the elements a[i] .. a[i + N - 1].
+*/
+enum TacKind
 {
-public:
-    vector<string> assemblyCode;
-    unordered_set<string> definedVariables;
+    TAC_COPY,
+    TAC_BINARY,
+    TAC_LABEL,
+    TAC_GOTO,
+    TAC_IF,
+    TAC_IF_FALSE,
+    TAC_RETURN,
+    TAC_JUMP_TABLE,
+    TAC_PRINT,
+    TAC_READ,
+    TAC_LOAD,
+    TAC_STORE,
+    TAC_OTHER,
+    TAC_FUNCTION,
+    TAC_CALL,
+    TAC_KIND_COUNT
+};
 
-    void generateAssembly(const vector<string> &tacInstructions)
+bool isTacOperator(const string &op)
+{
+    return op == "+" || op == "-" || op == "*" || op == "/" ||
+           op == ">" || op == "<" || op == "==" || op == "!=" ||
+           op == "<=" || op == ">=" || op == "&&" || op == "||";
+}
+
+// A compiler generated temporary: 't' followed only by digits (t0, t17, ...)
+bool isTacTemp(const string &name)
+{
+    return name.size() > 1 && name[0] == 't' &&
+           name.find_first_not_of("0123456789", 1) == string::npos;
+}
+
+bool isTacString(const string &operand)
+{
+    return operand.size() >= 2 && operand.front() == '"' && operand.back() == '"';
+}
+
+// Contents of a quoted TAC string literal with the escapes removed
+string unquoteTacString(const string &operand)
+{
+    string value;
+    for (size_t i = 1; i + 1 < operand.size(); i++)
     {
-        // Start with necessary assembly directives
-        // assemblyCode.push_back("%include 'syscall.asm'  ; Include system call definitions");
-        assemblyCode.push_back("section .data");
-        // assemblyCode.push_back("    SYS_EXIT equ 1");
-        // assemblyCode.push_back("    SYS_WRITE equ 4");
-        // assemblyCode.push_back("    STDOUT equ 1");
+        if (operand[i] == '\\' && i + 2 < operand.size())
+        {
+            value += operand[++i] == 'n' ? '\n' : operand[i];
+            continue;
+        }
+        value += operand[i];
+    }
+    return value;
+}
 
-        // Collect and declare variables
-        collectVariables(tacInstructions);
+// An operand that names a memory location (as opposed to a literal)
+bool isTacVariable(const string &name)
+{
+    if (name.empty() || !(isalpha(name[0]) || name[0] == '_'))
+        return false;
+    if (name == "true" || name == "false")
+        return false;
+    for (char c : name)
+    {
+        if (!isalnum(c) && c != '_')
+            return false;
+    }
+    return true;
+}
 
-        // Start text section
-        assemblyCode.push_back("\nsection .text");
-        assemblyCode.push_back("    global _start");
-        assemblyCode.push_back("_start:");
+// A temp, or a variable a pass derived from one (t20_iv, t7_splat)
+bool isCompilerVariable(const string &name)
+{
+    if (name.size() < 2 || name[0] != 't' || !isdigit(name[1]))
+        return false;
+    size_t i = 1;
+    while (i < name.size() && isdigit(name[i]))
+        i++;
+    return i == name.size() || (name[i] == '_' && isTacVariable(name.substr(i + 1)));
+}
 
-        // Process each TAC instruction
-        for (const auto &instr : tacInstructions)
+struct TacInstruction
+{
+    TacKind kind = TAC_OTHER;
+    string result;
+    string arg1;
+    string op;
+    string arg2;
+    string keyword;
+    vector<string> targets;
+    string text;
+    int lanes = 1;
+
+    static TacInstruction parse(const string &line)
+    {
+        TacInstruction instr;
+        instr.text = line;
+
+        if (line.empty())
+            return instr;
+
+        if (line.compare(0, 7, "vector ") == 0 && line.size() > 7 && isdigit(line[7]))
         {
-            if (instr.find(" = ") != string::npos)
-            {
-                processAssignment(instr);
-            }
-            else if (instr.find("if ") != string::npos || instr.find("agar ") != string::npos)
+            size_t space = line.find(' ', 7);
+            if (space == string::npos)
+                return instr;
+            instr = parse(line.substr(space + 1));
+            instr.lanes = stoi(line.substr(7, space - 7));
+            instr.text = line;
+            return instr;
+        }
+
+        if (line.back() == ':' && line.find(' ') == string::npos)
+        {
+            instr.kind = TAC_LABEL;
+            instr.result = line.substr(0, line.size() - 1);
+            return instr;
+        }
+
+        if (line.compare(0, 5, "goto ") == 0)
+        {
+            instr.kind = TAC_GOTO;
+            instr.result = line.substr(5);
+            return instr;
+        }
+
+        if (line.compare(0, 3, "if ") == 0 || line.compare(0, 5, "agar ") == 0)
+        {
+            size_t gotoPos = line.rfind(" goto ");
+            if (gotoPos == string::npos)
+                return instr;
+
+            instr.keyword = line.substr(0, line.find(' '));
+            string condition = line.substr(instr.keyword.size() + 1, gotoPos - instr.keyword.size() - 1);
+            instr.result = line.substr(gotoPos + 6);
+            instr.kind = TAC_IF;
+            if (!condition.empty() && condition[0] == '!')
             {
-                processConditional(instr);
+                instr.kind = TAC_IF_FALSE;
+                condition = condition.substr(1);
             }
-            else if (instr.find("goto") != string::npos)
+            splitOperands(condition, instr);
+            return instr;
+        }
+
+        if (line.compare(0, 10, "jumptable ") == 0)
+        {
+            istringstream iss(line.substr(10));
+            string table, defaultWord;
+            iss >> instr.arg1 >> instr.arg2 >> table >> defaultWord >> instr.result;
+            if (defaultWord != "default" || instr.result.empty())
+                return instr;
+
+            size_t start = 0;
+            while (start <= table.size())
             {
-                processGoto(instr);
+                size_t comma = table.find(',', start);
+                if (comma == string::npos)
+                    comma = table.size();
+                instr.targets.push_back(table.substr(start, comma - start));
+                start = comma + 1;
             }
-            else if (instr.find(":") != string::npos)
+            instr.kind = TAC_JUMP_TABLE;
+            return instr;
+        }
+
+        if (line.compare(0, 7, "return ") == 0 || line == "return")
+        {
+            instr.kind = TAC_RETURN;
+            instr.arg1 = line.size() > 7 ? line.substr(7) : "";
+            return instr;
+        }
+
+        if (line.compare(0, 9, "function ") == 0 && line.compare(9, 2, "= ") != 0)
+        {
+            istringstream iss(line.substr(9));
+            iss >> instr.keyword >> instr.result;
+            string param;
+            while (iss >> param)
+                instr.targets.push_back(param);
+            if (!instr.result.empty())
+                instr.kind = TAC_FUNCTION;
+            return instr;
+        }
+
+        if (line.compare(0, 5, "call ") == 0 && line.compare(5, 2, "= ") != 0)
+        {
+            parseCall(line.substr(5), instr);
+            return instr;
+        }
+
+        // (but `print = 1` assigns a variable called print)
+        if (line.compare(0, 6, "print ") == 0 && line.compare(6, 2, "= ") != 0)
+        {
+            instr.kind = TAC_PRINT;
+            instr.arg1 = line.substr(6);
+            return instr;
+        }
+
+        if (line.compare(0, 5, "read ") == 0 && line.compare(5, 2, "= ") != 0)
+        {
+            instr.kind = TAC_READ;
+            instr.result = line.substr(5);
+            return instr;
+        }
+
+        size_t eqPos = line.find(" = ");
+        if (eqPos != string::npos)
+        {
+            instr.result = line.substr(0, eqPos);
+            string value = line.substr(eqPos + 3);
+            if (splitElement(line.substr(0, eqPos), instr.result, instr.arg2))
             {
-                processLabel(instr);
+                instr.kind = TAC_STORE;
+                instr.arg1 = value;
+                return instr;
             }
-            else if (!instr.empty())
+            if (value[0] != '"' && splitElement(value, instr.arg1, instr.arg2))
             {
-                cerr << "Unsupported TAC instruction: " << instr << endl;
+                instr.kind = TAC_LOAD;
+                return instr;
             }
+            splitOperands(value, instr);
+            instr.kind = instr.op.empty() ? TAC_COPY : TAC_BINARY;
+            if (instr.kind == TAC_COPY && value.compare(0, 5, "call ") == 0)
+                parseCall(value.substr(5), instr);
         }
+        return instr;
+    }
 
-        // Add program exit
-        // addProgramExit();
+    string toString() const
+    {
+        return (lanes > 1 ? "vector " + to_string(lanes) + " " : "") + scalarString();
     }
 
-    void printAssembly() const
+    string scalarString() const
     {
-        for (const auto &line : assemblyCode)
+        switch (kind)
+        {
+        case TAC_COPY:
+            return result + " = " + arg1;
+        case TAC_BINARY:
+            return result + " = " + arg1 + " " + op + " " + arg2;
+        case TAC_LABEL:
+            return result + ":";
+        case TAC_GOTO:
+            return "goto " + result;
+        case TAC_IF:
+        case TAC_IF_FALSE:
+            return keyword + " " + (kind == TAC_IF_FALSE ? "!" : "") + arg1 +
+                   (op.empty() ? "" : " " + op + " " + arg2) + " goto " + result;
+        case TAC_RETURN:
+            return arg1.empty() ? "return" : "return " + arg1;
+        case TAC_PRINT:
+            return "print " + arg1;
+        case TAC_READ:
+            return "read " + result;
+        case TAC_LOAD:
+            return result + " = " + arg1 + "[" + arg2 + "]";
+        case TAC_STORE:
+            return result + "[" + arg2 + "] = " + arg1;
+        case TAC_JUMP_TABLE:
+        {
+            string table;
+            for (size_t i = 0; i < targets.size(); i++)
+                table += (i ? "," : "") + targets[i];
+            return "jumptable " + arg1 + " " + arg2 + " " + table + " default " + result;
+        }
+        case TAC_FUNCTION:
+        case TAC_CALL:
         {
-            cout << line << endl;
+            string line = kind == TAC_FUNCTION ? "function " + keyword + " " + result
+                                               : (result.empty() ? "" : result + " = ") + "call " + arg1;
+            for (const auto &operand : targets)
+                line += " " + operand;
+            return line;
+        }
+        default:
+            return text;
         }
     }
 
-    void saveInstructionsToFile(const string &filename)
+    bool isJump() const
     {
-        // Open a .obj file in text mode
-        ofstream outFile(filename);
-        if (!outFile.is_open())
+        return kind == TAC_GOTO || kind == TAC_IF || kind == TAC_IF_FALSE || kind == TAC_JUMP_TABLE;
+    }
+
+    // Every label this instruction can jump to
+    vector<string> jumpTargets() const
+    {
+        vector<string> labels;
+        if (isJump())
+            labels.push_back(result);
+        for (const auto &target : kind == TAC_JUMP_TABLE ? targets : vector<string>())
         {
-            cerr << "Error: Unable to open file for writing!" << endl;
-            return;
+            if (find(labels.begin(), labels.end(), target) == labels.end())
+                labels.push_back(target);
         }
+        return labels;
+    }
 
-        // Write each instruction to the file
-        for (const auto &instr : assemblyCode)
+    void replaceTarget(const string &from, const string &to)
+    {
+        if (isJump() && result == from)
+            result = to;
+        for (auto &target : targets)
         {
-            outFile << instr << endl;
+            if (target == from && kind == TAC_JUMP_TABLE)
+                target = to;
         }
+    }
 
-        // Close the file
-        outFile.close();
-        cout << "Generated Assembly Code is saved to file: " << filename << endl;
+    bool definesVariable() const
+    {
+        return kind == TAC_COPY || kind == TAC_BINARY || kind == TAC_READ || kind == TAC_LOAD ||
+               (kind == TAC_CALL && !result.empty());
     }
 
-private:
-    void collectVariables(const vector<string> &instructions)
+    vector<string> uses() const
     {
-        for (const auto &instr : instructions)
+        vector<string> used;
+        if (kind == TAC_LOAD || kind == TAC_STORE)
         {
-            // Extract variables from assignments and conditions
-            extractVariablesFromInstruction(instr);
+            // The array itself is not a value; the index (and a stored value) are
+            if (kind == TAC_STORE && isTacVariable(arg1))
+                used.push_back(arg1);
+            if (isTacVariable(arg2))
+                used.push_back(arg2);
+            return used;
         }
-
-        // Declare collected variables
-        for (const auto &var : definedVariables)
+        if (kind == TAC_CALL)
         {
-            if (isNumeric(var))
+            for (const auto &argument : targets)
             {
-                // Skip numeric constants
-                continue;
+                if (isTacVariable(argument) && find(used.begin(), used.end(), argument) == used.end())
+                    used.push_back(argument);
             }
-            assemblyCode.push_back("    " + var + " dd 0");
+            return used;
+        }
+        if (kind == TAC_COPY || kind == TAC_BINARY || kind == TAC_IF || kind == TAC_IF_FALSE ||
+            kind == TAC_RETURN || kind == TAC_JUMP_TABLE || kind == TAC_PRINT)
+        {
+            if (isTacVariable(arg1))
+                used.push_back(arg1);
+            if (!op.empty() && isTacVariable(arg2) && kind != TAC_JUMP_TABLE)
+                used.push_back(arg2);
+        }
+        return used;
+    }
+
+private:
+    // "f a 1" (what follows `call`): arg1 = f, targets = a 1
+    static void parseCall(const string &call, TacInstruction &instr)
+    {
+        istringstream iss(call);
+        string function, argument;
+        iss >> function;
+        if (!isTacVariable(function))
+            return;
+        instr.kind = TAC_CALL;
+        instr.arg1 = function;
+        while (iss >> argument)
+            instr.targets.push_back(argument);
+    }
+
+    // `name[index]` -> name, index
+    static bool splitElement(const string &text, string &name, string &index)
+    {
+        size_t open = text.find('[');
+        if (open == string::npos || text.back() != ']' || !isTacVariable(text.substr(0, open)))
+            return false;
+        name = text.substr(0, open);
+        index = text.substr(open + 1, text.size() - open - 2);
+        return !index.empty() && index.find(' ') == string::npos;
+    }
+
+    // "a op b" fills arg1/op/arg2, anything else (including any quoted string literal) goes to arg1
+    static void splitOperands(const string &expr, TacInstruction &instr)
+    {
+        istringstream iss(expr);
+        vector<string> parts;
+        string part;
+        while (iss >> part)
+            parts.push_back(part);
+
+        if (parts.size() == 3 && isTacOperator(parts[1]) && expr[0] != '"')
+        {
+            instr.arg1 = parts[0];
+            instr.op = parts[1];
+            instr.arg2 = parts[2];
+        }
+        else
+        {
+            instr.arg1 = expr;
         }
     }
+};
+
+/*
+    ControlFlowGraph:
+
+    Splits a list of TAC instructions into basic blocks. A block starts at the first instruction,
+    at every label and after every jump or return, and ends with at most one jump. Blocks are kept
+    in their original order, so a block without a closing `goto` still falls through into the next
+    one and linearize() rebuilds a correct instruction list. A `function` instruction also starts
+    a block, and nothing falls through into it: each function is a separate entry of the graph.
+
+    computeDominators() uses the iterative algorithm of Cooper, Harvey and Kennedy over the reverse
+    post-order, which stays fast for programs with many thousands of blocks. findNaturalLoops()
+    then looks for back edges (an edge n -> h where h dominates n) and collects every block that
+    can reach n without passing through h.
+*/
+struct BasicBlock
+{
+    pmr::vector<TacInstruction> instrs;
+    pmr::vector<int> succs;
+    pmr::vector<int> preds;
+    string label;
+
+    explicit BasicBlock(pmr::memory_resource *memory) : instrs(memory), succs(memory), preds(memory) {}
+};
+
+struct NaturalLoop
+{
+    int header = -1;
+    pmr::vector<int> latches;
+    pmr::vector<int> body;   // block ids in layout order, header included
+    pmr::vector<bool> inLoop; // indexed by block id
+
+    explicit NaturalLoop(pmr::memory_resource *memory) : latches(memory), body(memory), inLoop(memory) {}
+};
+
+class ControlFlowGraph
+{
+public:
+    vector<BasicBlock> blocks;
+    vector<int> idom;
+    vector<int> domEnter, domExit; // dominator tree preorder / postorder numbers
 
-    void extractVariablesFromInstruction(const string &instr)
+    // The blocks, loops and label index are allocated from `memory`
+    explicit ControlFlowGraph(pmr::memory_resource *memory = pmr::get_default_resource())
+        : labelBlock(memory), memory(memory) {}
+
+    void build(const vector<TacInstruction> &code)
     {
-        // Split instruction into tokens
-        istringstream iss(instr);
-        string token;
-        while (iss >> token)
+        blocks.clear();
+        labelBlock.clear();
+
+        for (const auto &instr : code)
         {
-            // Ignore keywords and operators
-            if (token == "=" || token == "if" || token == "goto" ||
-                token == "agar" || token == "+" || token == "-" ||
-                token == "*" || token == "/" ||
-                token.back() == ':')
+            bool startsBlock = blocks.empty() || instr.kind == TAC_LABEL || instr.kind == TAC_FUNCTION;
+            if (!blocks.empty() && !blocks.back().instrs.empty())
             {
-                continue;
+                TacKind last = blocks.back().instrs.back().kind;
+                if (last == TAC_GOTO || last == TAC_IF || last == TAC_IF_FALSE || last == TAC_RETURN ||
+                    last == TAC_JUMP_TABLE)
+                    startsBlock = true;
+            }
+            if (startsBlock)
+            {
+                blocks.push_back(BasicBlock(memory));
+                if (instr.kind == TAC_LABEL)
+                {
+                    blocks.back().label = instr.result;
+                    labelBlock[instr.result] = (int)blocks.size() - 1;
+                }
             }
+            blocks.back().instrs.push_back(instr);
+        }
 
-            // Skip if token is a numeric constant
-            if (!isNumeric(token))
+        for (size_t b = 0; b < blocks.size(); b++)
+        {
+            const TacInstruction *last = blocks[b].instrs.empty() ? nullptr : &blocks[b].instrs.back();
+            if (last)
             {
-                definedVariables.insert(token);
+                for (const auto &label : last->jumpTargets())
+                {
+                    auto target = labelBlock.find(label);
+                    if (target != labelBlock.end())
+                        addEdge((int)b, target->second);
+                }
             }
+            bool fallsThrough = !last || (last->kind != TAC_GOTO && last->kind != TAC_RETURN &&
+                                          last->kind != TAC_JUMP_TABLE);
+            if (fallsThrough && b + 1 < blocks.size() && !isFunctionEntry((int)b + 1))
+                addEdge((int)b, (int)b + 1);
         }
     }
 
-    bool isNumeric(const string &str)
+    vector<TacInstruction> linearize() const
     {
-        return str.find_first_not_of("0123456789") == string::npos;
+        vector<TacInstruction> code;
+        for (const auto &block : blocks)
+            code.insert(code.end(), block.instrs.begin(), block.instrs.end());
+        return code;
     }
 
-    void processAssignment(const string &instr)
+    int blockForLabel(const string &label) const
     {
-        size_t eqPos = instr.find(" = ");
-        string lhs = instr.substr(0, eqPos);
-        string rhs = instr.substr(eqPos + 3);
+        auto it = labelBlock.find(label);
+        return it == labelBlock.end() ? -1 : it->second;
+    }
 
-        if (rhs.find("+") != string::npos)
-            translateBinaryOp(lhs, rhs, "add");
-        else if (rhs.find("-") != string::npos)
-            translateBinaryOp(lhs, rhs, "sub");
-        else if (rhs.find("*") != string::npos)
-            translateBinaryOp(lhs, rhs, "imul");
-        else if (rhs.find("/") != string::npos)
-            translateBinaryOp(lhs, rhs, "idiv");
-        else
-        {
-            // Simple assignment or constant
-            assemblyCode.push_back("    mov dword [" + lhs + "], " + rhs);
-        }
+    bool fallsThrough(int b) const
+    {
+        if (blocks[b].instrs.empty())
+            return true;
+        TacKind last = blocks[b].instrs.back().kind;
+        return last != TAC_GOTO && last != TAC_RETURN && last != TAC_JUMP_TABLE;
     }
 
-    void translateBinaryOp(const string &lhs, const string &rhs, const string &op)
+    bool isFunctionEntry(int b) const
     {
-        size_t opPos = rhs.find_first_of("+-*/");
-        string op1 = rhs.substr(0, opPos - 1);
-        string op2 = rhs.substr(opPos + 2);
+        return !blocks[b].instrs.empty() && blocks[b].instrs.front().kind == TAC_FUNCTION;
+    }
 
-        assemblyCode.push_back("    mov eax, [" + op1 + "]");
+    void computeDominators()
+    {
+        int n = (int)blocks.size();
+        idom.assign(n, -1);
+        if (n == 0)
+            return;
 
-        if (op == "idiv")
+        // Reverse post-order from the entry block and from the entry of every function
+        vector<int> order;
+        vector<int> rpoIndex(n, -1);
+        vector<char> visited(n, 0);
+        vector<pair<int, size_t>> stack;
+        for (int root = 0; root < n; root++)
         {
-            // Division requires special handling
-            assemblyCode.push_back("    mov ebx, [" + op2 + "]");
-            assemblyCode.push_back("    cdq  ; Sign extend for division");
-            assemblyCode.push_back("    idiv ebx");
+            if (root != 0 && !isFunctionEntry(root))
+                continue;
+            stack.push_back({root, 0});
+            visited[root] = 1;
+            idom[root] = root;
         }
-        else
+        while (!stack.empty())
         {
-            if (op == "imul")
+            int b = stack.back().first;
+            size_t &next = stack.back().second;
+            if (next < blocks[b].succs.size())
             {
-                assemblyCode.push_back("    imul eax, [" + op2 + "]");
+                int s = blocks[b].succs[next++];
+                if (!visited[s])
+                {
+                    visited[s] = 1;
+                    stack.push_back({s, 0});
+                }
             }
             else
             {
-                // Addition or subtraction
-                assemblyCode.push_back("    " + op + " eax, [" + op2 + "]");
+                order.push_back(b);
+                stack.pop_back();
             }
         }
+        reverse(order.begin(), order.end());
+        for (size_t i = 0; i < order.size(); i++)
+            rpoIndex[order[i]] = (int)i;
 
-        assemblyCode.push_back("    mov dword [" + lhs + "], eax");
-    }
-
-    void processConditional(const string &instr)
-    {
-        // Support for both 'if' and 'agar' keywords
-        size_t condStart = (instr.find("if ") != string::npos) ? instr.find("if ") : instr.find("agar ");
-        size_t gotoPos = instr.find("goto");
-        string condition = instr.substr(condStart + 3, gotoPos - condStart - 3);
-        string label = instr.substr(gotoPos + 5);
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (size_t i = 0; i < order.size(); i++)
+            {
+                int b = order[i];
+                if (idom[b] == b)
+                    continue;
+                int newIdom = -1;
+                for (int p : blocks[b].preds)
+                {
+                    if (idom[p] == -1)
+                        continue;
+                    if (newIdom == -1)
+                    {
+                        newIdom = p;
+                        continue;
+                    }
+                    int x = p, y = newIdom;
+                    while (x != y)
+                    {
+                        while (rpoIndex[x] > rpoIndex[y])
+                            x = idom[x];
+                        while (rpoIndex[y] > rpoIndex[x])
+                            y = idom[y];
+                    }
+                    newIdom = x;
+                }
+                if (newIdom != -1 && idom[b] != newIdom)
+                {
+                    idom[b] = newIdom;
+                    changed = true;
+                }
+            }
+        }
 
-        if (condition.find_first_of("<>=") == string::npos)
+        // Number the dominator tree depth-first, so dominates() is two comparisons
+        vector<vector<int>> children(n);
+        for (int b = 0; b < n; b++)
         {
-            // Boolean condition
-            assemblyCode.push_back("    cmp dword [" + condition + "], 1");
-            assemblyCode.push_back("    je " + label);
+            if (idom[b] != -1 && idom[b] != b)
+                children[idom[b]].push_back(b);
         }
-        else
+        domEnter.assign(n, -1);
+        domExit.assign(n, -1);
+        int counter = 0;
+        for (int root = 0; root < n; root++)
         {
-            // Relational condition
-            size_t opPos = condition.find_first_of("<>=");
-            string op1 = condition.substr(0, opPos - 1);
-            string op2 = condition.substr(opPos + 2);
-            string compOp = condition.substr(opPos, 1);
+            if (idom[root] != root)
+                continue;
+            stack.push_back({root, 0});
+            domEnter[root] = counter++;
+            while (!stack.empty())
+            {
+                int b = stack.back().first;
+                size_t &next = stack.back().second;
+                if (next < children[b].size())
+                {
+                    int child = children[b][next++];
+                    domEnter[child] = counter++;
+                    stack.push_back({child, 0});
+                }
+                else
+                {
+                    domExit[b] = counter++;
+                    stack.pop_back();
+                }
+            }
+        }
+    }
 
-            assemblyCode.push_back("    mov eax, [" + op1 + "]");
-            assemblyCode.push_back("    cmp eax, [" + op2 + "]");
+    bool isReachable(int b) const
+    {
+        return idom[b] != -1;
+    }
 
-            if (compOp == ">")
-                assemblyCode.push_back("    jg " + label);
-            else if (compOp == "<")
-                assemblyCode.push_back("    jl " + label);
-            else if (compOp == "=")
-                assemblyCode.push_back("    je " + label);
-        }
+    // True if every path from the entry to b passes through a
+    bool dominates(int a, int b) const
+    {
+        if (!isReachable(a) || !isReachable(b))
+            return false;
+        return domEnter[a] <= domEnter[b] && domExit[b] <= domExit[a];
     }
 
-    void processLabel(const string &instr)
+    vector<NaturalLoop> findNaturalLoops() const
     {
-        // Remove whitespace and ensure proper label format
-        string trimmedLabel = regex_replace(instr, regex("^\\s+|\\s+$"), "");
-        assemblyCode.push_back("\n" + trimmedLabel);
+        map<int, NaturalLoop> byHeader;
+        for (size_t b = 0; b < blocks.size(); b++)
+        {
+            if (!isReachable((int)b))
+                continue;
+            for (int h : blocks[b].succs)
+            {
+                if (!dominates(h, (int)b))
+                    continue;
+
+                auto it = byHeader.find(h);
+                if (it == byHeader.end())
+                {
+                    NaturalLoop loop(memory);
+                    loop.header = h;
+                    loop.inLoop.assign(blocks.size(), false);
+                    loop.inLoop[h] = true;
+                    loop.body.push_back(h);
+                    it = byHeader.insert({h, move(loop)}).first;
+                }
+                NaturalLoop &loop = it->second;
+                loop.latches.push_back((int)b);
+
+                vector<int> work;
+                if (!loop.inLoop[b])
+                {
+                    loop.inLoop[b] = true;
+                    loop.body.push_back((int)b);
+                    work.push_back((int)b);
+                }
+                while (!work.empty())
+                {
+                    int m = work.back();
+                    work.pop_back();
+                    for (int p : blocks[m].preds)
+                    {
+                        if (isReachable(p) && !loop.inLoop[p])
+                        {
+                            loop.inLoop[p] = true;
+                            loop.body.push_back(p);
+                            work.push_back(p);
+                        }
+                    }
+                }
+            }
+        }
+
+        vector<NaturalLoop> loops;
+        for (auto &entry : byHeader)
+        {
+            NaturalLoop &loop = entry.second;
+            sort(loop.body.begin(), loop.body.end());
+            loops.push_back(move(loop));
+        }
+        return loops;
     }
 
-    void processGoto(const string &instr)
+    // A call can change any global, so code in such a loop is not invariant
+    bool containsCall(const NaturalLoop &loop) const
     {
-        size_t gotoPos = instr.find("goto");
-        string label = instr.substr(gotoPos + 5);
-        assemblyCode.push_back("    jmp " + label);
+        for (int b : loop.body)
+        {
+            for (const auto &instr : blocks[b].instrs)
+            {
+                if (instr.kind == TAC_CALL)
+                    return true;
+            }
+        }
+        return false;
     }
 
-    void addProgramExit()
+private:
+    pmr::map<string, int> labelBlock;
+    pmr::memory_resource *memory;
+
+    void addEdge(int from, int to)
     {
-        // Add standard exit syscall
-        assemblyCode.push_back("\n    ; Exit program");
-        assemblyCode.push_back("    mov eax, SYS_EXIT");
-        assemblyCode.push_back("    xor ebx, ebx  ; Exit code 0");
-        assemblyCode.push_back("    int 0x80");
+        blocks[from].succs.push_back(to);
+        blocks[to].preds.push_back(from);
     }
 };
 
-int main(int argc, char *argv[])
+/*
+    CallGraph:
+
+    The functions of a TAC program and which of them call which. Everything before the first
+    `function` instruction is the main program, which has the empty name. A function can recurse
+    when it reaches itself through one or more calls; only such functions need their variables
+    saved around a call, all others keep them in static slots like the main program does.
+*/
+struct FunctionInfo
 {
-    // Check if the correct number of arguments is provided
-    if (argc != 2)
+    string name;
+    string returnType;      // "void" when it returns nothing
+    vector<string> params;
+    size_t first = 0;       // index of its `function` instruction
+    size_t end = 0;         // one past its last instruction
+    set<string> callees;
+    int callSites = 0;      // calls to it anywhere in the program
+};
+
+class CallGraph
+{
+public:
+    vector<FunctionInfo> functions; // the main program first, then in program order
+
+    void build(const vector<TacInstruction> &code)
     {
-        cerr << "Usage: " << argv[0] << " <filename>" << endl;
-        return 1;
+        functions.assign(1, FunctionInfo());
+        index.clear();
+        index[""] = 0;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            if (code[i].kind == TAC_FUNCTION)
+            {
+                functions.back().end = i;
+                FunctionInfo function;
+                function.name = code[i].result;
+                function.returnType = code[i].keyword;
+                function.params = code[i].targets;
+                function.first = i;
+                index[function.name] = functions.size();
+                functions.push_back(function);
+            }
+            else if (code[i].kind == TAC_CALL)
+            {
+                functions.back().callees.insert(code[i].arg1);
+            }
+        }
+        functions.back().end = code.size();
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            if (code[i].kind == TAC_CALL && index.count(code[i].arg1))
+                functions[index[code[i].arg1]].callSites++;
+        }
     }
 
-    // Open the file
-    ifstream inputFile(argv[1]);
-    if (!inputFile.is_open())
+    bool hasFunctions() const
     {
-        cerr << "Error opening file: " << argv[1] << endl;
-        return 1;
+        return functions.size() > 1;
     }
 
-    // // Read and print the file content
-    string input = "", line;
-    while (getline(inputFile, line))
+    const FunctionInfo *find(const string &name) const
     {
-        input += line + "\n";
+        auto it = index.find(name);
+        return it == index.end() ? nullptr : &functions[it->second];
     }
 
-    Lexer lexer(input);
-    vector<Token> tokens = lexer.tokenize();
+    // Can a call to `from` end up calling `to` (directly or through other functions)?
+    bool reaches(const string &from, const string &to) const
+    {
+        set<string> seen;
+        vector<string> work(1, from);
+        while (!work.empty())
+        {
+            const FunctionInfo *function = find(work.back());
+            work.pop_back();
+            if (!function)
+                continue;
+            for (const auto &callee : function->callees)
+            {
+                if (callee == to)
+                    return true;
+                if (seen.insert(callee).second)
+                    work.push_back(callee);
+            }
+        }
+        return false;
+    }
+
+    bool isRecursive(const string &name) const
+    {
+        return reaches(name, name);
+    }
+
+private:
+    map<string, size_t> index;
+};
+
+/*
+    BlockProfile:
+
+    How often every label was reached in one run of the program. --instrument counts them in the
+    bytecode interpreter and writes them to a profile file; --use-profile reads the file back and
+    the InductionVariableOptimizer, the ProfileGuidedLayout, the Inliner and the RegisterAllocator
+    use it.
+    A label starts every block that can be jumped to, so the counts cover all branch targets; an
+    unlabeled block (the fall-through side of a branch) takes the count of the label before it.
+    The file is plain text: a header with a hash of the source, then one label per line:
+        block-profile 1 8c3a0f5e2b7d1946
+        L3 1000
+        t7_do_while_start 250
+    Passes that copy code (unrolling, inlining) give the copied labels estimated counts, so the passes after
+    them still see roughly how often each copy runs.
+*/
+class BlockProfile
+{
+public:
+    static constexpr int64_t minimumHotCount = 32;
+
+    uint64_t sourceHash = 0;
+
+    // FNV-1a over the source; the profile only matches TAC built from the same program
+    static uint64_t hashSource(string_view source, bool vectorize, int inlineSize)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : source)
+            hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+        // The vectorizer and the Inliner add labels, so a profile is only valid with the same settings
+        hash = (hash ^ (uint32_t)inlineSize) * 1099511628211ull;
+        return vectorize ? hash : ~hash;
+    }
+
+    bool empty() const { return counts.empty(); }
+
+    // Times `label` was reached, or -1 when the profile does not know it
+    int64_t count(const string &label) const
+    {
+        auto it = counts.find(label);
+        return it == counts.end() ? -1 : it->second;
+    }
+
+    void set(const string &label, int64_t count)
+    {
+        counts[label] = count;
+        hottest = max(hottest, count);
+    }
+
+    // Takes over the counts a pass changed in `updated`, its copy of `original`
+    void update(const BlockProfile &original, const BlockProfile &updated)
+    {
+        for (const auto &[label, count] : updated.counts)
+        {
+            if (original.count(label) != count)
+                set(label, count);
+        }
+    }
+
+    // Within 1/16 of the hottest label and not just a handful of runs
+    bool isHot(const string &label) const
+    {
+        int64_t c = count(label);
+        return c >= minimumHotCount && c * 16 >= hottest;
+    }
+
+    // Known and never reached
+    bool isCold(const string &label) const
+    {
+        return count(label) == 0;
+    }
+
+    bool save(const string &filename) const
+    {
+        OutputBuffer out;
+        char hash[17];
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)sourceHash);
+        out.append("block-profile 1 ");
+        out.append(hash);
+        out.append('\n');
+        for (const auto &[label, count] : counts)
+        {
+            out.append(label);
+            out.append(' ');
+            out.appendNumber(count);
+            out.append('\n');
+        }
+        return out.writeToFile(filename);
+    }
+
+    bool load(const string &filename, string &error)
+    {
+        ifstream file(filename);
+        if (!file.is_open())
+        {
+            error = "Error opening profile: " + filename;
+            return false;
+        }
+        string magic, version, hash;
+        if (!(file >> magic >> version >> hash) || magic != "block-profile" || version != "1")
+        {
+            error = filename + ": not a block profile";
+            return false;
+        }
+        sourceHash = strtoull(hash.c_str(), nullptr, 16);
+        string label;
+        int64_t count;
+        while (file >> label >> count)
+            set(label, count);
+        if (!file.eof())
+        {
+            error = filename + ": malformed line after " + (label.empty() ? "the header" : label);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    map<string, int64_t> counts;
+    int64_t hottest = 0;
+};
+
+/*
+    Inliner:
+
+    Replaces a call by a copy of the body of the function it calls. A call is inlined when the
+    function cannot recurse and has at most maxSize TAC instructions or is called from only one
+    place. The copy
+    - first assigns the arguments to the parameters. Parameters and locals keep their names:
+      a function that cannot recurse never runs twice at the same time, so its slots are free;
+    - gets fresh labels and compiler temps, so several copies of one body do not collide;
+    - turns `return x` into an assignment to a `tN_ret` variable, declared with the return type
+      so x is converted as the call would have done, and a jump to the end of the copy, where
+      the result of the call is read from it.
+    The copied body can call further functions, so this repeats for up to maxRounds rounds.
+    Functions the main program no longer reaches are removed afterwards.
+
+    optimizeHot() is the profile-guided variant. It runs after ProfileGuidedLayout, so the
+    passes before it see the labels the profile was recorded with, and inlines calls in hot
+    blocks up to hotSizeFactor times the usual size. The copied labels take the counts of the
+    originals.
+*/
+class Inliner
+{
+public:
+    static constexpr int defaultMaxSize = 40;
+
+    int callsInlined = 0;
+    int functionsRemoved = 0;
+
+    Inliner(IntermediateCodeGnerator &icg, SymbolTable &symTable, int maxSize)
+        : icg(icg), symTable(symTable), maxSize(maxSize) {}
+
+    void optimize()
+    {
+        if (maxSize <= 0)
+            return;
+        vector<TacInstruction> code = parse();
+        callGraph.build(code);
+        if (!callGraph.hasFunctions())
+            return;
+        for (int round = 0; round < maxRounds; round++)
+        {
+            if (round)
+                callGraph.build(code);
+            if (!inlineCalls(code, [this](const string &, const FunctionInfo &callee)
+                             { return bodySize(callee) <= (size_t)maxSize || callee.callSites == 1; }))
+                break;
+        }
+        removeUnreachable(code);
+        write(code);
+    }
+
+    void optimizeHot(BlockProfile &blockProfile)
+    {
+        if (maxSize <= 0 || blockProfile.empty())
+            return;
+        profile = &blockProfile;
+        vector<TacInstruction> code = parse();
+        callGraph.build(code);
+        if (callGraph.hasFunctions() &&
+            inlineCalls(code, [this](const string &label, const FunctionInfo &callee)
+                        { return profile->isHot(label) && bodySize(callee) <= (size_t)maxSize * hotSizeFactor; }))
+        {
+            removeUnreachable(code);
+            write(code);
+        }
+        profile = nullptr;
+    }
+
+private:
+    static constexpr int maxRounds = 3;
+    static constexpr int hotSizeFactor = 4;
+
+    IntermediateCodeGnerator &icg;
+    SymbolTable &symTable;
+    int maxSize;
+    BlockProfile *profile = nullptr; // only during optimizeHot
+    CallGraph callGraph;
+
+    vector<TacInstruction> parse() const
+    {
+        vector<TacInstruction> code;
+        code.reserve(icg.instructions.size());
+        for (const auto &line : icg.instructions)
+            code.push_back(TacInstruction::parse(line));
+        return code;
+    }
+
+    void write(const vector<TacInstruction> &code)
+    {
+        icg.instructions.clear();
+        for (const auto &instr : code)
+            icg.instructions.push_back(instr.toString());
+    }
+
+    static size_t bodySize(const FunctionInfo &function)
+    {
+        return function.end - function.first - 1;
+    }
+
+    // Inlines every call `wanted(label, callee)` accepts, label being the last one before the call
+    bool inlineCalls(vector<TacInstruction> &code, const function<bool(const string &, const FunctionInfo &)> &wanted)
+    {
+        vector<TacInstruction> inlined;
+        inlined.reserve(code.size());
+        string label;
+        bool changed = false;
+        for (const auto &instr : code)
+        {
+            if (instr.kind == TAC_LABEL || instr.kind == TAC_FUNCTION)
+                label = instr.kind == TAC_LABEL ? instr.result : "";
+            const FunctionInfo *callee = instr.kind == TAC_CALL ? callGraph.find(instr.arg1) : nullptr;
+            if (!callee || callGraph.isRecursive(callee->name) || !wanted(label, *callee))
+            {
+                inlined.push_back(instr);
+                continue;
+            }
+            expand(code, *callee, instr, label, inlined);
+            callsInlined++;
+            changed = true;
+        }
+        code = move(inlined);
+        return changed;
+    }
+
+    // A new name of the same kind: tN_suffix for compiler variables, LN for labels
+    string freshName(const string &name)
+    {
+        if (!isCompilerVariable(name))
+            return icg.newLabel();
+        size_t suffix = name.find('_');
+        string fresh = icg.newTemp() + (suffix == string::npos ? "" : name.substr(suffix));
+        if (symTable.isDeclared(name))
+            symTable.declareVariable(fresh, symTable.getVariableType(name));
+        return fresh;
+    }
+
+    void expand(const vector<TacInstruction> &code, const FunctionInfo &callee, const TacInstruction &call,
+                const string &callLabel, vector<TacInstruction> &out)
+    {
+        for (size_t p = 0; p < callee.params.size() && p < call.targets.size(); p++)
+            out.push_back(TacInstruction::parse(callee.params[p] + " = " + call.targets[p]));
+
+        map<string, string> rename;
+        for (size_t i = callee.first + 1; i < callee.end; i++)
+        {
+            if (code[i].kind == TAC_LABEL)
+            {
+                string fresh = freshName(code[i].result);
+                if (profile && profile->count(code[i].result) >= 0)
+                    profile->set(fresh, profile->count(code[i].result));
+                rename[code[i].result] = fresh;
+            }
+        }
+        auto renamed = [&](string &name)
+        {
+            auto it = rename.find(name);
+            if (it != rename.end())
+                name = it->second;
+            else if (isCompilerVariable(name))
+                name = rename[name] = freshName(name);
+        };
+
+        string value = call.result.empty() ? "" : icg.newTemp() + "_ret";
+        if (!value.empty())
+            symTable.declareVariable(value, callee.returnType);
+        string end;
+        for (size_t i = callee.first + 1; i < callee.end; i++)
+        {
+            TacInstruction instr = code[i];
+            renamed(instr.result);
+            renamed(instr.arg1);
+            renamed(instr.arg2);
+            for (auto &target : instr.targets)
+                renamed(target);
+            if (instr.kind != TAC_RETURN)
+            {
+                out.push_back(instr);
+                continue;
+            }
+            if (!value.empty() && !instr.arg1.empty())
+                out.push_back(TacInstruction::parse(value + " = " + instr.arg1));
+            if (i + 1 < callee.end)
+            {
+                if (end.empty())
+                    end = icg.newLabel();
+                out.push_back(TacInstruction::parse("goto " + end));
+            }
+        }
+        if (!end.empty())
+        {
+            out.push_back(TacInstruction::parse(end + ":"));
+            if (profile && profile->count(callLabel) >= 0)
+                profile->set(end, profile->count(callLabel));
+        }
+        if (!value.empty())
+            out.push_back(TacInstruction::parse(call.result + " = " + value));
+    }
+
+    void removeUnreachable(vector<TacInstruction> &code)
+    {
+        callGraph.build(code);
+        set<string> reached;
+        vector<string> work(1, "");
+        while (!work.empty())
+        {
+            const FunctionInfo *function = callGraph.find(work.back());
+            work.pop_back();
+            for (const auto &callee : function ? function->callees : set<string>())
+            {
+                if (reached.insert(callee).second)
+                    work.push_back(callee);
+            }
+        }
+
+        vector<TacInstruction> kept;
+        kept.reserve(code.size());
+        for (const auto &function : callGraph.functions)
+        {
+            if (!function.name.empty() && !reached.count(function.name))
+            {
+                functionsRemoved++;
+                continue;
+            }
+            kept.insert(kept.end(), code.begin() + function.first, code.begin() + function.end);
+        }
+        code = move(kept);
+    }
+};
+
+/*
+    LoopOptimizer:
+
+    Loop-invariant code motion over the TAC produced for `while`, `for` and `do-while` loops.
+
+    1. Every natural loop gets a preheader: a new label placed right before the loop header.
+       Jumps into the header from outside the loop are redirected to it, so the preheader runs
+       exactly once each time the loop is entered.
+    2. Loops are visited innermost first. An assignment `x = a op b` (or `x = a`) is invariant when
+       each operand is a literal, is not assigned anywhere in the loop, or is itself the result of
+       an invariant assignment that has already been hoisted.
+    3. An invariant assignment is moved to the end of the preheader when that is safe:
+       - it is the only assignment to x inside the loop;
+       - it cannot trap (division is only moved for a non-zero literal divisor);
+       - x is a compiler temp, which has a single definition and is only read after it, or
+         the assignment dominates every loop exit and every use of x inside the loop.
+    Because inner loops are handled first and an inner preheader is part of the outer loop,
+    work that is invariant in several nested loops moves out one level at a time.
+    Nothing is hoisted out of a loop that calls a function: the call may assign any global.
+*/
+class LoopOptimizer
+{
+public:
+    int loopsFound = 0;
+    int instructionsHoisted = 0;
+
+    LoopOptimizer(IntermediateCodeGnerator &icg) : icg(icg) {}
+
+    void optimize()
+    {
+        vector<TacInstruction> code;
+        code.reserve(icg.instructions.size());
+        for (const auto &line : icg.instructions)
+            code.push_back(TacInstruction::parse(line));
+
+        code = insertPreheaders(code);
+
+        ControlFlowGraph cfg(icg.memory);
+        cfg.build(code);
+        cfg.computeDominators();
+        vector<NaturalLoop> loops = cfg.findNaturalLoops();
+        loopsFound = (int)loops.size();
+
+        // Innermost loops have the smallest bodies
+        sort(loops.begin(), loops.end(), [](const NaturalLoop &a, const NaturalLoop &b)
+             { return a.body.size() < b.body.size(); });
+
+        for (const auto &loop : loops)
+        {
+            auto pre = preheaderOf.find(cfg.blocks[loop.header].label);
+            if (pre == preheaderOf.end())
+                continue;
+            int preheader = cfg.blockForLabel(pre->second);
+            if (preheader != -1 && !cfg.containsCall(loop))
+                hoistInvariants(cfg, loop, preheader);
+        }
+
+        icg.instructions.clear();
+        for (const auto &instr : cfg.linearize())
+            icg.instructions.push_back(instr.toString());
+    }
+
+private:
+    IntermediateCodeGnerator &icg;
+    map<string, string> preheaderOf; // header label -> preheader label
+
+    vector<TacInstruction> insertPreheaders(const vector<TacInstruction> &code)
+    {
+        ControlFlowGraph cfg(icg.memory);
+        cfg.build(code);
+        cfg.computeDominators();
+        vector<NaturalLoop> loops = cfg.findNaturalLoops();
+
+        map<int, const NaturalLoop *> loopAt;
+        for (const auto &loop : loops)
+        {
+            if (!cfg.blocks[loop.header].label.empty())
+            {
+                loopAt[loop.header] = &loop;
+                preheaderOf[cfg.blocks[loop.header].label] = icg.newLabel();
+            }
+        }
+
+        vector<TacInstruction> result;
+        result.reserve(code.size() + 2 * loopAt.size());
+        for (size_t b = 0; b < cfg.blocks.size(); b++)
+        {
+            auto loop = loopAt.find((int)b);
+            if (loop != loopAt.end())
+            {
+                // A loop block that fell into the header must now jump over the preheader
+                if (b > 0 && loop->second->inLoop[b - 1] && cfg.fallsThrough((int)b - 1))
+                    result.push_back(TacInstruction::parse("goto " + cfg.blocks[b].label));
+                result.push_back(TacInstruction::parse(preheaderOf[cfg.blocks[b].label] + ":"));
+            }
+
+            for (TacInstruction instr : cfg.blocks[b].instrs)
+            {
+                for (const auto &label : instr.jumpTargets())
+                {
+                    auto targetLoop = loopAt.find(cfg.blockForLabel(label));
+                    if (targetLoop != loopAt.end() && !targetLoop->second->inLoop[b])
+                        instr.replaceTarget(label, preheaderOf[label]);
+                }
+                result.push_back(instr);
+            }
+        }
+        return result;
+    }
+
+    void hoistInvariants(ControlFlowGraph &cfg, const NaturalLoop &loop, int preheader)
+    {
+        map<string, int> defCount;
+        for (int b : loop.body)
+        {
+            for (const auto &instr : cfg.blocks[b].instrs)
+            {
+                if (instr.definesVariable())
+                    defCount[instr.result]++;
+            }
+        }
+
+        vector<int> exits;
+        for (int b : loop.body)
+        {
+            for (int s : cfg.blocks[b].succs)
+            {
+                if (!loop.inLoop[s])
+                {
+                    exits.push_back(b);
+                    break;
+                }
+            }
+        }
+
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (int b : loop.body)
+            {
+                // Hoisted instructions are blanked first and dropped in one sweep,
+                // so a block is never shifted once per hoisted instruction
+                auto &instrs = cfg.blocks[b].instrs;
+                bool blockChanged = false;
+                for (size_t i = 0; i < instrs.size(); i++)
+                {
+                    if (canHoist(cfg, loop, exits, defCount, b, i))
+                    {
+                        defCount[instrs[i].result] = 0;
+                        cfg.blocks[preheader].instrs.push_back(instrs[i]);
+                        instrs[i] = TacInstruction();
+                        instructionsHoisted++;
+                        blockChanged = true;
+                    }
+                }
+                if (blockChanged)
+                {
+                    instrs.erase(remove_if(instrs.begin(), instrs.end(), [](const TacInstruction &instr)
+                                           { return instr.kind == TAC_OTHER && instr.text.empty(); }),
+                                 instrs.end());
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    bool canHoist(const ControlFlowGraph &cfg, const NaturalLoop &loop, const vector<int> &exits,
+                  map<string, int> &defCount, int block, size_t index)
+    {
+        const TacInstruction &instr = cfg.blocks[block].instrs[index];
+        // (a load could see a store made by the loop)
+        if (!instr.definesVariable() || instr.kind == TAC_READ || instr.kind == TAC_LOAD || defCount[instr.result] != 1)
+            return false;
+
+        for (const auto &operand : instr.uses())
+        {
+            auto it = defCount.find(operand);
+            if (it != defCount.end() && it->second != 0)
+                return false;
+        }
+
+        if (instr.op == "/" && (instr.arg2.find_first_not_of("0123456789") != string::npos ||
+                                instr.arg2.find_first_not_of("0") == string::npos))
+            return false;
+
+        if (isTacTemp(instr.result))
+            return true;
+
+        for (int e : exits)
+        {
+            if (!cfg.dominates(block, e))
+                return false;
+        }
+        for (int b : loop.body)
+        {
+            const auto &instrs = cfg.blocks[b].instrs;
+            for (size_t i = 0; i < instrs.size(); i++)
+            {
+                vector<string> used = instrs[i].uses();
+                if (find(used.begin(), used.end(), instr.result) == used.end())
+                    continue;
+                bool dominated = (b == block) ? i > index : cfg.dominates(block, b);
+                if (!dominated)
+                    return false;
+            }
+        }
+        return true;
+    }
+};
+
+/*
+    InductionVariableOptimizer:
+
+    Works on innermost loops of the shape produced by parseForStatement (and by parseWhileStatement
+    when the loop counts): a header that only computes the condition and leaves with `if !c goto end`,
+    a body laid out right after it, and one latch ending in `goto header`.
+
+    - Induction variable: an `int` variable whose only assignment in the loop is `i = i + k` or
+      `i = i - k` for an integer literal k (usually through a temp, `t = i + 1` / `i = t`).
+    - Strength reduction: every `x = i * c` (c a literal or loop-invariant variable) becomes a copy
+      of a new variable that starts as `i * c` in the preheader and grows by `c * k` right after
+      each update of i, so the multiplication turns into an addition.
+    - Full unrolling: when the start value and the bound are literals, the trip count is known at
+      compile time. Loops with at most `maxFullUnrollTrips` trips are replaced by straight copies
+      of the body; the condition is not evaluated at all.
+    - Partial unrolling: otherwise, a loop that counts towards a bound that does not change inside
+      it gets an unrolled copy placed in front of it. That copy checks once whether `factor` more
+      iterations fit, runs `factor` bodies back to back, and falls back to the original loop, which
+      is left in place as the remainder loop. The check compares i with the bound moved back by
+      step * (factor - 1) rather than computing i + step * (factor - 1), which could wrap around
+      near INT_MAX (or INT_MIN) in a loop that never overflows itself.
+    Labels and temps inside each copy of the body are renamed so they stay unique.
+    Loops that call a function are left alone, since the call may change i or the bound.
+    With a BlockProfile, loops whose header never ran are not unrolled at all, and hot loops may
+    grow to twice --unroll-size. The labels of the copies get counts estimated from the originals.
+*/
+struct UnrollOptions
+{
+    int maxFullUnrollTrips = 8; // --unroll-count
+    int factor = 4;             // --unroll-factor
+    int maxUnrolledSize = 200;  // --unroll-size, TAC instructions produced by one unrolled loop
+};
+
+class InductionVariableOptimizer
+{
+public:
+    int strengthReduced = 0;
+    int fullyUnrolled = 0;
+    int partiallyUnrolled = 0;
+    BlockProfile *profile = nullptr; // updated for the labels unrolling creates
+
+    InductionVariableOptimizer(IntermediateCodeGnerator &icg, SymbolTable &symTable, const UnrollOptions &options)
+        : icg(icg), symTable(symTable), options(options) {}
+
+    void optimize()
+    {
+        vector<TacInstruction> code;
+        code.reserve(icg.instructions.size());
+        for (const auto &line : icg.instructions)
+            code.push_back(TacInstruction::parse(line));
+
+        unordered_set<string> visitedHeaders;
+        bool transformed = true;
+        while (transformed)
+        {
+            transformed = false;
+
+            ControlFlowGraph cfg(icg.memory);
+            cfg.build(code);
+            cfg.computeDominators();
+            vector<NaturalLoop> loops = cfg.findNaturalLoops();
+            vector<char> isHeader(cfg.blocks.size(), 0);
+            for (const auto &loop : loops)
+                isHeader[loop.header] = 1;
+
+            // Innermost loops never overlap, so all of them are rewritten from this one graph
+            map<int, pair<int, vector<TacInstruction>>> rewritten; // header -> (latch, new code)
+            for (const auto &loop : loops)
+            {
+                const string &headerLabel = cfg.blocks[loop.header].label;
+                if (headerLabel.empty() || !visitedHeaders.insert(headerLabel).second)
+                    continue;
+
+                CountedLoop info;
+                if (!analyze(cfg, isHeader, loop, info))
+                    continue;
+
+                int changes = strengthReduced + fullyUnrolled + partiallyUnrolled;
+                strengthReduce(cfg, loop, info);
+                vector<TacInstruction> loopCode = unroll(cfg, info, visitedHeaders);
+                if (strengthReduced + fullyUnrolled + partiallyUnrolled == changes)
+                    continue;
+                rewritten[info.header] = {info.latch, move(loopCode)};
+                transformed = true;
+            }
+            if (!transformed)
+                break;
+
+            code.clear();
+            for (int b = 0; b < (int)cfg.blocks.size();)
+            {
+                auto it = rewritten.find(b);
+                if (it == rewritten.end())
+                {
+                    code.insert(code.end(), cfg.blocks[b].instrs.begin(), cfg.blocks[b].instrs.end());
+                    b++;
+                    continue;
+                }
+                code.insert(code.end(), it->second.second.begin(), it->second.second.end());
+                b = it->second.first + 1;
+            }
+        }
+
+        icg.instructions.clear();
+        for (const auto &instr : code)
+            icg.instructions.push_back(instr.toString());
+    }
+
+private:
+    IntermediateCodeGnerator &icg;
+    SymbolTable &symTable;
+    UnrollOptions options;
+
+    struct CountedLoop
+    {
+        int header = -1;
+        int latch = -1;
+        int preheader = -1;
+        int exitBlock = -1;
+        string iv;
+        long long step = 0;
+        string relop;         // normalised so that the test reads `iv relop bound`
+        string bound;
+        int incrementBlock = -1;
+        size_t incrementIndex = 0;
+        bool incrementEveryTrip = false;
+        bool hasInit = false;
+        long long init = 0;
+    };
+
+    static bool isIntegerLiteral(const string &s)
+    {
+        return !s.empty() && s.find_first_not_of("0123456789") == string::npos && s.size() < 10;
+    }
+
+    static string flipRelop(const string &op)
+    {
+        if (op == "<")
+            return ">";
+        if (op == ">")
+            return "<";
+        if (op == "<=")
+            return ">=";
+        if (op == ">=")
+            return "<=";
+        return op;
+    }
+
+    static bool compare(long long a, const string &op, long long b)
+    {
+        if (op == "<")
+            return a < b;
+        if (op == "<=")
+            return a <= b;
+        if (op == ">")
+            return a > b;
+        if (op == ">=")
+            return a >= b;
+        if (op == "!=")
+            return a != b;
+        return false;
+    }
+
+    bool analyze(const ControlFlowGraph &cfg, const vector<char> &isHeader, const NaturalLoop &loop, CountedLoop &info)
+    {
+        int header = loop.header;
+        if (loop.latches.size() != 1 || cfg.containsCall(loop))
+            return false;
+        int latch = loop.latches[0];
+
+        // Innermost only
+        for (int b : loop.body)
+        {
+            if (b != header && isHeader[b])
+                return false;
+        }
+
+        // Body laid out as header..latch, closed by `goto header`
+        if (loop.body.front() != header || loop.body.back() != latch ||
+            (int)loop.body.size() != latch - header + 1)
+            return false;
+        const BasicBlock &latchBlock = cfg.blocks[latch];
+        if (latchBlock.instrs.empty() || latchBlock.instrs.back().kind != TAC_GOTO ||
+            cfg.blockForLabel(latchBlock.instrs.back().result) != header)
+            return false;
+
+        // Single exit: the test at the end of the header
+        for (int b : loop.body)
+        {
+            for (int s : cfg.blocks[b].succs)
+            {
+                if (!loop.inLoop[s] && b != header)
+                    return false;
+            }
+        }
+        const BasicBlock &headerBlock = cfg.blocks[header];
+        const TacInstruction &test = headerBlock.instrs.back();
+        if (test.kind != TAC_IF_FALSE || !test.op.empty() || header + 1 > latch)
+            return false;
+        info.exitBlock = cfg.blockForLabel(test.result);
+        if (info.exitBlock == -1 || loop.inLoop[info.exitBlock])
+            return false;
+
+        // The header only computes the condition into temps
+        map<string, const TacInstruction *> headerDefs;
+        for (size_t i = 1; i + 1 < headerBlock.instrs.size(); i++)
+        {
+            const TacInstruction &instr = headerBlock.instrs[i];
+            if (!instr.definesVariable() || !isTacTemp(instr.result))
+                return false;
+            headerDefs[instr.result] = &instr;
+        }
+        string condition = test.arg1;
+        while (headerDefs.count(condition) && headerDefs[condition]->kind == TAC_COPY)
+            condition = headerDefs[condition]->arg1;
+        if (!headerDefs.count(condition))
+            return false;
+        const TacInstruction &compareInstr = *headerDefs[condition];
+        if (compareInstr.kind != TAC_BINARY || (compareInstr.op != "<" && compareInstr.op != "<=" &&
+                                                compareInstr.op != ">" && compareInstr.op != ">=" &&
+                                                compareInstr.op != "!="))
+            return false;
+
+        map<string, int> defCount;
+        for (int b : loop.body)
+        {
+            for (const auto &instr : cfg.blocks[b].instrs)
+            {
+                if (instr.definesVariable())
+                    defCount[instr.result]++;
+            }
+        }
+
+        // Which side of the comparison is the induction variable?
+        if (isTacVariable(compareInstr.arg1) && defCount[compareInstr.arg1] == 1 && isLoopInvariant(compareInstr.arg2, defCount))
+        {
+            info.iv = compareInstr.arg1;
+            info.bound = compareInstr.arg2;
+            info.relop = compareInstr.op;
+        }
+        else if (isTacVariable(compareInstr.arg2) && defCount[compareInstr.arg2] == 1 && isLoopInvariant(compareInstr.arg1, defCount))
+        {
+            info.iv = compareInstr.arg2;
+            info.bound = compareInstr.arg1;
+            info.relop = flipRelop(compareInstr.op);
+        }
+        else
+        {
+            return false;
+        }
+        if (!symTable.isDeclared(info.iv) || symTable.getVariableType(info.iv) != "int")
+            return false;
+
+        // Find `iv = iv +/- k`, directly or through a temp
+        for (int b = header + 1; b <= latch && info.incrementBlock == -1; b++)
+        {
+            const auto &instrs = cfg.blocks[b].instrs;
+            for (size_t i = 0; i < instrs.size(); i++)
+            {
+                if (!instrs[i].definesVariable() || instrs[i].result != info.iv)
+                    continue;
+
+                const TacInstruction *update = &instrs[i];
+                if (update->kind == TAC_COPY && i > 0 && instrs[i - 1].kind == TAC_BINARY &&
+                    instrs[i - 1].result == update->arg1 && isTacTemp(update->arg1) && defCount[update->arg1] == 1)
+                    update = &instrs[i - 1];
+
+                if (update->kind != TAC_BINARY || update->arg1 != info.iv || !isIntegerLiteral(update->arg2) ||
+                    (update->op != "+" && update->op != "-"))
+                    return false;
+
+                info.step = stoll(update->arg2) * (update->op == "+" ? 1 : -1);
+                if (info.step == 0)
+                    return false;
+                info.incrementBlock = b;
+                info.incrementIndex = i;
+                info.incrementEveryTrip = cfg.dominates(b, latch);
+                break;
+            }
+        }
+        if (info.incrementBlock == -1)
+            return false;
+
+        // Preheader: the only way into the loop besides the back edge
+        int preheader = header - 1;
+        if (preheader < 0 || loop.inLoop[preheader] || cfg.blocks[preheader].succs.size() != 1 ||
+            cfg.blocks[preheader].succs[0] != header || headerBlock.preds.size() != 2)
+            return false;
+
+        // Start value, if it is a literal assigned right before the loop
+        for (int b = preheader; b >= 0;)
+        {
+            const auto &instrs = cfg.blocks[b].instrs;
+            bool found = false;
+            for (size_t i = instrs.size(); i-- > 0;)
+            {
+                if (instrs[i].definesVariable() && instrs[i].result == info.iv)
+                {
+                    if (instrs[i].kind == TAC_COPY && isIntegerLiteral(instrs[i].arg1))
+                    {
+                        info.hasInit = true;
+                        info.init = stoll(instrs[i].arg1);
+                    }
+                    found = true;
+                    break;
+                }
+            }
+            if (found || cfg.blocks[b].preds.size() != 1 || cfg.blocks[b].preds[0] != b - 1 || !cfg.fallsThrough(b - 1))
+                break;
+            b--;
+        }
+
+        info.header = header;
+        info.latch = latch;
+        info.preheader = preheader;
+        return true;
+    }
+
+    static bool isLoopInvariant(const string &operand, map<string, int> &defCount)
+    {
+        return !isTacVariable(operand) || defCount[operand] == 0;
+    }
+
+    void strengthReduce(ControlFlowGraph &cfg, const NaturalLoop &loop, CountedLoop &info)
+    {
+        map<string, int> defCount;
+        for (int b : loop.body)
+        {
+            for (const auto &instr : cfg.blocks[b].instrs)
+            {
+                if (instr.definesVariable())
+                    defCount[instr.result]++;
+            }
+        }
+
+        map<string, string> reduced; // multiplier -> variable holding iv * multiplier
+        vector<TacInstruction> updates;
+        for (int b = info.header + 1; b <= info.latch; b++)
+        {
+            for (auto &instr : cfg.blocks[b].instrs)
+            {
+                if (instr.kind != TAC_BINARY || instr.op != "*")
+                    continue;
+
+                string multiplier;
+                if (instr.arg1 == info.iv && isLoopInvariant(instr.arg2, defCount))
+                    multiplier = instr.arg2;
+                else if (instr.arg2 == info.iv && isLoopInvariant(instr.arg1, defCount))
+                    multiplier = instr.arg1;
+                if (multiplier.empty() || (!isIntegerLiteral(multiplier) && !isTacVariable(multiplier)))
+                    continue;
+
+                auto it = reduced.find(multiplier);
+                if (it == reduced.end())
+                {
+                    string var = icg.newTemp() + "_iv";
+                    it = reduced.insert({multiplier, var}).first;
+                    cfg.blocks[info.preheader].instrs.push_back(TacInstruction::parse(var + " = " + info.iv + " * " + multiplier));
+
+                    long long magnitude = info.step < 0 ? -info.step : info.step;
+                    string op = info.step < 0 ? " - " : " + ";
+                    string delta;
+                    if (isIntegerLiteral(multiplier))
+                    {
+                        delta = to_string(stoll(multiplier) * magnitude);
+                    }
+                    else
+                    {
+                        delta = icg.newTemp() + "_iv_step";
+                        cfg.blocks[info.preheader].instrs.push_back(TacInstruction::parse(delta + " = " + multiplier + " * " + to_string(magnitude)));
+                    }
+                    updates.push_back(TacInstruction::parse(var + " = " + var + op + delta));
+                }
+
+                instr = TacInstruction::parse(instr.result + " = " + it->second);
+                strengthReduced++;
+            }
+        }
+
+        auto &incrementInstrs = cfg.blocks[info.incrementBlock].instrs;
+        incrementInstrs.insert(incrementInstrs.begin() + info.incrementIndex + 1, updates.begin(), updates.end());
+    }
+
+    // The code that replaces the blocks header..latch
+    vector<TacInstruction> unroll(const ControlFlowGraph &cfg, const CountedLoop &info, unordered_set<string> &visitedHeaders)
+    {
+        size_t bodySize = 0;
+        for (int b = info.header + 1; b <= info.latch; b++)
+            bodySize += cfg.blocks[b].instrs.size();
+
+        vector<TacInstruction> loopCode;
+        bool unrolled = false;
+
+        const string &headerLabel = cfg.blocks[info.header].label;
+        int64_t headerCount = profile ? profile->count(headerLabel) : -1;
+        size_t maxUnrolledSize = options.maxUnrolledSize;
+        if (profile && profile->isHot(headerLabel))
+            maxUnrolledSize *= 2;
+        if (profile && profile->isCold(headerLabel))
+            maxUnrolledSize = 0;
+
+        if (info.incrementEveryTrip && info.hasInit && isIntegerLiteral(info.bound))
+        {
+            long long bound = stoll(info.bound);
+            long long value = info.init;
+            int trips = 0;
+            while (trips <= options.maxFullUnrollTrips && compare(value, info.relop, bound))
+            {
+                value += info.step;
+                trips++;
+            }
+
+            if (trips <= options.maxFullUnrollTrips && bodySize * trips <= maxUnrolledSize)
+            {
+                loopCode.push_back(cfg.blocks[info.header].instrs.front());
+                for (int copy = 0; copy < trips; copy++)
+                    appendBodyCopy(cfg, info, loopCode, trips);
+                // The header label now runs once per entry into the loop
+                if (headerCount >= 0)
+                    profile->set(headerLabel, headerCount / (trips + 1));
+                if (info.exitBlock != info.latch + 1)
+                    loopCode.push_back(TacInstruction::parse("goto " + cfg.blocks[info.exitBlock].label));
+                fullyUnrolled++;
+                unrolled = true;
+            }
+        }
+
+        bool countsUp = (info.relop == "<" || info.relop == "<=") && info.step > 0;
+        bool countsDown = (info.relop == ">" || info.relop == ">=") && info.step < 0;
+        // i + lookahead relop bound  <=>  i relop bound - lookahead, which is computed without wrapping
+        long long lookahead = info.step * (options.factor - 1);
+        long long literalLimit = isIntegerLiteral(info.bound) ? stoll(info.bound) - lookahead : 0;
+        bool limitFits = llabs(lookahead) <= INT_MAX && literalLimit >= INT_MIN && literalLimit <= INT_MAX;
+        if (!unrolled && info.incrementEveryTrip && (countsUp || countsDown) && options.factor > 1 &&
+            limitFits && bodySize * options.factor <= maxUnrolledSize)
+        {
+            // Unrolled loop that falls back to the original (remainder) loop
+            string unrolledLabel = icg.newLabel();
+            visitedHeaders.insert(unrolledLabel);
+            string limit = icg.newTemp();
+            string check = icg.newTemp();
+
+            // The bound does not change inside the loop, so the limit is computed once on entry
+            loopCode.push_back(TacInstruction::parse(limit + " = " + info.bound + (lookahead < 0 ? " + " : " - ") +
+                                                     to_string(llabs(lookahead))));
+            if (!isIntegerLiteral(info.bound))
+            {
+                // A bound within lookahead of INT_MIN (INT_MAX when counting down) leaves no room for
+                // `factor` trips, and moving it back wraps around: then only the remainder loop runs
+                string wrapped = icg.newTemp();
+                loopCode.push_back(TacInstruction::parse(wrapped + " = " + limit + (lookahead < 0 ? " < " : " > ") + info.bound));
+                loopCode.push_back(TacInstruction::parse("if " + wrapped + " goto " + headerLabel));
+            }
+            loopCode.push_back(TacInstruction::parse(unrolledLabel + ":"));
+            loopCode.push_back(TacInstruction::parse(check + " = " + info.iv + " " + info.relop + " " + limit));
+            loopCode.push_back(TacInstruction::parse("if !" + check + " goto " + headerLabel));
+            for (int copy = 0; copy < options.factor; copy++)
+                appendBodyCopy(cfg, info, loopCode, options.factor);
+            loopCode.push_back(TacInstruction::parse("goto " + unrolledLabel));
+            if (headerCount >= 0)
+                estimateRemainderCounts(cfg, info, headerCount, unrolledLabel);
+
+            for (int b = info.header; b <= info.latch; b++)
+                loopCode.insert(loopCode.end(), cfg.blocks[b].instrs.begin(), cfg.blocks[b].instrs.end());
+            partiallyUnrolled++;
+            unrolled = true;
+        }
+
+        if (!unrolled)
+        {
+            for (int b = info.header; b <= info.latch; b++)
+                loopCode.insert(loopCode.end(), cfg.blocks[b].instrs.begin(), cfg.blocks[b].instrs.end());
+        }
+        return loopCode;
+    }
+
+    /*
+        After partial unrolling most trips run in the unrolled loop, each of its `factor` body copies
+        once per `factor` trips. The original loop is only the remainder: per entry into the loop
+        (the count of the preheader label) it runs at most factor - 1 trips.
+    */
+    void estimateRemainderCounts(const ControlFlowGraph &cfg, const CountedLoop &info, int64_t headerCount, const string &unrolledLabel)
+    {
+        profile->set(unrolledLabel, headerCount / options.factor);
+        int64_t entries = profile->count(cfg.blocks[info.preheader].label);
+        if (entries < 0)
+            entries = headerCount / options.factor;
+        for (int b = info.header; b <= info.latch; b++)
+        {
+            const string &label = cfg.blocks[b].label;
+            int64_t count = profile->count(label);
+            if (count >= 0)
+                profile->set(label, min(count, entries * (options.factor - (b == info.header ? 0 : 1))));
+        }
+    }
+
+    // One iteration of the body (header excluded, closing `goto header` dropped) with fresh labels and temps.
+    // With a profile, each of the `copies` copies is expected to run 1/copies as often as the original.
+    void appendBodyCopy(const ControlFlowGraph &cfg, const CountedLoop &info, vector<TacInstruction> &out, int copies)
+    {
+        map<string, string> rename;
+        for (int b = info.header + 1; b <= info.latch; b++)
+        {
+            for (const auto &instr : cfg.blocks[b].instrs)
+            {
+                if (instr.kind == TAC_LABEL)
+                {
+                    rename[instr.result] = icg.newLabel();
+                    int64_t count = profile ? profile->count(instr.result) : -1;
+                    if (count >= 0)
+                        profile->set(rename[instr.result], count / copies);
+                }
+                else if (instr.definesVariable() && isTacTemp(instr.result) && !rename.count(instr.result))
+                    rename[instr.result] = icg.newTemp();
+            }
+        }
+
+        auto renamed = [&rename](const string &name)
+        {
+            auto it = rename.find(name);
+            return it == rename.end() ? name : it->second;
+        };
+
+        for (int b = info.header + 1; b <= info.latch; b++)
+        {
+            const auto &instrs = cfg.blocks[b].instrs;
+            size_t count = (b == info.latch) ? instrs.size() - 1 : instrs.size();
+            for (size_t i = 0; i < count; i++)
+            {
+                TacInstruction instr = instrs[i];
+                instr.result = renamed(instr.result);
+                instr.arg1 = renamed(instr.arg1);
+                instr.arg2 = renamed(instr.arg2);
+                for (auto &target : instr.targets)
+                    target = renamed(target);
+                out.push_back(instr);
+            }
+        }
+    }
+};
+
+/*
+    ProfileGuidedLayout:
+
+    Rearranges hot code so that its common path falls through, using a BlockProfile. Runs after
+    the InductionVariableOptimizer, which expects loops in the shape the parser produced.
+    - Loop rotation. A `while` loop from parseWhileStatement tests at the top and jumps back at
+      the bottom, so every trip takes two branches:
+          L1: t4 = i < n; if !t4 goto L2; <body>; goto L1; L2:
+      When L1 is hot, a copy of the test (with fresh temps and the branch inverted) replaces the
+      jump back, so a trip ends in a single conditional jump and leaving the loop falls through:
+          L1: t4 = i < n; if !t4 goto L2; L7: <body>; t9 = i < n; if t9 goto L7; L2:
+      Only tests of up to maxTestSize plain copies, arithmetic and loads are copied.
+    - Branch inversion. An if/else in hot code whose else part ran more often than its then part
+          if !c goto Lf; <then>; goto Le; Lf: <else>; Le:
+      gets the two parts swapped, so the more frequent one follows the branch:
+          if c goto L9; Lf: <else>; goto Le; L9: <then>; goto Le; Le:
+      This is what the (already bottom-tested) bodies of hot do-while loops gain from.
+    Both only move code that is entered through its first block, so jumps stay valid.
+*/
+class ProfileGuidedLayout
+{
+public:
+    int loopsRotated = 0;
+    int branchesInverted = 0;
+
+    ProfileGuidedLayout(IntermediateCodeGnerator &icg, BlockProfile &profile) : icg(icg), profile(profile) {}
+
+    void optimize()
+    {
+        vector<TacInstruction> code;
+        code.reserve(icg.instructions.size());
+        for (const auto &line : icg.instructions)
+            code.push_back(TacInstruction::parse(line));
+
+        ControlFlowGraph cfg(icg.memory);
+        cfg.build(code);
+        for (size_t h = 0; h < cfg.blocks.size(); h++)
+            loopsRotated += rotateLoop(cfg, (int)h);
+        code = cfg.linearize();
+
+        // Swapping moves blocks around, so the graph is rebuilt after each one
+        set<string> tried;
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            cfg.build(code);
+            for (size_t b = 0; b < cfg.blocks.size() && !changed; b++)
+                changed = invertBranch(cfg, (int)b, tried, code);
+            branchesInverted += changed;
+        }
+
+        icg.instructions.clear();
+        for (const auto &instr : code)
+            icg.instructions.push_back(instr.toString());
+    }
+
+private:
+    static constexpr size_t maxTestSize = 8;
+
+    IntermediateCodeGnerator &icg;
+    BlockProfile &profile;
+
+    static bool isConditional(const TacInstruction &instr)
+    {
+        return instr.kind == TAC_IF || instr.kind == TAC_IF_FALSE;
+    }
+
+    static TacInstruction inverted(TacInstruction branch, const string &target)
+    {
+        branch.kind = branch.kind == TAC_IF ? TAC_IF_FALSE : TAC_IF;
+        branch.result = target;
+        return branch;
+    }
+
+    // True when every predecessor of blocks first..last lies in first..last or is `entry`
+    static bool enteredOnlyFrom(const ControlFlowGraph &cfg, int first, int last, int entry)
+    {
+        for (int b = first; b <= last; b++)
+        {
+            for (int p : cfg.blocks[b].preds)
+            {
+                if ((p < first || p > last) && !(b == first && p == entry))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    bool rotateLoop(ControlFlowGraph &cfg, int h)
+    {
+        BasicBlock &header = cfg.blocks[h];
+        if (header.label.empty() || !profile.isHot(header.label) || header.instrs.size() < 2 ||
+            header.instrs.size() - 2 > maxTestSize || !isConditional(header.instrs.back()))
+            return false;
+
+        int exit = cfg.blockForLabel(header.instrs.back().result);
+        int latch = exit - 1;
+        if (exit <= h + 1 || latch <= h)
+            return false;
+        const TacInstruction &back = cfg.blocks[latch].instrs.back();
+        if (back.kind != TAC_GOTO || back.result != header.label || !enteredOnlyFrom(cfg, h + 1, latch, h))
+            return false;
+
+        // The test must be plain computation whose temps are not used outside the header
+        set<string> testTemps;
+        for (size_t i = 1; i + 1 < header.instrs.size(); i++)
+        {
+            const TacInstruction &instr = header.instrs[i];
+            if ((instr.kind != TAC_COPY && instr.kind != TAC_BINARY && instr.kind != TAC_LOAD) || instr.lanes != 1)
+                return false;
+            if (isTacTemp(instr.result))
+                testTemps.insert(instr.result);
+        }
+        for (size_t b = 0; b < cfg.blocks.size(); b++)
+        {
+            if ((int)b == h)
+                continue;
+            for (const auto &instr : cfg.blocks[b].instrs)
+            {
+                for (const auto &used : instr.uses())
+                {
+                    if (testTemps.count(used))
+                        return false;
+                }
+            }
+        }
+
+        // Label the first block of the body so the copied test can jump back to it
+        BasicBlock &body = cfg.blocks[h + 1];
+        if (body.label.empty())
+        {
+            body.label = icg.newLabel();
+            body.instrs.insert(body.instrs.begin(), TacInstruction::parse(body.label + ":"));
+            profile.set(body.label, max<int64_t>(profile.count(header.label) - 1, 0));
+        }
+
+        map<string, string> rename;
+        auto renamed = [&rename](const string &name)
+        {
+            auto it = rename.find(name);
+            return it == rename.end() ? name : it->second;
+        };
+        auto &latchInstrs = cfg.blocks[latch].instrs;
+        latchInstrs.pop_back();
+        for (size_t i = 1; i + 1 < header.instrs.size(); i++)
+        {
+            TacInstruction instr = header.instrs[i];
+            instr.arg1 = renamed(instr.arg1);
+            instr.arg2 = renamed(instr.arg2);
+            if (testTemps.count(instr.result))
+                instr.result = rename[instr.result] = icg.newTemp();
+            latchInstrs.push_back(instr);
+        }
+        TacInstruction branch = inverted(header.instrs.back(), body.label);
+        branch.arg1 = renamed(branch.arg1);
+        branch.arg2 = renamed(branch.arg2);
+        latchInstrs.push_back(branch);
+        return true;
+    }
+
+    bool invertBranch(const ControlFlowGraph &cfg, int b, set<string> &tried, vector<TacInstruction> &code)
+    {
+        const auto &blocks = cfg.blocks;
+        if (blocks[b].instrs.empty() || !isConditional(blocks[b].instrs.back()) || b + 1 >= (int)blocks.size() ||
+            !blocks[b + 1].label.empty())
+            return false;
+        const string &elseLabel = blocks[b].instrs.back().result;
+        int elseBlock = cfg.blockForLabel(elseLabel);
+        if (elseBlock <= b + 1 || !tried.insert(elseLabel).second)
+            return false;
+        const TacInstruction &thenEnd = blocks[elseBlock - 1].instrs.back();
+        if (thenEnd.kind != TAC_GOTO)
+            return false;
+        int endBlock = cfg.blockForLabel(thenEnd.result);
+        if (endBlock <= elseBlock || !cfg.fallsThrough(endBlock - 1) || blocks[endBlock].preds.size() != 2 ||
+            !enteredOnlyFrom(cfg, b + 1, elseBlock - 1, b) || !enteredOnlyFrom(cfg, elseBlock, endBlock - 1, b))
+            return false;
+
+        // Both parts end up in the end label, so it counts then + else
+        int64_t total = profile.count(thenEnd.result);
+        int64_t elseCount = profile.count(elseLabel);
+        if (!profile.isHot(thenEnd.result) || elseCount < 0 || elseCount * 2 <= total)
+            return false;
+
+        string thenLabel = icg.newLabel();
+        profile.set(thenLabel, total - elseCount);
+        vector<TacInstruction> swapped;
+        auto append = [&](int first, int last)
+        {
+            for (int i = first; i <= last; i++)
+                swapped.insert(swapped.end(), blocks[i].instrs.begin(), blocks[i].instrs.end());
+        };
+        append(0, b - 1);
+        swapped.insert(swapped.end(), blocks[b].instrs.begin(), blocks[b].instrs.end() - 1);
+        swapped.push_back(inverted(blocks[b].instrs.back(), thenLabel));
+        append(elseBlock, endBlock - 1);
+        swapped.push_back(TacInstruction::parse("goto " + thenEnd.result));
+        swapped.push_back(TacInstruction::parse(thenLabel + ":"));
+        append(b + 1, elseBlock - 1);
+        append(endBlock, (int)blocks.size() - 1);
+        code = move(swapped);
+        return true;
+    }
+};
+
+/*
+    DeadCodeEliminator:
+
+    Runs last on the TAC, after every pass that moves or copies code.
+    1. Blocks that cannot be reached from the start of the program or from a function entry are
+       removed: code after a `goto`, `break` or `return` that no jump leads to, loop tails that
+       unrolling left behind, functions whose calls were all inlined, ...
+    2. Assignments to compiler temps that are never read are removed, which can make the
+       temps they read dead as well. Divisions stay unless the divisor is a non-zero literal,
+       since they can trap. A call whose result is unused is kept, without the result.
+    Program variables are left alone: their stores are what the program does. Whatever is no
+    longer mentioned in the TAC gets no `.data` slot in the AssemblyCodeGenerator.
+*/
+class DeadCodeEliminator
+{
+public:
+    int blocksRemoved = 0;
+    int instructionsRemoved = 0;
+
+    DeadCodeEliminator(IntermediateCodeGnerator &icg) : icg(icg) {}
+
+    void optimize()
+    {
+        vector<TacInstruction> code;
+        code.reserve(icg.instructions.size());
+        for (const auto &line : icg.instructions)
+            code.push_back(TacInstruction::parse(line));
+
+        size_t before = code.size();
+        removeUnreachableBlocks(code);
+        removeDeadTemps(code);
+        if (code.size() == before && !resultsDropped)
+            return;
+        icg.instructions.clear();
+        for (const auto &instr : code)
+            icg.instructions.push_back(instr.toString());
+    }
+
+private:
+    IntermediateCodeGnerator &icg;
+    bool resultsDropped = false;
+
+    void removeUnreachableBlocks(vector<TacInstruction> &code)
+    {
+        ControlFlowGraph cfg(icg.memory);
+        cfg.build(code);
+        vector<char> reached(cfg.blocks.size(), 0);
+        vector<int> work;
+        for (int b = 0; b < (int)cfg.blocks.size(); b++)
+        {
+            if (b == 0 || cfg.isFunctionEntry(b))
+            {
+                reached[b] = 1;
+                work.push_back(b);
+            }
+        }
+        while (!work.empty())
+        {
+            int b = work.back();
+            work.pop_back();
+            for (int s : cfg.blocks[b].succs)
+            {
+                if (!reached[s])
+                {
+                    reached[s] = 1;
+                    work.push_back(s);
+                }
+            }
+        }
+        if (find(reached.begin(), reached.end(), 0) == reached.end())
+            return;
+
+        vector<TacInstruction> kept;
+        kept.reserve(code.size());
+        for (size_t b = 0; b < cfg.blocks.size(); b++)
+        {
+            if (reached[b])
+                kept.insert(kept.end(), cfg.blocks[b].instrs.begin(), cfg.blocks[b].instrs.end());
+            else
+                blocksRemoved++;
+        }
+        instructionsRemoved += (int)(code.size() - kept.size());
+        code = move(kept);
+    }
+
+    static bool isPure(const TacInstruction &instr)
+    {
+        if (instr.kind == TAC_COPY || instr.kind == TAC_LOAD)
+            return true;
+        if (instr.kind != TAC_BINARY)
+            return false;
+        return instr.op != "/" || (instr.arg2.find_first_not_of("0123456789") == string::npos &&
+                                   instr.arg2.find_first_not_of("0") != string::npos);
+    }
+
+    void removeDeadTemps(vector<TacInstruction> &code)
+    {
+        unordered_map<string, int> useCount;
+        unordered_map<string, vector<size_t>> definitions;
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            for (const auto &used : code[i].uses())
+                useCount[used]++;
+            if (code[i].definesVariable() && isCompilerVariable(code[i].result))
+                definitions[code[i].result].push_back(i);
+        }
+
+        vector<char> removed(code.size(), 0);
+        vector<string> work;
+        for (const auto &[name, defs] : definitions)
+        {
+            if (!useCount.count(name))
+                work.push_back(name);
+        }
+        while (!work.empty())
+        {
+            string name = work.back();
+            work.pop_back();
+            for (size_t i : definitions[name])
+            {
+                TacInstruction &instr = code[i];
+                if (removed[i])
+                    continue;
+                if (instr.kind == TAC_CALL)
+                {
+                    instr.result.clear();
+                    resultsDropped = true;
+                    continue;
+                }
+                if (!isPure(instr))
+                    continue;
+                removed[i] = 1;
+                instructionsRemoved++;
+                for (const auto &used : instr.uses())
+                {
+                    if (--useCount[used] == 0 && definitions.count(used))
+                        work.push_back(used);
+                }
+            }
+        }
+
+        vector<TacInstruction> kept;
+        kept.reserve(code.size());
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            if (!removed[i])
+                kept.push_back(move(code[i]));
+        }
+        code = move(kept);
+    }
+};
+
+/*
+    RegisterAllocator:
+
+    Linear-scan register allocation (Poletto and Sarkar) for the variables the compiler invents:
+    temps such as `t12` and the helper variables of other passes such as `t20_iv`. Variables
+    declared in the program keep their `.data` slot.
+
+    1. Live intervals. A temp whose uses all follow its definition inside one basic block (almost
+       every temp the parser creates) simply lives from that definition to its last use. For the
+       others, liveness is found per variable by walking backwards from each use over predecessor
+       blocks until a definition is met; the interval then stretches over every block it is live
+       in. This avoids a dense (variables x blocks) data-flow problem, so the cost stays close to
+       linear even with hundreds of thousands of temps.
+    2. Intervals are visited in order of their start. Intervals that ended before the current
+       one starts hand their register back. If no register is free, whichever of the current
+       interval and the active ones ends last is spilled to a memory slot, so spill slots are only
+       used once the registers really run out.
+       With a BlockProfile the one whose definitions and uses ran least often is spilled instead,
+       so temps of hot loop bodies keep their registers.
+*/
+struct LiveInterval
+{
+    string name;
+    int start;
+    int end;
+    int reg = -1;       // index into the register list, -1 when spilled
+    int64_t weight = 0; // profiled executions of its definitions and uses (with a BlockProfile)
+};
+
+class RegisterAllocator
+{
+public:
+    int allocatedCount = 0;
+    int spilledCount = 0;
+    pmr::memory_resource *memory = pmr::get_default_resource(); // for the control flow graph of the intervals
+
+    RegisterAllocator(const vector<string> &registers) : registers(registers) {}
+
+    // `candidate` restricts allocation to some of the compiler variables (e.g. only float temps)
+    void allocate(const vector<TacInstruction> &code, const function<bool(const string &)> &candidate = nullptr,
+                  const BlockProfile *profile = nullptr)
+    {
+        assignment.clear();
+        isCandidate = [&candidate](const string &name)
+        { return isCompilerVariable(name) && (!candidate || candidate(name)); };
+        vector<LiveInterval> intervals = buildIntervals(code, profile);
+        sort(intervals.begin(), intervals.end(), [](const LiveInterval &a, const LiveInterval &b)
+             { return a.start < b.start || (a.start == b.start && a.end < b.end); });
+
+        vector<int> freeRegisters;
+        for (int r = (int)registers.size() - 1; r >= 0; r--)
+            freeRegisters.push_back(r);
+        vector<LiveInterval *> active; // at most registers.size() entries
+
+        for (auto &current : intervals)
+        {
+            // Expire intervals that ended before this one starts
+            for (size_t i = 0; i < active.size();)
+            {
+                if (active[i]->end < current.start)
+                {
+                    freeRegisters.push_back(active[i]->reg);
+                    active[i] = active.back();
+                    active.pop_back();
+                }
+                else
+                {
+                    i++;
+                }
+            }
+
+            if (!freeRegisters.empty())
+            {
+                current.reg = freeRegisters.back();
+                freeRegisters.pop_back();
+                active.push_back(&current);
+                continue;
+            }
+
+            // Spill whichever interval reaches furthest (or, with a profile, runs least often)
+            auto spillFirst = [profile](const LiveInterval *a, const LiveInterval *b)
+            {
+                if (profile && a->weight != b->weight)
+                    return a->weight < b->weight;
+                return a->end > b->end;
+            };
+            size_t furthest = 0;
+            for (size_t i = 1; i < active.size(); i++)
+            {
+                if (spillFirst(active[i], active[furthest]))
+                    furthest = i;
+            }
+            if (!active.empty() && spillFirst(active[furthest], &current))
+            {
+                current.reg = active[furthest]->reg;
+                active[furthest]->reg = -1;
+                active[furthest] = &current;
+            }
+        }
+
+        allocatedCount = spilledCount = 0;
+        for (const auto &interval : intervals)
+        {
+            if (interval.reg == -1)
+            {
+                spilledCount++;
+                continue;
+            }
+            assignment[interval.name] = registers[interval.reg];
+            allocatedCount++;
+        }
+    }
+
+    // Register holding a compiler variable, or an empty string if it lives in memory
+    string registerOf(const string &name) const
+    {
+        auto it = assignment.find(name);
+        return it == assignment.end() ? "" : it->second;
+    }
+
+    // Registers given to at least one variable, in the order of the register list
+    vector<string> usedRegisters() const
+    {
+        unordered_set<string> used;
+        for (const auto &entry : assignment)
+            used.insert(entry.second);
+        vector<string> inOrder;
+        for (const auto &reg : registers)
+        {
+            if (used.count(reg))
+                inOrder.push_back(reg);
+        }
+        return inOrder;
+    }
+
+    // Live intervals of the compiler variables `candidate` accepts, without assigning registers
+    vector<LiveInterval> liveIntervals(const vector<TacInstruction> &code, const function<bool(const string &)> &candidate)
+    {
+        isCandidate = [&candidate](const string &name)
+        { return isCompilerVariable(name) && candidate(name); };
+        return buildIntervals(code, nullptr);
+    }
+
+private:
+    vector<string> registers;
+    unordered_map<string, string> assignment;
+    function<bool(const string &)> isCandidate;
+
+    struct VariableInfo
+    {
+        vector<int> defs;
+        vector<int> uses;
+    };
+
+    vector<LiveInterval> buildIntervals(const vector<TacInstruction> &code, const BlockProfile *profile)
+    {
+        ControlFlowGraph cfg(memory);
+        cfg.build(code);
+
+        // Profiled executions per block; an unlabeled block runs as often as the label before it
+        vector<int64_t> blockWeight(cfg.blocks.size(), 1);
+        for (size_t b = 0; profile && b < cfg.blocks.size(); b++)
+        {
+            int64_t count = profile->count(cfg.blocks[b].label);
+            blockWeight[b] = count >= 0 ? count : (b > 0 ? blockWeight[b - 1] : 1);
+        }
+
+        // Position of every instruction and the block it belongs to
+        vector<int> blockStart(cfg.blocks.size() + 1, 0);
+        vector<int> blockOf;
+        blockOf.reserve(code.size());
+        for (size_t b = 0; b < cfg.blocks.size(); b++)
+        {
+            blockStart[b + 1] = blockStart[b] + (int)cfg.blocks[b].instrs.size();
+            blockOf.insert(blockOf.end(), cfg.blocks[b].instrs.size(), (int)b);
+        }
+
+        unordered_map<string, int> ids;
+        vector<string> names;
+        vector<VariableInfo> info;
+        auto idOf = [&](const string &name)
+        {
+            auto it = ids.find(name);
+            if (it != ids.end())
+                return it->second;
+            ids[name] = (int)names.size();
+            names.push_back(name);
+            info.push_back(VariableInfo());
+            return (int)names.size() - 1;
+        };
+
+        int position = 0;
+        for (const auto &block : cfg.blocks)
+        {
+            for (const auto &instr : block.instrs)
+            {
+                for (const auto &used : instr.uses())
+                {
+                    if (isCandidate(used))
+                        info[idOf(used)].uses.push_back(position);
+                }
+                if (instr.definesVariable() && isCandidate(instr.result))
+                    info[idOf(instr.result)].defs.push_back(position);
+                position++;
+            }
+        }
+
+        vector<LiveInterval> intervals;
+        intervals.reserve(names.size());
+        vector<int> liveInStamp(cfg.blocks.size(), -1);
+        vector<int> defStamp(cfg.blocks.size(), -1);
+        vector<int> work;
+
+        for (size_t v = 0; v < names.size(); v++)
+        {
+            const VariableInfo &var = info[v];
+            LiveInterval interval;
+            interval.name = names[v];
+            interval.start = var.defs.empty() ? var.uses.front() : var.defs.front();
+            interval.end = interval.start;
+            for (int d : var.defs)
+                interval.start = min(interval.start, d), interval.end = max(interval.end, d);
+            for (int u : var.uses)
+                interval.start = min(interval.start, u), interval.end = max(interval.end, u);
+            for (int d : var.defs)
+                interval.weight += blockWeight[blockOf[d]];
+            for (int u : var.uses)
+                interval.weight += blockWeight[blockOf[u]];
+
+            // Block-local: every use follows the first definition in the same block
+            int firstBlock = blockOf[interval.start];
+            bool local = !var.defs.empty() && var.defs.front() == interval.start &&
+                         blockOf[interval.end] == firstBlock;
+            if (!local)
+            {
+                for (int d : var.defs)
+                    defStamp[blockOf[d]] = (int)v;
+
+                // Walk back from every use that is not preceded by a definition in its own block
+                for (int u : var.uses)
+                {
+                    int b = blockOf[u];
+                    bool definedBefore = false;
+                    for (int d : var.defs)
+                        definedBefore = definedBefore || (blockOf[d] == b && d < u);
+                    if (definedBefore || liveInStamp[b] == (int)v)
+                        continue;
+                    liveInStamp[b] = (int)v;
+                    work.push_back(b);
+                }
+                while (!work.empty())
+                {
+                    int b = work.back();
+                    work.pop_back();
+                    interval.start = min(interval.start, blockStart[b]);
+                    for (int p : cfg.blocks[b].preds)
+                    {
+                        // Live out of p: the interval reaches p's last instruction
+                        interval.start = min(interval.start, blockStart[p + 1] - 1);
+                        interval.end = max(interval.end, blockStart[p + 1] - 1);
+                        if (defStamp[p] != (int)v && liveInStamp[p] != (int)v)
+                        {
+                            liveInStamp[p] = (int)v;
+                            work.push_back(p);
+                        }
+                    }
+                }
+            }
+            intervals.push_back(interval);
+        }
+        return intervals;
+    }
+};
+
+/*
+    AsmInstruction:
+
+    One line of generated assembly kept in structured form so later passes can inspect and
+    rewrite it without parsing text: an instruction (mnemonic plus operands), a label, or a
+    directive/data line that is passed through unchanged.
+       mov ebx, [x]      -> ASM_INSTRUCTION  (mnemonic = "mov", operands = {"ebx", "[x]"})
+       L4:               -> ASM_LABEL        (mnemonic = "L4")
+       section .data     -> ASM_DIRECTIVE    (mnemonic = the whole line)
+*/
+enum AsmKind
+{
+    ASM_INSTRUCTION,
+    ASM_LABEL,
+    ASM_DIRECTIVE
+};
+
+struct AsmInstruction
+{
+    AsmKind kind = ASM_INSTRUCTION;
+    string mnemonic;
+    vector<string> operands;
+    string comment;
+
+    static AsmInstruction instruction(const string &mnemonic, const vector<string> &operands = {}, const string &comment = "")
+    {
+        AsmInstruction instr;
+        instr.mnemonic = mnemonic;
+        instr.operands = operands;
+        instr.comment = comment;
+        return instr;
+    }
+
+    static AsmInstruction label(const string &name)
+    {
+        AsmInstruction instr;
+        instr.kind = ASM_LABEL;
+        instr.mnemonic = name;
+        return instr;
+    }
+
+    static AsmInstruction directive(const string &text)
+    {
+        AsmInstruction instr;
+        instr.kind = ASM_DIRECTIVE;
+        instr.mnemonic = text;
+        return instr;
+    }
+
+    bool is(const string &name) const
+    {
+        return kind == ASM_INSTRUCTION && mnemonic == name;
+    }
+
+    string toString() const
+    {
+        OutputBuffer out(64);
+        appendTo(out);
+        return out.str();
+    }
+
+    // Format the line straight into `out` (without the trailing newline)
+    void appendTo(OutputBuffer &out) const
+    {
+        if (kind == ASM_LABEL)
+        {
+            out.append('\n');
+            out.append(mnemonic);
+            out.append(':');
+            return;
+        }
+        if (kind == ASM_DIRECTIVE)
+        {
+            out.append(mnemonic);
+            return;
+        }
+
+        out.append("    ", 4);
+        out.append(mnemonic);
+        for (size_t i = 0; i < operands.size(); i++)
+        {
+            out.append(i ? ", " : " ");
+            out.append(operands[i]);
+        }
+        if (!comment.empty())
+        {
+            out.append("  ; ", 4);
+            out.append(comment);
+        }
+    }
+};
+
+bool isAsmRegister(const string &operand)
+{
+    static const unordered_set<string> registers = {
+        "eax", "ebx", "ecx", "edx", "esi", "edi", "ebp", "esp",
+        "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rbp", "rsp",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+        "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+    return registers.count(operand) > 0;
+}
+
+bool isAsmMemory(const string &operand)
+{
+    return operand.find('[') != string::npos;
+}
+
+bool isAsmImmediate(const string &operand)
+{
+    return !operand.empty() && (isdigit(operand[0]) || operand[0] == '-') &&
+           operand.find_first_not_of("-0123456789", 1) == string::npos;
+}
+
+// "dword [x]" and "[x]" name the same memory
+string asmMemoryKey(const string &operand)
+{
+    size_t bracket = operand.find('[');
+    return bracket == string::npos ? operand : operand.substr(bracket);
+}
+
+/*
+    PeepholeOptimizer:
+
+    Rewrites short windows of the generated instruction list using the rule table below. Each
+    rule names a window size, a `match` test over the instructions of the window and a `rewrite`
+    that returns their replacement. Rules are applied to the tail of the output while it is being
+    built: after an instruction is appended, every rule is tried on the last few instructions, and
+    after a rewrite the new tail is tried again, so one pass reaches a fixed point in linear time.
+
+    The code generator never branches on the flags of add/sub/mov, which is what makes the
+    `lea` rules (lea leaves the flags alone) and the removal of `add r, 0` safe here.
+
+    Every rule counts its hits; `--peephole-stats` prints them.
+*/
+struct PeepholeRule
+{
+    string name;
+    size_t window;
+    function<bool(const AsmInstruction *w)> match;
+    function<vector<AsmInstruction>(const AsmInstruction *w)> rewrite;
+    long long hits = 0;
+};
+
+class PeepholeOptimizer
+{
+public:
+    vector<PeepholeRule> rules;
+
+    PeepholeOptimizer()
+    {
+        using I = AsmInstruction;
+        auto isJcc = [](const I &i)
+        { return i.kind == ASM_INSTRUCTION && i.mnemonic.size() >= 2 && i.mnemonic[0] == 'j' && i.mnemonic != "jmp" &&
+                 !inverseJump(i.mnemonic).empty(); };
+        auto isLabelJump = [](const I &i)
+        { return i.is("jmp") && i.operands.size() == 1 && isTacVariable(i.operands[0]); };
+
+        rules = {
+            // mov r, r
+            {"self-move", 1,
+             [](const I *w)
+             { return w[0].is("mov") && w[0].operands[0] == w[0].operands[1]; },
+             [](const I *)
+             { return vector<I>{}; }},
+
+            // mov [m], r / mov r, [m]  ->  mov [m], r
+            {"redundant-load", 2,
+             [](const I *w)
+             { return w[0].is("mov") && w[1].is("mov") && isAsmMemory(w[0].operands[0]) && isAsmRegister(w[0].operands[1]) &&
+                      w[1].operands[0] == w[0].operands[1] && asmMemoryKey(w[1].operands[1]) == asmMemoryKey(w[0].operands[0]); },
+             [](const I *w)
+             { return vector<I>{w[0]}; }},
+
+            // mov [m], r1 / mov r2, [m]  ->  mov [m], r1 / mov r2, r1
+            {"store-forward", 2,
+             [](const I *w)
+             { return w[0].is("mov") && w[1].is("mov") && isAsmMemory(w[0].operands[0]) && isAsmRegister(w[0].operands[1]) &&
+                      isAsmRegister(w[1].operands[0]) && asmMemoryKey(w[1].operands[1]) == asmMemoryKey(w[0].operands[0]); },
+             [](const I *w)
+             { return vector<I>{w[0], I::instruction("mov", {w[1].operands[0], w[0].operands[1]})}; }},
+
+            // mov r, x / mov r, x  ->  mov r, x
+            {"duplicate-load", 2,
+             [](const I *w)
+             { return w[0].is("mov") && w[1].is("mov") && isAsmRegister(w[0].operands[0]) && w[0].operands == w[1].operands &&
+                      w[0].operands[1].find(w[0].operands[0]) == string::npos; },
+             [](const I *w)
+             { return vector<I>{w[0]}; }},
+
+            // mov [m], r / cmp [m], x  ->  mov [m], r / cmp r, x
+            {"compare-stored", 2,
+             [](const I *w)
+             { return w[0].is("mov") && w[1].is("cmp") && isAsmMemory(w[0].operands[0]) && isAsmRegister(w[0].operands[1]) &&
+                      asmMemoryKey(w[1].operands[0]) == asmMemoryKey(w[0].operands[0]) && !isAsmMemory(w[1].operands[1]); },
+             [](const I *w)
+             { return vector<I>{w[0], I::instruction("cmp", {w[0].operands[1], w[1].operands[1]})}; }},
+
+            // jmp L / L:  ->  L:
+            {"jump-to-next", 2,
+             [isLabelJump](const I *w)
+             { return isLabelJump(w[0]) && w[1].kind == ASM_LABEL && w[1].mnemonic == w[0].operands[0]; },
+             [](const I *w)
+             { return vector<I>{w[1]}; }},
+
+            // jmp L / K: / L:  ->  K: / L:
+            {"jump-over-label", 3,
+             [isLabelJump](const I *w)
+             { return isLabelJump(w[0]) && w[1].kind == ASM_LABEL && w[2].kind == ASM_LABEL && w[2].mnemonic == w[0].operands[0]; },
+             [](const I *w)
+             { return vector<I>{w[1], w[2]}; }},
+
+            // jcc L1 / jmp L2 / L1:  ->  jncc L2 / L1:
+            {"branch-over-jump", 3,
+             [isJcc, isLabelJump](const I *w)
+             { return isJcc(w[0]) && isLabelJump(w[1]) && w[2].kind == ASM_LABEL && w[2].mnemonic == w[0].operands[0]; },
+             [](const I *w)
+             { return vector<I>{I::instruction(inverseJump(w[0].mnemonic), {w[1].operands[0]}), w[2]}; }},
+
+            // jmp L / anything but a label  ->  jmp L
+            {"unreachable-after-jump", 2,
+             [](const I *w)
+             { return w[0].is("jmp") && w[1].kind == ASM_INSTRUCTION; },
+             [](const I *w)
+             { return vector<I>{w[0]}; }},
+
+            // mov r1, r2 / add r1, x  ->  lea r1, [r2 + x]
+            {"mov-add-to-lea", 2,
+             [](const I *w)
+             { return w[0].is("mov") && (w[1].is("add") || w[1].is("sub")) && isAsmRegister(w[0].operands[0]) &&
+                      isAsmRegister(w[0].operands[1]) && w[1].operands[0] == w[0].operands[0] &&
+                      (isAsmImmediate(w[1].operands[1]) || (w[1].is("add") && isAsmRegister(w[1].operands[1]))); },
+             [](const I *w)
+             {
+                 const string &base = w[0].operands[1];
+                 string other = w[1].operands[1] == w[0].operands[0] ? base : w[1].operands[1];
+                 string sign = w[1].is("sub") ? " - " : " + ";
+                 return vector<I>{I::instruction("lea", {w[0].operands[0], "[" + base + sign + other + "]"})};
+             }},
+
+            // add r, 0 / sub r, 0
+            {"add-zero", 1,
+             [](const I *w)
+             { return (w[0].is("add") || w[0].is("sub")) && w[0].operands[1] == "0" && isAsmRegister(w[0].operands[0]); },
+             [](const I *)
+             { return vector<I>{}; }},
+        };
+    }
+
+    void optimize(vector<AsmInstruction> &code)
+    {
+        vector<AsmInstruction> out;
+        out.reserve(code.size());
+        for (auto &instr : code)
+        {
+            out.push_back(move(instr));
+            while (applyOnce(out))
+            {
+            }
+        }
+        code = move(out);
+    }
+
+    void printStatistics(ostream &out) const
+    {
+        out << "Peephole rule hits:" << endl;
+        for (const auto &rule : rules)
+            out << "  " << left << setw(24) << rule.name << rule.hits << endl;
+    }
+
+    static string inverseJump(const string &jcc)
+    {
+        static const map<string, string> inverse = {
+            {"je", "jne"}, {"jne", "je"}, {"jl", "jge"}, {"jge", "jl"}, {"jg", "jle"}, {"jle", "jg"},
+            {"jb", "jae"}, {"jae", "jb"}, {"ja", "jbe"}, {"jbe", "ja"}, {"jp", "jnp"}, {"jnp", "jp"}};
+        auto it = inverse.find(jcc);
+        return it == inverse.end() ? "" : it->second;
+    }
+
+private:
+    bool applyOnce(vector<AsmInstruction> &out)
+    {
+        for (auto &rule : rules)
+        {
+            if (out.size() < rule.window)
+                continue;
+            const AsmInstruction *w = out.data() + out.size() - rule.window;
+            if (!rule.match(w))
+                continue;
+
+            vector<AsmInstruction> replacement = rule.rewrite(w);
+            out.resize(out.size() - rule.window);
+            out.insert(out.end(), replacement.begin(), replacement.end());
+            rule.hits++;
+            return true;
+        }
+        return false;
+    }
+};
+
+/*
+    TypeInference:
+
+    The type of every TAC value, shared by the back ends. Program variables take the type they
+    were declared with in the SymbolTable (for an array, the type of its elements); literals are
+    int, double (when they have a fraction or exponent) or string (when quoted). Compiler temps
+    have no declaration, so infer() gives each one the type of the value stored into it:
+       int, bool, char   VALUE_INT
+       float             VALUE_FLOAT
+       double            VALUE_DOUBLE
+       string            VALUE_STRING
+    Mixed operands are converted to the wider type as in C: int < float < double.
+*/
+enum ValueType
+{
+    VALUE_INT,
+    VALUE_FLOAT,
+    VALUE_DOUBLE,
+    VALUE_STRING
+};
+
+bool isFloatLiteral(const string &str)
+{
+    return !str.empty() && isdigit(str[0]) && str.find_first_not_of("0123456789") != string::npos &&
+           str.find_first_not_of("0123456789.eE+-") == string::npos;
+}
+
+bool isFloating(ValueType type)
+{
+    return type == VALUE_FLOAT || type == VALUE_DOUBLE;
+}
+
+// The type both operands are converted to: int < float < double
+ValueType widerType(ValueType a, ValueType b)
+{
+    return max(a, b);
+}
+
+bool isArithmetic(const string &op)
+{
+    return op == "+" || op == "-" || op == "*" || op == "/";
+}
+
+class TypeInference
+{
+public:
+    TypeInference(SymbolTable &symTable) : symTable(symTable) {}
+
+    ValueType typeOf(const string &name) const
+    {
+        if (isTacString(name))
+            return VALUE_STRING;
+        if (!isTacVariable(name))
+            return isFloatLiteral(name) ? VALUE_DOUBLE : VALUE_INT;
+        auto it = tempTypes.find(name);
+        if (it != tempTypes.end())
+            return it->second;
+        if (!symTable.isDeclared(name))
+            return VALUE_INT;
+        return declaredType(symTable.getVariableType(name));
+    }
+
+    static ValueType declaredType(const string &declared)
+    {
+        if (declared == "float")
+            return VALUE_FLOAT;
+        if (declared == "double")
+            return VALUE_DOUBLE;
+        if (declared == "string")
+            return VALUE_STRING;
+        return VALUE_INT;
+    }
+
+    // What a call to `function` gives back (VALUE_INT for an unknown or void function)
+    ValueType returnType(const string &function) const
+    {
+        auto it = returnTypes.find(function);
+        return it == returnTypes.end() ? VALUE_INT : it->second;
+    }
+
+    /*
+        infer gives every compiler temp the type of the value stored into it: arithmetic takes
+        the wider of its operand types, comparisons and logical operators give an int, copies
+        take the type of their source, loads the element type of their array and calls the
+        return type of the function. A temp defined in several places gets the widest of them.
+        Temps can be used before their definition in loops, so this runs until nothing changes.
+    */
+    void infer(const vector<TacInstruction> &code)
+    {
+        tempTypes.clear();
+        returnTypes.clear();
+        for (const auto &instr : code)
+        {
+            if (instr.kind == TAC_FUNCTION)
+                returnTypes[instr.result] = declaredType(instr.keyword);
+        }
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (const auto &instr : code)
+            {
+                if (!instr.definesVariable() || !isCompilerVariable(instr.result) || symTable.isDeclared(instr.result))
+                    continue;
+                ValueType type = VALUE_INT;
+                if (instr.kind == TAC_COPY || instr.kind == TAC_LOAD)
+                    type = typeOf(instr.arg1);
+                else if (instr.kind == TAC_CALL)
+                    type = returnType(instr.arg1);
+                else if (isArithmetic(instr.op))
+                    type = widerType(typeOf(instr.arg1), typeOf(instr.arg2));
+
+                auto it = tempTypes.find(instr.result);
+                if (it == tempTypes.end())
+                {
+                    tempTypes[instr.result] = type;
+                    changed = true;
+                }
+                else if (widerType(it->second, type) != it->second)
+                {
+                    it->second = widerType(it->second, type);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+private:
+    SymbolTable &symTable;
+    unordered_map<string, ValueType> tempTypes;
+    unordered_map<string, ValueType> returnTypes;
+};
+
+/*
+    LoopVectorizer:
+
+    Runs after LoopOptimizer (so every loop has a preheader) and turns simple counted loops over
+    int or float arrays into a loop that handles four elements per trip with `vector 4` TAC, which
+    the code generator lowers to 128-bit SSE and the bytecode compiler to one operation per lane.
+    A loop qualifies when
+    - the header only tests `i < N` or `i <= N`, N being an int literal or an int variable the
+      loop does not assign, and the body is a single block ending with `i = i + 1` and the jump
+      back to the header;
+    - the body only loads and stores elements at `i`, `i + c` or `i - c` and combines them with
+      + and - (int) or + - * / (float), so every value has the element type. No program variable
+      is assigned in the body (that would be a reduction) and `i` is not used as a value;
+    - every array that is stored to is accessed at a single offset, so one lane never reads an
+      element another lane of the same trip writes.
+    The vector loop is placed in front of the header and runs while i + 3 passes the test; the
+    original loop stays behind it and finishes the remaining iterations. Loop-invariant operands
+    are broadcast once, before the vector loop, into `tN_splat` temps. Integer lanes do not
+    multiply: SSE2 has no packed 32-bit multiply (pmulld is SSE4.1).
+*/
+class LoopVectorizer
+{
+public:
+    static const int lanes = 4;
+    int loopsVectorized = 0;
+
+    LoopVectorizer(IntermediateCodeGnerator &icg, SymbolTable &symTable) : icg(icg), symTable(symTable), types(symTable) {}
+
+    void optimize()
+    {
+        vector<TacInstruction> code;
+        code.reserve(icg.instructions.size());
+        for (const auto &line : icg.instructions)
+            code.push_back(TacInstruction::parse(line));
+        types.infer(code);
+
+        ControlFlowGraph cfg(icg.memory);
+        cfg.build(code);
+        cfg.computeDominators();
+        vector<NaturalLoop> loops = cfg.findNaturalLoops();
+
+        // Uses of each temp per block, to make sure body temps do not escape the loop
+        unordered_map<string, unordered_set<int>> useBlocks;
+        for (size_t b = 0; b < cfg.blocks.size(); b++)
+        {
+            for (const auto &instr : cfg.blocks[b].instrs)
+            {
+                for (const auto &name : instr.uses())
+                    useBlocks[name].insert((int)b);
+            }
+        }
+
+        map<int, vector<TacInstruction>> vectorLoops; // header block -> vector loop placed before it
+        for (const auto &loop : loops)
+        {
+            vector<TacInstruction> vectorLoop;
+            if (vectorize(cfg, loop, useBlocks, vectorLoop))
+            {
+                vectorLoops[loop.header] = vectorLoop;
+                loopsVectorized++;
+            }
+        }
+
+        icg.instructions.clear();
+        for (size_t b = 0; b < cfg.blocks.size(); b++)
+        {
+            auto vectorLoop = vectorLoops.find((int)b);
+            if (vectorLoop != vectorLoops.end())
+            {
+                for (const auto &instr : vectorLoop->second)
+                    icg.instructions.push_back(instr.toString());
+            }
+            for (const auto &instr : cfg.blocks[b].instrs)
+                icg.instructions.push_back(instr.toString());
+        }
+    }
+
+private:
+    IntermediateCodeGnerator &icg;
+    SymbolTable &symTable;
+    TypeInference types;
+
+    static bool isIntegerLiteral(const string &s)
+    {
+        return !s.empty() && s.find_first_not_of("0123456789") == string::npos && s.size() < 10;
+    }
+
+    bool vectorize(const ControlFlowGraph &cfg, const NaturalLoop &loop,
+                   unordered_map<string, unordered_set<int>> &useBlocks, vector<TacInstruction> &out)
+    {
+        int header = loop.header;
+        int body = header + 1;
+        if (loop.body.size() != 2 || loop.body[1] != body || loop.latches.size() != 1 || loop.latches[0] != body)
+            return false;
+        const BasicBlock &headerBlock = cfg.blocks[header];
+        const auto &instrs = cfg.blocks[body].instrs;
+
+        // Entered only from the preheader, which falls through into the header
+        if (header == 0 || headerBlock.label.empty() || headerBlock.preds.size() != 2 ||
+            loop.inLoop[header - 1] || !cfg.fallsThrough(header - 1))
+            return false;
+
+        // Header: `L: / c = i < N / if !c goto exit`
+        if (headerBlock.instrs.size() != 3)
+            return false;
+        const TacInstruction &compare = headerBlock.instrs[1];
+        const TacInstruction &test = headerBlock.instrs[2];
+        if (compare.kind != TAC_BINARY || test.kind != TAC_IF_FALSE || !test.op.empty() || test.arg1 != compare.result)
+            return false;
+        string iv, bound, relop;
+        if (compare.op == "<" || compare.op == "<=")
+        {
+            iv = compare.arg1;
+            bound = compare.arg2;
+            relop = compare.op;
+        }
+        else if (compare.op == ">" || compare.op == ">=")
+        {
+            iv = compare.arg2;
+            bound = compare.arg1;
+            relop = compare.op == ">" ? "<" : "<=";
+        }
+        else
+        {
+            return false;
+        }
+        if (!isTacVariable(iv) || !symTable.isDeclared(iv) || symTable.isArray(iv) || types.typeOf(iv) != VALUE_INT)
+            return false;
+        // Body: `[L:] ... i = i + 1 / goto header`, the increment possibly through a temp
+        if (instrs.empty() || instrs.back().kind != TAC_GOTO || instrs.back().result != headerBlock.label)
+            return false;
+        size_t first = instrs.front().kind == TAC_LABEL ? 1 : 0;
+        size_t end = instrs.size() - 1;
+        if (end < first + 1)
+            return false;
+        const TacInstruction &update = instrs[end - 1];
+        string incrementTemp;
+        if (update.kind == TAC_COPY && update.result == iv && isTacTemp(update.arg1) && end - 1 > first &&
+            instrs[end - 2].result == update.arg1)
+        {
+            incrementTemp = update.arg1;
+            end--;
+        }
+        const TacInstruction &increment = instrs[end - 1];
+        if (increment.kind != TAC_BINARY || increment.op != "+" || increment.arg1 != iv || increment.arg2 != "1" ||
+            increment.result != (incrementTemp.empty() ? iv : incrementTemp))
+            return false;
+        end--;
+        if (!incrementTemp.empty() && useBlocks[incrementTemp].size() != 1)
+            return false;
+
+        unordered_set<string> bodyDefs;
+        for (const auto &instr : instrs)
+        {
+            if (instr.definesVariable())
+                bodyDefs.insert(instr.result);
+        }
+        if (isIntegerLiteral(bound) ? stoll(bound) < lanes
+                                    : !isTacVariable(bound) || bodyDefs.count(bound) || types.typeOf(bound) != VALUE_INT)
+            return false;
+
+        // Every array has the same element type, int or float
+        ValueType element = VALUE_STRING;
+        for (size_t i = first; i < end; i++)
+        {
+            const TacInstruction &instr = instrs[i];
+            if (instr.kind != TAC_LOAD && instr.kind != TAC_STORE)
+                continue;
+            const string &array = instr.kind == TAC_LOAD ? instr.arg1 : instr.result;
+            if (!symTable.isArray(array))
+                return false;
+            if (element == VALUE_STRING)
+                element = types.typeOf(array);
+            if (types.typeOf(array) != element)
+                return false;
+        }
+        if (element != VALUE_INT && element != VALUE_FLOAT)
+            return false;
+
+        // Classify the body: index temps `i +/- c`, values of the element type and invariant operands
+        map<string, long long> offsets = {{iv, 0}};
+        unordered_set<string> values;
+        map<string, set<long long>> accesses; // array -> offsets used
+        unordered_set<string> stored;
+        auto isInvariant = [&](const string &operand)
+        {
+            if (isIntegerLiteral(operand))
+                return true;
+            if (!isTacVariable(operand) || operand == iv || symTable.isArray(operand) || bodyDefs.count(operand))
+                return false;
+            ValueType type = types.typeOf(operand);
+            return type == VALUE_INT || type == element;
+        };
+        auto isOperand = [&](const string &operand)
+        {
+            return values.count(operand) || (!offsets.count(operand) && isInvariant(operand));
+        };
+
+        unordered_set<string> defined;
+        for (size_t i = first; i < end; i++)
+        {
+            const TacInstruction &instr = instrs[i];
+            if (instr.definesVariable())
+            {
+                // Only temps, each defined once and used nowhere else
+                if (!isTacTemp(instr.result) || !defined.insert(instr.result).second ||
+                    useBlocks[instr.result].size() > 1 || (useBlocks[instr.result].size() == 1 && !useBlocks[instr.result].count(body)))
+                    return false;
+            }
+            if (instr.kind == TAC_LOAD)
+            {
+                if (!offsets.count(instr.arg2) || types.typeOf(instr.result) != element)
+                    return false;
+                accesses[instr.arg1].insert(offsets[instr.arg2]);
+                values.insert(instr.result);
+            }
+            else if (instr.kind == TAC_STORE)
+            {
+                if (!offsets.count(instr.arg2) || !isOperand(instr.arg1))
+                    return false;
+                accesses[instr.result].insert(offsets[instr.arg2]);
+                stored.insert(instr.result);
+            }
+            else if (instr.kind == TAC_BINARY && instr.arg1 == iv && (instr.op == "+" || instr.op == "-") &&
+                     isIntegerLiteral(instr.arg2))
+            {
+                offsets[instr.result] = stoll(instr.arg2) * (instr.op == "+" ? 1 : -1);
+            }
+            else if (instr.kind == TAC_BINARY || instr.kind == TAC_COPY)
+            {
+                bool allowed = instr.kind == TAC_COPY || instr.op == "+" || instr.op == "-" ||
+                               (element == VALUE_FLOAT && (instr.op == "*" || instr.op == "/"));
+                if (!allowed || types.typeOf(instr.result) != element ||
+                    !isOperand(instr.arg1) || (instr.kind == TAC_BINARY && !isOperand(instr.arg2)))
+                    return false;
+                values.insert(instr.result);
+            }
+            else
+            {
+                return false;
+            }
+        }
+        if (stored.empty())
+            return false;
+        for (const auto &array : stored)
+        {
+            if (accesses[array].size() != 1)
+                return false;
+        }
+        // Invariant operands are broadcast once, in front of the vector loop
+        map<string, string> splats;
+        string vectorLabel = icg.newLabel();
+        string last = icg.newTemp();
+        string check = icg.newTemp();
+        map<string, string> rename;
+        vector<TacInstruction> vectorBody;
+        auto operand = [&](const string &name)
+        {
+            if (rename.count(name))
+                return rename[name];
+            if (offsets.count(name))
+                return name;
+            auto it = splats.find(name);
+            if (it == splats.end())
+            {
+                string splat = icg.newTemp() + "_splat";
+                symTable.declareVariable(splat, element == VALUE_FLOAT ? "float" : "int");
+                TacInstruction broadcast = TacInstruction::parse(splat + " = " + name);
+                broadcast.lanes = lanes;
+                out.push_back(broadcast);
+                it = splats.insert({name, splat}).first;
+            }
+            return it->second;
+        };
+        for (size_t i = first; i < end; i++)
+        {
+            TacInstruction instr = instrs[i];
+            bool index = instr.kind == TAC_BINARY && offsets.count(instr.result); // stays scalar
+            if (instr.kind == TAC_LOAD || instr.kind == TAC_STORE)
+                instr.arg2 = operand(instr.arg2);
+            if (instr.kind == TAC_STORE || (!index && instr.kind != TAC_LOAD))
+                instr.arg1 = operand(instr.arg1);
+            if (!index && instr.kind == TAC_BINARY)
+                instr.arg2 = operand(instr.arg2);
+            if (instr.definesVariable())
+                instr.result = rename[instr.result] = icg.newTemp();
+            if (!index)
+                instr.lanes = lanes;
+            vectorBody.push_back(instr);
+        }
+
+        out.push_back(TacInstruction::parse(vectorLabel + ":"));
+        out.push_back(TacInstruction::parse(last + " = " + iv + " + " + to_string(lanes - 1)));
+        out.push_back(TacInstruction::parse(check + " = " + last + " " + relop + " " + bound));
+        out.push_back(TacInstruction::parse("if !" + check + " goto " + headerBlock.label));
+        out.insert(out.end(), vectorBody.begin(), vectorBody.end());
+        out.push_back(TacInstruction::parse(iv + " = " + iv + " + " + to_string(lanes)));
+        out.push_back(TacInstruction::parse("goto " + vectorLabel));
+        return true;
+    }
+};
+
+/*
+    AssemblyCodeGenerator:
+
+    Translates the TAC into x86-64 NASM assembly (`default rel`, so variables are addressed
+    relative to rip). Every value is stored according to its type (TypeInference):
+       int, bool, char   32-bit, computed in general purpose registers, `dd` slot
+       float             SSE2 scalar single (addss, ucomiss, ...), `dd` slot
+       double            SSE2 scalar double (addsd, ucomisd, ...), `dq` slot
+       string            pointer to a NUL terminated literal, `dq` slot
+    Mixed operands are converted to the wider type as in C, and stores into int variables truncate.
+    Arrays are 16-byte aligned runs of such slots in `.data`, indexed through rdx and rax.
+    `vector 4` instructions work on all four lanes of an xmm register (see processVector).
+    Integer temps get ebx, ecx, esi, edi or r8d-r15d and floating point temps xmm2-xmm15 from two
+    RegisterAllocators; only temps that do not fit and the program's own variables get a slot in
+    `.data`. eax, edx, xmm0 and xmm1 are kept free as scratch registers (idiv needs eax and edx).
+    Integer literals are used as immediate operands; floating point and string literals are placed
+    once each in an aligned `.rodata` literal pool.
+    `print` and `read` call the runtime functions rt_print_int / rt_print_double / rt_print_string
+    and rt_read_int / rt_read_double / rt_read_string with the SysV calling convention; they are
+    declared `extern` and provided by the JIT, or by runtime.c when the object file is linked.
+    With returnToCaller set, _start saves the callee-saved registers and ends with `ret` instead of
+    the exit syscall, so it can be called as a function.
+    Functions follow the same convention: int and string arguments go in edi, esi, edx, ecx, r8d
+    and r9d (rdi.. for strings), float and double ones in xmm0-xmm7, and the result comes back in
+    eax/rax or xmm0. Parameters and locals are `.data` slots; a function that can end up calling
+    itself pushes its own slots on entry and pops them before `ret`. The caller saves whichever
+    allocated registers are live across the call (see processCall). Each function is generated
+    on its own, in parallel when there is a TaskPool (see generateFunctions).
+    A comparison whose temp only feeds the next branch becomes a cmp + jcc pair; a 0/1 value is
+    only produced (with setcc) when the result of a comparison is actually stored.
+    Integer arithmetic goes through a tree-pattern instruction selector first (see
+    selectInstructions), which picks lea, shifts, immediates and memory operands by cost.
+    Code is built as a list of AsmInstructions, cleaned up by the PeepholeOptimizer and only
+    then turned into text.
+*/
+class AssemblyCodeGenerator
+{
+public:
+    vector<AsmInstruction> instructions;
+    pmr::set<string> definedVariables; // in name order, so the output is the same on every run
+    int jumpTableCount = 0;
+    RegisterAllocator allocator{{"ebx", "ecx", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"}};
+    RegisterAllocator floatAllocator{{"xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", "xmm8",
+                                      "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15"}};
+    PeepholeOptimizer peephole;
+    bool returnToCaller = false;
+    const BlockProfile *profile = nullptr; // spill weights for the register allocators
+    TaskPool *pool = nullptr;              // generates the functions of a program in parallel
+
+    // `memory` holds the per-compile sets and control flow graphs (see CompilationArena)
+    explicit AssemblyCodeGenerator(SymbolTable &symTable, pmr::memory_resource *memory = pmr::get_default_resource())
+        : definedVariables(memory), symTable(symTable), types(symTable), memory(memory)
+    {
+        allocator.memory = memory;
+        floatAllocator.memory = memory;
+    }
+
+    void generateAssembly(const vector<string> &tacInstructions)
+    {
+        vector<TacInstruction> code;
+        code.reserve(tacInstructions.size());
+        for (const auto &instr : tacInstructions)
+            code.push_back(TacInstruction::parse(instr));
+        generateAssembly(move(code));
+    }
+
+    // The same for TAC that is already split into fields (such as a loaded binary IR file)
+    void generateAssembly(vector<TacInstruction> code)
+    {
+        for (const auto &instr : code)
+            collectVariables(instr);
+        types.infer(code);
+        for (const auto &instr : code)
+        {
+            if (instr.lanes > 1 && instr.definesVariable())
+                vectorTemps.insert(instr.result);
+        }
+        callGraph.build(code);
+        if (callGraph.hasFunctions())
+        {
+            generateFunctions(code);
+            return;
+        }
+
+        measureSlotUsage(code);
+        code = selectInstructions(code);
+        allocateRegisters(code);
+        size_t externPosition = emitHeader();
+        emitCode(code);
+
+        // Add program exit, unless the code already ended with a return
+        if (code.empty() || code.back().kind != TAC_RETURN)
+            emitProgramEnd();
+        emitLiteralPool();
+        emitExterns(externPosition);
+
+        peephole.optimize(instructions);
+    }
+    void printAssembly() const
+    {
+        for (const auto &instr : instructions)
+        {
+            cout << instr.toString() << '\n';
+        }
+        cout.flush();
+    }
+
+private:
+    /*
+        A program with functions is generated one function at a time (the main program being the
+        first), on the TaskPool when there is one. Every function goes through instruction
+        selection, register allocation, emission and the peephole optimizer in its own part: a
+        generator that reads the types, the call graph and the vector temps of the whole program
+        from this one and puts labelPrefix in front of the labels it makes up (literals, jump
+        tables). Temps never live across functions, and every call saves the registers it needs,
+        so the parts allocate registers independently. Their output is then merged in program
+        order: slot usage (for the layout of .data), literal pools, runtime functions and peephole
+        statistics. The result does not depend on the number of threads.
+    */
+    void generateFunctions(const vector<TacInstruction> &code)
+    {
+        vector<unique_ptr<AssemblyCodeGenerator>> parts;
+        vector<size_t> costs;
+        for (const auto &function : callGraph.functions)
+        {
+            parts.push_back(make_unique<AssemblyCodeGenerator>(symTable, memory));
+            AssemblyCodeGenerator &part = *parts.back();
+            part.module = this;
+            part.labelPrefix = function.name.empty() ? "" : function.name + "_";
+            part.returnToCaller = returnToCaller;
+            part.profile = profile;
+            costs.push_back(function.end - function.first);
+        }
+        auto generate = [&](size_t p)
+        {
+            const FunctionInfo &function = callGraph.functions[p];
+            parts[p]->generatePart(vector<TacInstruction>(code.begin() + function.first, code.begin() + function.end));
+        };
+        if (pool)
+            pool->run(costs, generate);
+        else
+        {
+            for (size_t p = 0; p < parts.size(); p++)
+                generate(p);
+        }
+
+        int groupBase = 0;
+        for (const auto &part : parts)
+        {
+            for (const auto &[name, usage] : part->slotUsage)
+            {
+                SlotUsage &merged = slotUsage[name];
+                merged.weight += usage.weight;
+                if (usage.groupBlock > merged.groupBlock)
+                {
+                    merged.groupBlock = usage.groupBlock;
+                    merged.group = usage.group < 0 ? -1 : groupBase + usage.group;
+                }
+            }
+            groupBase += part->loopCount;
+            for (const auto &var : part->definedVariables)
+            {
+                if (part->hasRegister(var))
+                    partRegisters.insert(var);
+            }
+            for (const auto &function : part->runtimeFunctions)
+            {
+                if (find(runtimeFunctions.begin(), runtimeFunctions.end(), function) == runtimeFunctions.end())
+                    runtimeFunctions.push_back(function);
+            }
+            poolEntries.insert(poolEntries.end(), part->poolEntries.begin(), part->poolEntries.end());
+            for (size_t r = 0; r < peephole.rules.size(); r++)
+                peephole.rules[r].hits += part->peephole.rules[r].hits;
+        }
+
+        size_t externPosition = emitHeader();
+        for (auto &part : parts)
+            instructions.insert(instructions.end(), make_move_iterator(part->instructions.begin()),
+                                make_move_iterator(part->instructions.end()));
+        if (code.back().kind != TAC_RETURN)
+            emitProgramEnd();
+        emitLiteralPool();
+        emitExterns(externPosition);
+    }
+
+    // generateFunctions: one function on its own
+    void generatePart(vector<TacInstruction> code)
+    {
+        for (const auto &instr : code)
+            collectVariables(instr);
+        measureSlotUsage(code);
+        code = selectInstructions(code);
+        allocateRegisters(code);
+        RegisterAllocator intervals({});
+        intervals.memory = memory;
+        callIntervals = intervals.liveIntervals(code, [](const string &)
+                                                { return true; });
+        emitCode(code);
+        peephole.optimize(instructions);
+    }
+
+    void allocateRegisters(const vector<TacInstruction> &code)
+    {
+        allocator.allocate(
+            code, [this](const string &name)
+            { return typeOf(name) == VALUE_INT && !isVectorTemp(name); }, profile);
+        floatAllocator.allocate(
+            code, [this](const string &name)
+            { return isFloating(typeOf(name)) || isVectorTemp(name); }, profile);
+        for (const auto &reg : allocator.usedRegisters())
+        {
+            // Registers a runtime call may clobber (as their 64-bit names)
+            static const map<string, string> callerSaved = {
+                {"ecx", "rcx"}, {"esi", "rsi"}, {"edi", "rdi"}, {"r8d", "r8"}, {"r9d", "r9"}, {"r10d", "r10"}, {"r11d", "r11"}};
+            if (callerSaved.count(reg))
+                savedAcrossCalls.push_back(callerSaved.at(reg));
+        }
+    }
+
+    // The directives, .data and the start of .text up to `_start:`; returns where the externs go
+    size_t emitHeader()
+    {
+        // Start with necessary assembly directives
+        // assemblyCode.push_back("%include 'syscall.asm'  ; Include system call definitions");
+        instructions.push_back(AsmInstruction::directive("bits 64"));
+        instructions.push_back(AsmInstruction::directive("default rel"));
+        instructions.push_back(AsmInstruction::directive("\nsection .data"));
+        // assemblyCode.push_back("    SYS_EXIT equ 1");
+        // assemblyCode.push_back("    SYS_WRITE equ 4");
+        // assemblyCode.push_back("    STDOUT equ 1");
+
+        // Declare the collected variables
+        declareVariables();
+
+        // Start text section
+        instructions.push_back(AsmInstruction::directive("\nsection .text"));
+        instructions.push_back(AsmInstruction::directive("    global _start"));
+        instructions.push_back(AsmInstruction::label("_start"));
+        size_t externPosition = instructions.size() - 2;
+        if (returnToCaller)
+        {
+            for (const char *reg : {"rbx", "rbp", "r12", "r13", "r14", "r15"})
+                emit("push", {reg});
+        }
+        return externPosition;
+    }
+
+    void emitExterns(size_t position)
+    {
+        for (const auto &function : runtimeFunctions)
+            instructions.insert(instructions.begin() + position, AsmInstruction::directive("    extern " + function));
+    }
+
+    void emitCode(const vector<TacInstruction> &code)
+    {
+        map<string, int> useCount;
+        for (const auto &instr : code)
+        {
+            for (const auto &used : instr.uses())
+                useCount[used]++;
+        }
+
+        // Process each TAC instruction
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            const TacInstruction &instr = code[i];
+            if (covers[i].folded)
+            {
+                // Computed as part of the address of the instruction that uses it
+                continue;
+            }
+            else if (covers[i].lea)
+            {
+                emitLea(instr, covers[i]);
+            }
+            else if (i + 1 < code.size() && isFusedCompare(instr, code[i + 1], useCount))
+            {
+                // `t = a < b` / `if !t goto L` becomes a single cmp + jge
+                const TacInstruction &branch = code[++i];
+                emitCompareBranch(instr.arg1, instr.op, instr.arg2, branch.kind == TAC_IF_FALSE, branch.result);
+            }
+            else if (instr.kind == TAC_JUMP_TABLE)
+            {
+                processJumpTable(instr);
+            }
+            else if (instr.lanes > 1)
+            {
+                processVector(instr);
+            }
+            else if (instr.kind == TAC_COPY || instr.kind == TAC_BINARY)
+            {
+                processAssignment(instr);
+            }
+            else if (instr.kind == TAC_LOAD)
+            {
+                processLoad(instr);
+            }
+            else if (instr.kind == TAC_STORE)
+            {
+                processStore(instr);
+            }
+            else if (instr.kind == TAC_IF || instr.kind == TAC_IF_FALSE)
+            {
+                processConditional(instr);
+            }
+            else if (instr.kind == TAC_GOTO)
+            {
+                processGoto(instr);
+            }
+            else if (instr.kind == TAC_PRINT)
+            {
+                processPrint(instr);
+            }
+            else if (instr.kind == TAC_READ)
+            {
+                processRead(instr);
+            }
+            else if (instr.kind == TAC_LABEL)
+            {
+                processLabel(instr.result);
+            }
+            else if (instr.kind == TAC_FUNCTION)
+            {
+                processFunction(code, i);
+            }
+            else if (instr.kind == TAC_CALL)
+            {
+                processCall(instr, (int)i);
+            }
+            else if (instr.kind == TAC_RETURN)
+            {
+                processReturn(instr);
+            }
+            else if (!instr.text.empty())
+            {
+                throw CompileError("Unsupported TAC instruction: " + instr.text);
+            }
+        }
+    }
+
+    // Every operand of `instr` that names a variable: a symbol or a compiler variable. Labels,
+    // function names, operators and literals of any kind are skipped
+    void collectVariables(const TacInstruction &instr)
+    {
+        auto add = [this](const string &operand)
+        {
+            if (isCompilerVariable(operand) || (isTacVariable(operand) && symTable.isDeclared(operand)))
+                definedVariables.insert(operand);
+        };
+        switch (instr.kind)
+        {
+        case TAC_LABEL:
+        case TAC_GOTO:
+        case TAC_OTHER:
+            return;
+        case TAC_JUMP_TABLE:
+            // Only the switched value of a jump table is a variable
+            add(instr.arg1);
+            return;
+        case TAC_IF:
+        case TAC_IF_FALSE:
+            add(instr.arg1);
+            add(instr.arg2);
+            return;
+        case TAC_FUNCTION:
+        case TAC_CALL:
+            // The function name is a label; parameters and arguments are variables
+            if (instr.kind == TAC_CALL)
+                add(instr.result);
+            for (const auto &operand : instr.targets)
+                add(operand);
+            return;
+        default:
+            add(instr.result);
+            add(instr.arg1);
+            add(instr.arg2);
+            return;
+        }
+    }
+
+    /*
+        Data layout. measureSlotUsage gives every variable an access weight: how often the
+        instructions naming it run, from the BlockProfile when there is one and estimated as
+        8^(loop depth) otherwise. A variable's group is the innermost loop of the block where it
+        is accessed most; straight-line code forms one more group. declareVariables then places
+        - the scalars first, starting on a 64-byte cache line, by group (hottest group first).
+          A loop's group that fits in one line but would straddle two starts a new line. Within
+          a group the 8-byte slots come before the 4-byte ones, so only group boundaries may
+          need padding;
+        - then vector temps and arrays, 16-byte aligned, hottest first.
+        Ties are broken by name, so the layout is the same on every run.
+    */
+    struct SlotUsage
+    {
+        int64_t weight = 0;
+        int group = -1;          // natural loop index, -1 for code outside loops
+        int64_t groupBlock = -1; // weight of the block that decided the group
+    };
+
+    void measureSlotUsage(const vector<TacInstruction> &code)
+    {
+        ControlFlowGraph cfg(memory);
+        cfg.build(code);
+        cfg.computeDominators();
+        vector<NaturalLoop> loops = cfg.findNaturalLoops();
+        loopCount = (int)loops.size();
+        vector<int> depth(cfg.blocks.size(), 0), innermost(cfg.blocks.size(), -1);
+        for (size_t l = 0; l < loops.size(); l++)
+        {
+            for (int b : loops[l].body)
+            {
+                depth[b]++;
+                if (innermost[b] < 0 || loops[l].body.size() < loops[innermost[b]].body.size())
+                    innermost[b] = (int)l;
+            }
+        }
+
+        // As in the RegisterAllocator, an unlabeled block runs as often as the label before it
+        int64_t profiled = 1;
+        for (size_t b = 0; b < cfg.blocks.size(); b++)
+        {
+            int64_t count = profile ? profile->count(cfg.blocks[b].label) : -1;
+            profiled = count >= 0 ? count : profiled;
+            int64_t weight = profile ? profiled : (int64_t)1 << (3 * min(depth[b], 6));
+            for (const auto &instr : cfg.blocks[b].instrs)
+            {
+                vector<string> names = instr.uses();
+                if (instr.definesVariable() || instr.kind == TAC_STORE)
+                    names.push_back(instr.result);
+                if (instr.kind == TAC_LOAD)
+                    names.push_back(instr.arg1);
+                if (instr.kind == TAC_FUNCTION)
+                    names.insert(names.end(), instr.targets.begin(), instr.targets.end());
+                for (const auto &name : names)
+                {
+                    if (!definedVariables.count(name))
+                        continue;
+                    SlotUsage &usage = slotUsage[name];
+                    usage.weight += weight;
+                    if (weight > usage.groupBlock)
+                    {
+                        usage.groupBlock = weight;
+                        usage.group = innermost[b];
+                    }
+                }
+            }
+        }
+    }
+
+    void declareVariables()
+    {
+        vector<string> vectors, arrays, scalars;
+        map<int, int64_t> groupWeight;
+        for (const auto &var : definedVariables)
+        {
+            if (hasRegister(var))
+            {
+                // Temps that live in a register need no slot
+                continue;
+            }
+            if (symTable.isArray(var))
+                arrays.push_back(var);
+            else if (isVectorTemp(var))
+                vectors.push_back(var);
+            else
+                scalars.push_back(var);
+            groupWeight[slotUsage[var].group] += slotUsage[var].weight;
+        }
+
+        auto hotter = [this](const string &a, const string &b)
+        {
+            int64_t wa = slotUsage[a].weight, wb = slotUsage[b].weight;
+            return wa != wb ? wa > wb : a < b;
+        };
+        stable_sort(scalars.begin(), scalars.end(), [&](const string &a, const string &b)
+                    {
+                        int ga = slotUsage[a].group, gb = slotUsage[b].group;
+                        if (ga != gb)
+                            return groupWeight[ga] != groupWeight[gb] ? groupWeight[ga] > groupWeight[gb] : ga < gb;
+                        size_t sa = slotSize(a), sb = slotSize(b);
+                        return sa != sb ? sa > sb : hotter(a, b); });
+        sort(vectors.begin(), vectors.end(), hotter);
+        sort(arrays.begin(), arrays.end(), hotter);
+
+        if (!scalars.empty())
+            instructions.push_back(AsmInstruction::directive("    align 64"));
+        size_t offset = 0;
+        for (size_t first = 0; first < scalars.size();)
+        {
+            int group = slotUsage[scalars[first]].group;
+            size_t last = first, size = 0;
+            for (; last < scalars.size() && slotUsage[scalars[last]].group == group; last++)
+                size += slotSize(scalars[last]);
+            size_t alignment = slotSize(scalars[first]);
+            if (group >= 0 && size <= 64 && offset % 64 + size > 64)
+                alignment = 64;
+            if (offset % alignment)
+            {
+                instructions.push_back(AsmInstruction::directive("    align " + to_string(alignment)));
+                offset += alignment - offset % alignment;
+            }
+            for (; first < last; first++)
+            {
+                const string &var = scalars[first];
+                instructions.push_back(AsmInstruction::directive("    " + var + (slotSize(var) == 8 ? " dq 0" : " dd 0")));
+                offset += slotSize(var);
+            }
+        }
+        if (!vectors.empty())
+            instructions.push_back(AsmInstruction::directive("    align 16"));
+        for (const auto &var : vectors)
+            instructions.push_back(AsmInstruction::directive("    " + var + " times 4 dd 0"));
+        for (const auto &var : arrays)
+        {
+            instructions.push_back(AsmInstruction::directive("    align 16"));
+            instructions.push_back(AsmInstruction::directive("    " + var + " times " + to_string(symTable.getArraySize(var)) +
+                                                             (elementSize(var) == 8 ? " dq 0" : " dd 0")));
+        }
+    }
+
+    // Bytes of a scalar slot: doubles and string pointers take 8, everything else 4
+    size_t slotSize(const string &var) const
+    {
+        ValueType type = typeOf(var);
+        return type == VALUE_DOUBLE || type == VALUE_STRING ? 8 : 4;
+    }
+
+    // "ss" or "sd": the suffix of the SSE2 scalar instructions for a floating point type
+    static string sseSuffix(ValueType type)
+    {
+        return type == VALUE_FLOAT ? "ss" : "sd";
+    }
+
+    ValueType typeOf(const string &name) const
+    {
+        return module->types.typeOf(name);
+    }
+
+    bool isVectorTemp(const string &name) const
+    {
+        return module->vectorTemps.count(name) > 0;
+    }
+
+    // Does a register hold `var` (in this generator or, once merged, in one of its parts)?
+    bool hasRegister(const string &var) const
+    {
+        return !allocator.registerOf(var).empty() || !floatAllocator.registerOf(var).empty() || partRegisters.count(var);
+    }
+
+    // Where an operand lives: a register, a `.data` slot or an immediate
+    string location(const string &name)
+    {
+        string reg = allocator.registerOf(name);
+        if (!reg.empty())
+            return reg;
+        if (name == "true")
+            return "1";
+        if (name == "false")
+            return "0";
+        if (isTacVariable(name))
+            return "[" + name + "]";
+        return name;
+    }
+
+    static bool isMemory(const string &loc)
+    {
+        return !loc.empty() && loc[0] == '[';
+    }
+
+    static bool isRegister(const string &loc)
+    {
+        return isAsmRegister(loc);
+    }
+
+    void processAssignment(const TacInstruction &instr)
+    {
+        ValueType operandType = instr.kind == TAC_BINARY ? widerType(typeOf(instr.arg1), typeOf(instr.arg2)) : typeOf(instr.arg1);
+        ValueType resultType = typeOf(instr.result);
+
+        if (instr.kind == TAC_BINARY && isFloating(operandType) && isArithmetic(instr.op))
+            translateFloatBinaryOp(instr, operandType);
+        else if (instr.kind == TAC_BINARY && isFloating(operandType) && !conditionCode(instr.op).empty())
+        {
+            // A floating point comparison whose value is stored
+            string cc = emitFloatCompare(instr.arg1, instr.op, instr.arg2);
+            emit("set" + cc, {"al"});
+            if (cc == "e")
+            {
+                // Unordered (NaN) operands are never equal
+                emit("setnp", {"dl"});
+                emit("and", {"al", "dl"});
+            }
+            else if (cc == "ne")
+            {
+                emit("setp", {"dl"});
+                emit("or", {"al", "dl"});
+            }
+            storeFlag(instr.result);
+        }
+        else if (instr.kind == TAC_COPY && (resultType == VALUE_STRING || operandType == VALUE_STRING))
+        {
+            // Strings are pointers: copy the address
+            if (isTacString(instr.arg1))
+                emit("lea", {"rax", "[" + poolLabel(instr.arg1, VALUE_STRING) + "]"});
+            else
+                emit("mov", {"rax", "[" + instr.arg1 + "]"});
+            emit("mov", {"[" + instr.result + "]", "rax"});
+        }
+        else if (instr.kind == TAC_COPY && isFloating(resultType))
+        {
+            // Load straight into the destination register (converting if needed)
+            string reg = floatAllocator.registerOf(instr.result);
+            string src = floatAllocator.registerOf(instr.arg1);
+            if (reg.empty() && !src.empty() && operandType == resultType)
+                storeFloat(instr.result, src, resultType);
+            else
+            {
+                loadFloat(instr.arg1, resultType, reg.empty() ? "xmm0" : reg);
+                if (reg.empty())
+                    storeFloat(instr.result, "xmm0", resultType);
+            }
+        }
+        else if (instr.kind == TAC_COPY && isFloating(operandType))
+        {
+            string reg = floatAllocator.registerOf(instr.arg1);
+            if (reg.empty())
+            {
+                loadFloat(instr.arg1, operandType, "xmm0");
+                reg = "xmm0";
+            }
+            storeFloat(instr.result, reg, operandType);
+        }
+        else if (instr.kind == TAC_BINARY && instr.op == "+")
+            translateBinaryOp(instr, "add");
+        else if (instr.kind == TAC_BINARY && instr.op == "-")
+            translateBinaryOp(instr, "sub");
+        else if (instr.kind == TAC_BINARY && instr.op == "*")
+            translateBinaryOp(instr, "imul");
+        else if (instr.kind == TAC_BINARY && instr.op == "/")
+            translateBinaryOp(instr, "idiv");
+        else if (instr.kind == TAC_BINARY && instr.op == "&&")
+            translateBinaryOp(instr, "and");
+        else if (instr.kind == TAC_BINARY && instr.op == "||")
+            translateBinaryOp(instr, "or");
+        else if (instr.kind == TAC_BINARY && !conditionCode(instr.op).empty())
+        {
+            // A comparison whose value is stored: materialise 0/1 with setcc
+            string cc = emitCompare(instr.arg1, instr.op, instr.arg2);
+            emit("set" + cc, {"al"});
+            storeFlag(instr.result);
+        }
+        else
+        {
+            // Simple assignment or constant
+            string dst = location(instr.result);
+            string src = location(instr.arg1);
+            if (dst == src)
+                return;
+            if (isMemory(dst) && isMemory(src))
+            {
+                emit("mov", {"eax", src});
+                src = "eax";
+            }
+            emit("mov", {sizedLocation(dst), src});
+        }
+    }
+
+    // Memory destinations need an explicit size when the source is an immediate
+    static string sizedLocation(const string &loc)
+    {
+        return isMemory(loc) ? "dword " + loc : loc;
+    }
+
+    // Zero-extend the flag left in al by setcc into an int variable
+    void storeFlag(const string &name)
+    {
+        string dst = location(name);
+        if (isRegister(dst))
+            emit("movzx", {dst, "al"});
+        else
+        {
+            emit("movzx", {"eax", "al"});
+            emit("mov", {sizedLocation(dst), "eax"});
+        }
+    }
+
+    void translateFloatBinaryOp(const TacInstruction &instr, ValueType type)
+    {
+        static const map<string, string> mnemonics = {{"+", "add"}, {"-", "sub"}, {"*", "mul"}, {"/", "div"}};
+
+        // Compute straight into the destination register when it has the same type
+        string dst = floatAllocator.registerOf(instr.result);
+        bool direct = !dst.empty() && typeOf(instr.result) == type && dst != floatAllocator.registerOf(instr.arg2);
+        string acc = direct ? dst : "xmm0";
+        loadFloat(instr.arg1, type, acc);
+        emit(mnemonics.at(instr.op) + sseSuffix(type), {acc, floatOperand(instr.arg2, type)});
+        if (!direct)
+            storeFloat(instr.result, acc, type);
+    }
+
+    // Load any operand into an xmm register as a value of the given floating point type
+    void loadFloat(const string &name, ValueType type, const string &reg)
+    {
+        string suffix = sseSuffix(type);
+        if (!isTacVariable(name))
+        {
+            emit("mov" + suffix, {reg, "[" + poolLabel(name, type) + "]"});
+            return;
+        }
+
+        ValueType from = typeOf(name);
+        string src = floatAllocator.registerOf(name);
+        if (src.empty())
+            src = isFloating(from) ? "[" + name + "]" : sizedLocation(location(name));
+        if (from == type)
+        {
+            if (src != reg)
+                emit(isMemory(src) ? "mov" + suffix : "movaps", {reg, src});
+        }
+        else if (isFloating(from))
+            emit(from == VALUE_FLOAT ? "cvtss2sd" : "cvtsd2ss", {reg, src});
+        else
+            emit("cvtsi2" + suffix, {reg, src});
+    }
+
+    // An operand of the given type for the second slot of an SSE instruction (register or memory)
+    string floatOperand(const string &name, ValueType type)
+    {
+        if (!isTacVariable(name))
+            return "[" + poolLabel(name, type) + "]";
+        if (typeOf(name) == type)
+        {
+            string reg = floatAllocator.registerOf(name);
+            return reg.empty() ? "[" + name + "]" : reg;
+        }
+        loadFloat(name, type, "xmm1");
+        return "xmm1";
+    }
+
+    // Store a value of the given type held in `reg` (which may be clobbered by a conversion)
+    void storeFloat(const string &name, const string &reg, ValueType type)
+    {
+        ValueType to = typeOf(name);
+        if (isFloating(to))
+        {
+            if (to != type)
+                emit(type == VALUE_FLOAT ? "cvtss2sd" : "cvtsd2ss", {reg, reg});
+            string dst = floatAllocator.registerOf(name);
+            if (dst.empty())
+                emit("mov" + sseSuffix(to), {"[" + name + "]", reg});
+            else if (dst != reg)
+                emit("movaps", {dst, reg});
+            return;
+        }
+
+        // Stores into an int truncate towards zero, as in C
+        string dst = location(name);
+        emit("cvtt" + sseSuffix(type) + "2si", {isRegister(dst) ? dst : "eax", reg});
+        if (!isRegister(dst))
+            emit("mov", {sizedLocation(dst), "eax"});
+    }
+
+    int elementSize(const string &array)
+    {
+        ValueType type = typeOf(array);
+        return type == VALUE_DOUBLE || type == VALUE_STRING ? 8 : 4;
+    }
+
+    /*
+        elementAddress returns the memory operand of `array[index]`. Arrays are addressed through
+        rdx (`lea rdx, [a]`, since a rip relative operand cannot take an index register) with the
+        index in rax; a literal index becomes a displacement.
+    */
+    string elementAddress(const string &array, const string &index)
+    {
+        int size = elementSize(array);
+        emit("lea", {"rdx", "[" + array + "]"});
+        if (!isTacVariable(index))
+        {
+            long long offset = stoll(index) * size;
+            return offset == 0 ? "[rdx]" : "[rdx + " + to_string(offset) + "]";
+        }
+        ValueType type = typeOf(index);
+        if (isFloating(type))
+            emit("cvtt" + sseSuffix(type) + "2si", {"eax", floatOperand(index, type)});
+        else
+            emit("mov", {"eax", location(index)});
+        return "[rdx + rax*" + to_string(size) + "]";
+    }
+
+    void processLoad(const TacInstruction &instr)
+    {
+        ValueType type = typeOf(instr.arg1);
+        ValueType to = typeOf(instr.result);
+        string element = elementAddress(instr.arg1, instr.arg2);
+        if (type == VALUE_STRING)
+        {
+            emit("mov", {"rax", element});
+            emit("mov", {"[" + instr.result + "]", "rax"});
+        }
+        else if (isFloating(type))
+        {
+            string reg = floatAllocator.registerOf(instr.result);
+            if (!reg.empty() && to == type)
+                emit("mov" + sseSuffix(type), {reg, element});
+            else
+            {
+                emit("mov" + sseSuffix(type), {"xmm0", element});
+                storeFloat(instr.result, "xmm0", type);
+            }
+        }
+        else if (isFloating(to))
+        {
+            emit("cvtsi2" + sseSuffix(to), {"xmm0", "dword " + element});
+            storeFloat(instr.result, "xmm0", to);
+        }
+        else
+        {
+            string dst = location(instr.result);
+            emit("mov", {isRegister(dst) ? dst : "eax", element});
+            if (!isRegister(dst))
+                emit("mov", {dst, "eax"});
+        }
+    }
+
+    void processStore(const TacInstruction &instr)
+    {
+        ValueType type = typeOf(instr.result);
+        const string &value = instr.arg1;
+        if (isFloating(type))
+        {
+            string reg = floatAllocator.registerOf(value);
+            if (reg.empty() || typeOf(value) != type)
+            {
+                loadFloat(value, type, "xmm0");
+                reg = "xmm0";
+            }
+            emit("mov" + sseSuffix(type), {elementAddress(instr.result, instr.arg2), reg});
+            return;
+        }
+
+        // The value may need eax, so the whole address goes into rdx first
+        string element = elementAddress(instr.result, instr.arg2);
+        if (element.find("rax") != string::npos)
+        {
+            emit("lea", {"rdx", element});
+            element = "[rdx]";
+        }
+        if (type == VALUE_STRING)
+        {
+            if (isTacString(value))
+                emit("lea", {"rax", "[" + poolLabel(value, VALUE_STRING) + "]"});
+            else
+                emit("mov", {"rax", "[" + value + "]"});
+            emit("mov", {element, "rax"});
+            return;
+        }
+        string src = location(value);
+        ValueType from = typeOf(value);
+        if (isFloating(from))
+        {
+            // Stores into an int truncate towards zero, as in C
+            emit("cvtt" + sseSuffix(from) + "2si", {"eax", floatOperand(value, from)});
+            src = "eax";
+        }
+        else if (isMemory(src))
+        {
+            emit("mov", {"eax", src});
+            src = "eax";
+        }
+        emit("mov", {sizedLocation(element), src});
+    }
+
+    /*
+        processVector lowers a `vector 4` instruction on int or float elements to 128-bit SSE.
+        A vector temp lives in an xmm register or in a 16-byte aligned `.data` slot. Float lanes
+        use addps / subps / mulps / divps and int lanes paddd / psubd; copying a single value
+        into a vector temp broadcasts it to all four lanes (shufps / pshufd).
+    */
+    void processVector(const TacInstruction &instr)
+    {
+        static const map<string, string> floatOps = {{"+", "addps"}, {"-", "subps"}, {"*", "mulps"}, {"/", "divps"}};
+        static const map<string, string> intOps = {{"+", "paddd"}, {"-", "psubd"}};
+
+        ValueType type = typeOf(instr.result);
+        const map<string, string> &ops = type == VALUE_FLOAT ? floatOps : intOps;
+        if (instr.lanes != 4 || (type != VALUE_INT && type != VALUE_FLOAT) ||
+            (instr.kind == TAC_BINARY && !ops.count(instr.op)))
+        {
+            throw CompileError("Unsupported vector instruction: " + instr.toString());
+        }
+
+        if (instr.kind == TAC_STORE)
+        {
+            string src = vectorOperand(instr.arg1, type, "xmm0");
+            emit("movups", {elementAddress(instr.result, instr.arg2), src});
+            return;
+        }
+
+        string dst = floatAllocator.registerOf(instr.result);
+        string acc = dst.empty() ? "xmm0" : dst;
+        if (instr.kind == TAC_LOAD)
+            emit("movups", {acc, elementAddress(instr.arg1, instr.arg2)});
+        else if (instr.kind == TAC_COPY)
+            loadVector(instr.arg1, type, acc);
+        else
+        {
+            // The second operand must survive loading the first one into the destination
+            if (acc == floatAllocator.registerOf(instr.arg2))
+                acc = "xmm0";
+            loadVector(instr.arg1, type, acc);
+            emit(ops.at(instr.op), {acc, vectorOperand(instr.arg2, type, "xmm1")});
+        }
+        if (acc != dst)
+            emit(dst.empty() ? "movups" : "movaps", {dst.empty() ? "[" + instr.result + "]" : dst, acc});
+    }
+
+    // The second operand of a packed instruction: a vector temp's register or aligned slot
+    string vectorOperand(const string &name, ValueType type, const string &scratch)
+    {
+        if (isVectorTemp(name))
+        {
+            string reg = floatAllocator.registerOf(name);
+            return reg.empty() ? "[" + name + "]" : reg;
+        }
+        loadVector(name, type, scratch);
+        return scratch;
+    }
+
+    // Load a vector temp into `reg`, or broadcast a single value to all four lanes
+    void loadVector(const string &name, ValueType type, const string &reg)
+    {
+        if (isVectorTemp(name))
+        {
+            string src = floatAllocator.registerOf(name);
+            if (src.empty())
+                emit("movups", {reg, "[" + name + "]"});
+            else if (src != reg)
+                emit("movaps", {reg, src});
+        }
+        else if (type == VALUE_FLOAT)
+        {
+            loadFloat(name, VALUE_FLOAT, reg);
+            emit("shufps", {reg, reg, "0"});
+        }
+        else
+        {
+            emit("mov", {"eax", location(name)});
+            emit("movd", {reg, "eax"});
+            emit("pshufd", {reg, reg, "0"});
+        }
+    }
+
+    /*
+        poolLabel returns the `.rodata` label of a literal, adding it to the pool the first time.
+        Floating point literals are stored in the precision they are used with and keyed on their
+        bit pattern, so `3.14e+2` and `314.0` share one entry; strings are keyed on their contents.
+    */
+    string poolLabel(const string &literal, ValueType type)
+    {
+        string key, data;
+        int size;
+        if (type == VALUE_STRING)
+        {
+            string value = unquoteTacString(literal);
+            key = "s" + value;
+            data = "db " + nasmString(value);
+            size = 1;
+        }
+        else
+        {
+            double value = literal == "true" ? 1 : literal == "false" ? 0 : stod(literal);
+            ostringstream bits;
+            bits << "0x" << hex << setfill('0');
+            if (type == VALUE_FLOAT)
+            {
+                float single = (float)value;
+                uint32_t raw;
+                memcpy(&raw, &single, sizeof raw);
+                bits << setw(8) << raw;
+                data = "dd ";
+                size = 4;
+            }
+            else
+            {
+                uint64_t raw;
+                memcpy(&raw, &value, sizeof raw);
+                bits << setw(16) << raw;
+                data = "dq ";
+                size = 8;
+            }
+            key = bits.str() + data;
+            data += bits.str() + "  ; " + literal;
+        }
+
+        auto it = literalPool.find(key);
+        if (it != literalPool.end())
+            return it->second;
+        string label = labelPrefix + (type == VALUE_STRING ? "ls" : "lf") + to_string(literalPool.size());
+        literalPool[key] = label;
+        poolEntries.push_back({size, label + ": " + data});
+        return label;
+    }
+
+    // NASM data for a NUL terminated string: printable runs in quotes, everything else as bytes
+    static string nasmString(const string &value)
+    {
+        string out;
+        bool inQuotes = false;
+        for (unsigned char c : value)
+        {
+            bool printable = c >= 32 && c < 127 && c != '"';
+            if (printable && !inQuotes)
+                out += string(out.empty() ? "" : ", ") + "\"";
+            else if (!printable && inQuotes)
+                out += "\"";
+            if (printable)
+                out += (char)c;
+            else
+                out += string(out.empty() ? "" : ", ") + to_string(c);
+            inQuotes = printable;
+        }
+        if (inQuotes)
+            out += "\"";
+        return out + (out.empty() ? "0" : ", 0");
+    }
+
+    // Widest entries first so one `align 8` keeps every entry naturally aligned
+    void emitLiteralPool()
+    {
+        if (poolEntries.empty())
+            return;
+        stable_sort(poolEntries.begin(), poolEntries.end(), [](const pair<int, string> &a, const pair<int, string> &b)
+                    { return a.first > b.first; });
+        instructions.push_back(AsmInstruction::directive("\nsection .rodata"));
+        instructions.push_back(AsmInstruction::directive("    align 8"));
+        for (const auto &entry : poolEntries)
+            instructions.push_back(AsmInstruction::directive(entry.second));
+    }
+
+    void translateBinaryOp(const TacInstruction &instr, const string &op)
+    {
+        string dst = location(instr.result);
+        string op1 = location(instr.arg1);
+        string op2 = location(instr.arg2);
+
+        if (op == "idiv" && isAsmImmediate(op2) && divideByConstant(dst, op1, stoll(op2)))
+            return;
+        if (op == "imul" && isAsmImmediate(op1))
+            swap(op1, op2);
+        if (op == "idiv")
+        {
+            // Division requires special handling: dividend in edx:eax, quotient in eax
+            emit("mov", {"eax", op1});
+            emit("cdq", {}, "Sign extend for division");
+            if (isMemory(op2) || isRegister(op2))
+            {
+                emit("idiv", {sizedLocation(op2)});
+            }
+            else
+            {
+                // idiv has no immediate form
+                emit("push", {op2});
+                emit("idiv", {"dword [rsp]"});
+                emit("add", {"rsp", "8"});
+            }
+            if (dst != "eax")
+                emit("mov", {sizedLocation(dst), "eax"});
+            return;
+        }
+
+        if ((op == "add" || op == "sub") && isMemory(dst) && dst == op1)
+        {
+            // x = x + y updates the slot in place
+            if (isMemory(op2))
+            {
+                emit("mov", {"eax", op2});
+                op2 = "eax";
+            }
+            emit(op, {sizedLocation(dst), op2});
+            return;
+        }
+
+        // Compute straight into the destination register when there is one
+        string acc = (isRegister(dst) && dst != op2) ? dst : "eax";
+        if (op == "imul" && isAsmImmediate(op2) && !isAsmImmediate(op1))
+        {
+            int shift = log2Exact(stoll(op2));
+            if (shift > 0)
+            {
+                if (acc != op1)
+                    emit("mov", {acc, op1});
+                emit("shl", {acc, to_string(shift)});
+            }
+            else
+                emit("imul", {acc, op1, op2});
+        }
+        else
+        {
+            if (acc != op1)
+                emit("mov", {acc, op1});
+            emit(op, {acc, op2});
+        }
+        if (acc != dst)
+            emit("mov", {sizedLocation(dst), acc});
+    }
+
+    /*
+        Tree-pattern instruction selection for integer + - *.
+
+        The TAC is flat, but a temp that is used once, by an instruction later in the same block,
+        is really an inner node of an expression tree: `t1 = i * 4 / t2 = t1 + a / t3 = t2 + 8`
+        is the tree (i * 4 + a) + 8. selectInstructions walks the code backwards, so each tree is
+        seen from its root first, and covers as much of it as it can with one pattern, the x86
+        address `base + index*scale + disp` computed by lea. Bottom-up, every node gets its
+        candidate covers as linear forms (sum of coefficient * operand plus a constant), with
+        each inner temp either folded in or left as an operand. A form fits the pattern when at
+        most two operands are left, with coefficients 1 and 1, 2, 4 or 8 (or one operand times
+        2, 3, 5 or 9, as base + base*1/2/4/8). The cheapest fitting candidate is taken when it
+        beats the instruction by instruction code, costed as one unit per instruction, three
+        for imul and one for each operand that has to be loaded from memory (program
+        variables; temps are assumed to get a register).
+        Folded instructions are moved next to their root: then no register of an operand the
+        root now reads can be handed to another temp in between, and since a folded instruction
+        never writes its result, nothing clobbers those registers until the root's lea.
+        Roots that are not covered by lea keep their own patterns in translateBinaryOp: shifts
+        and imul with an immediate for multiplication, add/sub straight into a memory operand,
+        and shifts or magic-number multiplication for division by a constant.
+    */
+    struct Cover
+    {
+        bool folded = false; // part of the tree of a later instruction
+        bool lea = false;    // root of a tree computed by one lea
+        string base, index;
+        int scale = 1;
+        int32_t disp = 0;
+    };
+    vector<Cover> covers; // one per instruction of the code being emitted
+
+    // Sum of at most two coefficient * operand terms plus a constant
+    struct LinearForm
+    {
+        string names[2];
+        long long coefficients[2] = {0, 0};
+        int count = 0;
+        uint32_t constant = 0; // wraps around like the 32-bit arithmetic it stands for
+
+        bool add(const string &name, long long coefficient)
+        {
+            for (int t = 0; t < count; t++)
+            {
+                if (names[t] == name)
+                {
+                    coefficients[t] += coefficient;
+                    if (coefficients[t] == 0)
+                    {
+                        names[t] = names[--count];
+                        coefficients[t] = coefficients[count];
+                    }
+                    return true;
+                }
+            }
+            if (count == 2)
+                return false;
+            names[count] = name;
+            coefficients[count++] = coefficient;
+            return true;
+        }
+    };
+
+    struct TreeCandidate
+    {
+        LinearForm form;
+        vector<size_t> folded; // instructions computed inside the lea
+        int saved = 0;         // what they would cost on their own
+    };
+
+    struct TreeTemp
+    {
+        size_t definition = 0;
+        int definitions = 0;
+        int uses = 0;
+    };
+    unordered_map<string, TreeTemp> treeTemps;
+    vector<char> treeNodes; // int + - * instructions, by position
+
+    bool isTreeNode(const TacInstruction &instr) const
+    {
+        return instr.kind == TAC_BINARY && instr.lanes == 1 && (instr.op == "+" || instr.op == "-" || instr.op == "*") &&
+               typeOf(instr.result) == VALUE_INT && typeOf(instr.arg1) == VALUE_INT && typeOf(instr.arg2) == VALUE_INT;
+    }
+
+    vector<TacInstruction> selectInstructions(vector<TacInstruction> code)
+    {
+        treeTemps.clear();
+        treeNodes.assign(code.size(), 0);
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            const TacInstruction &instr = code[i];
+            for (const auto &used : instr.uses())
+            {
+                if (isTacTemp(used))
+                    treeTemps[used].uses++;
+            }
+            if (instr.definesVariable() && isTacTemp(instr.result))
+            {
+                TreeTemp &temp = treeTemps[instr.result];
+                temp.definition = i;
+                temp.definitions++;
+            }
+            treeNodes[i] = isTreeNode(instr);
+        }
+
+        vector<Cover> cover(code.size());
+        vector<vector<size_t>> children(code.size());
+        for (size_t i = code.size(); i-- > 0;)
+        {
+            if (cover[i].folded || !treeNodes[i])
+                continue;
+
+            // The cheapest candidate that fits an address, against plain instructions
+            int bestCost = instructionCost(code[i]);
+            const TreeCandidate *best = nullptr;
+            Cover address;
+            vector<TreeCandidate> candidates = treeCandidates(code, i, i, 0);
+            for (const auto &candidate : candidates)
+            {
+                if (!fitsAddress(candidate.form, address))
+                    continue;
+                int cost = 1 + isMemoryOperand(code[i].result) + isMemoryOperand(address.base) +
+                           (address.index != address.base && isMemoryOperand(address.index)) - candidate.saved;
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    best = &candidate;
+                    cover[i] = address;
+                }
+            }
+            if (!best)
+                continue;
+
+            cover[i].lea = true;
+            for (size_t child : best->folded)
+                cover[child].folded = true;
+            children[i] = best->folded;
+        }
+
+        vector<TacInstruction> selected;
+        selected.reserve(code.size());
+        covers.clear();
+        covers.reserve(code.size());
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            if (cover[i].folded)
+                continue;
+            sort(children[i].begin(), children[i].end());
+            for (size_t child : children[i])
+            {
+                selected.push_back(move(code[child]));
+                covers.push_back(cover[child]);
+            }
+            selected.push_back(move(code[i]));
+            covers.push_back(cover[i]);
+        }
+        return selected;
+    }
+
+    // Program variables live in memory; temps are expected to get a register
+    static bool isMemoryOperand(const string &name)
+    {
+        return isTacVariable(name) && !isCompilerVariable(name);
+    }
+
+    // Rough cost of translateBinaryOp: the operation plus the moves around it
+    static int instructionCost(const TacInstruction &instr)
+    {
+        bool inRegister = !isMemoryOperand(instr.result);
+        int cost = instr.op == "*" && !(isAsmImmediate(instr.arg2) && log2Exact(stoll(instr.arg2)) > 0) ? 3 : 1;
+        if (!inRegister || instr.result != instr.arg1)
+            cost++;
+        if (!inRegister && instr.result != instr.arg1)
+            cost++;
+        return cost;
+    }
+
+    /*
+        The ways to write the tree of instruction `at` as a linear form of at most two operands:
+        each operand either stays a leaf or, when it is a temp that can be folded, is replaced
+        by the candidates of its own tree. Operands are read at `root`.
+    */
+    vector<TreeCandidate> treeCandidates(const vector<TacInstruction> &code, size_t at, size_t root, int depth)
+    {
+        const size_t maxCandidates = 8;
+        const TacInstruction &instr = code[at];
+        vector<TreeCandidate> result;
+        vector<TreeCandidate> lefts = operandCandidates(code, instr.arg1, at, root, depth);
+        vector<TreeCandidate> rights = operandCandidates(code, instr.arg2, at, root, depth);
+        for (size_t l = 0; l < lefts.size() && result.size() < maxCandidates; l++)
+        {
+            for (size_t r = 0; r < rights.size() && result.size() < maxCandidates; r++)
+            {
+                TreeCandidate candidate;
+                if (!combine(instr.op, lefts[l].form, rights[r].form, candidate.form))
+                    continue;
+                candidate.folded = lefts[l].folded;
+                candidate.folded.insert(candidate.folded.end(), rights[r].folded.begin(), rights[r].folded.end());
+                candidate.saved = lefts[l].saved + rights[r].saved;
+                result.push_back(move(candidate));
+            }
+        }
+        return result;
+    }
+
+    vector<TreeCandidate> operandCandidates(const vector<TacInstruction> &code, const string &name, size_t at, size_t root, int depth)
+    {
+        const int maxDepth = 3;
+        const size_t maxDistance = 32; // expression trees are contiguous; hoisted temps are not worth it
+        vector<TreeCandidate> result(1);
+        if (!isTacVariable(name))
+        {
+            if (name.empty() || name.find_first_not_of("0123456789") != string::npos || name.size() > 10)
+                return {};
+            result[0].form.constant = (uint32_t)stoull(name);
+            return result;
+        }
+        result[0].form.add(name, 1);
+
+        // A temp used only here, whose operands still hold the same values at the root
+        if (depth >= maxDepth || !isTacTemp(name))
+            return result;
+        auto temp = treeTemps.find(name);
+        if (temp == treeTemps.end() || temp->second.uses != 1 || temp->second.definitions != 1)
+            return result;
+        size_t def = temp->second.definition;
+        if (def >= at || root - def > maxDistance || !treeNodes[def])
+            return result;
+        for (size_t j = def + 1; j < root; j++)
+        {
+            TacKind kind = code[j].kind;
+            if (kind == TAC_LABEL || kind == TAC_GOTO || kind == TAC_IF || kind == TAC_IF_FALSE ||
+                kind == TAC_JUMP_TABLE || kind == TAC_RETURN || kind == TAC_CALL || kind == TAC_FUNCTION ||
+                (code[j].definesVariable() && (code[j].result == code[def].arg1 || code[j].result == code[def].arg2)))
+                return result;
+        }
+        for (auto &candidate : treeCandidates(code, def, root, depth + 1))
+        {
+            candidate.folded.push_back(def);
+            candidate.saved += instructionCost(code[def]);
+            result.push_back(move(candidate));
+        }
+        return result;
+    }
+
+    // form = left op right, as long as it keeps at most two operands with small coefficients
+    static bool combine(const string &op, const LinearForm &left, const LinearForm &right, LinearForm &form)
+    {
+        if (op == "*")
+        {
+            // One side has to be a constant
+            if (left.count && right.count)
+                return false;
+            const LinearForm &variable = left.count ? left : right;
+            const LinearForm &factor = left.count ? right : left;
+            form = variable;
+            for (int t = 0; t < form.count; t++)
+                form.coefficients[t] *= (int32_t)factor.constant;
+            form.constant = variable.constant * factor.constant;
+        }
+        else
+        {
+            long long sign = op == "-" ? -1 : 1;
+            form = left;
+            for (int t = 0; t < right.count; t++)
+            {
+                if (!form.add(right.names[t], sign * right.coefficients[t]))
+                    return false;
+            }
+            form.constant = sign < 0 ? left.constant - right.constant : left.constant + right.constant;
+        }
+        for (int t = 0; t < form.count; t++)
+        {
+            if (form.coefficients[t] < -9 || form.coefficients[t] > 9)
+                return false;
+        }
+        return true;
+    }
+
+    // Does the linear form fit base + index*scale + disp?
+    static bool fitsAddress(const LinearForm &form, Cover &cover)
+    {
+        auto isScale = [](long long c)
+        { return c == 1 || c == 2 || c == 4 || c == 8; };
+        cover = Cover();
+        cover.disp = (int32_t)form.constant;
+        long long c0 = form.coefficients[0], c1 = form.coefficients[1];
+        if (form.count == 1 && (c0 == 1 || c0 == 2 || c0 == 3 || c0 == 5 || c0 == 9))
+        {
+            // x, or x + x*(c - 1)
+            cover.base = form.names[0];
+            if (c0 > 1)
+            {
+                cover.index = form.names[0];
+                cover.scale = (int)c0 - 1;
+            }
+            return true;
+        }
+        if (form.count == 2 && (c0 == 1 || c1 == 1) && isScale(c0) && isScale(c1))
+        {
+            bool firstIsBase = c0 == 1;
+            cover.base = form.names[firstIsBase ? 0 : 1];
+            cover.index = form.names[firstIsBase ? 1 : 0];
+            cover.scale = (int)(firstIsBase ? c1 : c0);
+            return true;
+        }
+        return false;
+    }
+
+    static string wideRegister(const string &reg)
+    {
+        if (reg[0] == 'r')
+            return reg.substr(0, reg.size() - 1); // r8d -> r8
+        return "r" + reg.substr(1);               // ebx -> rbx
+    }
+
+    // lea for a covered tree; operands in memory are loaded into eax / edx first
+    void emitLea(const TacInstruction &instr, const Cover &cover)
+    {
+        string dst = location(instr.result);
+        string base = location(cover.base);
+        string index = cover.index.empty() ? "" : location(cover.index);
+        if (isMemory(base))
+        {
+            emit("mov", {"eax", base});
+            base = "eax";
+        }
+        if (cover.index == cover.base)
+            index = base;
+        else if (isMemory(index))
+        {
+            emit("mov", {"edx", index});
+            index = "edx";
+        }
+
+        string address = "[" + wideRegister(base);
+        if (!index.empty())
+            address += " + " + wideRegister(index) + (cover.scale > 1 ? "*" + to_string(cover.scale) : "");
+        if (cover.disp != 0)
+            address += (cover.disp < 0 ? " - " : " + ") + to_string(cover.disp < 0 ? -(long long)cover.disp : cover.disp);
+        address += "]";
+
+        string acc = isRegister(dst) ? dst : "eax";
+        emit("lea", {acc, address});
+        if (acc != dst)
+            emit("mov", {sizedLocation(dst), acc});
+    }
+
+    // n when value is 2^n (n >= 1), otherwise 0
+    static int log2Exact(long long value)
+    {
+        int shift = 0;
+        while (value > 1 && value % 2 == 0)
+        {
+            value /= 2;
+            shift++;
+        }
+        return value == 1 ? shift : 0;
+    }
+
+    /*
+        Signed division by a constant without idiv (Hacker's Delight, chapter 10). By 2^n: add
+        2^n - 1 to a negative dividend, then shift right arithmetically. By any other d >= 3:
+        multiply by a magic number M ~ 2^(32+s) / d, keep the high half, shift it right by s and
+        add one if the result is negative, so the quotient is truncated towards zero like idiv.
+        Returns false for divisors it leaves to idiv (0, 1 is a copy, INT_MIN).
+    */
+    bool divideByConstant(const string &dst, const string &dividend, long long divisor)
+    {
+        if (divisor == 0 || divisor < -0x7FFFFFFFLL || divisor > 0x7FFFFFFFLL || isAsmImmediate(dividend))
+            return false;
+        long long magnitude = divisor < 0 ? -divisor : divisor;
+        string quotient;
+        int shift = log2Exact(magnitude);
+        if (magnitude == 1)
+        {
+            emit("mov", {"eax", dividend});
+            quotient = "eax";
+        }
+        else if (shift > 0)
+        {
+            emit("mov", {"eax", dividend});
+            emit("cdq", {}, "Sign mask for rounding towards zero");
+            emit("and", {"edx", to_string(magnitude - 1)});
+            emit("add", {"eax", "edx"});
+            emit("sar", {"eax", to_string(shift)});
+            quotient = "eax";
+        }
+        else
+        {
+            int32_t magic;
+            magicNumber((uint32_t)magnitude, magic, shift);
+            emit("mov", {"eax", to_string(magic)});
+            emit("imul", {sizedLocation(dividend)}, "edx = high half of magic * dividend");
+            if (magic < 0)
+                emit("add", {"edx", dividend});
+            if (shift > 0)
+                emit("sar", {"edx", to_string(shift)});
+            emit("mov", {"eax", "edx"});
+            emit("shr", {"eax", "31"});
+            emit("add", {"edx", "eax"});
+            quotient = "edx";
+        }
+        if (divisor < 0)
+            emit("neg", {quotient});
+        if (dst != quotient)
+            emit("mov", {sizedLocation(dst), quotient});
+        return true;
+    }
+
+    // Magic number and shift for signed 32-bit division by d >= 2 (Hacker's Delight, figure 10-1)
+    static void magicNumber(uint32_t d, int32_t &magic, int &shift)
+    {
+        const uint32_t two31 = 0x80000000u;
+        uint32_t anc = two31 - 1 - two31 % d;
+        int p = 31;
+        uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+        uint32_t q2 = two31 / d, r2 = two31 - q2 * d;
+        uint32_t delta;
+        do
+        {
+            p++;
+            q1 *= 2;
+            r1 *= 2;
+            if (r1 >= anc)
+            {
+                q1++;
+                r1 -= anc;
+            }
+            q2 *= 2;
+            r2 *= 2;
+            if (r2 >= d)
+            {
+                q2++;
+                r2 -= d;
+            }
+            delta = d - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+        magic = (int32_t)(q2 + 1);
+        shift = p - 32;
+    }
+
+    void processConditional(const TacInstruction &instr)
+    {
+        // `if !t goto L` jumps when the condition is false
+        bool negated = instr.kind == TAC_IF_FALSE;
+        const string &label = instr.result;
+
+        if (!instr.op.empty())
+        {
+            emitCompareBranch(instr.arg1, instr.op, instr.arg2, negated, label);
+            return;
+        }
+
+        // Boolean condition, stored as 0 or 1
+        string value = location(instr.arg1);
+        if (!isMemory(value) && !isRegister(value))
+        {
+            // Literal: the branch is decided at compile time
+            if ((value != "0") != negated)
+                emit("jmp", {label});
+            return;
+        }
+        if (isRegister(value))
+            emit("test", {value, value});
+        else
+            emit("cmp", {sizedLocation(value), "0"});
+        emit(negated ? "je" : "jne", {label});
+    }
+
+    // Signed condition code for a relational operator ("" if it is not one)
+    static string conditionCode(const string &relop)
+    {
+        static const map<string, string> codes = {
+            {"==", "e"}, {"!=", "ne"}, {"<", "l"}, {"<=", "le"}, {">", "g"}, {">=", "ge"}};
+        auto it = codes.find(relop);
+        return it == codes.end() ? "" : it->second;
+    }
+
+    static string negateConditionCode(const string &cc)
+    {
+        static const map<string, string> inverse = {
+            {"e", "ne"}, {"ne", "e"}, {"l", "ge"}, {"ge", "l"}, {"le", "g"}, {"g", "le"}};
+        return inverse.at(cc);
+    }
+
+    // Condition code after the two operands of the cmp have been swapped
+    static string swapConditionCode(const string &cc)
+    {
+        static const map<string, string> swapped = {
+            {"e", "e"}, {"ne", "ne"}, {"l", "g"}, {"g", "l"}, {"le", "ge"}, {"ge", "le"}};
+        return swapped.at(cc);
+    }
+
+    /*
+        emitCompare emits the cmp for `a relop b` and returns the condition code that holds when the
+        comparison is true. cmp cannot take an immediate as its first operand or two memory operands,
+        so a literal on the left is swapped to the right (and the condition mirrored), and eax is used
+        when neither form fits.
+    */
+    string emitCompare(const string &a, const string &relop, const string &b)
+    {
+        string left = location(a);
+        string right = location(b);
+        string cc = conditionCode(relop);
+
+        bool leftImmediate = !isMemory(left) && !isRegister(left);
+        bool rightImmediate = !isMemory(right) && !isRegister(right);
+        if (leftImmediate && !rightImmediate)
+        {
+            swap(left, right);
+            cc = swapConditionCode(cc);
+        }
+        else if (leftImmediate || (isMemory(left) && isMemory(right)))
+        {
+            emit("mov", {"eax", left});
+            left = "eax";
+        }
+        emit("cmp", {sizedLocation(left), right});
+        return cc;
+    }
+
+    /*
+        emitFloatCompare emits ucomiss/ucomisd for `a relop b`. ucomis sets the flags like an
+        unsigned compare and sets ZF, PF and CF together when either side is NaN, so `<` and `<=`
+        swap their operands to use `a` / `ae` (both false for NaN), and `==` / `!=` are returned as
+        `e` / `ne` for the caller to combine with the parity flag.
+    */
+    string emitFloatCompare(const string &a, const string &relop, const string &b)
+    {
+        ValueType type = widerType(typeOf(a), typeOf(b));
+        string left = a, right = b, cc;
+        if (relop == "<" || relop == "<=")
+        {
+            swap(left, right);
+            cc = relop == "<" ? "a" : "ae";
+        }
+        else
+            cc = relop == ">" ? "a" : relop == ">=" ? "ae" : relop == "==" ? "e" : "ne";
+
+        string reg = floatAllocator.registerOf(left);
+        if (reg.empty() || typeOf(left) != type)
+        {
+            loadFloat(left, type, "xmm0");
+            reg = "xmm0";
+        }
+        emit("ucomi" + sseSuffix(type), {reg, floatOperand(right, type)});
+        return cc;
+    }
+
+    void emitFloatCompareBranch(const string &a, const string &relop, const string &b, bool negated, const string &label)
+    {
+        string cc = emitFloatCompare(a, relop, b);
+        if (cc == "a" || cc == "ae")
+        {
+            // The negation (below or equal / below) includes the unordered case
+            emit(!negated ? "j" + cc : cc == "a" ? "jbe" : "jb", {label});
+            return;
+        }
+
+        // Jump only when the operands are ordered and equal, or whenever they are not
+        if ((cc == "e") != negated)
+        {
+            string ordered = labelPrefix + "Lf" + to_string(localLabelCount++);
+            emit("jp", {ordered});
+            emit("je", {label});
+            instructions.push_back(AsmInstruction::label(ordered));
+        }
+        else
+        {
+            emit("jp", {label});
+            emit("jne", {label});
+        }
+    }
+
+    void emitCompareBranch(const string &a, const string &relop, const string &b, bool negated, const string &label)
+    {
+        if (isFloating(widerType(typeOf(a), typeOf(b))))
+        {
+            emitFloatCompareBranch(a, relop, b, negated, label);
+            return;
+        }
+        string cc = emitCompare(a, relop, b);
+        emit("j" + (negated ? negateConditionCode(cc) : cc), {label});
+    }
+
+    // A comparison into a temp whose only use is the branch right after it
+    static bool isFusedCompare(const TacInstruction &compare, const TacInstruction &branch, map<string, int> &useCount)
+    {
+        return compare.kind == TAC_BINARY && compare.lanes == 1 && !conditionCode(compare.op).empty() &&
+               (branch.kind == TAC_IF || branch.kind == TAC_IF_FALSE) && branch.op.empty() &&
+               branch.arg1 == compare.result && isCompilerVariable(compare.result) &&
+               useCount[compare.result] == 1;
+    }
+
+    /*
+        processJumpTable lowers `jumptable x low L1,L2,... default Ld`:
+        the value is rebased to the first entry, a single unsigned compare sends everything outside
+        the table (below `low` as well as above the last entry) to the default label, and the jump
+        goes through a table of label addresses placed in .rodata.
+    */
+    void processJumpTable(const TacInstruction &table)
+    {
+        string tableLabel = labelPrefix + "jt" + to_string(jumpTableCount++);
+
+        emit("mov", {"eax", location(table.arg1)});
+        if (table.arg2 != "0")
+            emit("sub", {"eax", table.arg2});
+        emit("cmp", {"eax", to_string(table.targets.size() - 1)});
+        emit("ja", {table.result});
+        emit("lea", {"rdx", "[" + tableLabel + "]"});
+        emit("jmp", {"[rdx + rax*8]"});
+
+        string entries;
+        for (size_t i = 0; i < table.targets.size(); i++)
+            entries += (i ? ", " : "") + table.targets[i];
+        instructions.push_back(AsmInstruction::directive("section .rodata"));
+        instructions.push_back(AsmInstruction::directive("    align 8"));
+        instructions.push_back(AsmInstruction::directive(tableLabel + ": dq " + entries));
+        instructions.push_back(AsmInstruction::directive("section .text"));
+    }
+
+    void processLabel(const string &name)
+    {
+        instructions.push_back(AsmInstruction::label(name));
+    }
+
+    void processGoto(const TacInstruction &instr)
+    {
+        emit("jmp", {instr.result});
+    }
+
+    void emit(const string &mnemonic, const vector<string> &operands, const string &comment = "")
+    {
+        instructions.push_back(AsmInstruction::instruction(mnemonic, operands, comment));
+    }
+
+    void processPrint(const TacInstruction &instr)
+    {
+        ValueType type = typeOf(instr.arg1);
+        beginRuntimeCall();
+        if (type == VALUE_STRING)
+        {
+            if (isTacString(instr.arg1))
+                emit("lea", {"rdi", "[" + poolLabel(instr.arg1, VALUE_STRING) + "]"});
+            else
+                emit("mov", {"rdi", "[" + instr.arg1 + "]"});
+            callRuntime("rt_print_string");
+        }
+        else if (isFloating(type))
+        {
+            loadFloat(instr.arg1, VALUE_DOUBLE, "xmm0");
+            callRuntime("rt_print_double");
+        }
+        else
+        {
+            emit("mov", {"edi", location(instr.arg1)});
+            callRuntime("rt_print_int");
+        }
+        endRuntimeCall();
+    }
+
+    void processRead(const TacInstruction &instr)
+    {
+        ValueType type = typeOf(instr.result);
+        beginRuntimeCall();
+        callRuntime(type == VALUE_STRING ? "rt_read_string" : isFloating(type) ? "rt_read_double" : "rt_read_int");
+        endRuntimeCall();
+        if (type == VALUE_STRING)
+            emit("mov", {"[" + instr.result + "]", "rax"});
+        else if (isFloating(type))
+            storeFloat(instr.result, "xmm0", VALUE_DOUBLE);
+        else
+            emit("mov", {sizedLocation(location(instr.result)), "eax"});
+    }
+
+    /*
+        A runtime call may clobber rcx, rsi, rdi, r8-r11 and every xmm register, all of which can
+        hold allocated temps, so the ones in use are saved around the call. rbp remembers the stack
+        pointer while rsp is aligned to 16 bytes as the SysV ABI requires at a call.
+    */
+    void beginRuntimeCall()
+    {
+        emit("push", {"rbp"});
+        emit("mov", {"rbp", "rsp"});
+        for (const auto &reg : savedAcrossCalls)
+            emit("push", {reg});
+        vector<string> xmm = floatAllocator.usedRegisters();
+        if (!xmm.empty())
+        {
+            emit("sub", {"rsp", to_string(16 * xmm.size())});
+            for (size_t i = 0; i < xmm.size(); i++)
+                emit("movups", {"[rsp + " + to_string(16 * i) + "]", xmm[i]});
+        }
+        emit("and", {"rsp", "-16"});
+    }
+
+    void endRuntimeCall()
+    {
+        vector<string> xmm = floatAllocator.usedRegisters();
+        size_t saved = 8 * savedAcrossCalls.size() + 16 * xmm.size();
+        if (saved == 0)
+            emit("mov", {"rsp", "rbp"});
+        else
+            emit("lea", {"rsp", "[rbp - " + to_string(saved) + "]"});
+        if (!xmm.empty())
+        {
+            for (size_t i = 0; i < xmm.size(); i++)
+                emit("movups", {xmm[i], "[rsp + " + to_string(16 * i) + "]"});
+            emit("add", {"rsp", to_string(16 * xmm.size())});
+        }
+        for (size_t i = savedAcrossCalls.size(); i-- > 0;)
+            emit("pop", {savedAcrossCalls[i]});
+        emit("pop", {"rbp"});
+    }
+
+    void callRuntime(const string &function)
+    {
+        if (find(runtimeFunctions.begin(), runtimeFunctions.end(), function) == runtimeFunctions.end())
+            runtimeFunctions.push_back(function);
+        emit("call", {function});
+    }
+
+    void addProgramExit()
+    {
+        // Add standard exit syscall
+        emit("mov", {"eax", "60"}, "Exit program");
+        emit("xor", {"edi", "edi"}, "Exit code 0");
+        emit("syscall", {});
+    }
+
+    void emitProgramEnd()
+    {
+        if (returnToCaller)
+        {
+            for (const char *reg : {"r15", "r14", "r13", "r12", "rbp", "rbx"})
+                emit("pop", {reg});
+            emit("ret", {});
+        }
+        else
+        {
+            addProgramExit();
+        }
+    }
+
+    /*
+        Functions take their arguments in the SysV registers (edi, esi, edx, ecx, r8d, r9d, the
+        64-bit names for strings, xmm0-xmm7 for float and double) and return in eax, rax or xmm0.
+        Parameters and locals have `.data` slots like globals. A call may clobber every register,
+        so the caller saves the allocated registers whose interval spans the call. A function that
+        can recurse also pushes its own slots (locals, parameters and spilled temps) on entry and
+        pops them before it returns, so an inner call cannot overwrite the values of an outer one.
+    */
+    void processFunction(const vector<TacInstruction> &code, size_t first)
+    {
+        const TacInstruction &instr = code[first];
+        currentFunction = instr.result;
+        frame.clear();
+        if (module->callGraph.isRecursive(currentFunction))
+        {
+            set<string> slots;
+            for (size_t i = first; i < code.size() && (i == first || code[i].kind != TAC_FUNCTION); i++)
+            {
+                // `function` and `call` list their variables in targets
+                vector<string> names = code[i].uses();
+                if (code[i].definesVariable())
+                    names.push_back(code[i].result);
+                if (code[i].kind == TAC_FUNCTION)
+                    names.insert(names.end(), code[i].targets.begin(), code[i].targets.end());
+                for (const auto &name : names)
+                {
+                    bool own = isCompilerVariable(name) || name.compare(0, currentFunction.size() + 2, currentFunction + "__") == 0;
+                    // Vector temps never live across a call: vectorized loops do not contain any
+                    if (own && isTacVariable(name) && !symTable.isArray(name) && !isVectorTemp(name) &&
+                        allocator.registerOf(name).empty() && floatAllocator.registerOf(name).empty())
+                        slots.insert(name);
+                }
+            }
+            frame.assign(slots.begin(), slots.end());
+        }
+
+        instructions.push_back(AsmInstruction::label(instr.result));
+        for (const auto &slot : frame)
+        {
+            emit("mov", {wideSlot(slot) ? "rax" : "eax", "[" + slot + "]"});
+            emit("push", {"rax"});
+        }
+        size_t integer = 0, floating = 0;
+        for (const auto &param : instr.targets)
+        {
+            ValueType type = typeOf(param);
+            if (isFloating(type))
+                storeFloat(param, "xmm" + to_string(floating++), type);
+            else if (type == VALUE_STRING)
+                emit("mov", {"[" + param + "]", wideRegister(integerArguments[integer++])});
+            else
+                emit("mov", {location(param), integerArguments[integer++]});
+        }
+    }
+
+    void processReturn(const TacInstruction &instr)
+    {
+        if (currentFunction.empty())
+        {
+            emitProgramEnd();
+            return;
+        }
+        if (!instr.arg1.empty())
+            loadReturnValue(instr.arg1, module->types.returnType(currentFunction));
+        // rdx is free here: the value is in eax, rax or xmm0
+        for (size_t k = frame.size(); k-- > 0;)
+        {
+            emit("pop", {"rdx"});
+            emit("mov", {"[" + frame[k] + "]", wideSlot(frame[k]) ? "rdx" : "edx"});
+        }
+        emit("ret", {});
+    }
+
+    void loadReturnValue(const string &value, ValueType type)
+    {
+        if (type == VALUE_STRING)
+        {
+            if (isTacString(value))
+                emit("lea", {"rax", "[" + poolLabel(value, VALUE_STRING) + "]"});
+            else
+                emit("mov", {"rax", "[" + value + "]"});
+        }
+        else if (isFloating(type))
+            loadFloat(value, type, "xmm0");
+        else if (isFloating(typeOf(value)))
+            emit("cvtt" + sseSuffix(typeOf(value)) + "2si", {"eax", floatOperand(value, typeOf(value))});
+        else
+            emit("mov", {"eax", location(value)});
+    }
+
+    /*
+        Arguments are loaded straight into their registers, in order, when none of them lives in
+        the register of an argument before it. Otherwise every argument is converted to the type of its parameter and pushed
+        first, and only then are the argument registers loaded from the stack, so loading one
+        argument never overwrites another that is still needed.
+    */
+    void processCall(const TacInstruction &instr, int position)
+    {
+        const FunctionInfo *callee = module->callGraph.find(instr.arg1);
+        if (!callee || callee->params.size() != instr.targets.size())
+            throw CompileError("Call does not match any function: " + instr.text);
+
+        vector<string> saved, savedXmm;
+        for (const auto &interval : callIntervals)
+        {
+            if (interval.start >= position || interval.end <= position)
+                continue;
+            string reg = allocator.registerOf(interval.name);
+            if (!reg.empty())
+                saved.push_back(wideRegister(reg));
+            else if (!(reg = floatAllocator.registerOf(interval.name)).empty())
+                savedXmm.push_back(reg);
+        }
+        for (const auto &reg : saved)
+            emit("push", {reg});
+        if (!savedXmm.empty())
+        {
+            emit("sub", {"rsp", to_string(16 * savedXmm.size())});
+            for (size_t i = 0; i < savedXmm.size(); i++)
+                emit("movups", {"[rsp + " + to_string(16 * i) + "]", savedXmm[i]});
+        }
+
+        size_t count = instr.targets.size();
+        vector<string> argumentRegisters;
+        bool direct = true;
+        for (size_t k = 0, integer = 0, floating = 0; k < count; k++)
+        {
+            ValueType type = typeOf(callee->params[k]);
+            argumentRegisters.push_back(isFloating(type) ? "xmm" + to_string(floating++) : integerArguments[integer++]);
+            // A conversion to int may need xmm1 as scratch
+            direct = direct && (isFloating(type) || !isFloating(typeOf(instr.targets[k])));
+        }
+        for (size_t k = 0; k < count; k++)
+        {
+            const string &argument = instr.targets[k];
+            string reg = isFloating(typeOf(argument)) ? floatAllocator.registerOf(argument) : allocator.registerOf(argument);
+            direct = direct && find(argumentRegisters.begin(), argumentRegisters.begin() + k, reg) == argumentRegisters.begin() + k;
+        }
+
+        if (!direct)
+        {
+            for (size_t k = 0; k < count; k++)
+                pushArgument(instr.targets[k], typeOf(callee->params[k]));
+        }
+        for (size_t k = 0; k < count; k++)
+        {
+            ValueType type = typeOf(callee->params[k]);
+            string reg = argumentRegisters[k];
+            size_t offset = 8 * (count - 1 - k);
+            string source = offset == 0 ? "[rsp]" : "[rsp + " + to_string(offset) + "]";
+            if (isFloating(type) && direct)
+                loadFloat(instr.targets[k], type, reg);
+            else if (isFloating(type))
+                emit("mov" + sseSuffix(type), {reg, source});
+            else if (type == VALUE_STRING && direct && isTacString(instr.targets[k]))
+                emit("lea", {wideRegister(reg), "[" + poolLabel(instr.targets[k], VALUE_STRING) + "]"});
+            else if (type == VALUE_STRING)
+                emit("mov", {wideRegister(reg), direct ? "[" + instr.targets[k] + "]" : source});
+            else
+                emit("mov", {reg, direct ? location(instr.targets[k]) : source});
+        }
+        if (!direct && count > 0)
+            emit("add", {"rsp", to_string(8 * count)});
+        emit("call", {instr.arg1});
+
+        if (!savedXmm.empty())
+        {
+            for (size_t i = 0; i < savedXmm.size(); i++)
+                emit("movups", {savedXmm[i], "[rsp + " + to_string(16 * i) + "]"});
+            emit("add", {"rsp", to_string(16 * savedXmm.size())});
+        }
+        for (size_t i = saved.size(); i-- > 0;)
+            emit("pop", {saved[i]});
+
+        if (instr.result.empty())
+            return;
+        ValueType returned = module->types.returnType(instr.arg1);
+        if (returned == VALUE_STRING)
+            emit("mov", {"[" + instr.result + "]", "rax"});
+        else if (isFloating(returned))
+            storeFloat(instr.result, "xmm0", returned);
+        else
+            emit("mov", {location(instr.result), "eax"});
+    }
+
+    // One 8-byte stack slot holding `name` converted to `type`
+    void pushArgument(const string &name, ValueType type)
+    {
+        if (isFloating(type))
+        {
+            loadFloat(name, type, "xmm0");
+            emit("sub", {"rsp", "8"});
+            emit("mov" + sseSuffix(type), {"[rsp]", "xmm0"});
+            return;
+        }
+        if (type == VALUE_STRING)
+        {
+            if (isTacString(name))
+                emit("lea", {"rax", "[" + poolLabel(name, VALUE_STRING) + "]"});
+            else
+                emit("mov", {"rax", "[" + name + "]"});
+        }
+        else if (isFloating(typeOf(name)))
+        {
+            emit("cvtt" + sseSuffix(typeOf(name)) + "2si", {"eax", floatOperand(name, typeOf(name))});
+        }
+        else
+        {
+            string loc = location(name);
+            if (!isMemory(loc))
+            {
+                emit("push", {isRegister(loc) ? wideRegister(loc) : loc});
+                return;
+            }
+            emit("mov", {"eax", loc});
+        }
+        emit("push", {"rax"});
+    }
+
+    bool wideSlot(const string &name) const
+    {
+        ValueType type = typeOf(name);
+        return type == VALUE_DOUBLE || type == VALUE_STRING;
+    }
+
+    SymbolTable &symTable;
+    TypeInference types;
+    pmr::memory_resource *memory;
+    unordered_set<string> vectorTemps;    // temps holding the lanes of a `vector` instruction
+    unordered_map<string, SlotUsage> slotUsage;
+    map<string, string> literalPool;      // literal key -> label
+    vector<pair<int, string>> poolEntries; // (size, data line)
+    int localLabelCount = 0;
+    vector<string> savedAcrossCalls;  // caller-saved general purpose registers in use
+    vector<string> runtimeFunctions; // runtime functions called, declared extern
+    const vector<string> integerArguments = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
+    CallGraph callGraph;
+    const AssemblyCodeGenerator *module = this; // owner of the types, call graph and vector temps
+    string labelPrefix;                         // of literal and jump table labels, per function
+    set<string> partRegisters;                  // variables the parts keep in registers
+    int loopCount = 0;                          // natural loops seen by measureSlotUsage
+    vector<LiveInterval> callIntervals; // of every variable of the function being generated
+    string currentFunction;             // function being emitted, empty in the main program
+    vector<string> frame;               // slots it saves on entry (when it can recurse)
+};
+
+/*
+    MachineCodeEncoder:
+
+    Assembles the AsmInstructions produced by the AssemblyCodeGenerator straight into x86-64
+    machine code, so no external assembler is needed. It understands exactly the subset of NASM the
+    generator emits: the integer, SSE2 and control flow instructions, labels, and the data
+    directives of `.data` / `.rodata` (`x dd 0`, `lf0: dq 0x...`, `ls0: db "..", 0`, `align 8`).
+    Code and data go into three sections. Every reference to a label is recorded as a Fixup instead
+    of being patched right away, because the final addresses are only known once the ElfWriter has
+    laid the sections out (or turned the fixups into relocations).
+       rel32   a 32-bit offset relative to the next instruction: jumps and [rip + label] operands
+       abs64   a 64-bit absolute address: jump table entries
+    Jumps always use their rel32 form, so instruction sizes never depend on label positions.
+    Symbols declared `extern` (the runtime functions) may stay undefined; whoever loads the code
+    supplies them.
+*/
+enum ObjectSectionId
+{
+    SECTION_TEXT,
+    SECTION_RODATA,
+    SECTION_DATA,
+    SECTION_COUNT
+};
+
+enum FixupKind
+{
+    FIXUP_REL32,
+    FIXUP_ABS64
+};
+
+struct Fixup
+{
+    int section;
+    size_t offset;
+    string symbol;
+    FixupKind kind;
+    int64_t addend;
+};
+
+struct SymbolDefinition
+{
+    int section;
+    size_t offset;
+};
+
+struct ObjectSection
+{
+    string name;
+    vector<uint8_t> bytes;
+    size_t alignment = 1;
+};
+
+class MachineCodeEncoder
+{
+public:
+    ObjectSection sections[SECTION_COUNT] = {{".text", {}, 16}, {".rodata", {}, 8}, {".data", {}, 8}};
+    map<string, SymbolDefinition> symbols;
+    vector<string> symbolOrder;
+    unordered_set<string> globals;
+    vector<string> externs;
+    vector<Fixup> fixups;
+
+    void encode(const vector<AsmInstruction> &program)
+    {
+        current = SECTION_TEXT;
+        for (const auto &instr : program)
+        {
+            if (instr.kind == ASM_LABEL)
+                defineSymbol(instr.mnemonic);
+            else if (instr.kind == ASM_DIRECTIVE)
+                encodeDirective(instr.mnemonic);
+            else
+                encodeInstruction(instr);
+        }
+
+        for (const auto &fixup : fixups)
+        {
+            if (!symbols.count(fixup.symbol) && find(externs.begin(), externs.end(), fixup.symbol) == externs.end())
+            {
+                cerr << "Undefined symbol in generated code: " << fixup.symbol << endl;
+                exit(1);
+            }
+        }
+    }
+
+private:
+    int current = SECTION_TEXT;
+
+    struct Operand
+    {
+        enum Kind
+        {
+            REGISTER,
+            MEMORY,
+            IMMEDIATE,
+            LABEL
+        } kind;
+        int reg = -1;  // register number 0-15
+        int size = 0;  // register or memory size in bytes (16 for xmm), 0 if unknown
+        int base = -1; // memory operand: base and index register numbers, -1 if absent
+        int index = -1;
+        int scale = 1;
+        int64_t value = 0; // immediate or displacement
+        string symbol;     // [label] (rip relative) or jump target
+    };
+
+    vector<uint8_t> &out()
+    {
+        return sections[current].bytes;
+    }
+
+    void defineSymbol(const string &name)
+    {
+        if (symbols.count(name))
+        {
+            cerr << "Symbol defined twice in generated code: " << name << endl;
+            exit(1);
+        }
+        symbols[name] = {current, out().size()};
+        symbolOrder.push_back(name);
+    }
+
+    void byte(uint8_t value)
+    {
+        out().push_back(value);
+    }
+
+    void little(uint64_t value, int size)
+    {
+        for (int i = 0; i < size; i++)
+            out().push_back((uint8_t)(value >> (8 * i)));
+    }
+
+    void reference(const string &symbol, FixupKind kind, int64_t addend)
+    {
+        fixups.push_back({current, out().size(), symbol, kind, addend});
+        little(0, kind == FIXUP_REL32 ? 4 : 8);
+    }
+
+    [[noreturn]] static void unsupported(const string &what)
+    {
+        cerr << "Cannot encode: " << what << endl;
+        exit(1);
+    }
+
+    // ---- operands ----
+
+    static bool lookupRegister(const string &name, int &number, int &size)
+    {
+        static const map<string, pair<int, int>> registers = [] {
+            map<string, pair<int, int>> table;
+            const char *r32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"};
+            const char *r64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi"};
+            const char *r8[] = {"al", "cl", "dl", "bl"};
+            for (int i = 0; i < 8; i++)
+            {
+                table[r32[i]] = {i, 4};
+                table[r64[i]] = {i, 8};
+            }
+            for (int i = 0; i < 4; i++)
+                table[r8[i]] = {i, 1};
+            for (int i = 8; i < 16; i++)
+            {
+                table["r" + to_string(i) + "d"] = {i, 4};
+                table["r" + to_string(i)] = {i, 8};
+            }
+            for (int i = 0; i < 16; i++)
+                table["xmm" + to_string(i)] = {i, 16};
+            return table;
+        }();
+        auto it = registers.find(name);
+        if (it == registers.end())
+            return false;
+        number = it->second.first;
+        size = it->second.second;
+        return true;
+    }
+
+    static bool parseNumber(const string &text, int64_t &value)
+    {
+        if (text.empty())
+            return false;
+        size_t start = text[0] == '-' ? 1 : 0;
+        bool hexadecimal = text.compare(start, 2, "0x") == 0;
+        const char *digits = hexadecimal ? "0123456789abcdefABCDEF" : "0123456789";
+        size_t first = start + (hexadecimal ? 2 : 0);
+        if (first >= text.size() || text.find_first_not_of(digits, first) != string::npos)
+            return false;
+        value = (int64_t)stoull(text.substr(first), nullptr, hexadecimal ? 16 : 10);
+        if (start)
+            value = -value;
+        return true;
+    }
+
+    static string trim(const string &text)
+    {
+        size_t first = text.find_first_not_of(" \t\n");
+        if (first == string::npos)
+            return "";
+        return text.substr(first, text.find_last_not_of(" \t\n") - first + 1);
+    }
+
+    static Operand parseOperand(string text)
+    {
+        Operand op;
+        static const pair<const char *, int> sizes[] = {{"byte ", 1}, {"dword ", 4}, {"qword ", 8}};
+        for (const auto &prefix : sizes)
+        {
+            if (text.compare(0, strlen(prefix.first), prefix.first) == 0)
+            {
+                op.size = prefix.second;
+                text = text.substr(strlen(prefix.first));
+            }
+        }
+
+        if (text[0] != '[')
+        {
+            if (lookupRegister(text, op.reg, op.size))
+                op.kind = Operand::REGISTER;
+            else if (parseNumber(text, op.value))
+                op.kind = Operand::IMMEDIATE;
+            else
+            {
+                op.kind = Operand::LABEL;
+                op.symbol = text;
+            }
+            return op;
+        }
+
+        // [base + index*scale + disp], [base - disp] or [label]
+        op.kind = Operand::MEMORY;
+        string inside = text.substr(1, text.find(']') - 1);
+        size_t start = 0;
+        int sign = 1;
+        while (start < inside.size())
+        {
+            size_t end = inside.find_first_of("+-", start + 1);
+            if (end == string::npos)
+                end = inside.size();
+            string term = trim(inside.substr(start, end - start));
+            if (!term.empty() && (term[0] == '+' || term[0] == '-'))
+            {
+                sign = term[0] == '-' ? -1 : 1;
+                term = trim(term.substr(1));
+            }
+
+            int number, size;
+            int64_t value;
+            size_t star = term.find('*');
+            if (star != string::npos && lookupRegister(trim(term.substr(0, star)), number, size))
+            {
+                op.index = number;
+                op.scale = stoi(term.substr(star + 1));
+            }
+            else if (lookupRegister(term, number, size))
+            {
+                if (op.base == -1)
+                    op.base = number;
+                else
+                    op.index = number;
+            }
+            else if (parseNumber(term, value))
+                op.value += sign * value;
+            else
+                op.symbol = term;
+            start = end;
+            sign = 1;
+        }
+        return op;
+    }
+
+    // ---- encoding helpers ----
+
+    // REX prefix: W = 64-bit operand, R/X/B = high bit of the reg field, index and base/rm
+    void rex(bool w, int reg, int index, int rm)
+    {
+        uint8_t prefix = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((index & 8) ? 2 : 0) | ((rm & 8) ? 1 : 0);
+        if (prefix != 0x40)
+            byte(prefix);
+    }
+
+    void prefixes(bool w, int reg, const Operand &rm)
+    {
+        if (rm.kind == Operand::MEMORY)
+            rex(w, reg, max(rm.index, 0), max(rm.base, 0));
+        else
+            rex(w, reg, 0, rm.reg);
+    }
+
+    // ModRM (+ SIB + displacement) for `reg` and a register or memory operand; `trailing` is
+    // the number of immediate bytes that follow, needed for rip relative displacements
+    void modrm(int reg, const Operand &rm, int trailing = 0)
+    {
+        reg &= 7;
+        if (rm.kind == Operand::REGISTER)
+        {
+            byte(0xC0 | (reg << 3) | (rm.reg & 7));
+            return;
+        }
+        if (!rm.symbol.empty())
+        {
+            if (rm.base != -1 || rm.index != -1)
+                unsupported("label with a register in a memory operand");
+            byte(0x05 | (reg << 3));
+            reference(rm.symbol, FIXUP_REL32, rm.value - 4 - trailing);
+            return;
+        }
+        if (rm.base == -1)
+            unsupported("memory operand without a base register");
+
+        int mod = 2;
+        if (rm.value == 0 && (rm.base & 7) != 5)
+            mod = 0;
+        else if (rm.value >= -128 && rm.value <= 127)
+            mod = 1;
+
+        if (rm.index != -1 || (rm.base & 7) == 4)
+        {
+            int scaleBits = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+            byte((mod << 6) | (reg << 3) | 4);
+            byte((scaleBits << 6) | ((rm.index == -1 ? 4 : rm.index) & 7) << 3 | (rm.base & 7));
+        }
+        else
+        {
+            byte((mod << 6) | (reg << 3) | (rm.base & 7));
+        }
+        if (mod == 1)
+            little((uint64_t)rm.value, 1);
+        else if (mod == 2)
+            little((uint64_t)rm.value, 4);
+    }
+
+    // opcode bytes, then ModRM for reg + rm
+    void encodeRM(const vector<uint8_t> &opcode, bool w, int reg, const Operand &rm, int trailing = 0)
+    {
+        prefixes(w, reg, rm);
+        for (uint8_t b : opcode)
+            byte(b);
+        modrm(reg, rm, trailing);
+    }
+
+    // SSE instructions put their mandatory prefix (66/F2/F3) in front of REX
+    void encodeSSE(uint8_t prefix, uint8_t opcode, int reg, const Operand &rm, bool w = false, int trailing = 0)
+    {
+        if (prefix)
+            byte(prefix);
+        prefixes(w, reg, rm);
+        byte(0x0F);
+        byte(opcode);
+        modrm(reg, rm, trailing);
+    }
+
+    static int conditionCode(const string &cc)
+    {
+        static const map<string, int> codes = {
+            {"o", 0}, {"no", 1}, {"b", 2}, {"ae", 3}, {"e", 4}, {"ne", 5}, {"be", 6}, {"a", 7},
+            {"s", 8}, {"ns", 9}, {"p", 10}, {"np", 11}, {"l", 12}, {"ge", 13}, {"le", 14}, {"g", 15}};
+        auto it = codes.find(cc);
+        return it == codes.end() ? -1 : it->second;
+    }
+
+    static bool fitsInt8(int64_t value)
+    {
+        return value >= -128 && value <= 127;
+    }
+
+    // ---- instructions ----
+
+    void encodeInstruction(const AsmInstruction &instr)
+    {
+        const string &mn = instr.mnemonic;
+        vector<Operand> ops;
+        for (const auto &text : instr.operands)
+            ops.push_back(parseOperand(text));
+
+        static const map<string, int> alu = {{"add", 0}, {"or", 1}, {"and", 4}, {"sub", 5}, {"xor", 6}, {"cmp", 7}};
+        static const map<string, uint8_t> sseArithmetic = {{"add", 0x58}, {"mul", 0x59}, {"sub", 0x5C}, {"div", 0x5E}};
+        static const map<string, int> shifts = {{"shl", 4}, {"shr", 5}, {"sar", 7}};
+
+        if (mn == "syscall")
+        {
+            byte(0x0F);
+            byte(0x05);
+        }
+        else if (mn == "ret")
+            byte(0xC3);
+        else if (mn == "call" && ops.size() == 1 && ops[0].kind == Operand::LABEL)
+        {
+            byte(0xE8);
+            reference(ops[0].symbol, FIXUP_REL32, -4);
+        }
+        else if ((mn == "push" || mn == "pop") && ops.size() == 1 && ops[0].kind == Operand::REGISTER)
+        {
+            rex(false, 0, 0, ops[0].reg);
+            byte((mn == "push" ? 0x50 : 0x58) + (ops[0].reg & 7));
+        }
+        else if (mn == "cdq")
+            byte(0x99);
+        else if (mn == "jmp" && ops.size() == 1 && ops[0].kind == Operand::LABEL)
+        {
+            byte(0xE9);
+            reference(ops[0].symbol, FIXUP_REL32, -4);
+        }
+        else if (mn == "jmp" && ops.size() == 1)
+            encodeRM({0xFF}, false, 4, ops[0]);
+        else if (mn[0] == 'j' && ops.size() == 1 && conditionCode(mn.substr(1)) != -1)
+        {
+            byte(0x0F);
+            byte(0x80 + conditionCode(mn.substr(1)));
+            reference(ops[0].symbol, FIXUP_REL32, -4);
+        }
+        else if (mn.compare(0, 3, "set") == 0 && ops.size() == 1 && conditionCode(mn.substr(3)) != -1)
+            encodeRM({0x0F, (uint8_t)(0x90 + conditionCode(mn.substr(3)))}, false, 0, ops[0]);
+        else if (alu.count(mn) && ops.size() == 2)
+            encodeAlu(alu.at(mn), ops[0], ops[1], instr);
+        else if (mn == "test" && ops.size() == 2 && ops[1].kind == Operand::REGISTER)
+            encodeRM({0x85}, ops[1].size == 8, ops[1].reg, ops[0]);
+        else if (mn == "mov" && ops.size() == 2)
+            encodeMov(ops[0], ops[1], instr);
+        else if (mn == "lea" && ops.size() == 2 && ops[0].kind == Operand::REGISTER && ops[1].kind == Operand::MEMORY)
+            encodeRM({0x8D}, ops[0].size == 8, ops[0].reg, ops[1]);
+        else if (mn == "movzx" && ops.size() == 2 && ops[0].kind == Operand::REGISTER)
+            encodeRM({0x0F, 0xB6}, false, ops[0].reg, ops[1]);
+        else if (mn == "imul" && ops.size() == 3 && ops[0].kind == Operand::REGISTER && ops[2].kind == Operand::IMMEDIATE)
+        {
+            bool shortForm = fitsInt8(ops[2].value);
+            encodeRM({(uint8_t)(shortForm ? 0x6B : 0x69)}, ops[0].size == 8, ops[0].reg, ops[1], shortForm ? 1 : 4);
+            little((uint64_t)ops[2].value, shortForm ? 1 : 4);
+        }
+        else if (mn == "imul" && ops.size() == 1)
+            encodeRM({0xF7}, ops[0].size == 8, 5, ops[0]);
+        else if (mn == "neg" && ops.size() == 1)
+            encodeRM({0xF7}, ops[0].size == 8, 3, ops[0]);
+        else if (shifts.count(mn) && ops.size() == 2 && ops[1].kind == Operand::IMMEDIATE)
+        {
+            encodeRM({0xC1}, ops[0].size == 8, shifts.at(mn), ops[0], 1);
+            byte((uint8_t)ops[1].value);
+        }
+        else if (mn == "imul" && ops.size() == 2 && ops[0].kind == Operand::REGISTER)
+        {
+            if (ops[1].kind == Operand::IMMEDIATE)
+            {
+                bool shortForm = fitsInt8(ops[1].value);
+                encodeRM({(uint8_t)(shortForm ? 0x6B : 0x69)}, ops[0].size == 8, ops[0].reg, ops[0]);
+                little((uint64_t)ops[1].value, shortForm ? 1 : 4);
+            }
+            else
+                encodeRM({0x0F, 0xAF}, ops[0].size == 8, ops[0].reg, ops[1]);
+        }
+        else if (mn == "idiv" && ops.size() == 1)
+            encodeRM({0xF7}, ops[0].size == 8, 7, ops[0]);
+        else if (mn == "push" && ops.size() == 1 && ops[0].kind == Operand::IMMEDIATE)
+        {
+            bool shortForm = fitsInt8(ops[0].value);
+            byte(shortForm ? 0x6A : 0x68);
+            little((uint64_t)ops[0].value, shortForm ? 1 : 4);
+        }
+        else if ((mn == "movss" || mn == "movsd") && ops.size() == 2)
+        {
+            uint8_t prefix = mn == "movss" ? 0xF3 : 0xF2;
+            if (ops[0].kind == Operand::MEMORY)
+                encodeSSE(prefix, 0x11, ops[1].reg, ops[0]);
+            else
+                encodeSSE(prefix, 0x10, ops[0].reg, ops[1]);
+        }
+        else if (mn == "movaps" && ops.size() == 2)
+            encodeSSE(0, 0x28, ops[0].reg, ops[1]);
+        else if (mn == "movups" && ops.size() == 2)
+        {
+            if (ops[0].kind == Operand::MEMORY)
+                encodeSSE(0, 0x11, ops[1].reg, ops[0]);
+            else
+                encodeSSE(0, 0x10, ops[0].reg, ops[1]);
+        }
+        else if (mn.size() == 5 && sseArithmetic.count(mn.substr(0, 3)) && (mn.substr(3) == "ss" || mn.substr(3) == "sd"))
+            encodeSSE(mn[4] == 's' ? 0xF3 : 0xF2, sseArithmetic.at(mn.substr(0, 3)), ops[0].reg, ops[1]);
+        else if (mn.size() == 5 && sseArithmetic.count(mn.substr(0, 3)) && mn.substr(3) == "ps")
+            encodeSSE(0, sseArithmetic.at(mn.substr(0, 3)), ops[0].reg, ops[1]);
+        else if (mn == "paddd" || mn == "psubd")
+            encodeSSE(0x66, mn == "paddd" ? 0xFE : 0xFA, ops[0].reg, ops[1]);
+        else if ((mn == "shufps" || mn == "pshufd") && ops.size() == 3)
+        {
+            encodeSSE(mn == "shufps" ? 0 : 0x66, mn == "shufps" ? 0xC6 : 0x70, ops[0].reg, ops[1], false, 1);
+            byte((uint8_t)ops[2].value);
+        }
+        else if (mn == "movd" && ops.size() == 2 && ops[1].kind == Operand::REGISTER)
+            encodeSSE(0x66, 0x6E, ops[0].reg, ops[1]);
+        else if (mn == "ucomiss" || mn == "ucomisd")
+            encodeSSE(mn == "ucomisd" ? 0x66 : 0, 0x2E, ops[0].reg, ops[1]);
+        else if (mn == "cvtss2sd" || mn == "cvtsd2ss")
+            encodeSSE(mn == "cvtss2sd" ? 0xF3 : 0xF2, 0x5A, ops[0].reg, ops[1]);
+        else if (mn == "cvtsi2ss" || mn == "cvtsi2sd")
+            encodeSSE(mn == "cvtsi2ss" ? 0xF3 : 0xF2, 0x2A, ops[0].reg, ops[1]);
+        else if (mn == "cvttss2si" || mn == "cvttsd2si")
+            encodeSSE(mn == "cvttss2si" ? 0xF3 : 0xF2, 0x2C, ops[0].reg, ops[1]);
+        else
+            unsupported(instr.toString());
+    }
+
+    void encodeAlu(int digit, const Operand &dst, const Operand &src, const AsmInstruction &instr)
+    {
+        bool w = dst.size == 8 || src.size == 8;
+        if (src.kind == Operand::IMMEDIATE)
+        {
+            bool shortForm = fitsInt8(src.value);
+            int immediateSize = shortForm ? 1 : 4;
+            encodeRM({(uint8_t)(shortForm ? 0x83 : 0x81)}, w, digit, dst, immediateSize);
+            little((uint64_t)src.value, immediateSize);
+        }
+        else if (src.kind == Operand::REGISTER && src.size == 1)
+            encodeRM({(uint8_t)(digit * 8)}, false, src.reg, dst);
+        else if (src.kind == Operand::REGISTER)
+            encodeRM({(uint8_t)(digit * 8 + 1)}, w, src.reg, dst);
+        else if (dst.kind == Operand::REGISTER)
+            encodeRM({(uint8_t)(digit * 8 + 3)}, w, dst.reg, src);
+        else
+            unsupported(instr.toString());
+    }
+
+    void encodeMov(const Operand &dst, const Operand &src, const AsmInstruction &instr)
+    {
+        bool w = dst.size == 8 || src.size == 8;
+        if (src.kind == Operand::IMMEDIATE && dst.kind == Operand::REGISTER)
+        {
+            rex(false, 0, 0, dst.reg);
+            byte(0xB8 + (dst.reg & 7));
+            little((uint64_t)src.value, 4);
+        }
+        else if (src.kind == Operand::IMMEDIATE)
+        {
+            encodeRM({0xC7}, w, 0, dst, 4);
+            little((uint64_t)src.value, 4);
+        }
+        else if (src.kind == Operand::REGISTER)
+            encodeRM({0x89}, w, src.reg, dst);
+        else if (dst.kind == Operand::REGISTER)
+            encodeRM({0x8B}, w, dst.reg, src);
+        else
+            unsupported(instr.toString());
+    }
+
+    // ---- data ----
+
+    void encodeDirective(const string &line)
+    {
+        string text = trim(line);
+        if (text.empty() || text == "bits 64" || text == "default rel")
+            return;
+        if (text.compare(0, 8, "section ") == 0)
+        {
+            string name = trim(text.substr(8));
+            for (int i = 0; i < SECTION_COUNT; i++)
+            {
+                if (sections[i].name == name)
+                    current = i;
+            }
+            return;
+        }
+        if (text.compare(0, 7, "global ") == 0)
+        {
+            globals.insert(trim(text.substr(7)));
+            return;
+        }
+        if (text.compare(0, 7, "extern ") == 0)
+        {
+            externs.push_back(trim(text.substr(7)));
+            return;
+        }
+        if (text.compare(0, 6, "align ") == 0)
+        {
+            size_t alignment = stoul(text.substr(6));
+            sections[current].alignment = max(sections[current].alignment, alignment);
+            while (out().size() % alignment)
+                byte(current == SECTION_TEXT ? 0x90 : 0);
+            return;
+        }
+
+        // [label:] name dX items  or  label: dX items  or  name times N dX items
+        istringstream iss(text);
+        string name, directive;
+        iss >> name >> directive;
+        if (name.back() == ':')
+            name.pop_back();
+        int repeat = 1;
+        if (directive == "times")
+        {
+            iss >> repeat >> directive;
+        }
+        static const map<string, int> widths = {{"db", 1}, {"dd", 4}, {"dq", 8}};
+        if (!widths.count(directive) || repeat < 1)
+            unsupported(text);
+        defineSymbol(name);
+        string items;
+        getline(iss, items);
+        for (int i = 0; i < repeat; i++)
+            encodeData(widths.at(directive), items);
+    }
+
+    // Comma separated numbers, "strings" and (for dq) label addresses, up to a `;` comment
+    void encodeData(int width, const string &items)
+    {
+        size_t i = 0;
+        while (i < items.size())
+        {
+            while (i < items.size() && (items[i] == ' ' || items[i] == ','))
+                i++;
+            if (i >= items.size() || items[i] == ';')
+                break;
+            if (items[i] == '"')
+            {
+                size_t close = items.find('"', i + 1);
+                for (size_t c = i + 1; c < close; c++)
+                    byte((uint8_t)items[c]);
+                i = close + 1;
+                continue;
+            }
+            size_t end = items.find_first_of(",;", i);
+            if (end == string::npos)
+                end = items.size();
+            string item = trim(items.substr(i, end - i));
+            int64_t value;
+            if (parseNumber(item, value))
+                little((uint64_t)value, width);
+            else if (width == 8)
+                reference(item, FIXUP_ABS64, 0);
+            else
+                unsupported("data item " + item);
+            i = end;
+        }
+    }
+};
+
+/*
+    ElfWriter:
+
+    Writes the sections of a MachineCodeEncoder as an ELF64 file for x86-64 Linux, either
+       - a relocatable object (`.o`) for linking with other code: references that stay inside
+         their own section are resolved here, all others become R_X86_64_PC32 / R_X86_64_64
+         relocations against the section they point into, or
+       - a static executable: .text, .rodata and .data get their own page-aligned PT_LOAD segment
+         (r-x, r--, rw-) starting at 0x400000, every fixup is resolved and the entry point is _start.
+         Extern symbols cannot be resolved here, so a program that uses cout/cin needs the object
+         file route, linked with the runtime in runtime.c (see there for the command), or --run.
+    Both carry a symbol table so objdump and gdb show the labels.
+*/
+class ElfWriter
+{
+public:
+    ElfWriter(MachineCodeEncoder &encoder) : encoder(encoder) {}
+
+    bool writeObject(const string &filename)
+    {
+        vector<uint64_t> addresses(SECTION_COUNT, 0);
+        vector<vector<uint8_t>> relocations(SECTION_COUNT);
+        size_t firstExtern = 1 + SECTION_COUNT + encoder.symbolOrder.size();
+        for (const auto &fixup : encoder.fixups)
+        {
+            if (!encoder.symbols.count(fixup.symbol))
+            {
+                // Call to an extern function: R_X86_64_PLT32 against its undefined symbol
+                size_t index = find(encoder.externs.begin(), encoder.externs.end(), fixup.symbol) - encoder.externs.begin();
+                vector<uint8_t> &rela = relocations[fixup.section];
+                put(rela, fixup.offset, 8);
+                put(rela, ((uint64_t)(firstExtern + index) << 32) | 4, 8);
+                put(rela, (uint64_t)fixup.addend, 8);
+                continue;
+            }
+            const SymbolDefinition &target = encoder.symbols.at(fixup.symbol);
+            if (fixup.kind == FIXUP_REL32 && target.section == fixup.section)
+            {
+                patch(fixup, (int64_t)target.offset + fixup.addend - (int64_t)fixup.offset);
+                continue;
+            }
+            // Relocate against the section symbol, as assemblers do for local labels
+            vector<uint8_t> &rela = relocations[fixup.section];
+            put(rela, fixup.offset, 8);
+            put(rela, ((uint64_t)(1 + target.section) << 32) | (fixup.kind == FIXUP_REL32 ? 2 : 1), 8);
+            put(rela, (uint64_t)((int64_t)target.offset + fixup.addend), 8);
+        }
+
+        vector<Section> sections = contentSections(addresses);
+        for (int s = 0; s < SECTION_COUNT; s++)
+        {
+            if (relocations[s].empty())
+                continue;
+            Section rela{".rela" + encoder.sections[s].name, 4, 0x40, relocations[s], 0, 8, 24};
+            rela.link = -1; // patched to the symbol table below
+            rela.info = 1 + s;
+            sections.push_back(rela);
+        }
+        // Empty: the program does not need an executable stack
+        sections.push_back({".note.GNU-stack", 1, 0, {}, 0, 1, 0});
+        addSymbolTables(sections, addresses);
+        return writeFile(filename, 1, 0, sections, {});
+    }
+
+    bool writeExecutable(const string &filename)
+    {
+        const uint64_t base = 0x400000;
+        vector<uint64_t> addresses(SECTION_COUNT);
+        vector<uint64_t> offsets(SECTION_COUNT);
+        uint64_t offset = pageSize;
+        for (int s = 0; s < SECTION_COUNT; s++)
+        {
+            offsets[s] = offset;
+            addresses[s] = base + offset;
+            offset = alignUp(offset + encoder.sections[s].bytes.size(), pageSize);
+        }
+
+        for (const auto &fixup : encoder.fixups)
+        {
+            if (!encoder.symbols.count(fixup.symbol))
+            {
+                cerr << "Error: " << fixup.symbol << " is provided by the runtime; use --emit=obj and link assembly.o with runtime.c"
+                     << " (cc -nostartfiles -no-pie -o program assembly.o runtime.c), or --run" << endl;
+                return false;
+            }
+            const SymbolDefinition &target = encoder.symbols.at(fixup.symbol);
+            int64_t value = (int64_t)(addresses[target.section] + target.offset) + fixup.addend;
+            if (fixup.kind == FIXUP_REL32)
+                value -= (int64_t)(addresses[fixup.section] + fixup.offset);
+            patch(fixup, value);
+        }
+
+        if (!encoder.symbols.count("_start"))
+        {
+            cerr << "Error: no _start symbol to use as the entry point" << endl;
+            return false;
+        }
+        const SymbolDefinition &start = encoder.symbols.at("_start");
+
+        vector<Segment> segments;
+        static const uint32_t flags[SECTION_COUNT] = {5, 4, 6}; // r-x, r--, rw-
+        for (int s = 0; s < SECTION_COUNT; s++)
+        {
+            if (!encoder.sections[s].bytes.empty())
+                segments.push_back({flags[s], offsets[s], addresses[s], encoder.sections[s].bytes.size()});
+        }
+
+        vector<Section> sections = contentSections(addresses);
+        for (int s = 0; s < SECTION_COUNT; s++)
+            sections[s].fileOffset = offsets[s];
+        addSymbolTables(sections, addresses);
+        return writeFile(filename, 2, addresses[start.section] + start.offset, sections, segments);
+    }
+
+private:
+    static const uint64_t pageSize = 0x1000;
+    MachineCodeEncoder &encoder;
+
+    struct Section
+    {
+        string name;
+        uint32_t type;
+        uint64_t flags;
+        vector<uint8_t> bytes;
+        uint64_t address;
+        uint64_t alignment;
+        uint64_t entrySize;
+        int link = 0;
+        uint32_t info = 0;
+        uint64_t fileOffset = 0; // 0: placed after the previous section
+    };
+
+    struct Segment
+    {
+        uint32_t flags;
+        uint64_t offset;
+        uint64_t address;
+        uint64_t size;
+    };
+
+    static void put(vector<uint8_t> &out, uint64_t value, int size)
+    {
+        for (int i = 0; i < size; i++)
+            out.push_back((uint8_t)(value >> (8 * i)));
+    }
+
+    static uint64_t alignUp(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    void patch(const Fixup &fixup, int64_t value)
+    {
+        vector<uint8_t> &bytes = encoder.sections[fixup.section].bytes;
+        int size = fixup.kind == FIXUP_REL32 ? 4 : 8;
+        if (size == 4 && (value < INT32_MIN || value > INT32_MAX))
+        {
+            cerr << "Error: reference to " << fixup.symbol << " is out of range" << endl;
+            exit(1);
+        }
+        for (int i = 0; i < size; i++)
+            bytes[fixup.offset + i] = (uint8_t)((uint64_t)value >> (8 * i));
+    }
+
+    // Symbols in definition order, local ones before the globals as ELF requires
+    vector<string> localsFirst() const
+    {
+        vector<string> names;
+        for (const auto &name : encoder.symbolOrder)
+        {
+            if (!encoder.globals.count(name))
+                names.push_back(name);
+        }
+        for (const auto &name : encoder.symbolOrder)
+        {
+            if (encoder.globals.count(name))
+                names.push_back(name);
+        }
+        return names;
+    }
+
+    vector<Section> contentSections(const vector<uint64_t> &addresses)
+    {
+        static const uint64_t flags[SECTION_COUNT] = {6, 2, 3}; // alloc+exec, alloc, alloc+write
+        vector<Section> sections;
+        for (int s = 0; s < SECTION_COUNT; s++)
+        {
+            const ObjectSection &section = encoder.sections[s];
+            sections.push_back({section.name, 1, flags[s], section.bytes, addresses[s], section.alignment, 0});
+        }
+        return sections;
+    }
+
+    // .symtab (null, one per content section, then every label) and its .strtab
+    void addSymbolTables(vector<Section> &sections, const vector<uint64_t> &addresses)
+    {
+        vector<string> names = localsFirst();
+        vector<uint8_t> symtab(24, 0), strtab(1, 0);
+        for (int s = 0; s < SECTION_COUNT; s++)
+        {
+            put(symtab, 0, 4);
+            put(symtab, 3, 1); // STB_LOCAL, STT_SECTION
+            put(symtab, 0, 1);
+            put(symtab, 1 + s, 2);
+            put(symtab, addresses[s], 8);
+            put(symtab, 0, 8);
+        }
+
+        uint32_t firstGlobal = 1 + SECTION_COUNT;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            const SymbolDefinition &symbol = encoder.symbols.at(names[i]);
+            bool global = encoder.globals.count(names[i]) > 0;
+            if (!global)
+                firstGlobal++;
+            put(symtab, strtab.size(), 4);
+            put(symtab, global ? 0x10 : 0, 1); // STB_GLOBAL / STB_LOCAL, STT_NOTYPE
+            put(symtab, 0, 1);
+            put(symtab, 1 + symbol.section, 2);
+            put(symtab, addresses[symbol.section] + symbol.offset, 8);
+            put(symtab, 0, 8);
+            strtab.insert(strtab.end(), names[i].begin(), names[i].end());
+            strtab.push_back(0);
+        }
+        for (const auto &name : encoder.externs)
+        {
+            put(symtab, strtab.size(), 4);
+            put(symtab, 0x10, 1); // STB_GLOBAL, undefined
+            put(symtab, 0, 1);
+            put(symtab, 0, 2);
+            put(symtab, 0, 8);
+            put(symtab, 0, 8);
+            strtab.insert(strtab.end(), name.begin(), name.end());
+            strtab.push_back(0);
+        }
+
+        int symtabIndex = (int)sections.size() + 1;
+        for (auto &section : sections)
+        {
+            if (section.link == -1)
+                section.link = symtabIndex;
+        }
+        Section symbols{".symtab", 2, 0, symtab, 0, 8, 24};
+        symbols.link = symtabIndex + 1;
+        symbols.info = firstGlobal;
+        sections.push_back(symbols);
+        sections.push_back({".strtab", 3, 0, strtab, 0, 1, 0});
+    }
+
+    bool writeFile(const string &filename, uint16_t type, uint64_t entry,
+                   vector<Section> sections, const vector<Segment> &segments)
+    {
+        // Section names
+        vector<uint8_t> shstrtab(1, 0);
+        vector<uint32_t> nameOffsets;
+        sections.push_back({".shstrtab", 3, 0, {}, 0, 1, 0});
+        for (const auto &section : sections)
+        {
+            nameOffsets.push_back((uint32_t)shstrtab.size());
+            shstrtab.insert(shstrtab.end(), section.name.begin(), section.name.end());
+            shstrtab.push_back(0);
+        }
+        sections.back().bytes = shstrtab;
+
+        // File layout: ELF header, program headers, section contents, section headers
+        uint64_t offset = 64 + 56 * segments.size();
+        for (auto &section : sections)
+        {
+            if (section.fileOffset == 0)
+                section.fileOffset = alignUp(offset, max<uint64_t>(section.alignment, 1));
+            offset = max(offset, section.fileOffset + section.bytes.size());
+        }
+        uint64_t sectionHeaders = alignUp(offset, 8);
+
+        vector<uint8_t> file;
+        const uint8_t ident[16] = {0x7F, 'E', 'L', 'F', 2, 1, 1, 0};
+        file.insert(file.end(), ident, ident + 16);
+        put(file, type, 2);
+        put(file, 62, 2); // EM_X86_64
+        put(file, 1, 4);
+        put(file, entry, 8);
+        put(file, segments.empty() ? 0 : 64, 8);
+        put(file, sectionHeaders, 8);
+        put(file, 0, 4);
+        put(file, 64, 2);
+        put(file, 56, 2);
+        put(file, segments.size(), 2);
+        put(file, 64, 2);
+        put(file, sections.size() + 1, 2);
+        put(file, sections.size(), 2); // .shstrtab is the last section
+
+        for (const auto &segment : segments)
+        {
+            put(file, 1, 4); // PT_LOAD
+            put(file, segment.flags, 4);
+            put(file, segment.offset, 8);
+            put(file, segment.address, 8);
+            put(file, segment.address, 8);
+            put(file, segment.size, 8);
+            put(file, segment.size, 8);
+            put(file, pageSize, 8);
+        }
+
+        for (const auto &section : sections)
+        {
+            file.resize(section.fileOffset, 0);
+            file.insert(file.end(), section.bytes.begin(), section.bytes.end());
+        }
+        file.resize(sectionHeaders, 0);
+
+        file.resize(file.size() + 64, 0); // null section header
+        for (size_t i = 0; i < sections.size(); i++)
+        {
+            const Section &section = sections[i];
+            put(file, nameOffsets[i], 4);
+            put(file, section.type, 4);
+            put(file, section.flags, 8);
+            put(file, section.address, 8);
+            put(file, section.fileOffset, 8);
+            put(file, section.bytes.size(), 8);
+            put(file, section.link, 4);
+            put(file, section.info, 4);
+            put(file, section.alignment, 8);
+            put(file, section.entrySize, 8);
+        }
+
+        ofstream outFile(filename, ios::binary);
+        if (!outFile.is_open())
+        {
+            cerr << "Error: Unable to open " << filename << " for writing!" << endl;
+            return false;
+        }
+        outFile.write((const char *)file.data(), file.size());
+        outFile.close();
+        if (type == 2)
+            chmod(filename.c_str(), 0755);
+        cout << "Generated " << (type == 2 ? "executable" : "object file") << " is saved to file: " << filename << endl;
+        return true;
+    }
+};
+
+/*
+    JitExecutor:
+
+    Runs a program inside the compiler process (--run). The encoded sections are copied into
+    one anonymous mapping laid out like the executable (code, then read-only data, then variables,
+    each on its own pages) and every fixup is resolved against the real addresses. The runtime
+    functions that `print` / `read` call are small C++ functions bound through a jump thunk
+    (`jmp [rip + 0]` followed by the address) at the end of the code. Once everything is written the
+    code pages become read+execute and the constant pages read-only, so no page is ever writable
+    and executable at the same time. _start must have been generated with returnToCaller so it can
+    be called like a function.
+*/
+class JitExecutor
+{
+public:
+    JitExecutor(MachineCodeEncoder &encoder) : encoder(encoder) {}
+
+    ~JitExecutor()
+    {
+        if (memory != MAP_FAILED)
+            munmap(memory, mappedSize);
+    }
+
+    bool load()
+    {
+        const size_t thunkSize = 14;
+        size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        size_t codeSize = encoder.sections[SECTION_TEXT].bytes.size() + thunkSize * encoder.externs.size();
+
+        size_t sizes[SECTION_COUNT] = {codeSize, encoder.sections[SECTION_RODATA].bytes.size(),
+                                       encoder.sections[SECTION_DATA].bytes.size()};
+        size_t offsets[SECTION_COUNT];
+        mappedSize = 0;
+        for (int s = 0; s < SECTION_COUNT; s++)
+        {
+            offsets[s] = mappedSize;
+            mappedSize += (sizes[s] + pageSize - 1) / pageSize * pageSize;
+        }
+
+        memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            cerr << "Error: cannot map memory for the JIT" << endl;
+            return false;
+        }
+        uint8_t *base = (uint8_t *)memory;
+        for (int s = 0; s < SECTION_COUNT; s++)
+        {
+            const vector<uint8_t> &bytes = encoder.sections[s].bytes;
+            copy(bytes.begin(), bytes.end(), base + offsets[s]);
+        }
+
+        // Runtime thunks: jmp [rip + 0] / dq address
+        map<string, uint8_t *> externAddress;
+        uint8_t *thunk = base + encoder.sections[SECTION_TEXT].bytes.size();
+        for (const auto &name : encoder.externs)
+        {
+            auto function = runtimeFunctions().find(name);
+            if (function == runtimeFunctions().end())
+            {
+                cerr << "Error: unknown runtime function " << name << endl;
+                return false;
+            }
+            const uint8_t jump[6] = {0xFF, 0x25, 0, 0, 0, 0};
+            copy(jump, jump + 6, thunk);
+            uint64_t address = (uint64_t)function->second;
+            memcpy(thunk + 6, &address, 8);
+            externAddress[name] = thunk;
+            thunk += thunkSize;
+        }
+
+        for (const auto &fixup : encoder.fixups)
+        {
+            uint8_t *target;
+            if (encoder.symbols.count(fixup.symbol))
+            {
+                const SymbolDefinition &symbol = encoder.symbols.at(fixup.symbol);
+                target = base + offsets[symbol.section] + symbol.offset;
+            }
+            else
+                target = externAddress.at(fixup.symbol);
+            uint8_t *field = base + offsets[fixup.section] + fixup.offset;
+            if (fixup.kind == FIXUP_REL32)
+            {
+                int32_t value = (int32_t)(target + fixup.addend - field);
+                memcpy(field, &value, 4);
+            }
+            else
+            {
+                uint64_t value = (uint64_t)(target + fixup.addend);
+                memcpy(field, &value, 8);
+            }
+        }
+
+        if (!encoder.symbols.count("_start"))
+        {
+            cerr << "Error: no _start symbol to run" << endl;
+            return false;
+        }
+        entry = base + offsets[SECTION_TEXT] + encoder.symbols.at("_start").offset;
+        data = base + offsets[SECTION_DATA];
+        initialData.assign(data, data + sizes[SECTION_DATA]);
+
+        // W^X: code becomes executable only after it is no longer writable
+        if (mprotect(base + offsets[SECTION_TEXT], offsets[SECTION_RODATA] - offsets[SECTION_TEXT], PROT_READ | PROT_EXEC) != 0 ||
+            (offsets[SECTION_DATA] > offsets[SECTION_RODATA] &&
+             mprotect(base + offsets[SECTION_RODATA], offsets[SECTION_DATA] - offsets[SECTION_RODATA], PROT_READ) != 0))
+        {
+            cerr << "Error: cannot protect JIT memory" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Each run starts from the initial `.data`, so the program can be run more than once
+    void run(istream &in = cin, ostream &out = cout)
+    {
+        copy(initialData.begin(), initialData.end(), data);
+        input = &in;
+        output = &out;
+        ((void (*)())entry)();
+        out.flush();
+        input = &cin;
+        output = &cout;
+    }
+
+private:
+    MachineCodeEncoder &encoder;
+    void *memory = MAP_FAILED;
+    size_t mappedSize = 0;
+    uint8_t *entry = nullptr;
+    uint8_t *data = nullptr;
+    vector<uint8_t> initialData;
+
+    // The streams of the program that is running
+    static inline istream *input = &cin;
+    static inline ostream *output = &cout;
+
+    static void printInt(int value) { *output << value; }
+    static void printDouble(double value) { *output << value; }
+    static void printString(const char *value) { *output << (value ? value : ""); }
+
+    static int readInt()
+    {
+        int value = 0;
+        *input >> value;
+        return value;
+    }
+
+    static double readDouble()
+    {
+        double value = 0;
+        *input >> value;
+        return value;
+    }
+
+    // Strings read by the program stay alive until the compiler exits
+    static const char *readString()
+    {
+        static deque<string> strings;
+        strings.emplace_back();
+        *input >> strings.back();
+        return strings.back().c_str();
+    }
+
+    static const map<string, void *> &runtimeFunctions()
+    {
+        static const map<string, void *> functions = {
+            {"rt_print_int", (void *)&printInt},
+            {"rt_print_double", (void *)&printDouble},
+            {"rt_print_string", (void *)&printString},
+            {"rt_read_int", (void *)&readInt},
+            {"rt_read_double", (void *)&readDouble},
+            {"rt_read_string", (void *)&readString}};
+        return functions;
+    }
+};
+
+/*
+    Bytecode:
+
+    A compact register based form of the TAC that the interpreter runs (--vm). All values live in
+    one flat array of 8-byte slots: one per variable, one per distinct constant (already converted
+    to the type it is used as) and three scratch slots. An instruction is an opcode and up to three
+    operands, which are slot numbers unless noted:
+       ADD_I a b c       s[a].i = s[b].i + s[c].i       (ADD_F / ADD_D for float / double)
+       LT_D a b c        s[a].i = s[b].d < s[c].d
+       AND a b c         s[a].i = s[b].i && s[c].i
+       I2D a b           s[a].d = s[b].i                (and the other conversions)
+       JUMP a            continue at instruction a
+       JUMP_IF a b       continue at instruction a when s[b].i is not 0 (JUMP_IF_NOT: when it is)
+       JLT_I a b c       continue at instruction a when s[b].i < s[c].i
+       SWITCH a b c      jump through table c with index s[a].i - b; the last entry is the default
+       PRINT_S a         print the string s[a].s        (READ_S a reads one word into s[a].s)
+       LOAD a b c        s[a] = element s[c].i of array b
+       STORE a b c       element s[c].i of array a = s[b]
+       HALT              end of the program (also what `return` in the main program becomes)
+       CALL a            call site a: copy its argument slots into the parameters and jump to the function
+       RET a b           s[b] = s[a] (no value when a is -1) and continue after the call
+       COUNT a           s[a].n += 1, a label counter (only in instrumented programs)
+    Every operation is typed when the bytecode is built, so the interpreter never looks at a type,
+    and every jump target is already resolved to an instruction number. An array is a run of
+    consecutive slots; LOAD and STORE check the index against its size.
+    ADD_I, SUB_I and MUL_I wrap around on overflow like the native code does. DIV_I stops the
+    program with a runtime error on a zero divisor and on INT_MIN / -1, where idiv traps.
+    Typed families are laid out int, float, double (, string) so that the opcode for a ValueType is
+    the int opcode plus the type.
+*/
+#define BYTECODE_OPCODES(X)                                                 \
+    X(MOVE) X(I2F) X(I2D) X(F2I) X(F2D) X(D2I) X(D2F)                       \
+    X(ADD_I) X(ADD_F) X(ADD_D) X(SUB_I) X(SUB_F) X(SUB_D)                   \
+    X(MUL_I) X(MUL_F) X(MUL_D) X(DIV_I) X(DIV_F) X(DIV_D)                   \
+    X(LT_I) X(LT_F) X(LT_D) X(LE_I) X(LE_F) X(LE_D) X(GT_I) X(GT_F) X(GT_D) \
+    X(GE_I) X(GE_F) X(GE_D) X(EQ_I) X(EQ_F) X(EQ_D) X(NE_I) X(NE_F) X(NE_D) \
+    X(AND) X(OR) X(JUMP) X(JUMP_IF) X(JUMP_IF_NOT)                          \
+    X(JLT_I) X(JLE_I) X(JGT_I) X(JGE_I) X(JEQ_I) X(JNE_I) X(SWITCH)         \
+    X(PRINT_I) X(PRINT_F) X(PRINT_D) X(PRINT_S)                             \
+    X(READ_I) X(READ_F) X(READ_D) X(READ_S) X(LOAD) X(STORE) X(HALT)       \
+    X(CALL) X(RET) X(COUNT)
+
+enum Opcode : uint8_t
+{
+#define BYTECODE_ENUM(name) OP_##name,
+    BYTECODE_OPCODES(BYTECODE_ENUM)
+#undef BYTECODE_ENUM
+        OPCODE_COUNT
+};
+
+struct BytecodeInstruction
+{
+    Opcode opcode;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+};
+
+union VmValue
+{
+    int32_t i;
+    float f;
+    double d;
+    const char *s;
+    int64_t n;
+};
+
+struct VmArray
+{
+    string name;
+    int32_t first; // slot of element 0
+    int32_t size;
+};
+
+/*
+    Parameters and locals have fixed slots like globals. A function that can recurse lists all of
+    them (and its temps) in `frame`: CALL pushes their values on a stack and RET puts them back,
+    so an inner call cannot overwrite the values of an outer one.
+*/
+struct VmFunction
+{
+    int32_t entry = 0;
+    vector<int32_t> params;
+    vector<int32_t> frame;
+};
+
+struct VmCallSite
+{
+    int32_t function;
+    vector<int32_t> args; // already converted to the parameter types
+};
+
+struct BytecodeProgram
+{
+    vector<BytecodeInstruction> code;
+    vector<VmFunction> functions;
+    vector<VmCallSite> callSites;
+    vector<VmArray> arrays;
+    vector<VmValue> initialSlots;     // variables are 0, constants hold their value
+    vector<vector<int32_t>> jumpTables; // instruction numbers, default last
+    deque<string> strings;              // string constants (a deque never moves its elements)
+    vector<pair<string, int32_t>> labelCounters; // label -> slot of its COUNT (instrumented only)
+};
+
+/*
+    BytecodeCompiler:
+
+    Builds a BytecodeProgram from the TAC. Types come from TypeInference, with the same rules as the
+    AssemblyCodeGenerator: operands are converted to the wider type, stores into int variables
+    truncate. Constants are converted while compiling, so `f = f * 2` on a float multiplies by a
+    float 2.0 slot; a variable of another type is converted into a scratch slot first.
+    A comparison whose temp only feeds the next branch becomes one compare-and-jump instruction
+    (JLT_I ...) for ints, and a compare into a scratch slot followed by JUMP_IF for floating point.
+    A `vector N` instruction is compiled N times, once per lane: a vector temp has N slots, the
+    element index is offset by the lane and single values are used by every lane.
+    Arguments are converted to the parameter types before a CALL; its result arrives in the
+    `$return` slot and is converted to the type of the temp it is stored into.
+    With `instrument` set every label is followed by a COUNT of its own slot (--instrument).
+*/
+class BytecodeCompiler
+{
+public:
+    BytecodeProgram program;
+    bool instrument = false;
+
+    BytecodeCompiler(SymbolTable &symTable) : symTable(symTable), types(symTable) {}
+
+    void compile(const vector<string> &tacInstructions)
+    {
+        vector<TacInstruction> code;
+        code.reserve(tacInstructions.size());
+        for (const auto &instr : tacInstructions)
+            code.push_back(TacInstruction::parse(instr));
+        types.infer(code);
+        callGraph.build(code);
+        program.functions.resize(callGraph.functions.size() - 1);
+
+        map<string, int> useCount;
+        for (const auto &instr : code)
+        {
+            for (const auto &used : instr.uses())
+                useCount[used]++;
+            if (instr.lanes > 1 && instr.definesVariable())
+                vectorLanes[instr.result] = instr.lanes;
+        }
+
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            const TacInstruction &instr = code[i];
+            if (i + 1 < code.size() && isFusedCompare(instr, code[i + 1], useCount))
+            {
+                const TacInstruction &branch = code[++i];
+                compileCompareBranch(instr.arg1, instr.op, instr.arg2, branch.kind == TAC_IF_FALSE, branch.result);
+            }
+            else if (instr.lanes > 1)
+            {
+                TacInstruction scalar = instr;
+                scalar.lanes = 1;
+                for (lane = 0; lane < instr.lanes; lane++)
+                    compileInstruction(scalar);
+                lane = 0;
+            }
+            else
+            {
+                compileInstruction(instr);
+            }
+        }
+        emit(OP_HALT);
+        resolveLabels();
+        for (size_t f = 1; f < callGraph.functions.size(); f++)
+            buildFrame(code, callGraph.functions[f], program.functions[f - 1]);
+    }
+
+private:
+    SymbolTable &symTable;
+    TypeInference types;
+    CallGraph callGraph;
+    string currentFunction;      // function being compiled, empty in the main program
+    map<string, int32_t> slots;  // variable name, "#type:literal" or "$scratch" -> slot
+    map<string, int32_t> arrays; // array name -> index in program.arrays
+    map<string, int> vectorLanes; // temps defined by `vector N` instructions -> N
+    int lane = 0;                // lane of the vector instruction being compiled
+    map<string, int32_t> labels; // TAC label -> instruction number
+    vector<pair<size_t, string>> jumpPatches;               // instruction whose `a` is a label
+    vector<pair<pair<size_t, size_t>, string>> tablePatches; // (table, entry) holding a label
+
+    // Relational operators in the order of the LT, LE, GT, GE, EQ, NE opcode families
+    static int relation(const string &op)
+    {
+        static const vector<string> order = {"<", "<=", ">", ">=", "==", "!="};
+        auto it = find(order.begin(), order.end(), op);
+        return it == order.end() ? -1 : (int)(it - order.begin());
+    }
+
+    static bool isFusedCompare(const TacInstruction &compare, const TacInstruction &branch, map<string, int> &useCount)
+    {
+        return compare.kind == TAC_BINARY && compare.lanes == 1 && relation(compare.op) >= 0 &&
+               (branch.kind == TAC_IF || branch.kind == TAC_IF_FALSE) && branch.op.empty() &&
+               branch.arg1 == compare.result && isCompilerVariable(compare.result) &&
+               useCount[compare.result] == 1;
+    }
+
+    void compileInstruction(const TacInstruction &instr)
+    {
+        if (instr.kind == TAC_COPY)
+        {
+            compileCopy(instr);
+        }
+        else if (instr.kind == TAC_BINARY)
+        {
+            compileBinary(instr);
+        }
+        else if (instr.kind == TAC_LOAD)
+        {
+            ValueType type = types.typeOf(instr.arg1);
+            int32_t index = elementIndex(instr.arg2);
+            int32_t result = destination(instr.result, type);
+            emit(OP_LOAD, result, array(instr.arg1), index);
+            store(instr.result, type, result);
+        }
+        else if (instr.kind == TAC_STORE)
+        {
+            int32_t value = operand(instr.arg1, types.typeOf(instr.result), 0);
+            emit(OP_STORE, array(instr.result), value, elementIndex(instr.arg2));
+        }
+        else if (instr.kind == TAC_IF || instr.kind == TAC_IF_FALSE)
+        {
+            compileConditional(instr);
+        }
+        else if (instr.kind == TAC_GOTO)
+        {
+            emitJump(OP_JUMP, instr.result);
+        }
+        else if (instr.kind == TAC_LABEL)
+        {
+            labels[instr.result] = (int32_t)program.code.size();
+            if (instrument)
+            {
+                int32_t counter = newSlot("#count:" + instr.result, VmValue{});
+                program.labelCounters.push_back({instr.result, counter});
+                emit(OP_COUNT, counter);
+            }
+        }
+        else if (instr.kind == TAC_JUMP_TABLE)
+        {
+            compileJumpTable(instr);
+        }
+        else if (instr.kind == TAC_PRINT)
+        {
+            ValueType type = types.typeOf(instr.arg1);
+            emit(Opcode(OP_PRINT_I + type), operand(instr.arg1, type, 0));
+        }
+        else if (instr.kind == TAC_READ)
+        {
+            emit(Opcode(OP_READ_I + types.typeOf(instr.result)), variable(instr.result));
+        }
+        else if (instr.kind == TAC_FUNCTION)
+        {
+            currentFunction = instr.result;
+            VmFunction &function = program.functions[functionIndex(instr.result)];
+            function.entry = (int32_t)program.code.size();
+            for (const auto &param : instr.targets)
+                function.params.push_back(variable(param));
+        }
+        else if (instr.kind == TAC_CALL)
+        {
+            compileCall(instr);
+        }
+        else if (instr.kind == TAC_RETURN && !currentFunction.empty())
+        {
+            int32_t value = instr.arg1.empty() ? -1 : operand(instr.arg1, types.returnType(currentFunction), 0);
+            emit(OP_RET, value, variable("$return"));
+        }
+        else if (instr.kind == TAC_RETURN)
+        {
+            emit(OP_HALT);
+        }
+        else if (!instr.text.empty())
+        {
+            cerr << "Unsupported TAC instruction: " << instr.text << endl;
+        }
+    }
+
+    int32_t functionIndex(const string &name)
+    {
+        for (size_t f = 1; f < callGraph.functions.size(); f++)
+        {
+            if (callGraph.functions[f].name == name)
+                return (int32_t)f - 1;
+        }
+        cerr << "Error: call to undefined function " << name << endl;
+        exit(1);
+    }
+
+    void compileCall(const TacInstruction &instr)
+    {
+        const FunctionInfo *callee = callGraph.find(instr.arg1);
+        VmCallSite site{functionIndex(instr.arg1), {}};
+        if (callee->params.size() != instr.targets.size())
+        {
+            cerr << "Error: wrong number of arguments in " << instr.text << endl;
+            exit(1);
+        }
+        for (size_t k = 0; k < instr.targets.size(); k++)
+        {
+            const string &argument = instr.targets[k];
+            ValueType type = types.typeOf(callee->params[k]);
+            if (!isTacVariable(argument) || types.typeOf(argument) == type)
+            {
+                site.args.push_back(operand(argument, type, 0));
+                continue;
+            }
+            int32_t converted = variable("$arg" + to_string(k));
+            emitConversion(converted, variable(argument), types.typeOf(argument), type);
+            site.args.push_back(converted);
+        }
+        program.callSites.push_back(site);
+        emit(OP_CALL, (int32_t)program.callSites.size() - 1);
+        if (!instr.result.empty())
+            emitConversion(variable(instr.result), variable("$return"), types.returnType(instr.arg1), types.typeOf(instr.result));
+    }
+
+    // The slots a recursive function saves around its body: its parameters, locals and temps
+    void buildFrame(const vector<TacInstruction> &code, const FunctionInfo &info, VmFunction &function)
+    {
+        if (!callGraph.isRecursive(info.name))
+            return;
+        set<string> names(info.params.begin(), info.params.end());
+        for (size_t i = info.first; i < info.end; i++)
+        {
+            for (const auto &used : code[i].uses())
+                names.insert(used);
+            if (code[i].definesVariable())
+                names.insert(code[i].result);
+        }
+        string prefix = info.name + "__";
+        for (const auto &name : names)
+        {
+            if (symTable.isArray(name) || (!isCompilerVariable(name) && name.compare(0, prefix.size(), prefix) != 0))
+                continue;
+            auto lanes = vectorLanes.find(name);
+            int32_t first = variable(name);
+            for (int l = 0; l < (lanes == vectorLanes.end() ? 1 : lanes->second); l++)
+                function.frame.push_back(first + l);
+        }
+    }
+
+    void emit(Opcode opcode, int32_t a = 0, int32_t b = 0, int32_t c = 0)
+    {
+        program.code.push_back({opcode, a, b, c});
+    }
+
+    void emitJump(Opcode opcode, const string &label, int32_t b = 0, int32_t c = 0)
+    {
+        jumpPatches.push_back({program.code.size(), label});
+        emit(opcode, 0, b, c);
+    }
+
+    int32_t newSlot(const string &key, VmValue value)
+    {
+        int32_t slot = (int32_t)program.initialSlots.size();
+        program.initialSlots.push_back(value);
+        slots[key] = slot;
+        return slot;
+    }
+
+    int32_t variable(const string &name)
+    {
+        auto it = slots.find(name);
+        if (it != slots.end())
+            return it->second + (vectorLanes.count(name) ? lane : 0);
+
+        int32_t slot = newSlot(name, VmValue{});
+        auto lanes = vectorLanes.find(name);
+        if (lanes != vectorLanes.end())
+        {
+            program.initialSlots.resize(program.initialSlots.size() + lanes->second - 1);
+            return slot + lane;
+        }
+        return slot;
+    }
+
+    int32_t array(const string &name)
+    {
+        auto it = arrays.find(name);
+        if (it != arrays.end())
+            return it->second;
+        int32_t size = symTable.getArraySize(name);
+        program.arrays.push_back({name, (int32_t)program.initialSlots.size(), size});
+        program.initialSlots.resize(program.initialSlots.size() + size);
+        return arrays[name] = (int32_t)program.arrays.size() - 1;
+    }
+
+    // The slot holding the element number, moved along by the lane of a vector instruction
+    int32_t elementIndex(const string &index)
+    {
+        int32_t slot = operand(index, VALUE_INT, 4);
+        if (lane == 0)
+            return slot;
+        emit(OP_ADD_I, scratch(5), slot, constant(to_string(lane), VALUE_INT));
+        return scratch(5);
+    }
+
+    int32_t scratch(int index)
+    {
+        return variable("$" + to_string(index));
+    }
+
+    [[noreturn]] static void typeError(const string &what)
+    {
+        cerr << "Error: " << what << " is not supported for strings" << endl;
+        exit(1);
+    }
+
+    static double literalValue(const string &literal)
+    {
+        if (literal == "true" || literal == "false")
+            return literal == "true";
+        try
+        {
+            size_t used = 0;
+            double value = stod(literal, &used);
+            if (used == literal.size())
+                return value;
+        }
+        catch (const exception &)
+        {
+        }
+        cerr << "Error: invalid constant '" << literal << "'" << endl;
+        exit(1);
+    }
+
+    // The slot of a constant, holding the literal as a value of `type`
+    int32_t constant(const string &literal, ValueType type)
+    {
+        string key = "#" + to_string(type) + ":" + literal;
+        auto it = slots.find(key);
+        if (it != slots.end())
+            return it->second;
+
+        VmValue value{};
+        if (isTacString(literal) != (type == VALUE_STRING))
+            typeError("mixing numbers and " + literal);
+        if (type == VALUE_STRING)
+        {
+            program.strings.push_back(unquoteTacString(literal));
+            value.s = program.strings.back().c_str();
+        }
+        else if (type == VALUE_INT)
+            value.i = (int32_t)literalValue(literal);
+        else if (type == VALUE_FLOAT)
+            value.f = (float)literalValue(literal);
+        else
+            value.d = literalValue(literal);
+        return newSlot(key, value);
+    }
+
+    void emitConversion(int32_t destination, int32_t source, ValueType from, ValueType to)
+    {
+        if (from == to)
+        {
+            if (destination != source)
+                emit(OP_MOVE, destination, source);
+            return;
+        }
+        if (from == VALUE_STRING || to == VALUE_STRING)
+            typeError("converting");
+        static const Opcode conversions[3][3] = {{OP_MOVE, OP_I2F, OP_I2D},
+                                                 {OP_F2I, OP_MOVE, OP_F2D},
+                                                 {OP_D2I, OP_D2F, OP_MOVE}};
+        emit(conversions[from][to], destination, source);
+    }
+
+    // The slot holding `name` as a value of `type`; a variable of another type goes through scratch slot `index`
+    int32_t operand(const string &name, ValueType type, int index)
+    {
+        if (!isTacVariable(name))
+            return constant(name, type);
+        ValueType from = types.typeOf(name);
+        if (from == type)
+            return variable(name);
+        int32_t temp = scratch(index);
+        emitConversion(temp, variable(name), from, type);
+        return temp;
+    }
+
+    // An int slot that is non-zero when `name` is
+    int32_t truth(const string &name, int index)
+    {
+        ValueType type = types.typeOf(name);
+        if (type == VALUE_STRING)
+            typeError("testing");
+        if (type == VALUE_INT)
+            return operand(name, VALUE_INT, index);
+        int32_t temp = scratch(index);
+        emit(Opcode(OP_NE_I + type), temp, operand(name, type, index), constant("0", type));
+        return temp;
+    }
+
+    // Where a value of `type` for `result` is computed: the variable itself, or a scratch slot to convert from
+    int32_t destination(const string &result, ValueType type)
+    {
+        return types.typeOf(result) == type ? variable(result) : scratch(2);
+    }
+
+    void store(const string &result, ValueType type, int32_t slot)
+    {
+        if (types.typeOf(result) != type)
+            emitConversion(variable(result), slot, type, types.typeOf(result));
+    }
+
+    void compileCopy(const TacInstruction &instr)
+    {
+        ValueType to = types.typeOf(instr.result);
+        if (isTacVariable(instr.arg1))
+            emitConversion(variable(instr.result), variable(instr.arg1), types.typeOf(instr.arg1), to);
+        else
+            emit(OP_MOVE, variable(instr.result), constant(instr.arg1, to));
+    }
+
+    void compileBinary(const TacInstruction &instr)
+    {
+        ValueType operandType = widerType(types.typeOf(instr.arg1), types.typeOf(instr.arg2));
+        if (operandType == VALUE_STRING)
+            typeError("'" + instr.op + "'");
+
+        if (instr.op == "&&" || instr.op == "||")
+        {
+            int32_t a = truth(instr.arg1, 0), b = truth(instr.arg2, 1);
+            int32_t result = destination(instr.result, VALUE_INT);
+            emit(instr.op == "&&" ? OP_AND : OP_OR, result, a, b);
+            store(instr.result, VALUE_INT, result);
+            return;
+        }
+
+        static const map<string, Opcode> arithmetic = {{"+", OP_ADD_I}, {"-", OP_SUB_I}, {"*", OP_MUL_I}, {"/", OP_DIV_I}};
+        Opcode family = isArithmetic(instr.op) ? arithmetic.at(instr.op) : Opcode(OP_LT_I + 3 * relation(instr.op));
+        ValueType valueType = isArithmetic(instr.op) ? operandType : VALUE_INT;
+        int32_t a = operand(instr.arg1, operandType, 0), b = operand(instr.arg2, operandType, 1);
+        int32_t result = destination(instr.result, valueType);
+        emit(Opcode(family + operandType), result, a, b);
+        store(instr.result, valueType, result);
+    }
+
+    void compileCompareBranch(const string &left, const string &op, const string &right, bool whenFalse, const string &label)
+    {
+        ValueType type = widerType(types.typeOf(left), types.typeOf(right));
+        if (type == VALUE_STRING)
+            typeError("'" + op + "'");
+        int32_t a = operand(left, type, 0), b = operand(right, type, 1);
+        int rel = relation(op);
+        if (type == VALUE_INT)
+        {
+            // Negating is only exact for integers; with floating point NaN compares false both ways
+            static const int negated[6] = {3, 2, 1, 0, 5, 4};
+            emitJump(Opcode(OP_JLT_I + (whenFalse ? negated[rel] : rel)), label, a, b);
+            return;
+        }
+        emit(Opcode(OP_LT_I + 3 * rel + type), scratch(2), a, b);
+        emitJump(whenFalse ? OP_JUMP_IF_NOT : OP_JUMP_IF, label, scratch(2));
+    }
+
+    void compileConditional(const TacInstruction &instr)
+    {
+        bool whenFalse = instr.kind == TAC_IF_FALSE;
+        if (relation(instr.op) >= 0)
+        {
+            compileCompareBranch(instr.arg1, instr.op, instr.arg2, whenFalse, instr.result);
+            return;
+        }
+        if (!instr.op.empty())
+        {
+            TacInstruction logical = instr;
+            logical.kind = TAC_BINARY;
+            logical.result = "$3";
+            compileBinary(logical);
+            emitJump(whenFalse ? OP_JUMP_IF_NOT : OP_JUMP_IF, instr.result, variable("$3"));
+            return;
+        }
+        if (!isTacVariable(instr.arg1))
+        {
+            // A constant condition either always or never jumps
+            if (isTacString(instr.arg1))
+                typeError("testing");
+            if ((literalValue(instr.arg1) != 0) != whenFalse)
+                emitJump(OP_JUMP, instr.result);
+            return;
+        }
+        emitJump(whenFalse ? OP_JUMP_IF_NOT : OP_JUMP_IF, instr.result, truth(instr.arg1, 0));
+    }
+
+    void compileJumpTable(const TacInstruction &table)
+    {
+        size_t index = program.jumpTables.size();
+        program.jumpTables.emplace_back(table.targets.size() + 1);
+        for (size_t i = 0; i < table.targets.size(); i++)
+            tablePatches.push_back({{index, i}, table.targets[i]});
+        tablePatches.push_back({{index, table.targets.size()}, table.result});
+        emit(OP_SWITCH, operand(table.arg1, VALUE_INT, 0), (int32_t)literalValue(table.arg2), (int32_t)index);
+    }
+
+    int32_t labelAddress(const string &label)
+    {
+        auto it = labels.find(label);
+        if (it == labels.end())
+        {
+            cerr << "Error: jump to undefined label " << label << endl;
+            exit(1);
+        }
+        return it->second;
+    }
+
+    void resolveLabels()
+    {
+        for (const auto &patch : jumpPatches)
+            program.code[patch.first].a = labelAddress(patch.second);
+        for (const auto &patch : tablePatches)
+            program.jumpTables[patch.first.first][patch.first.second] = labelAddress(patch.second);
+    }
+};
+
+/*
+    BytecodeInterpreter:
+
+    Runs a BytecodeProgram. The instruction bodies are written once and compiled twice:
+       run()        threaded dispatch: each body ends by jumping straight to the body of the next
+                    instruction through a table of label addresses (GCC/Clang computed goto), so
+                    every instruction has its own, separately predicted, indirect jump;
+       runSwitch()  the naive loop around one switch, where all instructions share one jump.
+    Without computed goto both use the switch.
+    benchmark() times the two against each other.
+    When the program ends, run() copies the label counters of an instrumented program into `profile`.
+*/
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+class BytecodeInterpreter
+{
+public:
+    BytecodeInterpreter(const BytecodeProgram &program) : program(program) {}
+
+    void run(istream &in, ostream &out, BlockProfile *profile = nullptr) const
+    {
+        execute<true>(in, out, profile);
+    }
+
+    void runSwitch(istream &in, ostream &out) const
+    {
+        execute<false>(in, out, nullptr);
+    }
+
+    /*
+        Runs the program `runs` times with each dispatch method. Standard input is read once and
+        replayed for every run, and the output is collected and compared: both have to produce the
+        same output, which is printed once at the end.
+    */
+    void benchmark(int runs) const
+    {
+        string input((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+        string output;
+        double microseconds[2];
+        for (int threaded = 0; threaded < 2; threaded++)
+        {
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < runs; i++)
+            {
+                istringstream in(input);
+                ostringstream out;
+                if (threaded)
+                    run(in, out);
+                else
+                    runSwitch(in, out);
+                if (threaded == 0 && i == 0)
+                    output = out.str();
+                else if (out.str() != output)
+                {
+                    cerr << "Error: switch and threaded dispatch disagree" << endl;
+                    exit(1);
+                }
+            }
+            auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+            microseconds[threaded] = elapsed.count() / 1000.0 / runs;
+        }
+
+        cout << output;
+        cout.flush();
+        cerr << fixed << setprecision(1);
+        cerr << "[vm] " << program.code.size() << " instructions, " << runs << " runs" << endl;
+        cerr << "[vm] switch dispatch:   " << microseconds[0] << " us/run" << endl;
+        cerr << "[vm] threaded dispatch: " << microseconds[1] << " us/run" << endl;
+        cerr << "[vm] speedup: " << setprecision(2) << microseconds[0] / microseconds[1] << "x" << endl;
+    }
+
+private:
+    const BytecodeProgram &program;
+
+    void saveCounters(const VmValue *s, BlockProfile *profile) const
+    {
+        if (!profile)
+            return;
+        for (const auto &[label, slot] : program.labelCounters)
+            profile->set(label, s[slot].n);
+    }
+
+    [[noreturn]] static void outOfBounds(const VmArray &array, int32_t index)
+    {
+        cerr << "Runtime error: index " << index << " is out of bounds for " << array.name << "[" << array.size << "]" << endl;
+        exit(1);
+    }
+
+    template <bool Threaded>
+    void execute(istream &in, ostream &out, BlockProfile *profile) const
+    {
+        vector<VmValue> slots = program.initialSlots;
+        deque<string> strings; // words read by READ_S
+        struct Return
+        {
+            const BytecodeInstruction *to;
+            size_t saved; // where the caller's frame starts in `frames`
+            int32_t function;
+        };
+        vector<Return> returns;
+        vector<VmValue> frames;
+        VmValue *s = slots.data();
+        const BytecodeInstruction *code = program.code.data();
+        const BytecodeInstruction *ip = code;
+
+#if VM_COMPUTED_GOTO
+#define BYTECODE_LABEL(name) &&op_##name,
+        static const void *const dispatch[OPCODE_COUNT] = {BYTECODE_OPCODES(BYTECODE_LABEL)};
+#undef BYTECODE_LABEL
+#define VM_CASE(name) \
+    case OP_##name:   \
+    op_##name:
+#define VM_DISPATCH()                    \
+    if (Threaded)                        \
+        goto *dispatch[ip->opcode];      \
+    continue
+        if (Threaded)
+            goto *dispatch[ip->opcode];
+#else
+#define VM_CASE(name) case OP_##name:
+#define VM_DISPATCH() continue
+#endif
+#define VM_NEXT() \
+    ip++;         \
+    VM_DISPATCH()
+#define VM_BINARY(name, field, result, op)                    \
+    VM_CASE(name)                                             \
+    s[ip->a].result = s[ip->b].field op s[ip->c].field;       \
+    VM_NEXT();
+// Computed in uint32_t, so an int overflow in the program wraps instead of being undefined here
+#define VM_WRAPPING(name, op)                                                    \
+    VM_CASE(name)                                                                \
+    s[ip->a].i = (int32_t)((uint32_t)s[ip->b].i op (uint32_t)s[ip->c].i);        \
+    VM_NEXT();
+#define VM_ARITHMETIC(name, op)    \
+    VM_WRAPPING(name##_I, op)      \
+    VM_BINARY(name##_F, f, f, op)  \
+    VM_BINARY(name##_D, d, d, op)
+#define VM_COMPARE(name, op)       \
+    VM_BINARY(name##_I, i, i, op)  \
+    VM_BINARY(name##_F, f, i, op)  \
+    VM_BINARY(name##_D, d, i, op)
+#define VM_COMPARE_JUMP(name, op)                                     \
+    VM_CASE(name)                                                     \
+    ip = s[ip->b].i op s[ip->c].i ? code + ip->a : ip + 1;            \
+    VM_DISPATCH();
+
+        for (;;)
+        {
+            switch (ip->opcode)
+            {
+                VM_CASE(MOVE)
+                s[ip->a] = s[ip->b];
+                VM_NEXT();
+                VM_CASE(I2F)
+                s[ip->a].f = (float)s[ip->b].i;
+                VM_NEXT();
+                VM_CASE(I2D)
+                s[ip->a].d = s[ip->b].i;
+                VM_NEXT();
+                VM_CASE(F2I)
+                s[ip->a].i = (int32_t)s[ip->b].f;
+                VM_NEXT();
+                VM_CASE(F2D)
+                s[ip->a].d = s[ip->b].f;
+                VM_NEXT();
+                VM_CASE(D2I)
+                s[ip->a].i = (int32_t)s[ip->b].d;
+                VM_NEXT();
+                VM_CASE(D2F)
+                s[ip->a].f = (float)s[ip->b].d;
+                VM_NEXT();
+
+                VM_ARITHMETIC(ADD, +)
+                VM_ARITHMETIC(SUB, -)
+                VM_ARITHMETIC(MUL, *)
+                VM_CASE(DIV_I)
+                if (s[ip->c].i == 0)
+                {
+                    cerr << "Runtime error: division by zero" << endl;
+                    exit(1);
+                }
+                if (s[ip->b].i == INT32_MIN && s[ip->c].i == -1)
+                {
+                    cerr << "Runtime error: integer overflow in division" << endl;
+                    exit(1);
+                }
+                s[ip->a].i = s[ip->b].i / s[ip->c].i;
+                VM_NEXT();
+                VM_BINARY(DIV_F, f, f, /)
+                VM_BINARY(DIV_D, d, d, /)
+
+                VM_COMPARE(LT, <)
+                VM_COMPARE(LE, <=)
+                VM_COMPARE(GT, >)
+                VM_COMPARE(GE, >=)
+                VM_COMPARE(EQ, ==)
+                VM_COMPARE(NE, !=)
+                VM_CASE(AND)
+                s[ip->a].i = s[ip->b].i != 0 && s[ip->c].i != 0;
+                VM_NEXT();
+                VM_CASE(OR)
+                s[ip->a].i = s[ip->b].i != 0 || s[ip->c].i != 0;
+                VM_NEXT();
+
+                VM_CASE(JUMP)
+                ip = code + ip->a;
+                VM_DISPATCH();
+                VM_CASE(JUMP_IF)
+                ip = s[ip->b].i != 0 ? code + ip->a : ip + 1;
+                VM_DISPATCH();
+                VM_CASE(JUMP_IF_NOT)
+                ip = s[ip->b].i == 0 ? code + ip->a : ip + 1;
+                VM_DISPATCH();
+                VM_COMPARE_JUMP(JLT_I, <)
+                VM_COMPARE_JUMP(JLE_I, <=)
+                VM_COMPARE_JUMP(JGT_I, >)
+                VM_COMPARE_JUMP(JGE_I, >=)
+                VM_COMPARE_JUMP(JEQ_I, ==)
+                VM_COMPARE_JUMP(JNE_I, !=)
+                VM_CASE(SWITCH)
+                {
+                    const vector<int32_t> &table = program.jumpTables[ip->c];
+                    int64_t index = (int64_t)s[ip->a].i - ip->b;
+                    bool inRange = index >= 0 && index + 1 < (int64_t)table.size();
+                    ip = code + (inRange ? table[index] : table.back());
+                }
+                VM_DISPATCH();
+
+                VM_CASE(PRINT_I)
+                out << s[ip->a].i;
+                VM_NEXT();
+                VM_CASE(PRINT_F)
+                out << (double)s[ip->a].f;
+                VM_NEXT();
+                VM_CASE(PRINT_D)
+                out << s[ip->a].d;
+                VM_NEXT();
+                VM_CASE(PRINT_S)
+                out << (s[ip->a].s ? s[ip->a].s : "");
+                VM_NEXT();
+                VM_CASE(READ_I)
+                {
+                    int32_t value = 0;
+                    in >> value;
+                    s[ip->a].i = value;
+                }
+                VM_NEXT();
+                VM_CASE(READ_F)
+                {
+                    double value = 0;
+                    in >> value;
+                    s[ip->a].f = (float)value;
+                }
+                VM_NEXT();
+                VM_CASE(READ_D)
+                {
+                    double value = 0;
+                    in >> value;
+                    s[ip->a].d = value;
+                }
+                VM_NEXT();
+                VM_CASE(READ_S)
+                strings.emplace_back();
+                in >> strings.back();
+                s[ip->a].s = strings.back().c_str();
+                VM_NEXT();
+
+                VM_CASE(LOAD)
+                {
+                    const VmArray &array = program.arrays[ip->b];
+                    int32_t index = s[ip->c].i;
+                    if (index < 0 || index >= array.size)
+                        outOfBounds(array, index);
+                    s[ip->a] = s[array.first + index];
+                }
+                VM_NEXT();
+                VM_CASE(STORE)
+                {
+                    const VmArray &array = program.arrays[ip->a];
+                    int32_t index = s[ip->c].i;
+                    if (index < 0 || index >= array.size)
+                        outOfBounds(array, index);
+                    s[array.first + index] = s[ip->b];
+                }
+                VM_NEXT();
+
+                VM_CASE(COUNT)
+                s[ip->a].n++;
+                VM_NEXT();
+
+                VM_CASE(CALL)
+                {
+                    const VmCallSite &site = program.callSites[ip->a];
+                    const VmFunction &function = program.functions[site.function];
+                    returns.push_back({ip + 1, frames.size(), site.function});
+                    for (int32_t slot : function.frame)
+                        frames.push_back(s[slot]);
+                    // Through the stack, as an argument may be a parameter of the same function
+                    size_t args = frames.size();
+                    for (int32_t slot : site.args)
+                        frames.push_back(s[slot]);
+                    for (size_t k = 0; k < site.args.size(); k++)
+                        s[function.params[k]] = frames[args + k];
+                    frames.resize(args);
+                    ip = code + function.entry;
+                }
+                VM_DISPATCH();
+                VM_CASE(RET)
+                {
+                    if (ip->a >= 0)
+                        s[ip->b] = s[ip->a];
+                    const Return &back = returns.back();
+                    const vector<int32_t> &frame = program.functions[back.function].frame;
+                    for (size_t k = 0; k < frame.size(); k++)
+                        s[frame[k]] = frames[back.saved + k];
+                    frames.resize(back.saved);
+                    ip = back.to;
+                    returns.pop_back();
+                }
+                VM_DISPATCH();
+
+                VM_CASE(HALT)
+                saveCounters(s, profile);
+                return;
+            default:
+                saveCounters(s, profile);
+                return;
+            }
+        }
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_NEXT
+#undef VM_BINARY
+#undef VM_ARITHMETIC
+#undef VM_WRAPPING
+#undef VM_COMPARE
+#undef VM_COMPARE_JUMP
+    }
+};
+
+/*
+    --vector-bench=N: the TAC after loop-invariant code motion is finished twice, once without and
+    once with the LoopVectorizer, and both programs are run N times in the JIT on the same input.
+    The outputs must agree; the time per run of each is printed to stderr.
+*/
+int benchmarkVectorizer(const string &source, const UnrollOptions &unroll, int runs)
+{
+    SymbolTable symTable;
+    IntermediateCodeGnerator licm;
+    try
+    {
+        Lexer lexer(source);
+        vector<Token> tokens = lexer.tokenize();
+        Parser parser(tokens, symTable, licm);
+        parser.parseProgram();
+    }
+    catch (const runtime_error &error)
+    {
+        cout << error.what() << endl;
+        return 1;
+    }
+    Inliner inliner(licm, symTable, Inliner::defaultMaxSize);
+    inliner.optimize();
+    LoopOptimizer loopOptimizer(licm);
+    loopOptimizer.optimize();
+
+    string input((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+    string output;
+    double microseconds[2];
+    int loopsVectorized = 0;
+    for (int vectorize = 0; vectorize < 2; vectorize++)
+    {
+        IntermediateCodeGnerator icg = licm;
+        if (vectorize)
+        {
+            LoopVectorizer vectorizer(icg, symTable);
+            vectorizer.optimize();
+            loopsVectorized = vectorizer.loopsVectorized;
+        }
+        InductionVariableOptimizer inductionOptimizer(icg, symTable, unroll);
+        inductionOptimizer.optimize();
+        DeadCodeEliminator deadCode(icg);
+        deadCode.optimize();
+
+        AssemblyCodeGenerator acg(symTable);
+        acg.returnToCaller = true;
+        acg.generateAssembly(icg.instructions);
+        MachineCodeEncoder encoder;
+        encoder.encode(acg.instructions);
+        JitExecutor jit(encoder);
+        if (!jit.load())
+            return 1;
+
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < runs; i++)
+        {
+            istringstream in(input);
+            ostringstream out;
+            jit.run(in, out);
+            if (vectorize == 0 && i == 0)
+                output = out.str();
+            else if (out.str() != output)
+            {
+                cerr << "Error: scalar and vectorized code disagree" << endl;
+                return 1;
+            }
+        }
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+        microseconds[vectorize] = elapsed.count() / 1000.0 / runs;
+    }
+
+    cout << output;
+    cout.flush();
+    cerr << fixed << setprecision(1);
+    cerr << "[vector] " << loopsVectorized << " loops vectorized, " << runs << " runs" << endl;
+    cerr << "[vector] scalar:     " << microseconds[0] << " us/run" << endl;
+    cerr << "[vector] vectorized: " << microseconds[1] << " us/run" << endl;
+    cerr << "[vector] speedup: " << setprecision(2) << microseconds[0] / microseconds[1] << "x" << endl;
+    return 0;
+}
+
+/*
+    Allocation counting for --time-report:
+
+    The global operator new is replaced so the report can show how many allocations each
+    phase makes and how many bytes it asks for. Counting only happens while a report is
+    being collected; otherwise the only extra work is one well-predicted branch. Programs
+    that embed the compiler (built with COMPILER_NO_MAIN) keep their own operator new.
+    Every plain, array and nothrow form of new and delete is replaced, all on malloc and
+    free: a form left to the runtime (such as the nothrow new behind get_temporary_buffer)
+    would allocate with the runtime's allocator and free through ours. The aligned forms
+    are left alone; they pair only with each other.
+*/
+struct AllocationStats
+{
+    static inline bool enabled = false;
+    // Atomic because the tasks of a TaskPool allocate on several threads
+    static inline atomic<size_t> count{0};
+    static inline atomic<size_t> bytes{0};
+};
+
+#ifndef COMPILER_NO_MAIN
+static void *countedAllocation(size_t size) noexcept
+{
+    if (AllocationStats::enabled)
+    {
+        AllocationStats::count.fetch_add(1, memory_order_relaxed);
+        AllocationStats::bytes.fetch_add(size, memory_order_relaxed);
+    }
+    return malloc(size ? size : 1);
+}
+
+void *operator new(size_t size)
+{
+    if (void *block = countedAllocation(size))
+        return block;
+    throw bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    if (void *block = countedAllocation(size))
+        return block;
+    throw bad_alloc();
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+    return countedAllocation(size);
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept
+{
+    return countedAllocation(size);
+}
+
+// Not inlined, so the compiler never sees free() called on a pointer from operator new
+[[gnu::noinline]] void operator delete(void *block) noexcept
+{
+    free(block);
+}
+
+[[gnu::noinline]] void operator delete(void *block, size_t) noexcept
+{
+    free(block);
+}
+
+[[gnu::noinline]] void operator delete(void *block, const nothrow_t &) noexcept
+{
+    free(block);
+}
+
+[[gnu::noinline]] void operator delete[](void *block) noexcept
+{
+    free(block);
+}
+
+[[gnu::noinline]] void operator delete[](void *block, size_t) noexcept
+{
+    free(block);
+}
+
+[[gnu::noinline]] void operator delete[](void *block, const nothrow_t &) noexcept
+{
+    free(block);
+}
+#endif
+
+/*
+    TimeReport class:
+
+    Collects per-phase measurements for --time-report. phase() closes the running phase and
+    opens the next one; each phase records wall time, CPU time (user + system), the growth of
+    peak RSS and the allocations made while it ran. count() records sizes such as the number
+    of tokens or TAC instructions. The report is printed to stderr when the object goes out
+    of scope at the end of main, as a table or (with --time-report=json) as one JSON object:
+
+        Phase                     Wall ms    CPU ms   Peak RSS KB    Allocs     Alloc KB
+        lex                         12.41     12.38          2048     70012        4105
+        ...
+
+    When the report is not enabled every call returns immediately.
+*/
+class TimeReport
+{
+public:
+    bool enabled = false;
+    bool json = false;
+
+    TimeReport() = default;
+    TimeReport(const TimeReport &) = delete;
+    TimeReport &operator=(const TimeReport &) = delete;
+
+    ~TimeReport()
+    {
+        if (!enabled)
+            return;
+        endPhase();
+        AllocationStats::enabled = false;
+        if (json)
+            printJson(cerr);
+        else
+            printTable(cerr);
+    }
+
+    void phase(const char *name)
+    {
+        if (!enabled)
+            return;
+        endPhase();
+        AllocationStats::enabled = true;
+        current = name;
+        start = sample();
+    }
+
+    void count(const char *name, size_t value)
+    {
+        if (!enabled)
+            return;
+        counters.push_back({name, value});
+    }
+
+private:
+    struct Sample
+    {
+        chrono::steady_clock::time_point wall;
+        double cpuMs = 0;
+        long peakRssKb = 0;
+        size_t allocations = 0;
+        size_t allocatedBytes = 0;
+    };
+
+    struct Phase
+    {
+        string name;
+        double wallMs;
+        double cpuMs;
+        long peakRssKb;
+        size_t allocations;
+        size_t allocatedBytes;
+    };
+
+    string current;
+    Sample start;
+    vector<Phase> phases;
+    vector<pair<string, size_t>> counters;
+
+    static Sample sample()
+    {
+        Sample now;
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        now.cpuMs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+                    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+        now.peakRssKb = usage.ru_maxrss;
+        now.allocations = AllocationStats::count;
+        now.allocatedBytes = AllocationStats::bytes;
+        now.wall = chrono::steady_clock::now();
+        return now;
+    }
+
+    void endPhase()
+    {
+        if (current.empty())
+            return;
+        Sample end = sample();
+        phases.push_back({current,
+                          chrono::duration<double, milli>(end.wall - start.wall).count(),
+                          end.cpuMs - start.cpuMs,
+                          end.peakRssKb - start.peakRssKb,
+                          end.allocations - start.allocations,
+                          end.allocatedBytes - start.allocatedBytes});
+        current.clear();
+    }
+
+    void printTable(ostream &out) const
+    {
+        Phase total{"total", 0, 0, 0, 0, 0};
+        out << left << setw(22) << "Phase" << right << setw(12) << "Wall ms" << setw(12) << "CPU ms"
+            << setw(14) << "Peak RSS KB" << setw(12) << "Allocs" << setw(12) << "Alloc KB" << endl;
+        for (const Phase &phase : phases)
+        {
+            printRow(out, phase);
+            total.wallMs += phase.wallMs;
+            total.cpuMs += phase.cpuMs;
+            total.peakRssKb += phase.peakRssKb;
+            total.allocations += phase.allocations;
+            total.allocatedBytes += phase.allocatedBytes;
+        }
+        printRow(out, total);
+        for (const auto &[name, value] : counters)
+            out << left << setw(22) << name << right << setw(12) << value << endl;
+    }
+
+    static void printRow(ostream &out, const Phase &phase)
+    {
+        out << left << setw(22) << phase.name << right << fixed << setprecision(2)
+            << setw(12) << phase.wallMs << setw(12) << phase.cpuMs << setw(14) << phase.peakRssKb
+            << setw(12) << phase.allocations << setw(12) << phase.allocatedBytes / 1024 << endl;
+    }
+
+    void printJson(ostream &out) const
+    {
+        out << fixed << setprecision(3) << "{\"phases\": [";
+        for (size_t i = 0; i < phases.size(); i++)
+        {
+            const Phase &phase = phases[i];
+            out << (i ? ", " : "") << "{\"name\": \"" << phase.name << "\", \"wall_ms\": " << phase.wallMs
+                << ", \"cpu_ms\": " << phase.cpuMs << ", \"peak_rss_delta_kb\": " << phase.peakRssKb
+                << ", \"allocations\": " << phase.allocations << ", \"allocated_bytes\": " << phase.allocatedBytes << "}";
+        }
+        out << "], \"counters\": {";
+        for (size_t i = 0; i < counters.size(); i++)
+            out << (i ? ", " : "") << "\"" << counters[i].first << "\": " << counters[i].second;
+        out << "}}" << endl;
+    }
+};
+
+/*
+    PassManager:
+
+    Runs the optimization passes of compile() in the order their dependencies ask for. A module
+    pass sees the whole program at once (the Inliner, which moves code between functions). A
+    function pass never looks outside the function it is in (the loop, induction variable,
+    layout and dead code passes), so a run of consecutive function passes forms a stage that
+    runs one task per function, the main program counting as one, on the TaskPool. Every task
+    gets
+    - its own IntermediateCodeGnerator holding the function's TAC, which numbers the temps and
+      labels it creates base + unit, base + unit + units, ... so no two tasks make the same name
+      and the names do not depend on the order the tasks happened to run in,
+    - a SymbolTable layered over the program's, for the variables its passes declare,
+    - a copy of the profile, for the counts of the labels its passes create or move.
+    The stage then puts the functions back together in program order, so the TAC is the same
+    for any number of threads, and the time report shows the stage as one "function passes"
+    phase. A program without functions runs its passes one by one on the module objects, the
+    same as calling them in sequence.
+*/
+struct PassContext
+{
+    IntermediateCodeGnerator &icg;
+    SymbolTable &symbols;
+    BlockProfile *profile;         // null without a profile
+    map<string, size_t> &counts;   // for the time report, summed over the functions
+};
+
+class PassManager
+{
+public:
+    map<string, size_t> counts;
+
+    PassManager(IntermediateCodeGnerator &icg, SymbolTable &symbols, BlockProfile *profile, TaskPool *pool)
+        : icg(icg), symbols(symbols), profile(profile), pool(pool) {}
+
+    // `after` names passes that must have run first; every one of them has to be added too
+    void addModulePass(const string &name, const vector<string> &after, const function<void(PassContext &)> &run)
+    {
+        passes.push_back({name, after, run, false});
+    }
+
+    void addFunctionPass(const string &name, const vector<string> &after, const function<void(PassContext &)> &run)
+    {
+        passes.push_back({name, after, run, true});
+    }
+
+    // `phase` gets the name of every pass (or stage) before it starts
+    void run(const function<void(const string &)> &phase)
+    {
+        vector<size_t> order = schedule();
+        for (size_t i = 0; i < order.size();)
+        {
+            size_t end = i + 1;
+            if (passes[order[i]].functionLocal)
+            {
+                while (end < order.size() && passes[order[end]].functionLocal)
+                    end++;
+            }
+            vector<size_t> stage(order.begin() + i, order.begin() + end);
+            vector<size_t> starts = functionStarts();
+            if (passes[order[i]].functionLocal && starts.size() > 1)
+            {
+                phase("function passes");
+                runStage(stage, starts);
+            }
+            else
+            {
+                for (size_t p : stage)
+                {
+                    phase(passes[p].name);
+                    PassContext context{icg, symbols, profile, counts};
+                    passes[p].run(context);
+                }
+            }
+            i = end;
+        }
+    }
+
+    static bool startsFunction(const string &line)
+    {
+        return line.compare(0, 9, "function ") == 0 && line.compare(9, 2, "= ") != 0;
+    }
+
+private:
+    struct Pass
+    {
+        string name;
+        vector<string> after;
+        function<void(PassContext &)> run;
+        bool functionLocal;
+    };
+
+    struct Unit
+    {
+        IntermediateCodeGnerator icg;
+        SymbolTable symbols;
+        BlockProfile profile;
+        map<string, size_t> counts;
+
+        Unit(const SymbolTable *module, pmr::memory_resource *memory) : symbols(module, memory)
+        {
+            icg.memory = memory;
+        }
+    };
+
+    IntermediateCodeGnerator &icg;
+    SymbolTable &symbols;
+    BlockProfile *profile;
+    TaskPool *pool;
+    vector<Pass> passes;
+
+    // Every pass after the ones it depends on, otherwise in the order they were added
+    vector<size_t> schedule() const
+    {
+        map<string, size_t> index;
+        for (size_t p = 0; p < passes.size(); p++)
+            index[passes[p].name] = p;
+        vector<size_t> waiting(passes.size(), 0);
+        vector<vector<size_t>> dependents(passes.size());
+        for (size_t p = 0; p < passes.size(); p++)
+        {
+            for (const auto &name : passes[p].after)
+            {
+                auto it = index.find(name);
+                if (it == index.end())
+                    throw runtime_error("Pass '" + passes[p].name + "' runs after unknown pass '" + name + "'");
+                dependents[it->second].push_back(p);
+                waiting[p]++;
+            }
+        }
+        set<size_t> ready;
+        for (size_t p = 0; p < passes.size(); p++)
+        {
+            if (!waiting[p])
+                ready.insert(p);
+        }
+        vector<size_t> order;
+        while (!ready.empty())
+        {
+            size_t p = *ready.begin();
+            ready.erase(ready.begin());
+            order.push_back(p);
+            for (size_t next : dependents[p])
+            {
+                if (--waiting[next] == 0)
+                    ready.insert(next);
+            }
+        }
+        if (order.size() != passes.size())
+            throw runtime_error("Pass dependencies form a cycle");
+        return order;
+    }
+
+    // Index of the first instruction of every unit: the main program, then each function
+    vector<size_t> functionStarts() const
+    {
+        vector<size_t> starts(1, 0);
+        for (size_t i = 1; i < icg.instructions.size(); i++)
+        {
+            if (startsFunction(icg.instructions[i]))
+                starts.push_back(i);
+        }
+        return starts;
+    }
+
+    void runStage(const vector<size_t> &stage, const vector<size_t> &starts)
+    {
+        vector<unique_ptr<Unit>> units;
+        vector<size_t> costs;
+        for (size_t u = 0; u < starts.size(); u++)
+        {
+            size_t end = u + 1 < starts.size() ? starts[u + 1] : icg.instructions.size();
+            units.push_back(make_unique<Unit>(&symbols, icg.memory));
+            Unit &unit = *units.back();
+            unit.icg.instructions.assign(make_move_iterator(icg.instructions.begin() + starts[u]),
+                                         make_move_iterator(icg.instructions.begin() + end));
+            unit.icg.tempCount = icg.tempCount + (int)u;
+            unit.icg.tempStride = (int)starts.size();
+            if (profile)
+                unit.profile = *profile;
+            costs.push_back(end - starts[u]);
+        }
+
+        auto runUnit = [&](size_t u)
+        {
+            Unit &unit = *units[u];
+            PassContext context{unit.icg, unit.symbols, profile ? &unit.profile : nullptr, unit.counts};
+            for (size_t p : stage)
+                passes[p].run(context);
+        };
+        if (pool)
+            pool->run(costs, runUnit);
+        else
+        {
+            for (size_t u = 0; u < units.size(); u++)
+                runUnit(u);
+        }
+
+        icg.instructions.clear();
+        BlockProfile original;
+        if (profile)
+            original = *profile;
+        for (const auto &unit : units)
+        {
+            icg.instructions.insert(icg.instructions.end(), make_move_iterator(unit->icg.instructions.begin()),
+                                    make_move_iterator(unit->icg.instructions.end()));
+            icg.tempCount = max(icg.tempCount, unit->icg.tempCount);
+            unit->symbols.forEachSymbol([this](const string &name, const string &type, int arraySize)
+                                        {
+                                            if (arraySize)
+                                                symbols.declareArray(name, type, arraySize);
+                                            else
+                                                symbols.declareVariable(name, type); });
+            if (profile)
+                profile->update(original, unit->profile);
+            for (const auto &[name, value] : unit->counts)
+                counts[name] += value;
+        }
+    }
+};
+
+/*
+    Library API:
+
+    compile() runs the whole front end and the x86-64 back end on a source string in memory
+    and returns everything it produced: the tokens, the symbol table, the optimized TAC and
+    the assembly, or the diagnostics that stopped it. It reads and writes no files, prints
+    nothing and never exits, and it keeps no state between calls, so any number of threads
+    may compile at once. The command line driver below is a thin wrapper around it.
+
+        CompileResult result = compile("int x = 2; cout << x * 21 << endl;");
+        if (result.success)
+            string asmText = result.assemblyText();
+
+    Per-compile allocations go through CompileOptions::memory (the pmr default resource
+    unless it is set). A driver can make them arena allocations by passing the memory() of a
+    CompilationArena that outlives the call and every result it keeps; a thread that compiles
+    needs an arena of its own. With threads above 1, the functions of a program are optimized
+    and compiled on that many threads (see PassManager); compile() then puts a SharedMemory
+    in front of the resource for the time the tasks run.
+
+    Building with -DCOMPILER_NO_MAIN leaves out the command line driver (and the operator new
+    it uses for allocation counting), so the file can be compiled into another program.
+*/
+struct Diagnostic
+{
+    int line; // 0 when the error has no source position
+    string message;
+};
+
+struct CompileOptions
+{
+    UnrollOptions unroll;
+    int inlineSize = Inliner::defaultMaxSize; // 0 turns the Inliner off
+    bool vectorize = true;
+    bool assembly = true;           // false stops after the TAC (enough for the bytecode VM)
+    bool returnToCaller = false;    // end with `ret` instead of an exit syscall (for the JIT)
+    bool peepholeStatistics = false;
+    int threads = 1;                // for the functions of a program (see PassManager)
+    TimeReport *report = nullptr;   // per-phase measurements, when given (one thread at a time)
+    const BlockProfile *profile = nullptr; // from an instrumented run of the same source (--use-profile)
+    pmr::memory_resource *memory = pmr::get_default_resource(); // per-compile data, including result.symbols
+};
+
+struct CompileResult
+{
+    bool success = false;
+    vector<Diagnostic> diagnostics;
+    vector<Token> tokens;
+    SymbolTable symbols;
+    vector<string> tac; // one TAC instruction per entry, as written to icg.obj
+    int tempCount = 0;
+    vector<AsmInstruction> assembly;
+    string peepholeStatistics;
+
+    CompileResult() = default;
+
+    explicit CompileResult(pmr::memory_resource *memory) : symbols(memory) {}
+
+    // icg.obj: one instruction per line
+    void appendTac(OutputBuffer &out) const
+    {
+        for (const auto &instr : tac)
+        {
+            out.append(instr);
+            out.append('\n');
+        }
+    }
+
+    // assembly.asm: NASM source
+    void appendAssembly(OutputBuffer &out) const
+    {
+        for (const auto &instr : assembly)
+        {
+            instr.appendTo(out);
+            out.append('\n');
+        }
+    }
+
+    string tacText() const
+    {
+        OutputBuffer out;
+        appendTac(out);
+        return out.str();
+    }
+
+    string assemblyText() const
+    {
+        OutputBuffer out;
+        appendAssembly(out);
+        return out.str();
+    }
+
+    // One JSON string per line, holding the TAC instruction as written to icg.obj
+    void dumpTac(OutputBuffer &out) const
+    {
+        for (const auto &instr : tac)
+        {
+            out.appendJsonString(instr);
+            out.append('\n');
+        }
+    }
+
+    // One JSON object per line:
+    //    {"label":"L4"}  {"directive":"section .data"}  {"op":"mov","args":["ebx","[x]"]}
+    void dumpAssembly(OutputBuffer &out) const
+    {
+        for (const auto &instr : assembly)
+        {
+            if (instr.kind == ASM_LABEL || instr.kind == ASM_DIRECTIVE)
+            {
+                out.append(instr.kind == ASM_LABEL ? "{\"label\":" : "{\"directive\":");
+                out.appendJsonString(instr.mnemonic);
+            }
+            else
+            {
+                out.append("{\"op\":", 6);
+                out.appendJsonString(instr.mnemonic);
+                out.append(",\"args\":[", 9);
+                for (size_t i = 0; i < instr.operands.size(); i++)
+                {
+                    if (i)
+                        out.append(',');
+                    out.appendJsonString(instr.operands[i]);
+                }
+                out.append(']');
+                if (!instr.comment.empty())
+                {
+                    out.append(",\"comment\":", 11);
+                    out.appendJsonString(instr.comment);
+                }
+            }
+            out.append("}\n", 2);
+        }
+    }
+};
+
+/*
+    The optimization passes of compile(), in their order: inlining, loop-invariant code motion,
+    vectorization, induction variables, the profile guided passes (with options.profile) and
+    dead code elimination. The phase benchmark registers the same ones, so it measures what a
+    compile runs. `inliner` and `options` have to outlive passes.run().
+*/
+void addOptimizationPasses(PassManager &passes, Inliner &inliner, const CompileOptions &options)
+{
+    passes.addModulePass("inline", {}, [&inliner](PassContext &)
+                         { inliner.optimize(); });
+    passes.addFunctionPass("loop invariant motion", {"inline"}, [](PassContext &context)
+                           { LoopOptimizer(context.icg).optimize(); });
+    vector<string> afterLoops = {"loop invariant motion"};
+    if (options.vectorize)
+    {
+        passes.addFunctionPass("vectorize", afterLoops, [](PassContext &context)
+                               { LoopVectorizer(context.icg, context.symbols).optimize(); });
+        afterLoops = {"vectorize"};
+    }
+    passes.addFunctionPass("induction variables", afterLoops, [&options](PassContext &context)
+                           {
+                               InductionVariableOptimizer inductionOptimizer(context.icg, context.symbols, options.unroll);
+                               inductionOptimizer.profile = context.profile;
+                               inductionOptimizer.optimize(); });
+    vector<string> afterInlining = {"induction variables"};
+    if (options.profile)
+    {
+        passes.addFunctionPass("profile guided layout", {"induction variables"}, [](PassContext &context)
+                               {
+                                   ProfileGuidedLayout layout(context.icg, *context.profile);
+                                   layout.optimize();
+                                   context.counts["loops rotated"] += layout.loopsRotated;
+                                   context.counts["branches inverted"] += layout.branchesInverted; });
+        passes.addModulePass("profile guided inlining", {"profile guided layout"}, [&inliner](PassContext &context)
+                             { inliner.optimizeHot(*context.profile); });
+        afterInlining = {"profile guided inlining"};
+    }
+    passes.addFunctionPass("dead code", afterInlining, [](PassContext &context)
+                           {
+                               DeadCodeEliminator deadCode(context.icg);
+                               deadCode.optimize();
+                               context.counts["dead instructions"] += deadCode.instructionsRemoved; });
+}
+
+CompileResult compile(string_view source, const CompileOptions &options = {})
+{
+    CompileResult result(options.memory);
+    SharedMemory memory(options.memory);
+    TimeReport *report = options.report;
+    auto phase = [report](const char *name)
+    {
+        if (report)
+            report->phase(name);
+    };
+    auto count = [report](const char *name, size_t value)
+    {
+        if (report)
+            report->count(name, value);
+    };
+
+    try
+    {
+        phase("lex");
+        Lexer lexer{string(source)};
+        result.tokens = lexer.tokenize();
+        count("tokens", result.tokens.size());
+
+        phase("parse");
+        IntermediateCodeGnerator icg;
+        icg.memory = &memory;
+        Parser parser(result.tokens, result.symbols, icg);
+        parser.parseProgram();
+
+        unique_ptr<TaskPool> pool;
+        if (options.threads > 1 && any_of(icg.instructions.begin(), icg.instructions.end(), PassManager::startsFunction))
+            pool = make_unique<TaskPool>(options.threads, &memory);
+
+        // Unrolling and layout update the counts of the labels they create, so they get a copy
+        BlockProfile profile;
+        if (options.profile)
+            profile = *options.profile;
+
+        PassManager passes(icg, result.symbols, options.profile ? &profile : nullptr, pool.get());
+        Inliner inliner(icg, result.symbols, options.inlineSize);
+        addOptimizationPasses(passes, inliner, options);
+        passes.run([&phase](const string &name)
+                   { phase(name.c_str()); });
+
+        if (options.profile)
+        {
+            count("loops rotated", passes.counts["loops rotated"]);
+            count("branches inverted", passes.counts["branches inverted"]);
+        }
+        count("calls inlined", inliner.callsInlined);
+        count("functions removed", inliner.functionsRemoved);
+        count("dead instructions", passes.counts["dead instructions"]);
+        result.tac = move(icg.instructions);
+        result.tempCount = icg.tempCount;
+        count("tac instructions", result.tac.size());
+        count("temps", result.tempCount);
+
+        if (options.assembly)
+        {
+            phase("generate assembly");
+            AssemblyCodeGenerator acg(result.symbols, &memory);
+            acg.returnToCaller = options.returnToCaller;
+            if (options.profile)
+                acg.profile = &profile;
+            acg.pool = pool.get();
+            acg.generateAssembly(result.tac);
+            if (options.peepholeStatistics)
+            {
+                ostringstream statistics;
+                acg.peephole.printStatistics(statistics);
+                result.peepholeStatistics = statistics.str();
+            }
+            result.assembly = move(acg.instructions);
+            count("assembly lines", result.assembly.size());
+        }
+        result.success = true;
+    }
+    catch (const CompileError &error)
+    {
+        result.diagnostics.push_back({error.line, error.what()});
+    }
+    catch (const runtime_error &error)
+    {
+        // SymbolTable reports undeclared and redeclared variables this way
+        result.diagnostics.push_back({0, error.what()});
+    }
+    return result;
+}
+
+/*
+    Binary IR (icg.tir, written by --emit=ir):
+
+    The optimized TAC and the symbol table in a form the back end can mmap and use directly,
+    without tokenizing icg.obj line by line. All integers are little-endian and every section
+    starts on an 8-byte boundary:
+
+        IrHeader                            magic "TIR1", version, counts and section offsets
+        string offsets  uint32 x (n + 1)    string i is the bytes [offset[i], offset[i + 1] - 1)
+        string data                         every string followed by a NUL; string 0 is ""
+        instructions    IrInstruction x n   fixed-width records whose operands are string ids
+        targets         uint32 x n          jump table targets, call arguments, parameters (string ids)
+        labels          IrLabel x n         every label and the index of its instruction
+        symbols         IrSymbol x n        name, type and array size of every variable
+
+    IrFile checks every offset, count and string id when the file is opened, so a truncated
+    or corrupt file is rejected up front instead of being read out of bounds later. A change
+    to the layout or to the TacKind numbering must bump irVersion.
+*/
+struct IrHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t stringCount;
+    uint32_t instructionCount;
+    uint32_t targetCount;
+    uint32_t labelCount;
+    uint32_t symbolCount;
+    uint32_t tempCount;
+    uint64_t stringOffsetsOffset;
+    uint64_t stringDataOffset;
+    uint64_t instructionsOffset;
+    uint64_t targetsOffset;
+    uint64_t labelsOffset;
+    uint64_t symbolsOffset;
+    uint64_t fileSize;
+};
+
+struct IrInstruction
+{
+    uint8_t kind; // TacKind
+    uint8_t lanes;
+    uint16_t reserved;
+    uint32_t result;
+    uint32_t arg1;
+    uint32_t op;
+    uint32_t arg2;
+    uint32_t keyword;
+    uint32_t text; // the original line of a TAC_OTHER, otherwise 0
+    uint32_t firstTarget;
+    uint32_t targetCount;
+};
+
+struct IrLabel
+{
+    uint32_t name;
+    uint32_t instruction;
+};
+
+struct IrSymbol
+{
+    uint32_t name;
+    uint32_t type;
+    uint32_t arraySize; // 0 for scalars
+    uint32_t reserved;
+};
+
+static constexpr char irMagic[4] = {'T', 'I', 'R', '1'};
+static constexpr uint32_t irVersion = 1;
+
+// Serialize the TAC and the symbol table of a successful compile
+void writeIr(const CompileResult &result, OutputBuffer &out)
+{
+    vector<string> strings = {""};
+    unordered_map<string, uint32_t> stringIds = {{"", 0}};
+    auto intern = [&](const string &value)
+    {
+        auto [it, inserted] = stringIds.try_emplace(value, (uint32_t)strings.size());
+        if (inserted)
+            strings.push_back(value);
+        return it->second;
+    };
+
+    vector<IrInstruction> records;
+    vector<uint32_t> targets;
+    vector<IrLabel> labels;
+    records.reserve(result.tac.size());
+    for (const auto &line : result.tac)
+    {
+        TacInstruction instr = TacInstruction::parse(line);
+        IrInstruction record = {};
+        record.kind = (uint8_t)instr.kind;
+        record.lanes = instr.kind == TAC_OTHER ? 1 : (uint8_t)instr.lanes; // the text keeps any prefix
+        record.result = intern(instr.result);
+        record.arg1 = intern(instr.arg1);
+        record.op = intern(instr.op);
+        record.arg2 = intern(instr.arg2);
+        record.keyword = intern(instr.keyword);
+        record.text = instr.kind == TAC_OTHER ? intern(instr.text) : 0;
+        record.firstTarget = (uint32_t)targets.size();
+        record.targetCount = (uint32_t)instr.targets.size();
+        for (const auto &target : instr.targets)
+            targets.push_back(intern(target));
+        if (instr.kind == TAC_LABEL)
+            labels.push_back({record.result, (uint32_t)records.size()});
+        records.push_back(record);
+    }
+
+    vector<IrSymbol> symbols;
+    result.symbols.forEachSymbol([&](const string &name, const string &type, int arraySize)
+                                 { symbols.push_back({intern(name), intern(type), (uint32_t)arraySize, 0}); });
+
+    vector<uint32_t> offsets;
+    offsets.reserve(strings.size() + 1);
+    uint64_t stringBytes = 0;
+    for (const auto &value : strings)
+    {
+        offsets.push_back((uint32_t)stringBytes);
+        stringBytes += value.size() + 1;
+    }
+    offsets.push_back((uint32_t)stringBytes);
+
+    auto align = [](uint64_t offset)
+    { return (offset + 7) & ~(uint64_t)7; };
+    IrHeader header = {};
+    memcpy(header.magic, irMagic, sizeof(irMagic));
+    header.version = irVersion;
+    header.stringCount = (uint32_t)strings.size();
+    header.instructionCount = (uint32_t)records.size();
+    header.targetCount = (uint32_t)targets.size();
+    header.labelCount = (uint32_t)labels.size();
+    header.symbolCount = (uint32_t)symbols.size();
+    header.tempCount = (uint32_t)result.tempCount;
+    header.stringOffsetsOffset = align(sizeof(IrHeader));
+    header.stringDataOffset = align(header.stringOffsetsOffset + offsets.size() * sizeof(uint32_t));
+    header.instructionsOffset = align(header.stringDataOffset + stringBytes);
+    header.targetsOffset = align(header.instructionsOffset + records.size() * sizeof(IrInstruction));
+    header.labelsOffset = align(header.targetsOffset + targets.size() * sizeof(uint32_t));
+    header.symbolsOffset = align(header.labelsOffset + labels.size() * sizeof(IrLabel));
+    header.fileSize = header.symbolsOffset + symbols.size() * sizeof(IrSymbol);
+
+    // Sections are appended in file order; padTo fills the gap up to the next one with zeros
+    static const char zeros[8] = {};
+    auto padTo = [&](uint64_t offset)
+    { out.append(zeros, offset - out.size()); };
+    size_t start = out.size();
+    out.append((const char *)&header, sizeof(header));
+    padTo(start + header.stringOffsetsOffset);
+    out.append((const char *)offsets.data(), offsets.size() * sizeof(uint32_t));
+    padTo(start + header.stringDataOffset);
+    for (const auto &value : strings)
+        out.append(value.c_str(), value.size() + 1);
+    padTo(start + header.instructionsOffset);
+    out.append((const char *)records.data(), records.size() * sizeof(IrInstruction));
+    padTo(start + header.targetsOffset);
+    out.append((const char *)targets.data(), targets.size() * sizeof(uint32_t));
+    padTo(start + header.labelsOffset);
+    out.append((const char *)labels.data(), labels.size() * sizeof(IrLabel));
+    padTo(start + header.symbolsOffset);
+    out.append((const char *)symbols.data(), symbols.size() * sizeof(IrSymbol));
+}
+
+/*
+    IrFile class:
+
+    A read-only mapping of a file written by writeIr(). open() maps and validates it; after
+    that the records are used in place: instructions() turns them into TacInstructions by
+    looking up string ids, with no text to tokenize.
+*/
+class IrFile
+{
+public:
+    IrFile() = default;
+    IrFile(const IrFile &) = delete;
+    IrFile &operator=(const IrFile &) = delete;
+
+    ~IrFile()
+    {
+        if (data)
+            munmap((void *)data, size);
+    }
+
+    // True when the file starts with the IR magic (so it is not source code)
+    static bool hasMagic(const string &filename)
+    {
+        char magic[sizeof(irMagic)];
+        ifstream file(filename, ios::binary);
+        return file.read(magic, sizeof(magic)) && memcmp(magic, irMagic, sizeof(magic)) == 0;
+    }
+
+    bool open(const string &filename, string &error)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            error = "Error opening file: " + filename;
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(IrHeader))
+        {
+            close(fd);
+            error = filename + ": not an IR file (too short)";
+            return false;
+        }
+        size = info.st_size;
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            error = "Error mapping file: " + filename;
+            return false;
+        }
+        data = (const char *)mapping;
+
+        string problem = validate();
+        if (!problem.empty())
+        {
+            error = filename + ": invalid IR file: " + problem;
+            return false;
+        }
+        return true;
+    }
+
+    const IrHeader &header() const { return *(const IrHeader *)data; }
+
+    string_view stringAt(uint32_t id) const
+    {
+        const uint32_t *offsets = section<uint32_t>(header().stringOffsetsOffset);
+        return string_view(data + header().stringDataOffset + offsets[id], offsets[id + 1] - offsets[id] - 1);
+    }
+
+    // The label records, in instruction order
+    const IrLabel *labels() const { return section<IrLabel>(header().labelsOffset); }
+
+    vector<TacInstruction> instructions() const
+    {
+        const IrInstruction *records = section<IrInstruction>(header().instructionsOffset);
+        const uint32_t *targets = section<uint32_t>(header().targetsOffset);
+        vector<TacInstruction> code(header().instructionCount);
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            const IrInstruction &record = records[i];
+            TacInstruction &instr = code[i];
+            instr.kind = (TacKind)record.kind;
+            instr.lanes = record.lanes;
+            instr.result = stringAt(record.result);
+            instr.arg1 = stringAt(record.arg1);
+            instr.op = stringAt(record.op);
+            instr.arg2 = stringAt(record.arg2);
+            instr.keyword = stringAt(record.keyword);
+            instr.text = stringAt(record.text);
+            for (uint32_t t = 0; t < record.targetCount; t++)
+                instr.targets.emplace_back(stringAt(targets[record.firstTarget + t]));
+        }
+        return code;
+    }
+
+    void loadSymbols(SymbolTable &symbols) const
+    {
+        const IrSymbol *records = section<IrSymbol>(header().symbolsOffset);
+        for (uint32_t i = 0; i < header().symbolCount; i++)
+        {
+            string name(stringAt(records[i].name)), type(stringAt(records[i].type));
+            if (records[i].arraySize > 0)
+                symbols.declareArray(name, type, (int)records[i].arraySize);
+            else
+                symbols.declareVariable(name, type);
+        }
+    }
+
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+
+    template <typename T>
+    const T *section(uint64_t offset) const
+    {
+        return (const T *)(data + offset);
+    }
+
+    // Empty when the file is well formed, otherwise what is wrong with it
+    string validate() const
+    {
+        const IrHeader &h = header();
+        if (memcmp(h.magic, irMagic, sizeof(irMagic)) != 0)
+            return "bad magic";
+        if (h.version != irVersion)
+            return "unsupported version " + to_string(h.version) + " (expected " + to_string(irVersion) + ")";
+        if (h.fileSize != size)
+            return "file is " + to_string(size) + " bytes, header says " + to_string(h.fileSize);
+
+        auto fits = [this](uint64_t offset, uint64_t count, uint64_t width)
+        { return offset % 8 == 0 && offset >= sizeof(IrHeader) && offset <= size && count <= (size - offset) / width; };
+        if (h.stringCount == 0 || !fits(h.stringOffsetsOffset, (uint64_t)h.stringCount + 1, sizeof(uint32_t)) ||
+            !fits(h.instructionsOffset, h.instructionCount, sizeof(IrInstruction)) ||
+            !fits(h.targetsOffset, h.targetCount, sizeof(uint32_t)) ||
+            !fits(h.labelsOffset, h.labelCount, sizeof(IrLabel)) ||
+            !fits(h.symbolsOffset, h.symbolCount, sizeof(IrSymbol)) || !fits(h.stringDataOffset, 0, 1))
+        {
+            return "section out of bounds";
+        }
+
+        const uint32_t *offsets = section<uint32_t>(h.stringOffsetsOffset);
+        const char *strings = data + h.stringDataOffset;
+        if (offsets[0] != 0 || offsets[h.stringCount] > size - h.stringDataOffset)
+            return "string table out of bounds";
+        for (uint32_t i = 0; i < h.stringCount; i++)
+        {
+            if (offsets[i + 1] <= offsets[i] || offsets[i + 1] > offsets[h.stringCount] ||
+                strings[offsets[i + 1] - 1] != '\0')
+                return "string " + to_string(i) + " is not NUL terminated";
+        }
+        if (offsets[1] != 1)
+            return "string 0 is not empty";
+
+        auto validString = [&h](uint32_t id)
+        { return id < h.stringCount; };
+        const IrInstruction *records = section<IrInstruction>(h.instructionsOffset);
+        const uint32_t *targets = section<uint32_t>(h.targetsOffset);
+        for (uint32_t i = 0; i < h.instructionCount; i++)
+        {
+            const IrInstruction &r = records[i];
+            if (r.kind >= TAC_KIND_COUNT || r.lanes == 0 || !validString(r.result) || !validString(r.arg1) ||
+                !validString(r.op) || !validString(r.arg2) || !validString(r.keyword) || !validString(r.text) ||
+                r.firstTarget > h.targetCount || r.targetCount > h.targetCount - r.firstTarget)
+            {
+                return "bad instruction record " + to_string(i);
+            }
+        }
+        for (uint32_t i = 0; i < h.targetCount; i++)
+        {
+            if (!validString(targets[i]))
+                return "bad jump table target " + to_string(i);
+        }
+        const IrLabel *labelRecords = labels();
+        for (uint32_t i = 0; i < h.labelCount; i++)
+        {
+            const IrLabel &label = labelRecords[i];
+            if (label.instruction >= h.instructionCount || records[label.instruction].kind != TAC_LABEL ||
+                records[label.instruction].result != label.name)
+            {
+                return "bad label record " + to_string(i);
+            }
+        }
+        const IrSymbol *symbols = section<IrSymbol>(h.symbolsOffset);
+        for (uint32_t i = 0; i < h.symbolCount; i++)
+        {
+            if (!validString(symbols[i].name) || !validString(symbols[i].type) || symbols[i].arraySize > INT_MAX)
+                return "bad symbol record " + to_string(i);
+        }
+        return "";
+    }
+};
 
-    lexer.printTokenizer(tokens);
+// compile() for IR written by writeIr(): only the back end runs, on the TAC and symbols in the file
+CompileResult compileIr(const IrFile &ir, const CompileOptions &options = {})
+{
+    CompileResult result(options.memory);
+    SharedMemory memory(options.memory);
+    TimeReport *report = options.report;
+    try
+    {
+        if (report)
+            report->phase("load ir");
+        ir.loadSymbols(result.symbols);
+        vector<TacInstruction> code = ir.instructions();
+        result.tac.reserve(code.size());
+        for (const auto &instr : code)
+            result.tac.push_back(instr.toString());
+        result.tempCount = ir.header().tempCount;
+
+        if (options.assembly)
+        {
+            if (report)
+                report->phase("generate assembly");
+            unique_ptr<TaskPool> pool;
+            if (options.threads > 1)
+                pool = make_unique<TaskPool>(options.threads, &memory);
+            AssemblyCodeGenerator acg(result.symbols, &memory);
+            acg.returnToCaller = options.returnToCaller;
+            acg.pool = pool.get();
+            acg.generateAssembly(move(code));
+            if (options.peepholeStatistics)
+            {
+                ostringstream statistics;
+                acg.peephole.printStatistics(statistics);
+                result.peepholeStatistics = statistics.str();
+            }
+            result.assembly = move(acg.instructions);
+            if (report)
+                report->count("assembly lines", result.assembly.size());
+        }
+        result.success = true;
+    }
+    catch (const CompileError &error)
+    {
+        result.diagnostics.push_back({error.line, error.what()});
+    }
+    catch (const runtime_error &error)
+    {
+        result.diagnostics.push_back({0, error.what()});
+    }
+    return result;
+}
 
-    SymbolTable symTable;
+/*
+    Command line options:
+       --unroll-count=N    fully unroll counted loops with at most N iterations (0 disables)
+       --unroll-factor=N   partially unroll other counted loops N times (1 disables)
+       --unroll-size=N     never let one unrolled loop grow beyond N TAC instructions
+       --inline-size=N     inline calls to functions of at most N TAC instructions (default 40,
+                           0 disables inlining); calls in hot blocks may take 4 times as many
+       --jobs=N            optimize and generate code for the functions of a program on N
+                           threads (default: one per core, 1 disables); the output is the same
+       --peephole-stats    print how often each peephole rule fired
+       --emit=asm          write NASM source to assembly.asm (default)
+       --emit=obj          write a relocatable ELF64 object to assembly.o; link it with the
+                           runtime: cc -nostartfiles -no-pie -o program assembly.o runtime.c
+       --emit=exe          write a static ELF64 executable to program (only for programs
+                           without cout/cin, which need the runtime; use --emit=obj for those)
+       --emit=ir           write the optimized TAC and symbol table as binary IR to icg.tir;
+                           an input file in that format skips the front end, and
+                           --dump=symbols,tac prints its contents
+       --run               compile into memory and run the program right away; nothing is
+                           written to disk and only the program's own output is printed
+       --vm                run the program in the bytecode interpreter instead
+       --vm-bench=N        run it N times with switch and with threaded dispatch and compare
+       --instrument[=FILE] run the program in the bytecode interpreter with a counter on every
+                           label and write the counts to FILE (default profile.txt) when it ends;
+                           unrolling is off so the labels match what --use-profile sees
+       --use-profile=FILE  use such counts: cold loops are not unrolled, hot ones may be bigger,
+                           hot while loops are rotated, hot if/else parts are ordered by frequency
+                           and register spills go to the least executed temps
+       --no-vectorize      do not turn loops over arrays into SSE loops
+       --vector-bench=N    run it N times in the JIT without and with vectorized loops and compare
+       --time-report       print time, CPU time, peak RSS growth and allocations per compiler
+                           phase, plus token/TAC/temp/assembly line counts, to stderr
+       --time-report=json  the same as one JSON object
+       --dump=LIST         write the stages in the comma-separated LIST (tokens, symbols, tac,
+                           asm) to stdout as JSON Lines, one token/symbol/instruction per line;
+                           the "saved to file" messages and --peephole-stats then go to stderr
+       --phase-bench=N     time lex, parse, optimize and codegen N times each on generated
+                           programs (and the input file, which is then optional)
+       --bench-save=FILE   with --phase-bench, write the results to FILE as JSON
+       --bench-baseline=FILE  with --phase-bench, compare against results saved earlier and fail
+                           if a phase's median got slower by more than --bench-threshold=PCT
+                           percent (default 10), is missing from FILE, or FILE holds no results
+*/
+struct CompilerOptions
+{
+    string inputFile;
+    UnrollOptions unroll;
+    int inlineSize = Inliner::defaultMaxSize;
+    int jobs = max(1, (int)thread::hardware_concurrency());
+    bool peepholeStats = false;
+    string emit = "asm";
+    bool run = false;
+    bool vm = false;
+    int vmBenchRuns = 0;
+    bool vectorize = true;
+    int vectorBenchRuns = 0;
+    string instrument;
+    string useProfile;
+    bool timeReport = false;
+    bool timeReportJson = false;
+    set<string> dumps;
+    int phaseBenchRuns = 0;
+    string benchSave;
+    string benchBaseline;
+    int benchThreshold = 10;
+};
+
+bool parseIntOption(const string &arg, const string &name, int &value)
+{
+    if (arg.compare(0, name.size() + 1, name + "=") != 0)
+        return false;
+    string number = arg.substr(name.size() + 1);
+    if (number.empty() || number.find_first_not_of("0123456789") != string::npos)
+    {
+        cerr << "Invalid value for " << name << ": '" << number << "'" << endl;
+        exit(1);
+    }
+    value = stoi(number);
+    return true;
+}
+
+bool parseCommandLine(int argc, char *argv[], CompilerOptions &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (parseIntOption(arg, "--unroll-count", options.unroll.maxFullUnrollTrips) ||
+            parseIntOption(arg, "--unroll-factor", options.unroll.factor) ||
+            parseIntOption(arg, "--unroll-size", options.unroll.maxUnrolledSize) ||
+            parseIntOption(arg, "--inline-size", options.inlineSize))
+        {
+            continue;
+        }
+        if (parseIntOption(arg, "--jobs", options.jobs))
+        {
+            if (options.jobs < 1)
+            {
+                cerr << "Invalid value for --jobs: must be at least 1" << endl;
+                exit(1);
+            }
+            continue;
+        }
+        if (arg == "--peephole-stats")
+        {
+            options.peepholeStats = true;
+            continue;
+        }
+        if (arg == "--run")
+        {
+            options.run = true;
+            continue;
+        }
+        if (arg == "--vm")
+        {
+            options.vm = true;
+            continue;
+        }
+        if (parseIntOption(arg, "--vm-bench", options.vmBenchRuns))
+        {
+            if (options.vmBenchRuns < 1)
+            {
+                cerr << "Invalid value for --vm-bench: must be at least 1" << endl;
+                exit(1);
+            }
+            continue;
+        }
+        if (arg == "--instrument" || arg.compare(0, 13, "--instrument=") == 0)
+        {
+            options.instrument = arg.size() > 13 ? arg.substr(13) : "./profile.txt";
+            continue;
+        }
+        if (arg.compare(0, 14, "--use-profile=") == 0)
+        {
+            options.useProfile = arg.substr(14);
+            continue;
+        }
+        if (arg == "--no-vectorize")
+        {
+            options.vectorize = false;
+            continue;
+        }
+        if (parseIntOption(arg, "--vector-bench", options.vectorBenchRuns))
+        {
+            if (options.vectorBenchRuns < 1)
+            {
+                cerr << "Invalid value for --vector-bench: must be at least 1" << endl;
+                exit(1);
+            }
+            continue;
+        }
+        if (parseIntOption(arg, "--phase-bench", options.phaseBenchRuns))
+        {
+            if (options.phaseBenchRuns < 1)
+            {
+                cerr << "Invalid value for --phase-bench: must be at least 1" << endl;
+                exit(1);
+            }
+            continue;
+        }
+        if (parseIntOption(arg, "--bench-threshold", options.benchThreshold))
+            continue;
+        if (arg.compare(0, 13, "--bench-save=") == 0)
+        {
+            options.benchSave = arg.substr(13);
+            continue;
+        }
+        if (arg.compare(0, 17, "--bench-baseline=") == 0)
+        {
+            options.benchBaseline = arg.substr(17);
+            continue;
+        }
+        if (arg.compare(0, 7, "--dump=") == 0)
+        {
+            stringstream stages(arg.substr(7));
+            string stage;
+            while (getline(stages, stage, ','))
+            {
+                if (stage != "tokens" && stage != "symbols" && stage != "tac" && stage != "asm")
+                {
+                    cerr << "Invalid value for --dump: '" << stage << "' (expected tokens, symbols, tac or asm)" << endl;
+                    exit(1);
+                }
+                options.dumps.insert(stage);
+            }
+            continue;
+        }
+        if (arg == "--time-report" || arg == "--time-report=json")
+        {
+            options.timeReport = true;
+            options.timeReportJson = arg == "--time-report=json";
+            continue;
+        }
+        if (arg == "--emit=asm" || arg == "--emit=obj" || arg == "--emit=exe" || arg == "--emit=ir")
+        {
+            options.emit = arg.substr(7);
+            continue;
+        }
+        if (arg.compare(0, 2, "--") == 0 || !options.inputFile.empty())
+        {
+            return false;
+        }
+        options.inputFile = arg;
+    }
+    // --phase-bench brings its own programs; an input file is optional
+    return !options.inputFile.empty() || options.phaseBenchRuns > 0;
+}
+
+/*
+    PerfCounters class:
+
+    Hardware counters for the calling thread through perf_event_open: cycles, instructions,
+    L1 data cache read misses, last-level cache misses and branch misses. Each counter is
+    opened on its own (user space only), so a kernel or container that refuses one of them
+    only loses that column; a counter that could not be opened reads as -1.
+*/
+class PerfCounters
+{
+public:
+    static constexpr int count = 5;
+    static constexpr const char *names[count] = {"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"};
+
+    PerfCounters()
+    {
+        const pair<uint32_t, uint64_t> events[count] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}};
+        for (int i = 0; i < count; i++)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+
+    ~PerfCounters()
+    {
+        for (int fd : fds)
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    bool available(int counter) const { return fds[counter] >= 0; }
+
+    void start()
+    {
+        for (int fd : fds)
+        {
+            if (fd >= 0)
+            {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    // Stop counting and add what was counted since start() to `totals`
+    void stop(array<int64_t, count> &totals)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            uint64_t value;
+            if (fds[i] < 0)
+                continue;
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fds[i], &value, sizeof(value)) == sizeof(value))
+                totals[i] += value;
+        }
+    }
+
+private:
+    int fds[count];
+};
+
+/*
+    --phase-bench=N: times the compiler phases in isolation on a corpus of generated programs
+    (small, medium and large, plus the input file when one is given). For every program each
+    phase runs N times on the output of the previous one:
+       lex       Lexer::tokenize
+       parse     Parser::parseProgram with a fresh SymbolTable and IntermediateCodeGnerator
+       optimize  the passes of compile() (see addOptimizationPasses) on a copy of the TAC
+       codegen   AssemblyCodeGenerator::generateAssembly
+    and the median and p99 time per run are printed together with the average hardware counters
+    per run. --bench-save=FILE writes the results as JSON; --bench-baseline=FILE compares the
+    medians against such a file and fails when a phase got slower by more than
+    --bench-threshold=PCT percent (default 10) or has no entry in it.
+*/
+struct PhaseResult
+{
+    string phase;
+    string program;
+    double medianUs;
+    double p99Us;
+    array<int64_t, PerfCounters::count> counters;
+};
+
+// A deterministic program of `blocks` statements mixing arithmetic, branches, loops, arrays and output
+string generateBenchmarkProgram(int blocks, unsigned seed)
+{
+    mt19937 random(seed);
+    auto pick = [&random](int n)
+    { return (int)(random() % n); };
+    auto var = [&pick]()
+    { return "a" + to_string(pick(8)); };
+
+    string program;
+    for (int i = 0; i < 8; i++)
+        program += "int a" + to_string(i) + " = " + to_string(i + 1) + ";\n";
+    program += "float f0 = 1.5;\nfloat f1 = 2.25;\nint v[64];\nfloat w[64];\n";
+    for (int block = 0; block < blocks; block++)
+    {
+        string k = to_string(block);
+        switch (pick(7))
+        {
+        case 0:
+            program += var() + " = " + var() + " * " + var() + " + " + to_string(pick(100)) + " - " + var() + " / " + to_string(pick(9) + 1) + ";\n";
+            break;
+        case 1:
+            program += "if (" + var() + " < " + var() + " && " + var() + " != " + to_string(pick(10)) + ") {\n    " +
+                       var() + " = " + var() + " + 1;\n} else {\n    " + var() + " = " + var() + " - 2;\n}\n";
+            break;
+        case 2:
+            program += "int c" + k + " = 0;\nwhile (c" + k + " < " + to_string(pick(20) + 1) + ") {\n    " + var() +
+                       " = " + var() + " + c" + k + ";\n    c" + k + " = c" + k + " + 1;\n}\n";
+            break;
+        case 3:
+            program += "for (int i" + k + " = 0; i" + k + " < 64; i" + k + "++) {\n    v[i" + k + "] = v[i" + k + "] + " + var() +
+                       ";\n    w[i" + k + "] = w[i" + k + "] * 0.5 + f0;\n}\n";
+            break;
+        case 4:
+        {
+            string target = var();
+            program += "switch (" + var() + ") {\n";
+            for (int c = 0; c < 6; c++)
+                program += "case " + to_string(c) + ":\n    " + target + " = " + to_string(pick(1000)) + ";\n    break;\n";
+            program += "default:\n    " + target + " = 0;\n}\n";
+            break;
+        }
+        case 5:
+            program += "f1 = f1 * 0.75 + f0 - " + to_string(pick(10)) + ".5;\n";
+            break;
+        default:
+            program += "cout << " + var() + " << \" \" << f1 << endl;\n";
+            break;
+        }
+    }
+    return program;
+}
+
+// Median and p99 of `samples` (in microseconds)
+pair<double, double> summarize(vector<double> samples)
+{
+    sort(samples.begin(), samples.end());
+    size_t p99 = (size_t)ceil(samples.size() * 0.99) - 1;
+    size_t middle = samples.size() / 2;
+    double median = samples.size() % 2 ? samples[middle] : (samples[middle - 1] + samples[middle]) / 2;
+    return {median, samples[min(p99, samples.size() - 1)]};
+}
+
+vector<PhaseResult> benchmarkProgram(const string &name, const string &source, const UnrollOptions &unroll, int runs, PerfCounters &perf,
+                                     pmr::memory_resource *memory)
+{
+    vector<PhaseResult> results;
+    auto measure = [&](const char *phase, const function<void()> &body)
+    {
+        vector<double> samples;
+        array<int64_t, PerfCounters::count> totals{};
+        for (int i = 0; i < runs; i++)
+        {
+            auto start = chrono::steady_clock::now();
+            perf.start();
+            body();
+            perf.stop(totals);
+            samples.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+        }
+        for (int c = 0; c < PerfCounters::count; c++)
+            totals[c] = perf.available(c) ? totals[c] / runs : -1;
+        auto [median, p99] = summarize(samples);
+        results.push_back({phase, name, median, p99, totals});
+    };
+
+    vector<Token> tokens;
+    measure("lex", [&]()
+            { Lexer lexer(source);
+              tokens = lexer.tokenize(); });
+
+    SymbolTable parsedSymbols(memory);
+    IntermediateCodeGnerator parsed;
+    measure("parse", [&]()
+            { parsedSymbols = SymbolTable(memory);
+              parsed = IntermediateCodeGnerator();
+              parsed.memory = memory;
+              Parser parser(tokens, parsedSymbols, parsed);
+              parser.parseProgram(); });
+
+    CompileOptions options;
+    options.unroll = unroll;
+    options.memory = memory;
+    SymbolTable symTable(memory);
     IntermediateCodeGnerator icg;
-    Parser parser(tokens, symTable, icg);
+    measure("optimize", [&]()
+            { symTable = parsedSymbols;
+              icg = parsed;
+              PassManager passes(icg, symTable, nullptr, nullptr);
+              Inliner inliner(icg, symTable, options.inlineSize);
+              addOptimizationPasses(passes, inliner, options);
+              passes.run([](const string &) {}); });
+
+    measure("codegen", [&]()
+            { AssemblyCodeGenerator acg(symTable, memory);
+              acg.generateAssembly(icg.instructions); });
+    return results;
+}
+
+void printPhaseResults(const vector<PhaseResult> &results)
+{
+    cerr << "[bench] " << left << setw(10) << "phase" << setw(10) << "program" << right << setw(12) << "median us"
+         << setw(12) << "p99 us" << setw(14) << "cycles" << setw(14) << "instructions" << setw(7) << "IPC"
+         << setw(12) << "L1d miss" << setw(12) << "LLC miss" << setw(12) << "br miss" << endl;
+    for (const auto &result : results)
+    {
+        cerr << "[bench] " << left << setw(10) << result.phase << setw(10) << result.program << right << fixed
+             << setprecision(1) << setw(12) << result.medianUs << setw(12) << result.p99Us;
+        for (int c = 0; c < 2; c++)
+            cerr << setw(14) << (result.counters[c] < 0 ? "n/a" : to_string(result.counters[c]));
+        if (result.counters[0] > 0 && result.counters[1] >= 0)
+            cerr << setw(7) << setprecision(2) << (double)result.counters[1] / result.counters[0];
+        else
+            cerr << setw(7) << "n/a";
+        for (int c = 2; c < PerfCounters::count; c++)
+            cerr << setw(12) << (result.counters[c] < 0 ? "n/a" : to_string(result.counters[c]));
+        cerr << endl;
+    }
+}
+
+bool savePhaseResults(const vector<PhaseResult> &results, const string &filename)
+{
+    OutputBuffer out;
+    out.append("{\"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const PhaseResult &result = results[i];
+        ostringstream times;
+        times << fixed << setprecision(3) << ", \"median_us\": " << result.medianUs << ", \"p99_us\": " << result.p99Us;
+        out.append("  {\"phase\": ");
+        out.appendJsonString(result.phase);
+        out.append(", \"program\": ");
+        out.appendJsonString(result.program);
+        out.append(times.str());
+        for (int c = 0; c < PerfCounters::count; c++)
+        {
+            out.append(", \"");
+            out.append(PerfCounters::names[c]);
+            out.append("\": ");
+            out.appendNumber(result.counters[c]);
+        }
+        out.append(i + 1 < results.size() ? "},\n" : "}\n");
+    }
+    out.append("]}\n");
+    return out.writeToFile(filename);
+}
+
+/*
+    Compare medians against a file written by --bench-save (any whitespace between the JSON
+    tokens is accepted). Returns the number of phases that fail the check: slower by more than
+    thresholdPercent, or missing from the baseline. A baseline without any entry is an error,
+    so a truncated or mangled file cannot let the gate pass.
+*/
+int compareWithBaseline(const vector<PhaseResult> &results, const string &filename, double thresholdPercent)
+{
+    ifstream file(filename);
+    if (!file.is_open())
+    {
+        cerr << "Error opening baseline file: " << filename << endl;
+        exit(1);
+    }
+    string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    map<pair<string, string>, double> baseline;
+    static const regex entry("\\{\\s*\"phase\"\\s*:\\s*\"([^\"]*)\"\\s*,\\s*\"program\"\\s*:\\s*\"([^\"]*)\"\\s*,"
+                             "\\s*\"median_us\"\\s*:\\s*([0-9][0-9.eE+-]*)");
+    for (sregex_iterator it(text.begin(), text.end(), entry), end; it != end; ++it)
+        baseline[{(*it)[1], (*it)[2]}] = stod((*it)[3]);
+    if (baseline.empty())
+    {
+        cerr << "Error: no phase results in baseline file: " << filename << endl;
+        exit(1);
+    }
 
-    parser.parseProgram();
-    symTable.printSymbolTable();
+    int regressions = 0;
+    for (const auto &result : results)
+    {
+        auto old = baseline.find({result.phase, result.program});
+        if (old == baseline.end())
+        {
+            cerr << "[bench] MISSING " << result.phase << "/" << result.program << ": not in the baseline" << endl;
+            regressions++;
+            continue;
+        }
+        if (old->second <= 0)
+            continue;
+        double change = (result.medianUs - old->second) / old->second * 100;
+        bool regressed = change > thresholdPercent;
+        regressions += regressed;
+        cerr << "[bench] " << (regressed ? "REGRESSION " : "") << result.phase << "/" << result.program << ": "
+             << fixed << setprecision(1) << old->second << " -> " << result.medianUs << " us ("
+             << showpos << change << noshowpos << "%)" << endl;
+    }
+    return regressions;
+}
 
-    // cout << "\nThree Address Code:" << endl;
-    // icg.printInstructions();
-    icg.saveInstructionsToFile("./icg.obj");
+int benchmarkPhases(const CompilerOptions &options, const string &input)
+{
+    vector<pair<string, string>> corpus = {
+        {"small", generateBenchmarkProgram(20, 1)},
+        {"medium", generateBenchmarkProgram(100, 2)},
+        {"large", generateBenchmarkProgram(400, 3)}};
+    if (!options.inputFile.empty())
+    {
+        CompileOptions check;
+        check.assembly = false;
+        CompileResult result = compile(input, check);
+        if (!result.success)
+        {
+            for (const auto &diagnostic : result.diagnostics)
+                cout << diagnostic.message << endl;
+            return 1;
+        }
+        corpus.push_back({options.inputFile, input});
+    }
 
-    AssemblyCodeGenerator acg;
-    acg.generateAssembly(icg.instructions);
+    PerfCounters perf;
+    if (!perf.available(0))
+        cerr << "[bench] hardware counters are unavailable (perf_event_open failed); reporting times only" << endl;
 
-    // cout << "\nAssembly Code:" << endl;
-    // acg.printAssembly();
-    acg.saveInstructionsToFile("./assembly.asm");
+    vector<PhaseResult> results;
+    for (const auto &[name, source] : corpus)
+    {
+        CompilationArena arena;
+        auto programResults = benchmarkProgram(name, source, options.unroll, options.phaseBenchRuns, perf, arena.memory());
+        results.insert(results.end(), programResults.begin(), programResults.end());
+    }
+    printPhaseResults(results);
 
+    if (!options.benchSave.empty() && !savePhaseResults(results, options.benchSave))
+    {
+        cerr << "Error: Unable to write " << options.benchSave << endl;
+        return 1;
+    }
+    if (!options.benchBaseline.empty())
+    {
+        int regressions = compareWithBaseline(results, options.benchBaseline, options.benchThreshold);
+        if (regressions > 0)
+        {
+            cerr << "[bench] " << regressions << " phases slower than the baseline by more than "
+                 << options.benchThreshold << "% or missing from it" << endl;
+            return 1;
+        }
+    }
     return 0;
 }
+
+#ifndef COMPILER_NO_MAIN
+int main(int argc, char *argv[])
+{
+    // Check if the correct arguments are provided
+    CompilerOptions options;
+    if (!parseCommandLine(argc, argv, options))
+    {
+        cerr << "Usage: " << argv[0] << " [--unroll-count=N] [--unroll-factor=N] [--unroll-size=N] [--inline-size=N] [--jobs=N] [--peephole-stats] [--emit=asm|obj|exe|ir] [--run] [--vm] [--vm-bench=N] [--instrument[=FILE]] [--use-profile=FILE] [--no-vectorize] [--vector-bench=N] [--time-report[=json]] [--dump=tokens,symbols,tac,asm]\n"
+             << "       [--phase-bench=N [--bench-save=FILE] [--bench-baseline=FILE] [--bench-threshold=PCT]] <filename>" << endl;
+        return 1;
+    }
+
+    TimeReport report;
+    // Declared before everything the compile allocates, so it is released last
+    CompilationArena arena;
+    report.enabled = options.timeReport;
+    report.json = options.timeReportJson;
+
+    if (options.phaseBenchRuns > 0 && options.inputFile.empty())
+        return benchmarkPhases(options, "");
+
+    // Binary IR written by --emit=ir goes straight to the back end
+    bool irInput = IrFile::hasMagic(options.inputFile);
+    if (irInput && (options.phaseBenchRuns > 0 || options.vectorBenchRuns > 0 || !options.instrument.empty() ||
+                    !options.useProfile.empty()))
+    {
+        cerr << "Error: --phase-bench, --vector-bench and profiles need a source file, not IR" << endl;
+        return 1;
+    }
+    IrFile ir;
+    string input = "", line;
+    report.phase("read input");
+    if (irInput)
+    {
+        string error;
+        if (!ir.open(options.inputFile, error))
+        {
+            cerr << error << endl;
+            return 1;
+        }
+    }
+    else
+    {
+        // Open the file
+        ifstream inputFile(options.inputFile);
+        if (!inputFile.is_open())
+        {
+            cerr << "Error opening file: " << options.inputFile << endl;
+            return 1;
+        }
+
+        // // Read and print the file content
+        while (getline(inputFile, line))
+        {
+            input += line + "\n";
+        }
+    }
+    if (options.phaseBenchRuns > 0)
+        return benchmarkPhases(options, input);
+
+    // Modes that run the program print nothing but the program's own output
+    bool instrument = !options.instrument.empty();
+    bool quiet = options.run || options.vm || options.vmBenchRuns > 0 || options.vectorBenchRuns > 0 || instrument;
+    bool emitIr = options.emit == "ir" && !quiet;
+
+    if (options.vectorBenchRuns > 0)
+        return benchmarkVectorizer(input, options.unroll, options.vectorBenchRuns);
+
+    BlockProfile profile;
+    if (!options.useProfile.empty())
+    {
+        report.phase("read profile");
+        string error;
+        if (!profile.load(options.useProfile, error))
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        if (profile.sourceHash != BlockProfile::hashSource(input, options.vectorize, options.inlineSize))
+        {
+            cerr << "Warning: " << options.useProfile << " was recorded for another program (or vectorizer or inliner setting); ignoring it" << endl;
+            profile = BlockProfile();
+        }
+    }
+
+    auto compileStart = chrono::steady_clock::now();
+    CompileOptions compileOptions;
+    compileOptions.unroll = options.unroll;
+    compileOptions.inlineSize = options.inlineSize;
+    compileOptions.threads = options.jobs;
+    compileOptions.vectorize = options.vectorize;
+    compileOptions.assembly = !options.vm && options.vmBenchRuns == 0 && !emitIr && !instrument;
+    if (instrument)
+        compileOptions.unroll.maxFullUnrollTrips = -1, compileOptions.unroll.factor = 1;
+    if (!profile.empty())
+        compileOptions.profile = &profile;
+    compileOptions.returnToCaller = options.run;
+    compileOptions.peepholeStatistics = options.peepholeStats;
+    compileOptions.report = &report;
+    compileOptions.memory = arena.memory();
+    CompileResult result = irInput ? compileIr(ir, compileOptions) : compile(input, compileOptions);
+    if (!result.success)
+    {
+        for (const auto &diagnostic : result.diagnostics)
+            cout << diagnostic.message << endl;
+        return 1;
+    }
+
+    // Stage dumps go to stdout as JSON Lines, each preceded by {"stage":...,"count":...}
+    auto dump = [&](const char *stage, size_t count, const function<void(OutputBuffer &)> &write)
+    {
+        if (!options.dumps.count(stage))
+            return;
+        report.phase((string("dump ") + stage).c_str());
+        OutputBuffer out;
+        out.append("{\"stage\":\"");
+        out.append(stage);
+        out.append("\",\"count\":");
+        out.appendNumber(count);
+        out.append("}\n");
+        write(out);
+        cout.flush();
+        out.writeTo(STDOUT_FILENO);
+    };
+
+    // Lexer::printTokenizer(result.tokens);
+    dump("tokens", result.tokens.size(), [&](OutputBuffer &out)
+         { Lexer::dumpTokens(result.tokens, out); });
+    // result.symbols.printSymbolTable();
+    dump("symbols", result.symbols.size(), [&](OutputBuffer &out)
+         { result.symbols.dumpSymbols(out); });
+    dump("tac", result.tac.size(), [&](OutputBuffer &out)
+         { result.dumpTac(out); });
+    dump("asm", result.assembly.size(), [&](OutputBuffer &out)
+         { result.dumpAssembly(out); });
+    // With dumps, stdout holds nothing but JSON Lines (and the program's own output)
+    ostream &status = options.dumps.empty() ? cout : cerr;
+    if (!quiet)
+    {
+        report.phase("write icg.obj");
+        OutputBuffer out;
+        result.appendTac(out);
+        if (out.writeToFile("./icg.obj"))
+            status << "Generated Intermediate Code is saved to file: ./icg.obj" << endl;
+        else
+            cerr << "Error: Unable to open file for writing!" << endl;
+    }
+
+    if (emitIr)
+    {
+        report.phase("write icg.tir");
+        OutputBuffer out;
+        writeIr(result, out);
+        if (!out.writeToFile("./icg.tir"))
+        {
+            cerr << "Error: Unable to open file for writing!" << endl;
+            return 1;
+        }
+        status << "Intermediate Representation is saved to file: ./icg.tir" << endl;
+        return 0;
+    }
+
+    if (options.vm || options.vmBenchRuns > 0 || instrument)
+    {
+        report.phase("compile bytecode");
+        BytecodeCompiler bytecode(result.symbols);
+        bytecode.instrument = instrument;
+        bytecode.compile(result.tac);
+        report.phase("interpret");
+        BytecodeInterpreter interpreter(bytecode.program);
+        BlockProfile counts;
+        if (options.vmBenchRuns > 0)
+            interpreter.benchmark(options.vmBenchRuns);
+        else
+            interpreter.run(cin, cout, instrument ? &counts : nullptr);
+        cout.flush();
+        if (instrument)
+        {
+            report.phase("write profile");
+            counts.sourceHash = BlockProfile::hashSource(input, options.vectorize, options.inlineSize);
+            if (!counts.save(options.instrument))
+            {
+                cerr << "Error: Unable to write " << options.instrument << endl;
+                return 1;
+            }
+            cerr << "[profile] " << bytecode.program.labelCounters.size() << " label counts saved to " << options.instrument << endl;
+        }
+        return 0;
+    }
+
+    if (options.peepholeStats)
+        status << result.peepholeStatistics;
+
+    if (options.emit == "asm" && !options.run)
+    {
+        report.phase("write assembly.asm");
+        OutputBuffer out;
+        result.appendAssembly(out);
+        if (!out.writeToFile("./assembly.asm"))
+        {
+            cerr << "Error: Unable to open file for writing!" << endl;
+            return 1;
+        }
+        status << "Generated Assembly Code is saved to file: ./assembly.asm" << endl;
+        return 0;
+    }
+
+    report.phase("encode");
+    MachineCodeEncoder encoder;
+    encoder.encode(result.assembly);
+    if (options.run)
+    {
+        report.phase("jit load");
+        JitExecutor jit(encoder);
+        if (!jit.load())
+            return 1;
+        auto latency = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - compileStart);
+        report.phase("run");
+        jit.run();
+        cerr << "[jit] compile to first instruction: " << latency.count() << " us" << endl;
+        return 0;
+    }
+
+    report.phase(options.emit == "obj" ? "write assembly.o" : "write program");
+    ElfWriter writer(encoder);
+    bool written = options.emit == "obj" ? writer.writeObject("./assembly.o") : writer.writeExecutable("./program");
+    return written ? 0 : 1;
+}
+#endif
@@ -0,0 +1,62 @@
+/*
+    Runtime for programs compiled with --emit=obj:
+
+    The generated code lowers `cout <<` and `cin >>` to calls of the rt_print_* and rt_read_*
+    functions below (SysV calling convention, see AssemblyCodeGenerator). The JIT (--run)
+    provides its own copies; a native program gets these ones by linking assembly.o with this
+    file. The object defines _start itself, so the C start files are left out:
+
+        ./Compiler --emit=obj program.txt
+        cc -nostartfiles -no-pie -o program assembly.o runtime.c
+        ./program
+
+    The program ends with the exit system call, which skips the flushing of stdio buffers at
+    exit, so every print flushes stdout. Numbers are formatted as by the default ostream (%g
+    with six significant digits for float and double), so the output matches --run and --vm.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void rt_print_int(int value)
+{
+    printf("%d", value);
+    fflush(stdout);
+}
+
+void rt_print_double(double value)
+{
+    printf("%g", value);
+    fflush(stdout);
+}
+
+void rt_print_string(const char *value)
+{
+    fputs(value ? value : "", stdout);
+    fflush(stdout);
+}
+
+int rt_read_int(void)
+{
+    int value = 0;
+    if (scanf("%d", &value) != 1)
+        return 0;
+    return value;
+}
+
+double rt_read_double(void)
+{
+    double value = 0;
+    if (scanf("%lf", &value) != 1)
+        return 0;
+    return value;
+}
+
+// One whitespace separated word; it stays allocated until the program exits
+const char *rt_read_string(void)
+{
+    char word[4096];
+    if (scanf("%4095s", word) != 1)
+        word[0] = '\0';
+    return strdup(word);
+}
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Regression programs: every NAME.txt here is compiled and run in the bytecode VM (--vm), in the
+# JIT (--run) and, when a C compiler is around, as a native program (--emit=obj linked with
+# runtime.c); every output must equal NAME.expected.
+#    test/run.sh [path/to/compiler]      (default: ./Compiler in the repository root)
+compiler=$(realpath "${1:-./Compiler}")
+dir=$(realpath "$(dirname "$0")")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+modes="--vm --run"
+command -v cc >/dev/null && modes="$modes native"
+failed=0
+for program in "$dir"/*.txt; do
+    name=$(basename "$program" .txt)
+    for mode in $modes; do
+        if [ $mode = native ]; then
+            (cd "$work" && rm -f program && "$compiler" --emit=obj "$program" >/dev/null &&
+                cc -nostartfiles -no-pie -o program assembly.o "$dir/../runtime.c" 2>link.txt && ./program </dev/null) >"$work/out" 2>&1
+        else
+            (cd "$work" && "$compiler" $mode "$program" </dev/null 2>&1 | grep -v '^\[jit\]') >"$work/out"
+        fi
+        if ! cmp -s "$work/out" "$dir/$name.expected"; then
+            echo "FAIL $name $mode"
+            diff "$dir/$name.expected" "$work/out" | head -20
+            failed=1
+        fi
+    done
+done
+[ $failed = 0 ] && echo "all regression programs passed"
+exit $failed